@@ -0,0 +1,446 @@
+/*
+ * BackFS access trace recording and reading
+ * Copyright (c) 2026 William R. Fraser
+ */
+
+#include "access_trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#define BACKFS_LOG_SUBSYS "Trace"
+#include "global.h"
+#include "stats.h"
+
+extern int backfs_log_level;
+extern bool backfs_log_stderr;
+
+//
+// Interned paths, shared by the recorder and the reader.
+//
+
+struct path_entry {
+    struct path_entry *next;
+    uint64_t hash;
+    uint32_t id;
+    uint16_t len;
+    char path[];
+};
+
+struct path_table {
+    struct path_entry **buckets;
+    uint32_t size;          // always a power of two
+    uint32_t count;
+};
+
+static uint64_t hash_bytes(const char *s, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)s[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static void path_table_grow(struct path_table *t)
+{
+    uint32_t size = (t->size == 0) ? 256 : t->size * 2;
+    struct path_entry **buckets = (struct path_entry**)calloc(size, sizeof(*buckets));
+    if (buckets == NULL) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < t->size; i++) {
+        struct path_entry *e = t->buckets[i];
+        while (e != NULL) {
+            struct path_entry *next = e->next;
+            e->next = buckets[e->hash & (size - 1)];
+            buckets[e->hash & (size - 1)] = e;
+            e = next;
+        }
+    }
+
+    free(t->buckets);
+    t->buckets = buckets;
+    t->size = size;
+}
+
+/*
+ * Find a path, adding it with the next ID if it isn't there. Sets *added if
+ * it was added. Returns NULL if out of memory.
+ */
+static struct path_entry * path_table_get(struct path_table *t,
+        const char *path, size_t len, bool *added)
+{
+    *added = false;
+    if (t->count >= t->size / 2) {
+        path_table_grow(t);
+        if (t->size == 0) {
+            return NULL;
+        }
+    }
+
+    uint64_t hash = hash_bytes(path, len);
+    struct path_entry **bucket = &t->buckets[hash & (t->size - 1)];
+    for (struct path_entry *e = *bucket; e != NULL; e = e->next) {
+        if (e->hash == hash && e->len == len && memcmp(e->path, path, len) == 0) {
+            return e;
+        }
+    }
+
+    struct path_entry *e = (struct path_entry*)malloc(sizeof(*e) + len + 1);
+    if (e == NULL) {
+        return NULL;
+    }
+    e->hash = hash;
+    e->id = t->count++;
+    e->len = (uint16_t) len;
+    memcpy(e->path, path, len);
+    e->path[len] = '\0';
+    e->next = *bucket;
+    *bucket = e;
+    *added = true;
+    return e;
+}
+
+static void path_table_free(struct path_table *t)
+{
+    for (uint32_t i = 0; i < t->size; i++) {
+        struct path_entry *e = t->buckets[i];
+        while (e != NULL) {
+            struct path_entry *next = e->next;
+            free(e);
+            e = next;
+        }
+    }
+    free(t->buckets);
+    t->buckets = NULL;
+    t->size = 0;
+    t->count = 0;
+}
+
+//
+// Recording
+//
+
+#define RECORD_BUFFER_SIZE 0x10000
+
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static int record_fd = -1;
+static char *record_buf = NULL;
+static size_t record_len = 0;
+static uint32_t record_block_size;
+static uint64_t record_start;
+static struct path_table record_paths;
+
+/*
+ * Write out the buffer. If that fails, recording stops.
+ * Caller holds record_lock.
+ */
+static void record_flush(void)
+{
+    size_t written = 0;
+    while (written < record_len) {
+        ssize_t n = write(record_fd, record_buf + written, record_len - written);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            PERROR("access trace: write failed; no longer recording");
+            close(record_fd);
+            record_fd = -1;
+            break;
+        }
+        written += n;
+    }
+    record_len = 0;
+}
+
+/*
+ * Caller holds record_lock.
+ */
+static void record_append(const void *data, size_t len)
+{
+    if (record_len + len > RECORD_BUFFER_SIZE) {
+        record_flush();
+        if (record_fd == -1)
+            return;
+    }
+    memcpy(record_buf + record_len, data, len);
+    record_len += len;
+}
+
+int access_trace_start(const char *filename, uint32_t block_size)
+{
+    int ret = 0;
+    pthread_mutex_lock(&record_lock);
+
+    if (record_fd != -1) {
+        ret = -EBUSY;
+        goto exit;
+    }
+
+    record_buf = (char*)malloc(RECORD_BUFFER_SIZE);
+    if (record_buf == NULL) {
+        ret = -ENOMEM;
+        goto exit;
+    }
+
+    record_fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (record_fd == -1) {
+        ret = -errno;
+        goto exit;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    struct access_trace_session session = {0};
+    session.type = ACCESS_TRACE_SESSION;
+    session.block_size = block_size;
+    memcpy(session.magic, ACCESS_TRACE_MAGIC, sizeof(session.magic));
+    session.start_time = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+
+    record_block_size = block_size;
+    record_start = stats_now();
+    record_append(&session, sizeof(session));
+
+exit:
+    if (ret != 0) {
+        free(record_buf);
+        record_buf = NULL;
+    }
+    pthread_mutex_unlock(&record_lock);
+    return ret;
+}
+
+void access_trace_read(const char *path, uint64_t offset, uint32_t size)
+{
+    if (record_fd == -1) {
+        return;
+    }
+
+    struct access_trace_read read = {0};
+    read.type = ACCESS_TRACE_READ;
+    read.time = stats_now() - record_start;
+    read.offset = offset;
+    read.size = size;
+
+    size_t len = strlen(path);
+    if (len > UINT16_MAX) {
+        return;
+    }
+
+    pthread_mutex_lock(&record_lock);
+
+    if (record_fd == -1) {
+        goto exit;
+    }
+    read.block = (uint32_t)(offset / record_block_size);
+
+    bool added;
+    struct path_entry *e = path_table_get(&record_paths, path, len, &added);
+    if (e == NULL) {
+        goto exit;
+    }
+    if (added) {
+        struct access_trace_path rec = {0};
+        rec.type = ACCESS_TRACE_PATH;
+        rec.len = (uint16_t) len;
+        rec.id = e->id;
+        record_append(&rec, sizeof(rec));
+        record_append(path, len);
+    }
+    read.path_id = e->id;
+    record_append(&read, sizeof(read));
+
+exit:
+    pthread_mutex_unlock(&record_lock);
+}
+
+void access_trace_stop(void)
+{
+    pthread_mutex_lock(&record_lock);
+    if (record_fd != -1) {
+        record_flush();
+        if (record_fd != -1) {
+            close(record_fd);
+            record_fd = -1;
+        }
+    }
+    free(record_buf);
+    record_buf = NULL;
+    path_table_free(&record_paths);
+    pthread_mutex_unlock(&record_lock);
+}
+
+//
+// Reading
+//
+
+struct access_trace_reader {
+    FILE *f;
+    struct path_table paths;        // every path, by its ID across sessions
+    struct path_entry **session;    // this session's IDs
+    uint32_t session_count;
+    uint32_t session_size;
+    uint32_t block_size;
+    uint64_t time_base;             // where the session starts in the trace
+    uint64_t last_time;
+    bool started;
+};
+
+struct access_trace_reader * access_trace_open(const char *filename)
+{
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+
+    struct access_trace_reader *r =
+        (struct access_trace_reader*)calloc(1, sizeof(*r));
+    if (r == NULL) {
+        fclose(f);
+        return NULL;
+    }
+    r->f = f;
+    return r;
+}
+
+static bool read_rest(FILE *f, void *rec, size_t size)
+{
+    // the type byte has been read already
+    return fread((char*)rec + 1, size - 1, 1, f) == 1;
+}
+
+int access_trace_next(struct access_trace_reader *r,
+        struct access_trace_event *event)
+{
+    for (;;) {
+        int type = fgetc(r->f);
+        if (type == EOF) {
+            return 0;
+        }
+
+        switch (type) {
+        case ACCESS_TRACE_SESSION: {
+            struct access_trace_session rec;
+            if (!read_rest(r->f, &rec, sizeof(rec))
+                    || memcmp(rec.magic, ACCESS_TRACE_MAGIC, sizeof(rec.magic)) != 0
+                    || rec.block_size == 0) {
+                errno = EINVAL;
+                return -1;
+            }
+            r->block_size = rec.block_size;
+            r->time_base = r->last_time;
+            r->session_count = 0;
+            r->started = true;
+            break;
+        }
+
+        case ACCESS_TRACE_PATH: {
+            struct access_trace_path rec;
+            char path[UINT16_MAX + 1];
+            if (!r->started || !read_rest(r->f, &rec, sizeof(rec))
+                    || fread(path, 1, rec.len, r->f) != rec.len) {
+                errno = EINVAL;
+                return -1;
+            }
+
+            if (rec.id >= r->session_size) {
+                uint32_t size = (r->session_size == 0) ? 256 : r->session_size;
+                while (size <= rec.id) {
+                    size *= 2;
+                }
+                struct path_entry **session = (struct path_entry**)realloc(
+                        r->session, size * sizeof(*session));
+                if (session == NULL) {
+                    return -1;
+                }
+                r->session = session;
+                r->session_size = size;
+            }
+            while (r->session_count <= rec.id) {
+                r->session[r->session_count++] = NULL;
+            }
+
+            bool added;
+            r->session[rec.id] = path_table_get(&r->paths, path, rec.len, &added);
+            if (r->session[rec.id] == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            break;
+        }
+
+        case ACCESS_TRACE_READ: {
+            struct access_trace_read rec;
+            if (!r->started || !read_rest(r->f, &rec, sizeof(rec))
+                    || rec.path_id >= r->session_count
+                    || r->session[rec.path_id] == NULL) {
+                errno = EINVAL;
+                return -1;
+            }
+
+            struct path_entry *e = r->session[rec.path_id];
+            event->path = e->path;
+            event->path_id = e->id;
+            event->block_size = r->block_size;
+            event->block = rec.block;
+            event->size = rec.size;
+            event->offset = rec.offset;
+            event->time = r->time_base + rec.time;
+            r->last_time = event->time;
+            return 1;
+        }
+
+        default:
+            errno = EINVAL;
+            return -1;
+        }
+    }
+}
+
+uint32_t access_trace_path_count(const struct access_trace_reader *r)
+{
+    return r->paths.count;
+}
+
+void access_trace_close(struct access_trace_reader *r)
+{
+    if (r == NULL) {
+        return;
+    }
+    fclose(r->f);
+    path_table_free(&r->paths);
+    free(r->session);
+    free(r);
+}
+
+/*
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
@@ -0,0 +1,98 @@
+#ifndef BACKFS_ACCESS_TRACE_H
+#define BACKFS_ACCESS_TRACE_H
+/*
+ * BackFS access trace recording and reading
+ * Copyright (c) 2026 William R. Fraser
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * The trace file is a sequence of records in host byte order. Each mount
+ * appends a session record, then a path record the first time each file is
+ * read, and a read record for every read. Path IDs are only unique within a
+ * session.
+ */
+#define ACCESS_TRACE_MAGIC "BFSTRC01"
+
+enum access_trace_type {
+    ACCESS_TRACE_SESSION = 1,
+    ACCESS_TRACE_PATH = 2,
+    ACCESS_TRACE_READ = 3,
+};
+
+struct access_trace_session {
+    uint8_t type;
+    uint8_t pad[3];
+    uint32_t block_size;
+    char magic[8];
+    uint64_t start_time;    // wall clock, nanoseconds since the epoch
+};
+
+struct access_trace_path {
+    uint8_t type;
+    uint8_t pad;
+    uint16_t len;           // followed by this many bytes of path, no NUL
+    uint32_t id;
+};
+
+struct access_trace_read {
+    uint8_t type;
+    uint8_t pad[3];
+    uint32_t path_id;
+    uint64_t time;          // nanoseconds since the session started
+    uint64_t offset;
+    uint32_t size;
+    uint32_t block;         // first block, by the session's block size
+};
+
+/*
+ * Start recording reads to filename, appending if it exists.
+ * Returns 0 or -errno.
+ */
+int access_trace_start(const char *filename, uint32_t block_size);
+
+/*
+ * Record a read. Does nothing unless recording was started.
+ */
+void access_trace_read(const char *path, uint64_t offset, uint32_t size);
+
+/*
+ * Write out anything buffered and stop recording.
+ */
+void access_trace_stop(void);
+
+/*
+ * A read from a trace, as seen by the tools that read traces.
+ */
+struct access_trace_event {
+    const char *path;       // valid until the reader is closed
+    uint32_t path_id;       // same for the same path, across sessions
+    uint32_t block_size;
+    uint32_t block;
+    uint32_t size;
+    uint64_t offset;
+    uint64_t time;          // nanoseconds since the start of the trace,
+                            // with sessions following one after another
+};
+
+struct access_trace_reader;
+
+struct access_trace_reader * access_trace_open(const char *filename);
+
+/*
+ * Get the next read. Returns 1 if there was one, 0 at the end of the trace,
+ * or -1 if the trace is damaged.
+ */
+int access_trace_next(struct access_trace_reader *reader,
+        struct access_trace_event *event);
+
+/*
+ * Number of distinct paths seen so far.
+ */
+uint32_t access_trace_path_count(const struct access_trace_reader *reader);
+
+void access_trace_close(struct access_trace_reader *reader);
+
+#endif //BACKFS_ACCESS_TRACE_H
@@ -22,11 +22,21 @@
 #include <sys/statvfs.h>
 #include <sys/stat.h>
 #include <sys/xattr.h>
+#include <sys/ioctl.h>
+
+#include <linux/fs.h>
 
 #include <pthread.h>
 
 #include "global.h"
 #include "fscache.h"
+#include "stats.h"
+#include "trace.h"
+#include "access_trace.h"
+#include "blocks.h"
+#include "prefetch.h"
+#include "heat.h"
+#include "watch.h"
 #include "util.h"
 
 #if FUSE_USE_VERSION > 25
@@ -47,8 +57,28 @@ struct backfs {
     bool real_root_alloc;
     unsigned long long cache_size;
     unsigned long long block_size;
+    unsigned int verify_percent;
+    unsigned int evict_high;
+    char *cache_io;
+    char *cache_key;
+    unsigned int evict_low;
     bool rw;
+    bool writeback;
+    unsigned int writeback_threads;
+    unsigned long long writeback_max_dirty;
+    unsigned int writeback_delay;
+    unsigned int trace_size;
+    bool access_trace;
+    unsigned int prefetch_threads;
+    unsigned long long prefetch_rate;
+    unsigned int heat_blocks;
+    unsigned int heat_half_life;
+    bool check_cache;
+    unsigned int check_threads;
+    bool watch;
+    unsigned int watch_ttl;
     pthread_mutex_t lock;
+    uint64_t generation;    // bumped, under lock, whenever backing file data changes
 };
 static struct backfs backfs = {0};
 
@@ -95,8 +125,51 @@ void usage()
         "                              it is on)\n"
 #ifdef BACKFS_RW
         "    -o rw                  be a read-write cache (default is read-only)\n"
+#endif
+#ifdef BACKFS_RW
+        "    -o writeback           with rw, acknowledge writes of whole blocks once\n"
+        "                           they're in the cache, and write them to the\n"
+        "                           backing filesystem in the background\n"
+        "    -o writeback_threads   threads writing back dirty blocks (2)\n"
+        "    -o writeback_max_dirty most bytes waiting to be written back before\n"
+        "                           writes have to wait (64M)\n"
+        "    -o writeback_delay     seconds a dirty block waits to be written back,\n"
+        "                           so following writes can be combined with it (5)\n"
 #endif
         "    -o block_size          cache block size. defaults to 128K\n"
+        "    -o verify_percent      percentage of cache reads to check against the\n"
+        "                           block's checksum, besides the first read of\n"
+        "                           each block after mounting; 0 checks none (1)\n"
+        "    -o cache_io            how bucket data is read and written: buffered,\n"
+        "                           fadvise (drop from page cache after use), or\n"
+        "                           direct (O_DIRECT) (buffered)\n"
+        "    -o cache_key           what cached data belongs to: path, or inode\n"
+        "                           (shared by hard links, kept across renames in\n"
+        "                           the backing filesystem) (path)\n"
+        "    -o evict_high          cache usage (percent) at which buckets start\n"
+        "                           being freed in the background (95)\n"
+        "    -o evict_low           cache usage (percent) the background eviction\n"
+        "                           brings it back down to (90)\n"
+        "    -o trace_size          operations kept in memory for the dump_trace\n"
+        "                           command; 0 to turn off (16384)\n"
+        "    -o access_trace        record every read to access.trace in the cache\n"
+        "                           directory, for backfs-replay and backfs-sim\n"
+        "    -o prefetch_threads    threads reading files into the cache for the\n"
+        "                           prefetch command (4)\n"
+        "    -o prefetch_rate       most bytes per second the prefetch command reads\n"
+        "                           from the backing filesystem; 0 for no limit (0)\n"
+        "    -o heat_blocks         blocks to keep a decaying read count for, to\n"
+        "                           spare hot blocks from eviction and for the\n"
+        "                           rewarm command; 0 to turn off (0)\n"
+        "    -o heat_half_life      seconds for a block's read count to halve (86400)\n"
+        "    -o check_cache         check the cache for damage at startup even if\n"
+        "                           it was shut down cleanly\n"
+        "    -o check_threads       threads checking the cache at startup; 0 for\n"
+        "                           one per CPU (0)\n"
+        "    -o watch               watch the backing filesystem for changes, and\n"
+        "                           only stat backing files again when they change\n"
+        "    -o watch_ttl           with watch, seconds to trust a stat of a file\n"
+        "                           whose changes can't be watched (1)\n"
         "    -v --verbose           Enable informational messages.\n"
         "       -o verbose\n"
         "    -d --debug -o debug    Enable debugging mode. BackFS will not fork to\n"
@@ -107,6 +180,203 @@ void usage()
 
 const char BACKFS_CONTROL_FILE[] = "/.backfs_control";
 const char BACKFS_VERSION_FILE[] = "/.backfs_version";
+const char BACKFS_STATS_FILE[] = "/.backfs_stats";
+const char BACKFS_LATENCY_FILE[] = "/.backfs_latency";
+
+/*
+ * Contents of the stats file: the counters, then the cache's current size.
+ * Returns the length, like snprintf.
+ */
+size_t backfs_stats_format(char *buf, size_t size)
+{
+    struct cache_usage usage;
+    cache_get_usage(&usage);
+
+    size_t len = stats_format(buf, size);
+    len += prefetch_format((len < size) ? buf + len : NULL,
+            (len < size) ? size - len : 0);
+    len += heat_format((len < size) ? buf + len : NULL,
+            (len < size) ? size - len : 0);
+    len += watch_format((len < size) ? buf + len : NULL,
+            (len < size) ? size - len : 0);
+    int n = snprintf((len < size) ? buf + len : NULL,
+            (len < size) ? size - len : 0,
+            "cache_used_size %llu\n"
+            "used_buckets %llu\n"
+            "free_buckets %llu\n"
+            "orphan_scan_next %llu\n"
+            "orphan_scan_end %llu\n"
+            "trash_trees %llu\n",
+            (unsigned long long) usage.used_bytes,
+            (unsigned long long) usage.used_buckets,
+            (unsigned long long) usage.free_buckets,
+            (unsigned long long) usage.orphan_scan_next,
+            (unsigned long long) usage.orphan_scan_end,
+            (unsigned long long) usage.trash_trees);
+    if (n > 0) {
+        len += n;
+    }
+    return len;
+}
+
+/*
+ * Read one block into the cache for the prefetch command, unless it's there
+ * already. Unlike backfs_read(), this reads the backing file without holding
+ * backfs.lock, so prefetching doesn't hold up reads, or other prefetch
+ * threads; if the file changes in the meantime, the block is dropped instead.
+ * Returns the number of bytes cached, or -errno.
+ */
+ssize_t backfs_prefetch_block(const char *path, int fd, uint32_t block)
+{
+    struct stat before, after;
+    if (fstat(fd, &before) == -1) {
+        return -errno;
+    }
+    off_t offset = (off_t)block * backfs.block_size;
+    if (offset >= before.st_size) {
+        return 0;
+    }
+
+    struct cache_validator validator;
+    cache_validator_from_stat(&validator, &before);
+    int cached = cache_touch_block(path, block, &validator);
+    if (cached != 0) {
+        return (cached == 1) ? 0 : -errno;
+    }
+
+    pthread_mutex_lock(&backfs.lock);
+    uint64_t generation = backfs.generation;
+    pthread_mutex_unlock(&backfs.lock);
+
+    char *buf = (char*)malloc(backfs.block_size);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+
+    uint64_t pread_start = stats_now();
+    ssize_t ret = pread(fd, buf, backfs.block_size, offset);
+    stats_record(STATS_BACKING_PREAD, pread_start);
+    if (ret == -1) {
+        ret = -errno;
+        goto exit;
+    }
+
+    pthread_mutex_lock(&backfs.lock);
+    if (ret > 0
+            && backfs.generation == generation
+            && fstat(fd, &after) == 0
+            && after.st_size == before.st_size
+            && after.st_mtim.tv_sec == before.st_mtim.tv_sec
+            && after.st_mtim.tv_nsec == before.st_mtim.tv_nsec
+            && cache_touch_block(path, block, &validator) == 0) {
+        // the same as before, so validator is still right
+        if (cache_add(path, block, buf, ret, &validator) == -1) {
+            ret = -errno;
+        }
+    } else {
+        DEBUG("prefetch: %s changed while reading block %lu, or it's cached now\n",
+                path, (unsigned long) block);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&backfs.lock);
+
+exit:
+    FREE(buf);
+    return ret;
+}
+
+/*
+ * A directory was removed or moved away in the backing filesystem behind our
+ * back; see watch_init().
+ */
+void backfs_watch_gone(const char *path)
+{
+    DEBUG("%s is gone from the backing filesystem\n", path);
+    cache_invalidate_tree(path);
+}
+
+/*
+ * prefetch <path> [recursive] [max_bytes]
+ */
+int backfs_prefetch_command(char *args)
+{
+    size_t len = strlen(args);
+    while (len > 0 && (args[len - 1] == '\n' || args[len - 1] == ' ')) {
+        args[--len] = '\0';
+    }
+
+    uint64_t max_bytes = 0;
+    bool recursive = false;
+    char *word = strrchr(args, ' ');
+    if (word != NULL) {
+        char *end;
+        unsigned long long n = strtoull(word + 1, &end, 0);
+        if (end != word + 1 && *end == '\0') {
+            max_bytes = n;
+            *word = '\0';
+            word = strrchr(args, ' ');
+        }
+    }
+    if (word != NULL && strcmp(word + 1, "recursive") == 0) {
+        recursive = true;
+        *word = '\0';
+    }
+
+    // nothing outside the backing filesystem
+    len = strlen(args);
+    if (args[0] != '/' || strstr(args, "/../") != NULL
+            || (len >= 3 && strcmp(args + len - 3, "/..") == 0)) {
+        return -EINVAL;
+    }
+
+    return prefetch_start(args, recursive, max_bytes);
+}
+
+/*
+ * import_manifest <file> [max_bytes]
+ */
+int backfs_import_command(char *args)
+{
+    size_t len = strlen(args);
+    while (len > 0 && (args[len - 1] == '\n' || args[len - 1] == ' ')) {
+        args[--len] = '\0';
+    }
+
+    uint64_t max_bytes = 0;
+    char *word = strrchr(args, ' ');
+    if (word != NULL) {
+        char *end;
+        unsigned long long n = strtoull(word + 1, &end, 0);
+        if (end != word + 1 && *end == '\0') {
+            max_bytes = n;
+            *word = '\0';
+        }
+    }
+
+    return prefetch_import(args, max_bytes);
+}
+
+/*
+ * rewarm [max_bytes]
+ * Prefetch the hottest blocks, hottest first, by way of a manifest.
+ */
+int backfs_rewarm_command(char *args)
+{
+    uint64_t max_bytes = strtoull(args, NULL, 0);
+
+    char *manifest = NULL;
+    if (asprintf(&manifest, "%s/rewarm.manifest", backfs.cache_dir) == -1) {
+        return -ENOMEM;
+    }
+
+    int ret = heat_write_manifest(manifest);
+    if (ret == 0) {
+        ret = prefetch_import(manifest, max_bytes);
+    }
+    unlink(manifest);
+    FREE(manifest);
+    return ret;
+}
 
 int backfs_control_file_write(const char *buf, size_t len)
 {
@@ -135,10 +405,44 @@ int backfs_control_file_write(const char *buf, size_t len)
         int err = cache_invalidate_file(data);
         if (err != 0)
             return err;
+    } else if (strcmp(command, "invalidate_tree") == 0) {
+        size_t n = strlen(data);
+        if (n > 0 && data[n - 1] == '\n') {
+            data[n - 1] = '\0';
+        }
+        int err = cache_invalidate_tree(data);
+        if (err != 0)
+            return err;
     } else if (strcmp(command, "free_orphans") == 0) {
         int err = cache_free_orphan_buckets();
         if (err != 0)
             return err;
+    } else if (strcmp(command, "dump_trace") == 0) {
+        int err = trace_dump(data);
+        if (err != 0)
+            return err;
+    } else if (strcmp(command, "prefetch") == 0) {
+        int err = backfs_prefetch_command(data);
+        if (err != 0)
+            return err;
+    } else if (strcmp(command, "export_manifest") == 0) {
+        size_t n = strlen(data);
+        if (n > 0 && data[n - 1] == '\n') {
+            data[n - 1] = '\0';
+        }
+        int err = cache_export_manifest(data);
+        if (err != 0)
+            return err;
+    } else if (strcmp(command, "import_manifest") == 0) {
+        int err = backfs_import_command(data);
+        if (err != 0)
+            return err;
+    } else if (strcmp(command, "rewarm") == 0) {
+        int err = backfs_rewarm_command(data);
+        if (err != 0)
+            return err;
+    } else if (strcmp(command, "reset_latency") == 0) {
+        stats_reset_latency();
     } else if (strcmp(command, "noop") == 0) {
         // test command; do nothing
     } else {
@@ -218,6 +522,252 @@ exit:
     return ret;
 }
 
+/*
+ * Open file handle (fi->fh) of a regular file.
+ *
+ * Writes of less than a block are collected in buf until they reach the end
+ * of the block, so they go to the backing file and into the cache as one
+ * whole block instead of a series of small partial writes. Anything else that
+ * touches the same file writes the buffered data out first; handles are kept
+ * in a list for that. All of this is protected by backfs.lock.
+ */
+struct backfs_handle {
+    int fd;
+    char *path;
+    char *buf;          // block_size bytes, allocated on first use
+    uint32_t block;     // block the buffered data is in
+    uint64_t start;     // offset of the buffered data within the block
+    uint64_t len;       // bytes buffered; 0 if none
+    struct backfs_handle *next;
+};
+static struct backfs_handle *handles = NULL;
+
+#define HANDLE(fi) ((struct backfs_handle*)(uintptr_t)(fi)->fh)
+
+/*
+ * Whether path is dir, or somewhere under it.
+ */
+bool path_under(const char *path, const char *dir)
+{
+    size_t len = strlen(dir);
+    return strncmp(path, dir, len) == 0
+        && (path[len] == '\0' || path[len] == '/');
+}
+
+struct backfs_handle * handle_new(int fd, const char *path)
+{
+    struct backfs_handle *h = (struct backfs_handle*)calloc(1, sizeof(*h));
+    h->fd = fd;
+    h->path = strdup(path);
+
+    pthread_mutex_lock(&backfs.lock);
+    h->next = handles;
+    handles = h;
+    pthread_mutex_unlock(&backfs.lock);
+
+    return h;
+}
+
+void handle_free(struct backfs_handle *h)
+{
+    pthread_mutex_lock(&backfs.lock);
+    struct backfs_handle **pp = &handles;
+    while (*pp != h) {
+        pp = &(*pp)->next;
+    }
+    *pp = h->next;
+    pthread_mutex_unlock(&backfs.lock);
+
+    FREE(h->path);
+    FREE(h->buf);
+    FREE(h);
+}
+
+/*
+ * Write part of one block (or all of it) to the backing file, and bring the
+ * cache up to date with it. In write-back mode, the cache may take the data
+ * instead.
+ * Caller holds backfs.lock.
+ * Returns 0, or -errno.
+ */
+int write_block(const char *path, int fd, uint32_t block,
+        uint64_t block_offset, const char *buf, size_t len)
+{
+    bool full = (len == backfs.block_size);
+    bool cached = false;
+
+    backfs.generation++;
+    watch_forget(path);
+
+    DEBUG("writing block %lu, 0x%lx to 0x%lx\n",
+        (unsigned long)block,
+        (unsigned long)block_offset,
+        (unsigned long)block_offset + len);
+
+    if (backfs.writeback) {
+        // the cache can take it from here: a full block replaces what's
+        // cached, a partial one is merged into the cached block
+        int result;
+        if (full) {
+            // only recorded if nothing of the file is cached yet
+            struct stat before = {0};
+            fstat(fd, &before);
+            struct cache_validator validator;
+            cache_validator_from_stat(&validator, &before);
+            result = cache_add_dirty(path, block, buf, len, &validator);
+        } else {
+            result = cache_update_dirty(path, block, block_offset, buf, len);
+        }
+        if (result == 0) {
+            return 0;
+        }
+        DEBUG("not written back: %s\n", strerror(errno));
+        cached = (errno != ENOENT);
+    }
+
+    if (!backfs.writeback || cached) {
+        // Writing through; dirty data written back later must not land on
+        // top of this.
+        int err = cache_flush_dirty(path);
+        if (err != 0) {
+            return err;
+        }
+    }
+
+    uint64_t offset = (uint64_t)block * backfs.block_size + block_offset;
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = pwrite(fd, buf + written, len - written, offset + written);
+        if (n == -1) {
+            int err = errno;
+            PERROR("write to real file failed");
+            cache_try_invalidate_block(path, block);
+            return -err;
+        }
+        written += n;
+    }
+
+    // Keep the cache warm: a full block (or all of the last one) replaces
+    // what's cached, and anything else is merged into the cached block, if
+    // there is one. Either way, the file's validator is now whatever this
+    // write made it.
+    struct stat after;
+    struct cache_validator validator;
+    if (fstat(fd, &after) == -1) {
+        PERROR("fstat after write");
+        cache_try_invalidate_block(path, block);
+        return 0;
+    }
+    cache_validator_from_stat(&validator, &after);
+    if (full || (block_offset == 0
+                && offset + len >= (uint64_t)after.st_size)) {
+        if (cache_replace(path, block, buf, len, &validator) == -1) {
+            DEBUG("not cached: %s\n", strerror(errno));
+        }
+    } else if (cache_update(path, block, block_offset, buf, len,
+                &validator) == -1 && errno != ENOENT) {
+        DEBUG("unable to update cache: %s\n", strerror(errno));
+        cache_try_invalidate_block(path, block);
+    }
+
+    return 0;
+}
+
+/*
+ * Write out a handle's buffered data. Without write-back, it's been written
+ * to the backing file already, and only a whole block is left to cache.
+ * Caller holds backfs.lock.
+ * Returns 0, or -errno, in which case the data stays buffered.
+ */
+int handle_flush(struct backfs_handle *h)
+{
+    if (h == NULL || h->len == 0) {
+        return 0;
+    }
+
+    if (!backfs.writeback) {
+        struct stat after;
+        if (h->start == 0 && h->len == backfs.block_size
+                && fstat(h->fd, &after) == 0) {
+            DEBUG("caching %llu written bytes of %s\n",
+                    (unsigned long long) h->len, h->path);
+            struct cache_validator validator;
+            cache_validator_from_stat(&validator, &after);
+            if (cache_replace(h->path, h->block, h->buf, h->len,
+                        &validator) == -1) {
+                DEBUG("not cached: %s\n", strerror(errno));
+            }
+        }
+        h->len = 0;
+        return 0;
+    }
+
+    DEBUG("writing out %llu buffered bytes of %s\n",
+            (unsigned long long) h->len, h->path);
+
+    int ret = write_block(h->path, h->fd, h->block, h->start,
+            h->buf + h->start, h->len);
+    if (ret == 0) {
+        h->len = 0;
+    }
+    return ret;
+}
+
+/*
+ * Write out the buffered data of every handle on path (or under it), other
+ * than except.
+ * Caller holds backfs.lock.
+ */
+int flush_handles(const char *path, struct backfs_handle *except)
+{
+    int ret = 0;
+    for (struct backfs_handle *h = handles; h != NULL; h = h->next) {
+        if (h != except && h->len > 0 && path_under(h->path, path)) {
+            int err = handle_flush(h);
+            if (err != 0 && ret == 0) {
+                ret = err;
+            }
+        }
+    }
+    return ret;
+}
+
+/*
+ * Where buffered data for path ends, or 0 if there isn't any.
+ * Caller holds backfs.lock.
+ */
+uint64_t handles_extent(const char *path)
+{
+    uint64_t extent = 0;
+    for (struct backfs_handle *h = handles; h != NULL; h = h->next) {
+        if (h->len > 0 && strcmp(h->path, path) == 0) {
+            uint64_t end = (uint64_t)h->block * backfs.block_size
+                + h->start + h->len;
+            if (end > extent) {
+                extent = end;
+            }
+        }
+    }
+    return extent;
+}
+
+/*
+ * Point handles on path (or under it) at where it's been renamed to.
+ * Caller holds backfs.lock.
+ */
+void handles_rename(const char *path, const char *path_new)
+{
+    size_t len = strlen(path);
+    for (struct backfs_handle *h = handles; h != NULL; h = h->next) {
+        if (path_under(h->path, path)) {
+            char *renamed = NULL;
+            asprintf(&renamed, "%s%s", path_new, h->path + len);
+            FREE(h->path);
+            h->path = renamed;
+        }
+    }
+}
+
 int backfs_open(const char *path, struct fuse_file_info *fi)
 {
     DEBUG("open %s\n", path);
@@ -236,6 +786,15 @@ int backfs_open(const char *path, struct fuse_file_info *fi)
         goto exit;
     }
 
+    if (strcmp(BACKFS_STATS_FILE, path) == 0
+            || strcmp(BACKFS_LATENCY_FILE, path) == 0) {
+        if ((fi->flags & 3) != O_RDONLY)
+            ret = -EACCES;
+        // the size changes with every read; don't let the kernel go by it
+        fi->direct_io = 1;
+        goto exit;
+    }
+
     REALPATH(real, path);
     int fd = open(real, fi->flags);
     if (fd == -1) {
@@ -244,7 +803,98 @@ int backfs_open(const char *path, struct fuse_file_info *fi)
         goto exit;
     }
     
-    fi->fh = fd;
+    fi->fh = (uintptr_t)handle_new(fd, path);
+
+    // If what we have cached for the file is still current, the kernel's
+    // page cache for it is too, so let it keep that and serve reads without
+    // calling us at all. Otherwise (changed, or not cached) the kernel drops
+    // its cached pages for the file on this open.
+    struct stat stbuf;
+    if (fstat(fd, &stbuf) == 0) {
+        struct cache_validator validator;
+        cache_validator_from_stat(&validator, &stbuf);
+        if (cache_file_is_current(path, &validator) == 1) {
+            DEBUG("open: cache is current, keeping kernel cache\n");
+            fi->keep_cache = 1;
+        }
+    }
+
+exit:
+    FREE(real);
+    return ret;
+}
+
+/*
+ * Write dirty cache data back to the backing file; see cache_set_writeback().
+ * Called from the cache's flusher threads.
+ */
+int backfs_flush_block(const char *path, uint64_t offset, const char *buf,
+        uint64_t len, struct cache_validator *validator)
+{
+    int ret = 0;
+    int fd = -1;
+    char *real = NULL;
+
+    REALPATH(real, path);
+
+    fd = open(real, O_WRONLY);
+    if (fd == -1) {
+        ret = -errno;
+        goto exit;
+    }
+
+    uint64_t written = 0;
+    while (written < len) {
+        ssize_t n = pwrite(fd, buf + written, len - written, offset + written);
+        if (n == -1) {
+            ret = -errno;
+            goto exit;
+        }
+        written += n;
+    }
+
+    struct stat stbuf;
+    FORWARD(fstat, fd, &stbuf);
+    cache_validator_from_stat(validator, &stbuf);
+    watch_forget(path);
+
+exit:
+    if (fd != -1)
+        close(fd);
+    FREE(real);
+    return ret;
+}
+
+/*
+ * Identify a backing file by device and inode; see cache_set_key_fn().
+ * The inode generation tells apart files that got a freed inode number, on
+ * filesystems that have one.
+ */
+int backfs_file_key(const char *path, struct cache_file_key *key)
+{
+    int ret = 0;
+    char *real = NULL;
+
+    REALPATH(real, path);
+
+    struct stat stbuf;
+    FORWARD(lstat, real, &stbuf);
+    key->dev = stbuf.st_dev;
+    key->ino = stbuf.st_ino;
+    key->generation = 0;
+
+#ifdef FS_IOC_GETVERSION
+    if (S_ISREG(stbuf.st_mode)) {
+        int fd = open(real, O_RDONLY | O_NOFOLLOW);
+        if (fd != -1) {
+            int generation;
+            if (ioctl(fd, FS_IOC_GETVERSION, &generation) == 0) {
+                key->generation = (uint32_t) generation;
+            }
+            close(fd);
+        }
+    }
+#endif
 
 exit:
     FREE(real);
@@ -259,7 +909,9 @@ int backfs_write(const char *path, const char *buf, size_t size, off_t offset,
     if (strcmp(path, BACKFS_CONTROL_FILE) == 0) {
         return backfs_control_file_write(buf, size);
     }
-    else if (strcmp(path, BACKFS_VERSION_FILE) == 0) {
+    else if (strcmp(path, BACKFS_VERSION_FILE) == 0
+            || strcmp(path, BACKFS_STATS_FILE) == 0
+            || strcmp(path, BACKFS_LATENCY_FILE) == 0) {
         return -EACCES;
     }
 
@@ -267,88 +919,85 @@ int backfs_write(const char *path, const char *buf, size_t size, off_t offset,
         return -EACCES;
     }
 
+    struct backfs_handle *h = HANDLE(fi);
     int ret = 0;
-    bool locked = false;
-    bool first = true;
-    
-    int bytes_written = 0;
-    uint32_t first_block = offset / backfs.block_size;
-    uint32_t last_block = (offset+size) / backfs.block_size;
-    uint32_t block;
-    off_t buf_offset = 0;
-    for (block = first_block; block <= last_block; block++) {
-        size_t block_size;
-
-        if (block == first_block)
-            block_size = ((block + 1) * backfs.block_size) - offset;
-        else if (block == last_block)
-            block_size = size - buf_offset;
-        else
-            block_size = backfs.block_size;
-
-        if (block_size > size)
-            block_size = size;
-        if (block_size == 0)
-            continue;
+    int err;
 
-        pthread_mutex_lock(&backfs.lock);
-        locked = true;
+    DEBUG("writing to 0x%lx to 0x%lx, block size is 0x%lx\n",
+        (unsigned long)offset,
+        (unsigned long)offset+size,
+        (unsigned long)backfs.block_size);
 
-        if (first) {
-            DEBUG("writing to 0x%lx to 0x%lx, block size is 0x%lx\n",
-                (unsigned long)offset,
-                (unsigned long)offset+size,
-                (unsigned long)backfs.block_size);
-            first = false;
-        }
-        
-        DEBUG("writing block %lu, 0x%lx to 0x%lx\n",
-            (unsigned long)block,
-            (unsigned long)offset + buf_offset,
-            (unsigned long)offset + buf_offset + block_size);
-
-        ssize_t nwritten = pwrite((int)fi->fh, buf + buf_offset, block_size, offset + buf_offset);
-
-        bytes_written += nwritten;
-        DEBUG("bytes_written=%lu\n",(unsigned long)bytes_written);
-        if (nwritten < block_size) {
-            DEBUG("wrote less than requested, %lu instead of %lu\n",
-                (unsigned long)nwritten,
-                (unsigned long)block_size);
-            ret = bytes_written;
-            goto exit;
-        }
-        
-        if (block_size == backfs.block_size) {
-            // a full block, save it to the cache
-            for (int loop = 0; loop < 5; loop++) {
-                if (0 == cache_add(
-                            path,
-                            block,
-                            buf + buf_offset,
-                            nwritten,
-                            time(NULL))
-                        || errno != EAGAIN) {
-                    break;
+    pthread_mutex_lock(&backfs.lock);
+
+    // Other handles' buffered data goes out first, so this write lands on
+    // top of it and not the other way around.
+    err = flush_handles(path, h);
+    if (err != 0) {
+        ret = err;
+        goto exit;
+    }
+
+    int bytes_written = 0;
+    while (bytes_written < size) {
+        uint64_t pos = offset + bytes_written;
+        uint32_t block = pos / backfs.block_size;
+        uint64_t block_offset = pos % backfs.block_size;
+        size_t len = backfs.block_size - block_offset;
+        if (len > size - bytes_written)
+            len = size - bytes_written;
+
+        if (len == backfs.block_size) {
+            // a whole block goes straight through
+            err = handle_flush(h);
+            if (err == 0) {
+                err = write_block(path, h->fd, block, 0, buf + bytes_written,
+                        len);
+            }
+        } else {
+            // Anything less gets buffered until the rest of the block shows
+            // up, or something else needs it written out. Without
+            // write-back, it's written through now all the same, so it's
+            // never acknowledged before it's in the backing file; the buffer
+            // only puts the block together to cache it whole.
+            err = 0;
+            if (!backfs.writeback) {
+                err = write_block(path, h->fd, block, block_offset,
+                        buf + bytes_written, len);
+            }
+            if (err == 0 && h->len > 0
+                    && (h->block != block || h->start + h->len != block_offset)) {
+                err = handle_flush(h);
+            }
+            if (err == 0) {
+                if (h->len == 0) {
+                    if (h->buf == NULL) {
+                        h->buf = (char*)malloc(backfs.block_size);
+                    }
+                    h->block = block;
+                    h->start = block_offset;
+                }
+                memcpy(h->buf + block_offset, buf + bytes_written, len);
+                h->len += len;
+
+                if (h->start + h->len == backfs.block_size) {
+                    err = handle_flush(h);
                 }
-                DEBUG("cache retry #%d\n", loop+1);
             }
         }
-        else {
-            cache_try_invalidate_block(path, block);
-        }
 
-        pthread_mutex_unlock(&backfs.lock);
-        locked = false;
+        if (err != 0) {
+            ret = (bytes_written > 0) ? bytes_written : err;
+            goto exit;
+        }
 
-        buf_offset += block_size;
+        bytes_written += len;
     }
 
     ret = bytes_written;
 
 exit:
-    if (locked)
-        pthread_mutex_unlock(&backfs.lock);
+    pthread_mutex_unlock(&backfs.lock);
     return ret;
 }
 
@@ -404,6 +1053,30 @@ int backfs_getattr(const char *path, struct stat *stbuf)
         goto exit;
     }
 
+    if (strcmp(path, BACKFS_STATS_FILE) == 0
+            || strcmp(path, BACKFS_LATENCY_FILE) == 0) {
+        memset(stbuf, 0, sizeof(struct stat));
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = 0;
+        stbuf->st_uid = 0;
+        stbuf->st_gid = 0;
+        stbuf->st_atime = 0;
+        stbuf->st_mtime = 0;
+        stbuf->st_ctime = 0;
+        goto exit;
+    }
+
+    // Writes past the end may not have reached the backing file yet. Look
+    // before the lstat: whatever gets written out in between shows up in it.
+    uint64_t extent = cache_dirty_extent(path);
+    pthread_mutex_lock(&backfs.lock);
+    uint64_t buffered = handles_extent(path);
+    pthread_mutex_unlock(&backfs.lock);
+    if (buffered > extent) {
+        extent = buffered;
+    }
+
     REALPATH(real, path);
     ret = lstat(real, stbuf);
     
@@ -417,6 +1090,12 @@ int backfs_getattr(const char *path, struct stat *stbuf)
     } else {
         DEBUG("mode: 0%o\n", stbuf->st_mode);
         ret = 0;
+
+        if (S_ISREG(stbuf->st_mode)) {
+            if (extent > (uint64_t)stbuf->st_size) {
+                stbuf->st_size = extent;
+            }
+        }
     }
 
 exit:
@@ -424,6 +1103,23 @@ exit:
     return ret;
 }
 
+/*
+ * stat() a backing file, unless the watcher says it hasn't changed since the
+ * last time.
+ */
+int stat_real(const char *path, const char *real, struct stat *st)
+{
+    uint64_t generation;
+    if (watch_lookup(path, st, &generation)) {
+        return 0;
+    }
+    if (stat(real, st) == -1) {
+        return -1;
+    }
+    watch_remember(path, st, generation);
+    return 0;
+}
+
 int backfs_read(const char *path, char *rbuf, size_t size, off_t offset,
         struct fuse_file_info *fi)
 {
@@ -448,36 +1144,54 @@ int backfs_read(const char *path, char *rbuf, size_t size, off_t offset,
         goto exit;
     }
 
+    if (strcmp(path, BACKFS_STATS_FILE) == 0
+            || strcmp(path, BACKFS_LATENCY_FILE) == 0) {
+        char stats[8192];
+        size_t len = (strcmp(path, BACKFS_STATS_FILE) == 0)
+            ? backfs_stats_format(stats, sizeof(stats))
+            : stats_format_latency(stats, sizeof(stats));
+        if (len >= sizeof(stats)) {
+            len = sizeof(stats) - 1;
+        }
+
+        if (offset > len) {
+            goto exit;
+        }
+
+        int bytes_out = ((len - offset) > size) ? size : (len - offset);
+
+        memcpy(rbuf, stats+offset, bytes_out);
+
+        ret = bytes_out;
+        goto exit;
+    }
+
+    access_trace_read(path, offset, size);
+
     // for debug output
     bool first = true;
 
     int bytes_read = 0;
-    uint32_t first_block = offset / backfs.block_size;
-    uint32_t last_block = (offset+size) / backfs.block_size;
+    uint32_t start_block = first_block(offset, backfs.block_size);
+    uint32_t end_block = last_block(offset, size, backfs.block_size);
     uint32_t block;
     size_t buf_offset = 0;
-    for (block = first_block; block <= last_block; block++) {
-        off_t block_offset;
-        size_t block_size;
-        
-        if (block == first_block) {
-            block_offset = offset - block * backfs.block_size;
-        } else {
-            block_offset = 0;
-        }
+    for (block = start_block; block <= end_block; block++) {
+        uint64_t part_offset;
+        size_t block_size = block_part(offset, size, backfs.block_size, block,
+                &part_offset);
+        off_t block_offset = part_offset;
 
-        if (block == last_block) {
-            block_size = (offset+size) - (block * backfs.block_size) - block_offset;
-        } else {
-            block_size = backfs.block_size - block_offset;
-        }
-		
         if (block_size == 0)
             continue;
 
+        heat_record(path, block);
+
         // in case another thread is reading a full block as a result of a 
         // cache miss
+        uint64_t lock_start = stats_now();
         ret = pthread_mutex_lock(&backfs.lock);
+        stats_record(STATS_READ_LOCK_WAIT, lock_start);
         if (ret) {
             DEBUG("Error locking mutex: %d!", ret);
             goto exit;
@@ -490,6 +1204,13 @@ int backfs_read(const char *path, char *rbuf, size_t size, off_t offset,
                     (unsigned long) offset+size,
                     (unsigned long) backfs.block_size);
             first = false;
+
+            // buffered writes to this file have to land before it's read;
+            // any made once this read has started can land after it
+            ret = flush_handles(path, NULL);
+            if (ret != 0) {
+                goto exit;
+            }
         }
 
         DEBUG("reading block %lu, 0x%lx to 0x%lx\n",
@@ -500,16 +1221,46 @@ int backfs_read(const char *path, char *rbuf, size_t size, off_t offset,
         REALPATH(real, path);
         
         struct stat real_stat;
-        real_stat.st_mtime = 0;
-        if (stat(real, &real_stat) == -1) {
+        if (stat_real(path, real, &real_stat) == -1) {
             PERROR("stat on real file failed");
             ret = -1 * errno;
             goto exit;
         }
 
+        // Dirty blocks can extend the file beyond what the backing file has;
+        // anything in between (a hole, or a short last block) has to come
+        // from the backing file, so get it up to date first.
+        if (offset + size > real_stat.st_size
+                && cache_dirty_extent(path) > (uint64_t)real_stat.st_size) {
+            DEBUG("read past the end of the backing file; writing back first\n");
+            ret = cache_flush_dirty(path);
+            if (ret != 0) {
+                goto exit;
+            }
+            if (stat(real, &real_stat) == -1) {
+                PERROR("stat on real file failed");
+                ret = -1 * errno;
+                goto exit;
+            }
+        }
+
+        struct cache_validator validator;
+        cache_validator_from_stat(&validator, &real_stat);
+
         uint64_t bread = 0;
         int result = cache_fetch(path, block, block_offset, 
-                rbuf + buf_offset, block_size, &bread, real_stat.st_mtime);
+                rbuf + buf_offset, block_size, &bread, &validator);
+        if (result == 0 && bread < block_size
+                && (uint64_t)block * backfs.block_size + block_offset + bread
+                    < (uint64_t)real_stat.st_size) {
+            // A short block was the end of the file, but a write further on
+            // has grown the file since; re-read what's now past the old end.
+            DEBUG("cached block ends before the file does; re-reading it\n");
+            cache_flush_dirty(path);
+            cache_try_invalidate_block(path, block);
+            result = -1;
+            errno = ENOENT;
+        }
         if (result == -1) {
             if (errno == ENOENT) {
                 // not an error
@@ -525,12 +1276,14 @@ int backfs_read(const char *path, char *rbuf, size_t size, off_t offset,
 
             DEBUG("reading block %lu from real file: %s\n",
                     (unsigned long) block, real);
-            int fd = (int)fi->fh;
+            int fd = HANDLE(fi)->fd;
             
             // read the entire block
             block_buf = (char*)malloc(backfs.block_size);
+            uint64_t pread_start = stats_now();
             int nread = pread(fd, block_buf, backfs.block_size,
                     backfs.block_size * block);
+            stats_record(STATS_BACKING_PREAD, pread_start);
             if (nread == -1) {
                 PERROR("read error on real file");
                 ret = -EIO;
@@ -539,27 +1292,29 @@ int backfs_read(const char *path, char *rbuf, size_t size, off_t offset,
                 DEBUG("got %lu bytes from real file\n", (unsigned long) nread);
                 DEBUG("adding to cache\n");
                 
-                for (int loop = 0; loop < 5; loop++) {
-                    if (0 == cache_add(
-                                path,
-                                block,
-                                block_buf,
-                                nread,
-                                real_stat.st_mtime)
-                            || errno != EAGAIN) {
-                        break;
-                    }
-                    DEBUG("cache retry #%d\n", loop+1);
+                if (cache_add(path, block, block_buf, nread,
+                            &validator) == -1) {
+                    // the read still succeeds; this block just isn't cached
+                    DEBUG("not cached: %s\n", strerror(errno));
                 }
 
+                // what the real file has from block_offset on
+                size_t avail = (nread > block_offset) ? nread - block_offset : 0;
+
                 memcpy(rbuf+buf_offset, block_buf+block_offset, 
-                        ((nread < block_size) ? nread : block_size));
+                        ((avail < block_size) ? avail : block_size));
                 FREE(block_buf);
-
-                if (nread < block_size) {
+                stats_inc(STATS_MISSES);
+                stats_add(STATS_BYTES_FROM_BACKING,
+                        (avail < block_size) ? avail : block_size);
+                trace_add(STATS_OP_READ, path, block, TRACE_MISS,
+                        (avail < block_size) ? avail : block_size,
+                        lock_start, stats_now() - lock_start);
+
+                if (avail < block_size) {
                     DEBUG("read less than requested, %lu instead of %lu\n", 
-                            (unsigned long) nread, (unsigned long) block_size);
-                    bytes_read += nread;
+                            (unsigned long) avail, (unsigned long) block_size);
+                    bytes_read += avail;
                     DEBUG("bytes_read=%lu\n", 
                             (unsigned long) bytes_read);
                     ret = bytes_read;
@@ -573,6 +1328,10 @@ int backfs_read(const char *path, char *rbuf, size_t size, off_t offset,
             }
         } else {
             DEBUG("got %lu bytes from cache\n", (unsigned long) bread);
+            stats_inc(STATS_HITS);
+            stats_add(STATS_BYTES_FROM_CACHE, bread);
+            trace_add(STATS_OP_READ, path, block, TRACE_HIT, bread,
+                    lock_start, stats_now() - lock_start);
             bytes_read += bread;
             DEBUG("bytes_read=%lu\n", (unsigned long) bytes_read);
 
@@ -665,6 +1424,8 @@ int backfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     if (strcmp("/", path) == 0) {
         filler(buf, ".backfs_control", NULL, 0);
         filler(buf, ".backfs_version", NULL, 0);
+        filler(buf, ".backfs_stats", NULL, 0);
+        filler(buf, ".backfs_latency", NULL, 0);
     }
 
     while ((entry = readdir(dir)) != NULL) {
@@ -691,8 +1452,29 @@ int backfs_truncate(const char *path, off_t length)
 
     RW_ONLY();
     REALPATH(real, path);
+
+    // buffered writes happened before the truncate, so they go out first
+    pthread_mutex_lock(&backfs.lock);
+    ret = flush_handles(path, NULL);
+    pthread_mutex_unlock(&backfs.lock);
+    if (ret != 0) {
+        goto exit;
+    }
+
+    // dirty blocks past the new end are discarded below; the one the new end
+    // falls in has data that has to be kept
+    ret = cache_flush_dirty(path);
+    if (ret != 0) {
+        goto exit;
+    }
+
     FORWARD(truncate, real, length);
 
+    pthread_mutex_lock(&backfs.lock);
+    backfs.generation++;
+    pthread_mutex_unlock(&backfs.lock);
+    watch_forget(path);
+
     uint32_t block = length / backfs.block_size;
     cache_try_invalidate_blocks_above(path, block);
 
@@ -710,13 +1492,14 @@ int backfs_create(const char *path, mode_t mode, struct fuse_file_info *info)
     RW_ONLY();
     REALPATH(real, path);
 
-    ret = open(real, info->flags | O_CREAT | O_EXCL); // not sure on the read/write mode here...
-    if (ret == -1) {
+    int fd = open(real, info->flags | O_CREAT | O_EXCL); // not sure on the read/write mode here...
+    if (fd == -1) {
         PERROR("error opening real file for create");
         ret = -errno;
         goto exit;
     }
-    info->fh = ret;
+    info->fh = (uintptr_t)handle_new(fd, path);
+    watch_forget(path);
 
     FORWARD(chmod, real, mode);
 
@@ -733,9 +1516,20 @@ int backfs_unlink(const char *path)
 
     RW_ONLY();
     REALPATH(real, path);
+
+    // anything still buffered was written before the unlink
+    pthread_mutex_lock(&backfs.lock);
+    flush_handles(path, NULL);
+    pthread_mutex_unlock(&backfs.lock);
+
     FORWARD(unlink, real);
 
-    if (0 == cache_try_invalidate_file(path)) {
+    pthread_mutex_lock(&backfs.lock);
+    backfs.generation++;
+    pthread_mutex_unlock(&backfs.lock);
+    watch_forget(path);
+
+    if (0 == cache_discard_file(path)) {
         DEBUG("unlink: invalidated cache for the file\n");
     }
     // ignore its return value; don't care if it fails.
@@ -745,14 +1539,74 @@ exit:
     return ret;
 }
 
+int backfs_flush(const char *path, struct fuse_file_info *info)
+{
+    DEBUG("flush: %s\n", path);
+    int ret = 0;
+
+    pthread_mutex_lock(&backfs.lock);
+    ret = handle_flush(HANDLE(info));
+    pthread_mutex_unlock(&backfs.lock);
+    if (ret != 0) {
+        return ret;
+    }
+
+    return cache_flush_dirty(path);
+}
+
+int backfs_fsync(const char *path, int datasync, struct fuse_file_info *info)
+{
+    DEBUG("fsync: %s\n", path);
+    int ret = 0;
+    struct backfs_handle *h = HANDLE(info);
+
+    if (h == NULL) {
+        // control or version file
+        goto exit;
+    }
+
+    pthread_mutex_lock(&backfs.lock);
+    ret = handle_flush(h);
+    pthread_mutex_unlock(&backfs.lock);
+    if (ret != 0) {
+        goto exit;
+    }
+
+    ret = cache_flush_dirty(path);
+    if (ret != 0) {
+        goto exit;
+    }
+
+    if (datasync) {
+        FORWARD(fdatasync, h->fd);
+    } else {
+        FORWARD(fsync, h->fd);
+    }
+
+exit:
+    return ret;
+}
+
 int backfs_release(const char *path, struct fuse_file_info *info)
 {
     DEBUG("release: %s\n", path);
+    struct backfs_handle *h = HANDLE(info);
+
+    // Nowhere to report an error from here. Dirty data stays dirty and gets
+    // retried; buffered data is lost, but flush (on close) already tried it.
+    pthread_mutex_lock(&backfs.lock);
+    if (handle_flush(h) != 0) {
+        ERROR("release: lost %llu buffered bytes of %s\n",
+                (unsigned long long) h->len, path);
+    }
+    pthread_mutex_unlock(&backfs.lock);
+    cache_flush_dirty(path);
 
-    if (info->fh != 0) {
+    if (h != NULL) {
         // If we saved a file handle here from 
         DEBUG("closing saved file handle\n");
-        close((int)info->fh);
+        close(h->fd);
+        handle_free(h);
     }
 
     // FUSE ignores the return value here.
@@ -804,6 +1658,20 @@ exit:
     return ret;
 }
 
+/*
+ * A change to a backing file's metadata moves its ctime; tell the cache, so
+ * it doesn't take that for a change to the file's data.
+ */
+static void refresh_validator(const char *path, const char *real)
+{
+    struct stat st;
+    if (lstat(real, &st) == 0 && S_ISREG(st.st_mode)) {
+        struct cache_validator validator;
+        cache_validator_from_stat(&validator, &st);
+        cache_refresh_validator(path, &validator);
+    }
+}
+
 enum rename_or_link { RENAME, LINK };
 
 static int rename_or_link_internal(
@@ -822,25 +1690,69 @@ static int rename_or_link_internal(
     REALPATH(real_new, path_new);
 
     if (which == RENAME) {
+        // Dirty blocks get written back by name. Write back what's there
+        // now without holding up everything else; once locked, only what
+        // got dirtied in the meantime (usually nothing) is left.
+        ret = cache_flush_dirty(path);
+        if (ret != 0) {
+            goto exit;
+        }
+
         pthread_mutex_lock(&backfs.lock);
         locked = true;
+
+        ret = flush_handles(path, NULL);
+        if (ret == 0) {
+            ret = flush_handles(path_new, NULL);
+        }
+        if (ret == 0) {
+            ret = cache_flush_dirty(path);
+        }
+        if (ret != 0) {
+            goto exit;
+        }
     }
 
     switch (which) {
         case RENAME:
-            FORWARD(rename, real, real_new);
+            // the watcher shouldn't take this for a directory gone
+            watch_own_move(path);
+            if (rename(real, real_new) == -1) {
+                PERROR("rename");
+                ret = -errno;
+                watch_own_move_failed(path);
+                goto exit;
+            }
             break;
         case LINK:
             FORWARD(link, real, real_new);
             break;
     }
 
+    // either could be a directory
+    watch_forget_tree(path_new);
     if (which == RENAME) {
+        backfs.generation++;
+        watch_forget_tree(path);
         int cache_ret = cache_rename(path, path_new);
         if (cache_ret != 0) {
-            FORWARD(rename, real_new, real); // undo the rename
+            // undo the rename
+            watch_own_move(path_new);
+            if (rename(real_new, real) == -1) {
+                PERROR("rename");
+                ret = -errno;
+                watch_own_move_failed(path_new);
+                goto exit;
+            }
             ret = cache_ret;
+        } else {
+            handles_rename(path, path_new);
+            refresh_validator(path_new, real_new);
         }
+    } else {
+        // the link count is part of the file's ctime
+        refresh_validator(path, real_new);
+        refresh_validator(path_new, real_new);
     }
 
 exit:
@@ -872,6 +1784,8 @@ int backfs_chmod(const char *path, mode_t mode)
     RW_ONLY();
     REALPATH(real, path);
     FORWARD(chmod, real, mode);
+    watch_forget(path);
+    refresh_validator(path, real);
 
 exit:
     FREE(real);
@@ -887,6 +1801,8 @@ int backfs_chown(const char *path, uid_t uid, gid_t gid)
     RW_ONLY();
     REALPATH(real, path);
     FORWARD(chown, real, uid, gid);
+    watch_forget(path);
+    refresh_validator(path, real);
 
 exit:
     FREE(real);
@@ -903,6 +1819,8 @@ int backfs_utimens(const char *path, const struct timespec tv[2])
     RW_ONLY();
     REALPATH(real, path);
     FORWARD(utimensat, 0, real, tv, 0);
+    watch_forget(path);
+    refresh_validator(path, real);
 
 exit:
     FREE(real);
@@ -1125,6 +2043,21 @@ exit:
     return ret;
 }
 
+/*
+ * Called at unmount. Stops the background threads, those that use the cache
+ * first, and marks the cache as having been shut down cleanly, so the next
+ * mount doesn't need to check it.
+ */
+void backfs_destroy(void *private_data)
+{
+    (void)private_data;
+    INFO("unmounting\n");
+    watch_shutdown();
+    prefetch_shutdown();
+    heat_shutdown();
+    cache_shutdown();
+}
+
 #ifdef STUB_FUNCTIONS
 //
 // Stubs for the remaining syscalls
@@ -1138,8 +2071,6 @@ int backfs_##func(const char *path, __VA_ARGS__) \
 }
 
 STUB(statfs, struct statvfs *stat)
-STUB(flush, struct fuse_file_info *ffi)
-STUB(fsync, int n, struct fuse_file_info *ffi)
 STUB(fsyncdir, int a, struct fuse_file_info *ffi)
 STUB(lock, struct fuse_file_info *ffi, int cmd, struct flock *flock)
 STUB(bmap, size_t blocksize, uint64_t *idx)
@@ -1149,7 +2080,93 @@ STUB(flock, struct fuse_file_info *ffi, int op)
 STUB(fallocate, int a, off_t b, off_t c, struct fuse_file_info *ffi)
 #endif
 
-#define IMPL(func) .func = backfs_##func
+#define STUB_IMPL(func) .func = backfs_##func
+
+//
+// Every operation goes through one of these, to record how long it took, and
+// add it to the trace.
+//
+
+#define TIMED(func, timer, params, args) \
+static int timed_##func params \
+{ \
+    uint64_t start = stats_now(); \
+    int ret = backfs_##func args; \
+    uint64_t latency = stats_record(timer, start); \
+    trace_add(timer, path, TRACE_NO_BLOCK, 0, (ret > 0) ? ret : 0, \
+            start, latency); \
+    return ret; \
+}
+
+#ifdef BACKFS_RW
+TIMED(mkdir, STATS_OP_MKDIR, (const char *path, mode_t mode),
+        (path, mode))
+TIMED(unlink, STATS_OP_UNLINK, (const char *path),
+        (path))
+TIMED(rmdir, STATS_OP_RMDIR, (const char *path),
+        (path))
+TIMED(symlink, STATS_OP_SYMLINK, (const char *target, const char *path),
+        (target, path))
+TIMED(rename, STATS_OP_RENAME, (const char *path, const char *path_new),
+        (path, path_new))
+TIMED(link, STATS_OP_LINK, (const char *path, const char *path_new),
+        (path, path_new))
+TIMED(chmod, STATS_OP_CHMOD, (const char *path, mode_t mode),
+        (path, mode))
+TIMED(chown, STATS_OP_CHOWN, (const char *path, uid_t uid, gid_t gid),
+        (path, uid, gid))
+TIMED(setxattr, STATS_OP_SETXATTR, (const char *path, const char *name,
+        const char *value, size_t size, int flags),
+        (path, name, value, size, flags))
+TIMED(removexattr, STATS_OP_REMOVEXATTR, (const char *path, const char *name),
+        (path, name))
+TIMED(create, STATS_OP_CREATE, (const char *path, mode_t mode,
+        struct fuse_file_info *fi),
+        (path, mode, fi))
+TIMED(flush, STATS_OP_FLUSH, (const char *path, struct fuse_file_info *fi),
+        (path, fi))
+TIMED(fsync, STATS_OP_FSYNC, (const char *path, int datasync,
+        struct fuse_file_info *fi),
+        (path, datasync, fi))
+#endif
+
+#ifdef HAVE_UTIMENS
+TIMED(utimens, STATS_OP_UTIMENS, (const char *path, const struct timespec tv[2]),
+        (path, tv))
+#endif
+
+TIMED(open, STATS_OP_OPEN, (const char *path, struct fuse_file_info *fi),
+        (path, fi))
+TIMED(read, STATS_OP_READ, (const char *path, char *buf, size_t size,
+        off_t offset, struct fuse_file_info *fi),
+        (path, buf, size, offset, fi))
+TIMED(opendir, STATS_OP_OPENDIR, (const char *path, struct fuse_file_info *fi),
+        (path, fi))
+TIMED(readdir, STATS_OP_READDIR, (const char *path, void *buf,
+        fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi),
+        (path, buf, filler, offset, fi))
+TIMED(releasedir, STATS_OP_RELEASEDIR, (const char *path, struct fuse_file_info *fi),
+        (path, fi))
+TIMED(getattr, STATS_OP_GETATTR, (const char *path, struct stat *stbuf),
+        (path, stbuf))
+TIMED(access, STATS_OP_ACCESS, (const char *path, int mode),
+        (path, mode))
+TIMED(write, STATS_OP_WRITE, (const char *path, const char *buf, size_t size,
+        off_t offset, struct fuse_file_info *fi),
+        (path, buf, size, offset, fi))
+TIMED(readlink, STATS_OP_READLINK, (const char *path, char *buf, size_t size),
+        (path, buf, size))
+TIMED(truncate, STATS_OP_TRUNCATE, (const char *path, off_t length),
+        (path, length))
+TIMED(release, STATS_OP_RELEASE, (const char *path, struct fuse_file_info *fi),
+        (path, fi))
+TIMED(getxattr, STATS_OP_GETXATTR, (const char *path, const char *name, char *value,
+        size_t size),
+        (path, name, value, size))
+TIMED(listxattr, STATS_OP_LISTXATTR, (const char *path, char *list, size_t size),
+        (path, list, size))
+
+#define IMPL(func) .func = timed_##func
 
 static struct fuse_operations BackFS_Opers = {
 #ifdef BACKFS_RW
@@ -1164,19 +2181,19 @@ static struct fuse_operations BackFS_Opers = {
     IMPL(setxattr),
     IMPL(removexattr),
     IMPL(create),
+    IMPL(flush),
+    IMPL(fsync),
 #ifdef HAVE_UTIMENS
     IMPL(utimens),
 #endif
 #ifdef STUB_FUNCTIONS
-    IMPL(fsyncdir),
-    IMPL(statfs),
-    IMPL(flush),
-    IMPL(fsync),
-    IMPL(lock),
-    IMPL(bmap),
-    IMPL(ioctl),
-    IMPL(poll),
-    IMPL(flock),
+    STUB_IMPL(fsyncdir),
+    STUB_IMPL(statfs),
+    STUB_IMPL(lock),
+    STUB_IMPL(bmap),
+    STUB_IMPL(ioctl),
+    STUB_IMPL(poll),
+    STUB_IMPL(flock),
 //    IMPL(fallocate),  // pretty new; a lot of FUSE installs don't have this yet.
 #endif
 #endif
@@ -1197,10 +2214,15 @@ static struct fuse_operations BackFS_Opers = {
 //  IMPL(fgetattr),     // redundant, use getattr instead
 //  IMPL(read_buf),     // use read instead
 //  IMPL(write_buf),    // use write instead
+    .destroy = backfs_destroy,
 };
 
 enum {
     KEY_RW,
+    KEY_WRITEBACK,
+    KEY_ACCESS_TRACE,
+    KEY_CHECK_CACHE,
+    KEY_WATCH,
     KEY_VERBOSE,
     KEY_DEBUG,
     KEY_HELP,
@@ -1212,7 +2234,26 @@ static struct fuse_opt backfs_opts[] = {
     {"cache_size=%llu", offsetof(struct backfs, cache_size),    0},
     {"backing_fs=%s",   offsetof(struct backfs, real_root),     0},
     {"block_size=%llu", offsetof(struct backfs, block_size),    0},
+    {"verify_percent=%u", offsetof(struct backfs, verify_percent), 0},
+    {"cache_io=%s",     offsetof(struct backfs, cache_io),      0},
+    {"cache_key=%s",    offsetof(struct backfs, cache_key),     0},
+    {"evict_high=%u",   offsetof(struct backfs, evict_high),    0},
+    {"evict_low=%u",    offsetof(struct backfs, evict_low),     0},
+    {"writeback_threads=%u", offsetof(struct backfs, writeback_threads), 0},
+    {"writeback_max_dirty=%llu", offsetof(struct backfs, writeback_max_dirty), 0},
+    {"writeback_delay=%u", offsetof(struct backfs, writeback_delay), 0},
+    {"trace_size=%u",   offsetof(struct backfs, trace_size),    0},
+    {"prefetch_threads=%u", offsetof(struct backfs, prefetch_threads), 0},
+    {"prefetch_rate=%llu", offsetof(struct backfs, prefetch_rate), 0},
+    {"heat_blocks=%u",  offsetof(struct backfs, heat_blocks),   0},
+    {"heat_half_life=%u", offsetof(struct backfs, heat_half_life), 0},
+    {"check_threads=%u", offsetof(struct backfs, check_threads), 0},
+    {"watch_ttl=%u",    offsetof(struct backfs, watch_ttl),     0},
     FUSE_OPT_KEY("rw",          KEY_RW),
+    FUSE_OPT_KEY("writeback",   KEY_WRITEBACK),
+    FUSE_OPT_KEY("access_trace", KEY_ACCESS_TRACE),
+    FUSE_OPT_KEY("check_cache", KEY_CHECK_CACHE),
+    FUSE_OPT_KEY("watch",       KEY_WATCH),
     FUSE_OPT_KEY("verbose",     KEY_VERBOSE),
     FUSE_OPT_KEY("-v",          KEY_VERBOSE),
     FUSE_OPT_KEY("--verbose",   KEY_VERBOSE),
@@ -1278,6 +2319,27 @@ int backfs_opt_proc(void *data, const char *arg, int key,
         return FUSE_OPT_ERROR;
 #endif
 
+    case KEY_WRITEBACK:
+#ifdef BACKFS_RW
+        backfs.writeback = true;
+        return FUSE_OPT_DISCARD;
+#else
+        fprintf(stderr, "BackFS: write-back is not supported in this build.\n");
+        return FUSE_OPT_ERROR;
+#endif
+
+    case KEY_ACCESS_TRACE:
+        backfs.access_trace = true;
+        return FUSE_OPT_DISCARD;
+
+    case KEY_CHECK_CACHE:
+        backfs.check_cache = true;
+        return FUSE_OPT_DISCARD;
+
+    case KEY_WATCH:
+        backfs.watch = true;
+        return FUSE_OPT_DISCARD;
+
     case KEY_VERBOSE:
         backfs_log_level = LOG_LEVEL_INFO;
         return FUSE_OPT_DISCARD;
@@ -1315,6 +2377,16 @@ int main(int argc, char **argv)
 
     backfs_log_level = LOG_LEVEL_WARN;
     backfs.real_root_alloc = true;  // assume it comes from arg parsing.
+    backfs.verify_percent = 1;
+    backfs.evict_high = 95;
+    backfs.evict_low = 90;
+    backfs.writeback_threads = 2;
+    backfs.writeback_max_dirty = 64 * 1024 * 1024;
+    backfs.writeback_delay = 5;
+    backfs.trace_size = 16384;
+    backfs.prefetch_threads = 4;
+    backfs.heat_half_life = 24 * 60 * 60;
+    backfs.watch_ttl = 1;
 
     if (fuse_opt_parse(&args, &backfs, backfs_opts, backfs_opt_proc) == -1) {
         fprintf(stderr, "BackFS: argument parsing failed.\n");
@@ -1512,24 +2584,120 @@ int main(int argc, char **argv)
 
     printf("block size %llu bytes\n", backfs.block_size);
 
+    if (backfs.verify_percent > 100) {
+        fprintf(stderr, "BackFS: error: verify_percent must be between 0 and 100\n");
+        exit_code = -1;
+        goto exit;
+    }
+    cache_set_verify_percent(backfs.verify_percent);
+
+    if (backfs.evict_high > 100 || backfs.evict_low > backfs.evict_high) {
+        fprintf(stderr, "BackFS: error: need 0 <= evict_low <= evict_high <= 100\n");
+        exit_code = -1;
+        goto exit;
+    }
+    cache_set_watermarks(backfs.evict_high, backfs.evict_low);
+
+    if (backfs.cache_io == NULL || strcmp(backfs.cache_io, "buffered") == 0) {
+        cache_set_io_mode(CACHE_IO_BUFFERED);
+    } else if (strcmp(backfs.cache_io, "fadvise") == 0) {
+        cache_set_io_mode(CACHE_IO_FADVISE);
+    } else if (strcmp(backfs.cache_io, "direct") == 0) {
+        cache_set_io_mode(CACHE_IO_DIRECT);
+    } else {
+        fprintf(stderr, "BackFS: error: cache_io must be one of buffered, fadvise, or direct\n");
+        exit_code = -1;
+        goto exit;
+    }
+
+    if (backfs.cache_key != NULL && strcmp(backfs.cache_key, "inode") == 0) {
+        cache_set_key_fn(&backfs_file_key);
+    } else if (backfs.cache_key != NULL && strcmp(backfs.cache_key, "path") != 0) {
+        fprintf(stderr, "BackFS: error: cache_key must be path or inode\n");
+        exit_code = -1;
+        goto exit;
+    }
+
+    if (backfs.writeback) {
+        if (!backfs.rw) {
+            fprintf(stderr, "BackFS: error: writeback needs a rw mount\n");
+            exit_code = -1;
+            goto exit;
+        }
+        if (backfs.writeback_threads == 0
+                || backfs.writeback_max_dirty < backfs.block_size) {
+            fprintf(stderr, "BackFS: error: writeback needs at least one thread, "
+                    "and writeback_max_dirty of at least one block\n");
+            exit_code = -1;
+            goto exit;
+        }
+        printf("write-back: %u threads, up to %llu dirty bytes\n",
+                backfs.writeback_threads, backfs.writeback_max_dirty);
+    }
+    // even without write-back, dirty blocks left from before need flushing
+    cache_set_writeback(&backfs_flush_block,
+            backfs.writeback ? backfs.writeback_threads : 0,
+            backfs.writeback_max_dirty, backfs.writeback_delay);
+
+    trace_init(backfs.trace_size);
+
+    cache_set_check(backfs.check_threads, backfs.check_cache);
+
+    if (backfs.heat_blocks > 0) {
+        heat_init(backfs.cache_dir, backfs.heat_blocks, backfs.heat_half_life,
+                backfs.block_size);
+        cache_set_keep_fn(&heat_keep);
+    }
+
     printf("initializing cache and scanning existing cache dir...\n");
     cache_init(backfs.cache_dir, backfs.cache_size, backfs.block_size);
 
     // Initializing mutex
     pthread_mutex_init(&backfs.lock, NULL);
+
+    prefetch_init(backfs.real_root, backfs.block_size, backfs.prefetch_threads,
+            backfs.prefetch_rate, &backfs_prefetch_block);
+
+    if (backfs.watch) {
+        int err = watch_init(backfs.real_root, backfs.watch_ttl,
+                &backfs_watch_gone);
+        if (err != 0) {
+            fprintf(stderr, "BackFS: warning: can't watch %s for changes (%s);"
+                    " checking files on every read\n",
+                    backfs.real_root, strerror(-err));
+        } else {
+            printf("watching %s for changes\n", backfs.real_root);
+        }
+    }
     
+    if (backfs.access_trace) {
+        char *trace_file = NULL;
+        asprintf(&trace_file, "%s/access.trace", backfs.cache_dir);
+        int err = access_trace_start(trace_file, backfs.block_size);
+        if (err != 0) {
+            fprintf(stderr, "BackFS: error: can't record reads to %s: %s\n",
+                    trace_file, strerror(-err));
+            free(trace_file);
+            exit_code = -1;
+            goto exit;
+        }
+        printf("recording reads to %s\n", trace_file);
+        free(trace_file);
+    }
+
     printf("ready to go!\n");
-    backfs_fuse_main(args.argc, args.argv, &BackFS_Opers);
+    exit_code = backfs_fuse_main(args.argc, args.argv, &BackFS_Opers);
+    access_trace_stop();
 
 exit:
     fuse_opt_free_args(&args);
     free(backfs.cache_dir);
+    free(backfs.cache_io);
+    free(backfs.cache_key);
     if (backfs.real_root_alloc) {
         free(backfs.real_root);
     }
 
-    pthread_exit(NULL);
-
     return exit_code;
 }
 
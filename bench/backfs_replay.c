@@ -0,0 +1,282 @@
+/*
+ * BackFS access trace replay
+ * Copyright (c) 2026 William R. Fraser
+ *
+ * Replays the reads in an access trace (recorded with -o access_trace)
+ * against a mounted BackFS, and reports throughput and read latency as a
+ * JSON object on stdout.
+ *
+ * Reads are issued at their recorded times, sped up by the -s factor (0
+ * means as fast as possible), spread over -j threads. A read that can't
+ * start on time starts as soon as a thread is free; how late the latest one
+ * was is reported too.
+ *
+ * usage: backfs-replay [-s speed] [-j threads] <trace> <mount point>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <pthread.h>
+
+#include "../access_trace.h"
+
+int backfs_log_level = 0;
+bool backfs_log_stderr = true;
+
+struct job {
+    uint32_t path_id;
+    char *path;
+    uint64_t offset;
+    uint32_t size;
+    uint64_t due;           // when it should start, in ns since the start
+};
+
+#define QUEUE_SIZE 1024
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t room_cond = PTHREAD_COND_INITIALIZER;
+static struct job queue[QUEUE_SIZE];
+static unsigned int queue_head, queue_len;
+static bool done;
+
+static const char *mount_point;
+static int *fds;
+static uint32_t fds_size;
+
+static uint64_t *latencies;
+static size_t latencies_count, latencies_size;
+static uint64_t bytes_read, errors, max_late;
+static uint64_t start_time;
+static bool paced;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t when)
+{
+    struct timespec ts;
+    ts.tv_sec = when / 1000000000;
+    ts.tv_nsec = when % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/*
+ * Caller holds the lock. The open (a lookup through BackFS, which can take a
+ * while on a cold cache) is done without it, so it doesn't hold up the other
+ * workers; if one of them opened the same file meanwhile, its fd is used.
+ */
+static int get_fd(uint32_t path_id, const char *path)
+{
+    if (path_id >= fds_size) {
+        uint32_t size = fds_size ? fds_size : 256;
+        while (size <= path_id)
+            size *= 2;
+        fds = (int*)realloc(fds, size * sizeof(int));
+        for (uint32_t i = fds_size; i < size; i++)
+            fds[i] = -1;
+        fds_size = size;
+    }
+
+    if (fds[path_id] == -1) {
+        char *full = NULL;
+        if (asprintf(&full, "%s%s", mount_point, path) == -1)
+            return -1;
+        pthread_mutex_unlock(&lock);
+        int fd = open(full, O_RDONLY);
+        int err = errno;
+        pthread_mutex_lock(&lock);
+        if (fds[path_id] != -1) {
+            if (fd != -1)
+                close(fd);
+        } else if (fd == -1) {
+            fprintf(stderr, "can't open %s: %s\n", full, strerror(err));
+            // don't try again for every read
+            fds[path_id] = -2;
+        } else {
+            fds[path_id] = fd;
+        }
+        free(full);
+    }
+    return fds[path_id];
+}
+
+static void * worker(void *arg)
+{
+    (void)arg;
+    char *buf = NULL;
+    size_t buf_size = 0;
+
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (queue_len == 0 && !done)
+            pthread_cond_wait(&queue_cond, &lock);
+        if (queue_len == 0)
+            break;
+
+        struct job job = queue[queue_head];
+        queue_head = (queue_head + 1) % QUEUE_SIZE;
+        queue_len--;
+        pthread_cond_signal(&room_cond);
+
+        int fd = get_fd(job.path_id, job.path);
+        pthread_mutex_unlock(&lock);
+
+        if (job.size > buf_size) {
+            buf_size = job.size;
+            buf = (char*)realloc(buf, buf_size);
+        }
+
+        uint64_t begin = now_ns();
+        ssize_t n = (fd < 0) ? -1 : pread(fd, buf, job.size, job.offset);
+        uint64_t end = now_ns();
+
+        pthread_mutex_lock(&lock);
+        if (n == -1) {
+            errors++;
+        } else {
+            bytes_read += n;
+            if (latencies_count == latencies_size) {
+                latencies_size = latencies_size ? latencies_size * 2 : 65536;
+                latencies = (uint64_t*)realloc(latencies,
+                        latencies_size * sizeof(uint64_t));
+            }
+            latencies[latencies_count++] = end - begin;
+        }
+        uint64_t late = begin - start_time;
+        late = (late > job.due) ? late - job.due : 0;
+        if (paced && late > max_late)
+            max_late = late;
+        free(job.path);
+    }
+    pthread_mutex_unlock(&lock);
+
+    free(buf);
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(double p)
+{
+    if (latencies_count == 0)
+        return 0;
+    size_t i = (size_t)(p / 100 * (latencies_count - 1) + 0.5);
+    return latencies[i] / 1000.0;
+}
+
+int main(int argc, char **argv)
+{
+    double speed = 1;
+    int threads = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:j:")) != -1) {
+        switch (opt) {
+        case 's':
+            speed = atof(optarg);
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (argc - optind != 2 || speed < 0 || threads < 1) {
+usage:
+        fprintf(stderr, "usage: %s [-s speed] [-j threads] <trace> <mount point>\n"
+                "    -s  speed-up over the recorded timing; 0 for as fast as possible (1)\n"
+                "    -j  threads issuing reads (1)\n",
+                argv[0]);
+        return 1;
+    }
+
+    struct access_trace_reader *reader = access_trace_open(argv[optind]);
+    if (reader == NULL) {
+        fprintf(stderr, "can't open %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    mount_point = argv[optind + 1];
+    paced = (speed != 0);
+
+    pthread_t *workers = (pthread_t*)malloc(threads * sizeof(pthread_t));
+    start_time = now_ns();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&workers[i], NULL, &worker, NULL);
+    }
+
+    struct access_trace_event event;
+    uint64_t reads = 0;
+    int result;
+    while ((result = access_trace_next(reader, &event)) == 1) {
+        uint64_t due = (speed == 0) ? 0 : (uint64_t)(event.time / speed);
+        if (due > now_ns() - start_time) {
+            sleep_until(start_time + due);
+        }
+
+        pthread_mutex_lock(&lock);
+        while (queue_len == QUEUE_SIZE)
+            pthread_cond_wait(&room_cond, &lock);
+        struct job *job = &queue[(queue_head + queue_len) % QUEUE_SIZE];
+        job->path_id = event.path_id;
+        job->path = strdup(event.path);
+        job->offset = event.offset;
+        job->size = event.size;
+        job->due = due;
+        queue_len++;
+        pthread_cond_signal(&queue_cond);
+        pthread_mutex_unlock(&lock);
+        reads++;
+    }
+    if (result == -1) {
+        fprintf(stderr, "trace is damaged after %llu reads; replaying those\n",
+                (unsigned long long) reads);
+    }
+
+    pthread_mutex_lock(&lock);
+    done = true;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&lock);
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    double seconds = (now_ns() - start_time) / 1e9;
+
+    qsort(latencies, latencies_count, sizeof(uint64_t), compare_u64);
+    double total_us = 0;
+    for (size_t i = 0; i < latencies_count; i++) {
+        total_us += latencies[i] / 1000.0;
+    }
+
+    printf("{\"reads\": %llu, \"errors\": %llu, \"files\": %u, \"bytes\": %llu, "
+            "\"seconds\": %.3f, \"mib_per_sec\": %.1f, \"reads_per_sec\": %.1f, "
+            "\"mean_us\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, "
+            "\"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f, "
+            "\"max_late_ms\": %.1f}\n",
+            (unsigned long long) reads, (unsigned long long) errors,
+            access_trace_path_count(reader), (unsigned long long) bytes_read,
+            seconds, bytes_read / (1024.0 * 1024) / seconds, reads / seconds,
+            latencies_count ? total_us / latencies_count : 0,
+            percentile_us(50), percentile_us(90), percentile_us(99),
+            percentile_us(99.9), percentile_us(100), max_late / 1e6);
+
+    access_trace_close(reader);
+    return (result == -1 || errors > 0) ? 1 : 0;
+}
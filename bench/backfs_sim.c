@@ -0,0 +1,468 @@
+/*
+ * BackFS cache simulator
+ * Copyright (c) 2026 William R. Fraser
+ *
+ * Runs the reads in an access trace (recorded with -o access_trace) through
+ * models of the cache, for several block sizes and cache sizes at once, and
+ * prints the hit ratio of each as JSON lines on stdout.
+ *
+ * Reads are split into blocks the same way backfs_read() does (blocks.h),
+ * and the hit ratio is the fraction of those block reads served from the
+ * cache. Policies:
+ *
+ *   lru    what BackFS does without -o heat_blocks: buckets move to the head
+ *          of the queue when read, and are freed from the tail. Computed for
+ *          every cache size in one go from stack distances. With heat_blocks,
+ *          BackFS also gives blocks read often lately another trip round the
+ *          queue, which isn't modelled here.
+ *   fifo   buckets are freed in the order they were filled.
+ *   clock  FIFO, but a bucket read since it last came around gets another
+ *          pass (second chance).
+ *
+ * Every block is counted as a whole block of cache space, without the
+ * per-bucket metadata; and BackFS evicts down to evict_low percent of the
+ * cache size, so a real cache behaves a bit smaller than the size given here.
+ *
+ * usage: backfs-sim [-b block sizes] [-c cache sizes] <trace>
+ *   sizes are comma-separated, with optional K, M, G or T suffix.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "../access_trace.h"
+#include "../blocks.h"
+
+int backfs_log_level = 0;
+bool backfs_log_stderr = true;
+
+#define MAX_SIZES 64
+
+//
+// uint64 -> uint64 hash map: linear probing, deletion by backward shift.
+//
+
+#define EMPTY UINT64_MAX
+
+struct map {
+    uint64_t *keys;
+    uint64_t *vals;
+    uint64_t size;          // power of two
+    uint64_t count;
+};
+
+static uint64_t mix(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static void * xmalloc(size_t size)
+{
+    void *p = malloc(size);
+    if (p == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static void * xcalloc(size_t n, size_t size)
+{
+    void *p = calloc(n, size);
+    if (p == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static void map_init(struct map *m, uint64_t size)
+{
+    m->size = size;
+    m->count = 0;
+    m->keys = (uint64_t*)xmalloc(size * sizeof(uint64_t));
+    m->vals = (uint64_t*)xmalloc(size * sizeof(uint64_t));
+    for (uint64_t i = 0; i < size; i++) {
+        m->keys[i] = EMPTY;
+    }
+}
+
+static uint64_t * map_find(struct map *m, uint64_t key)
+{
+    for (uint64_t i = mix(key) & (m->size - 1); ; i = (i + 1) & (m->size - 1)) {
+        if (m->keys[i] == key)
+            return &m->vals[i];
+        if (m->keys[i] == EMPTY)
+            return NULL;
+    }
+}
+
+static void map_put(struct map *m, uint64_t key, uint64_t val);
+
+static void map_grow(struct map *m)
+{
+    struct map old = *m;
+    map_init(m, old.size * 2);
+    for (uint64_t i = 0; i < old.size; i++) {
+        if (old.keys[i] != EMPTY)
+            map_put(m, old.keys[i], old.vals[i]);
+    }
+    free(old.keys);
+    free(old.vals);
+}
+
+static void map_put(struct map *m, uint64_t key, uint64_t val)
+{
+    if ((m->count + 1) * 2 > m->size)
+        map_grow(m);
+
+    uint64_t i = mix(key) & (m->size - 1);
+    while (m->keys[i] != EMPTY && m->keys[i] != key)
+        i = (i + 1) & (m->size - 1);
+    if (m->keys[i] == EMPTY)
+        m->count++;
+    m->keys[i] = key;
+    m->vals[i] = val;
+}
+
+static void map_del(struct map *m, uint64_t key)
+{
+    uint64_t mask = m->size - 1;
+    uint64_t i = mix(key) & mask;
+    while (m->keys[i] != key) {
+        if (m->keys[i] == EMPTY)
+            return;
+        i = (i + 1) & mask;
+    }
+
+    // pull later entries of the same run back over the hole
+    uint64_t hole = i;
+    for (uint64_t j = (i + 1) & mask; m->keys[j] != EMPTY; j = (j + 1) & mask) {
+        uint64_t home = mix(m->keys[j]) & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            m->keys[hole] = m->keys[j];
+            m->vals[hole] = m->vals[j];
+            hole = j;
+        }
+    }
+    m->keys[hole] = EMPTY;
+    m->count--;
+}
+
+//
+// LRU, by stack distance: the number of other blocks read since a block was
+// last read. With a cache of N blocks, a read hits if that's less than N.
+// A Fenwick tree over the sequence of reads, with a 1 where a block was read
+// for the last time (so far), counts them. Only the order of those last reads
+// matters, so when the tree fills up they're renumbered 1, 2, 3... and it
+// only has to grow with the number of distinct blocks, not of reads.
+//
+
+struct lru_sim {
+    struct map last;        // block -> position of its last read
+    uint32_t *tree;
+    uint8_t *marks;
+    uint64_t tree_size;
+    uint64_t now;
+    uint64_t *distances;    // how many reads had each stack distance
+    uint64_t distances_size;
+    uint64_t cold;          // first reads of a block
+};
+
+static void tree_add(struct lru_sim *s, uint64_t i, int delta)
+{
+    s->marks[i] += delta;
+    for (; i <= s->tree_size; i += i & -i)
+        s->tree[i] += delta;
+}
+
+static uint64_t tree_sum(struct lru_sim *s, uint64_t i)
+{
+    uint64_t sum = 0;
+    for (; i > 0; i -= i & -i)
+        sum += s->tree[i];
+    return sum;
+}
+
+// from the marks, in linear time
+static void tree_rebuild(struct lru_sim *s)
+{
+    memset(s->tree, 0, (s->tree_size + 1) * sizeof(uint32_t));
+    for (uint64_t i = 1; i <= s->tree_size; i++) {
+        s->tree[i] += s->marks[i];
+        uint64_t parent = i + (i & -i);
+        if (parent <= s->tree_size)
+            s->tree[parent] += s->tree[i];
+    }
+}
+
+static void tree_grow(struct lru_sim *s)
+{
+    uint64_t size = s->tree_size ? s->tree_size * 2 : 1 << 20;
+    s->marks = (uint8_t*)realloc(s->marks, size + 1);
+    free(s->tree);
+    s->tree = (uint32_t*)xcalloc(size + 1, sizeof(uint32_t));
+    if (s->marks == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memset(s->marks + s->tree_size + 1, 0, size - s->tree_size);
+    s->tree_size = size;
+    tree_rebuild(s);
+}
+
+/*
+ * Renumber the last reads 1, 2, 3... in the same order, freeing up the tree
+ * from there on.
+ */
+static void tree_compact(struct lru_sim *s)
+{
+    // a last read's new position is how many last reads there are up to it
+    for (uint64_t i = 0; i < s->last.size; i++) {
+        if (s->last.keys[i] != EMPTY)
+            s->last.vals[i] = tree_sum(s, s->last.vals[i]);
+    }
+
+    uint64_t count = s->last.count;
+    memset(s->marks + 1, 1, count);
+    memset(s->marks + count + 1, 0, s->tree_size - count);
+    tree_rebuild(s);
+    s->now = count;
+}
+
+static void lru_access(struct lru_sim *s, uint64_t key)
+{
+    if (s->now + 1 > s->tree_size) {
+        // mostly repeat reads: renumbering makes plenty of room
+        if (s->tree_size > 0 && s->last.count <= s->tree_size / 2)
+            tree_compact(s);
+        else
+            tree_grow(s);
+    }
+    uint64_t pos = ++s->now;
+
+    uint64_t *last = map_find(&s->last, key);
+    if (last == NULL) {
+        s->cold++;
+        map_put(&s->last, key, pos);
+    } else {
+        uint64_t distance = tree_sum(s, pos - 1) - tree_sum(s, *last);
+        if (distance >= s->distances_size) {
+            uint64_t size = s->distances_size ? s->distances_size : 1024;
+            while (size <= distance)
+                size *= 2;
+            s->distances = (uint64_t*)realloc(s->distances, size * sizeof(uint64_t));
+            memset(s->distances + s->distances_size, 0,
+                    (size - s->distances_size) * sizeof(uint64_t));
+            s->distances_size = size;
+        }
+        s->distances[distance]++;
+        tree_add(s, *last, -1);
+        *last = pos;
+    }
+    tree_add(s, pos, 1);
+}
+
+/*
+ * Hits with a cache of capacity blocks.
+ */
+static uint64_t lru_hits(const struct lru_sim *s, uint64_t capacity)
+{
+    uint64_t hits = 0;
+    for (uint64_t d = 0; d < capacity && d < s->distances_size; d++)
+        hits += s->distances[d];
+    return hits;
+}
+
+//
+// FIFO and CLOCK, simulated directly at one cache size each.
+//
+
+struct queue_sim {
+    bool clock;
+    uint64_t capacity;
+    struct map where;       // block -> slot
+    uint64_t *slots;
+    uint8_t *referenced;
+    uint64_t count;
+    uint64_t alloc;
+    uint64_t hand;
+    uint64_t hits;
+};
+
+static void queue_access(struct queue_sim *s, uint64_t key)
+{
+    uint64_t *slot = map_find(&s->where, key);
+    if (slot != NULL) {
+        s->hits++;
+        s->referenced[*slot] = 1;
+        return;
+    }
+    if (s->capacity == 0)
+        return;
+
+    uint64_t i;
+    if (s->count < s->capacity) {
+        if (s->count == s->alloc) {
+            s->alloc = s->alloc ? s->alloc * 2 : 1024;
+            if (s->alloc > s->capacity)
+                s->alloc = s->capacity;
+            s->slots = (uint64_t*)realloc(s->slots, s->alloc * sizeof(uint64_t));
+            s->referenced = (uint8_t*)realloc(s->referenced, s->alloc);
+            if (s->slots == NULL || s->referenced == NULL) {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+        }
+        i = s->count++;
+    } else {
+        while (s->clock && s->referenced[s->hand]) {
+            s->referenced[s->hand] = 0;
+            s->hand = (s->hand + 1) % s->capacity;
+        }
+        i = s->hand;
+        s->hand = (s->hand + 1) % s->capacity;
+        map_del(&s->where, s->slots[i]);
+    }
+
+    s->slots[i] = key;
+    s->referenced[i] = 0;
+    map_put(&s->where, key, i);
+}
+
+//
+// Driver
+//
+
+static int parse_sizes(const char *list, uint64_t *sizes)
+{
+    int n = 0;
+    const char *p = list;
+    while (*p != '\0' && n < MAX_SIZES) {
+        char *end;
+        uint64_t size = strtoull(p, &end, 0);
+        switch (*end) {
+        case 'T': case 't': size <<= 10; // fall through
+        case 'G': case 'g': size <<= 10; // fall through
+        case 'M': case 'm': size <<= 10; // fall through
+        case 'K': case 'k': size <<= 10; end++; break;
+        }
+        if (end == p || size == 0 || (*end != ',' && *end != '\0'))
+            return -1;
+        sizes[n++] = size;
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    const char *block_list = "64K,128K,256K,1M";
+    const char *cache_list = "64M,128M,256M,512M,1G,2G,4G,8G,16G,32G,64G,128G";
+    int opt;
+    while ((opt = getopt(argc, argv, "b:c:")) != -1) {
+        switch (opt) {
+        case 'b':
+            block_list = optarg;
+            break;
+        case 'c':
+            cache_list = optarg;
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    uint64_t block_sizes[MAX_SIZES], cache_sizes[MAX_SIZES];
+    int nblock = parse_sizes(block_list, block_sizes);
+    int ncache = parse_sizes(cache_list, cache_sizes);
+    if (argc - optind != 1 || nblock <= 0 || ncache <= 0) {
+usage:
+        fprintf(stderr, "usage: %s [-b block sizes] [-c cache sizes] <trace>\n"
+                "    sizes are comma-separated, with optional K, M, G or T suffix\n"
+                "    -b  (64K,128K,256K,1M)\n"
+                "    -c  (64M,128M,...,128G)\n",
+                argv[0]);
+        return 1;
+    }
+
+    struct access_trace_reader *reader = access_trace_open(argv[optind]);
+    if (reader == NULL) {
+        fprintf(stderr, "can't open %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    struct lru_sim *lru = (struct lru_sim*)xcalloc(nblock, sizeof(*lru));
+    struct queue_sim *queues = (struct queue_sim*)xcalloc(
+            (size_t)nblock * ncache * 2, sizeof(*queues));
+    uint64_t *accesses = (uint64_t*)xcalloc(nblock, sizeof(uint64_t));
+    for (int b = 0; b < nblock; b++) {
+        map_init(&lru[b].last, 1024);
+        for (int c = 0; c < ncache; c++) {
+            for (int clock = 0; clock < 2; clock++) {
+                struct queue_sim *q = &queues[(b * ncache + c) * 2 + clock];
+                q->clock = clock;
+                q->capacity = cache_sizes[c] / block_sizes[b];
+                map_init(&q->where, 1024);
+            }
+        }
+    }
+
+    struct access_trace_event event;
+    uint64_t reads = 0;
+    int result;
+    while ((result = access_trace_next(reader, &event)) == 1) {
+        reads++;
+        for (int b = 0; b < nblock; b++) {
+            uint64_t bs = block_sizes[b];
+            uint32_t end = last_block(event.offset, event.size, bs);
+            for (uint32_t block = first_block(event.offset, bs); block <= end; block++) {
+                uint64_t part_offset;
+                if (block_part(event.offset, event.size, bs, block, &part_offset) == 0)
+                    continue;
+
+                uint64_t key = ((uint64_t)event.path_id << 32) | block;
+                accesses[b]++;
+                lru_access(&lru[b], key);
+                for (int i = 0; i < ncache * 2; i++)
+                    queue_access(&queues[b * ncache * 2 + i], key);
+            }
+        }
+    }
+    if (result == -1) {
+        fprintf(stderr, "trace is damaged after %llu reads; using those\n",
+                (unsigned long long) reads);
+    }
+
+    for (int b = 0; b < nblock; b++) {
+        double total = accesses[b] ? (double) accesses[b] : 1;
+        for (int c = 0; c < ncache; c++) {
+            struct queue_sim *q = &queues[(b * ncache + c) * 2];
+            printf("{\"block_size\": %llu, \"cache_size\": %llu, \"blocks_read\": %llu, "
+                    "\"lru\": %.4f, \"fifo\": %.4f, \"clock\": %.4f}\n",
+                    (unsigned long long) block_sizes[b],
+                    (unsigned long long) cache_sizes[c],
+                    (unsigned long long) accesses[b],
+                    lru_hits(&lru[b], q[0].capacity) / total,
+                    q[0].hits / total, q[1].hits / total);
+        }
+        // the best any policy could do, and the space that takes
+        printf("{\"block_size\": %llu, \"cache_size\": %llu, \"blocks_read\": %llu, "
+                "\"unlimited\": %.4f}\n",
+                (unsigned long long) block_sizes[b],
+                (unsigned long long) lru[b].last.count * block_sizes[b],
+                (unsigned long long) accesses[b],
+                (accesses[b] - lru[b].cold) / total);
+    }
+
+    access_trace_close(reader);
+    return (result == -1) ? 1 : 0;
+}
@@ -0,0 +1,307 @@
+/*
+ * BackFS benchmark workloads
+ * Copyright (c) 2026 William R. Fraser
+ *
+ * Runs one workload against a directory (normally a BackFS mount) and prints
+ * its throughput and per-operation latency as a JSON object on stdout.
+ * bench/run_bench.sh strings these together; see there.
+ *
+ * usage: backfs_workload [-n name] <workload> <args>
+ *   seq <file> [read size]              read a file from start to end
+ *   rand <file> <reads> [read size]     read at random aligned offsets
+ *   tree <dir>                          read every file under a directory
+ *   meta <dir> [passes]                 list and stat everything under a
+ *                                       directory
+ *   write <file> <MiB> [write size]     write a new file, then fsync it
+ *   populate <dir> <files> <size>       make a tree of small files (setup;
+ *                                       prints nothing)
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+static uint64_t *latencies;
+static size_t ops, latencies_size;
+static uint64_t bytes, errors;
+static char *buf;
+static size_t buf_size;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void record(uint64_t begin, ssize_t n)
+{
+    uint64_t end = now_ns();
+    if (n < 0) {
+        errors++;
+        return;
+    }
+    bytes += n;
+    if (ops == latencies_size) {
+        latencies_size = latencies_size ? latencies_size * 2 : 65536;
+        latencies = (uint64_t*)realloc(latencies, latencies_size * sizeof(uint64_t));
+        if (latencies == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    latencies[ops++] = end - begin;
+}
+
+static void need_buf(size_t size)
+{
+    if (size > buf_size) {
+        buf = (char*)realloc(buf, size);
+        if (buf == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        buf_size = size;
+    }
+}
+
+static int open_or_complain(const char *path, int flags)
+{
+    int fd = open(path, flags, 0644);
+    if (fd == -1)
+        fprintf(stderr, "can't open %s: %s\n", path, strerror(errno));
+    return fd;
+}
+
+static int run_seq(const char *path, size_t size)
+{
+    int fd = open_or_complain(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    need_buf(size);
+    for (;;) {
+        uint64_t begin = now_ns();
+        ssize_t n = read(fd, buf, size);
+        if (n == 0)
+            break;
+        record(begin, n);
+        if (n < 0)
+            break;
+    }
+    close(fd);
+    return 0;
+}
+
+static int run_rand(const char *path, uint64_t reads, size_t size)
+{
+    int fd = open_or_complain(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (uint64_t)st.st_size < size) {
+        fprintf(stderr, "%s is smaller than one read\n", path);
+        close(fd);
+        return -1;
+    }
+    need_buf(size);
+
+    // fixed seed, so every run reads the same offsets
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    uint64_t slots = st.st_size / size;
+    for (uint64_t i = 0; i < reads; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        uint64_t begin = now_ns();
+        record(begin, pread(fd, buf, size, (off_t)(x % slots * size)));
+    }
+    close(fd);
+    return 0;
+}
+
+static int read_file(const char *path, const struct stat *sb, int type, struct FTW *ftw)
+{
+    (void)ftw;
+    if (type != FTW_F)
+        return 0;
+    need_buf(sb->st_size + 1);
+
+    // one operation per file: open, read it all, close
+    uint64_t begin = now_ns();
+    int fd = open(path, O_RDONLY);
+    ssize_t total = -1;
+    if (fd != -1) {
+        ssize_t n;
+        total = 0;
+        while ((n = read(fd, buf, buf_size)) > 0)
+            total += n;
+        if (n < 0)
+            total = -1;
+        close(fd);
+    }
+    record(begin, total);
+    return 0;
+}
+
+static int stat_entry(const char *path, const struct stat *sb, int type, struct FTW *ftw)
+{
+    (void)sb; (void)type; (void)ftw;
+    struct stat st;
+    uint64_t begin = now_ns();
+    record(begin, lstat(path, &st));
+    return 0;
+}
+
+static int run_write(const char *path, uint64_t mib, size_t size)
+{
+    int fd = open_or_complain(path, O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd == -1)
+        return -1;
+    need_buf(size);
+    for (size_t i = 0; i < size; i++)
+        buf[i] = (char)(i * 2654435761u >> 24);
+
+    for (uint64_t left = mib * 1024 * 1024; left > 0; ) {
+        size_t n = (left < size) ? left : size;
+        uint64_t begin = now_ns();
+        record(begin, write(fd, buf, n));
+        left -= n;
+    }
+    uint64_t begin = now_ns();
+    int ret = fsync(fd);
+    if (ret == -1)
+        errors++;
+    ret = close(fd);
+    if (ret == -1)
+        errors++;
+    // the flush is part of the time, but isn't an operation of its own
+    if (ops > 0)
+        latencies[ops - 1] += now_ns() - begin;
+    return 0;
+}
+
+static int populate(const char *dir, uint64_t files, size_t size)
+{
+    need_buf(size);
+    memset(buf, 'x', size);
+    for (uint64_t i = 0; i < files; i++) {
+        char path[4096];
+        // 100 files to a directory
+        snprintf(path, sizeof(path), "%s/%03llu", dir, (unsigned long long)(i / 100));
+        if (i % 100 == 0 && mkdir(path, 0755) == -1 && errno != EEXIST) {
+            fprintf(stderr, "can't make %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        snprintf(path, sizeof(path), "%s/%03llu/%05llu", dir,
+                (unsigned long long)(i / 100), (unsigned long long) i);
+        int fd = open_or_complain(path, O_WRONLY | O_CREAT | O_TRUNC);
+        if (fd == -1)
+            return -1;
+        ssize_t n = write(fd, buf, size);
+        close(fd);
+        if (n != (ssize_t)size)
+            return -1;
+    }
+    return 0;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(double p)
+{
+    if (ops == 0)
+        return 0;
+    size_t i = (size_t)(p / 100 * (ops - 1) + 0.5);
+    return latencies[i] / 1000.0;
+}
+
+static uint64_t arg_u64(int argc, char **argv, int i, uint64_t def)
+{
+    return (i < argc) ? strtoull(argv[i], NULL, 0) : def;
+}
+
+int main(int argc, char **argv)
+{
+    const char *name = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt != 'n')
+            goto usage;
+        name = optarg;
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc < 2)
+        goto usage;
+
+    const char *workload = argv[0];
+    const char *path = argv[1];
+    if (name == NULL)
+        name = workload;
+
+    uint64_t start = now_ns();
+    int ret;
+    if (strcmp(workload, "seq") == 0) {
+        ret = run_seq(path, arg_u64(argc, argv, 2, 128 * 1024));
+    } else if (strcmp(workload, "rand") == 0 && argc >= 3) {
+        ret = run_rand(path, arg_u64(argc, argv, 2, 0), arg_u64(argc, argv, 3, 4096));
+    } else if (strcmp(workload, "tree") == 0) {
+        ret = nftw(path, read_file, 16, FTW_PHYS);
+    } else if (strcmp(workload, "meta") == 0) {
+        ret = 0;
+        for (uint64_t i = arg_u64(argc, argv, 2, 1); i > 0 && ret == 0; i--)
+            ret = nftw(path, stat_entry, 16, FTW_PHYS);
+    } else if (strcmp(workload, "write") == 0 && argc >= 3) {
+        ret = run_write(path, arg_u64(argc, argv, 2, 0), arg_u64(argc, argv, 3, 128 * 1024));
+    } else if (strcmp(workload, "populate") == 0 && argc >= 4) {
+        return populate(path, arg_u64(argc, argv, 2, 0), arg_u64(argc, argv, 3, 0)) ? 1 : 0;
+    } else {
+        goto usage;
+    }
+    double seconds = (now_ns() - start) / 1e9;
+    if (ret != 0) {
+        fprintf(stderr, "%s: %s failed\n", name, path);
+        return 1;
+    }
+
+    qsort(latencies, ops, sizeof(uint64_t), compare_u64);
+    double total_us = 0;
+    for (size_t i = 0; i < ops; i++) {
+        total_us += latencies[i] / 1000.0;
+    }
+
+    printf("{\"workload\": \"%s\", \"ops\": %llu, \"errors\": %llu, \"bytes\": %llu, "
+            "\"seconds\": %.3f, \"mib_per_sec\": %.1f, \"ops_per_sec\": %.1f, "
+            "\"mean_us\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, "
+            "\"p99_us\": %.1f, \"max_us\": %.1f}\n",
+            name, (unsigned long long) ops, (unsigned long long) errors,
+            (unsigned long long) bytes, seconds,
+            bytes / (1024.0 * 1024) / seconds, ops / seconds,
+            ops ? total_us / ops : 0,
+            percentile_us(50), percentile_us(90), percentile_us(99), percentile_us(100));
+    return (errors > 0) ? 1 : 0;
+
+usage:
+    fprintf(stderr, "usage: backfs_workload [-n name] <workload> <args>\n"
+            "    seq <file> [read size]\n"
+            "    rand <file> <reads> [read size]\n"
+            "    tree <dir>\n"
+            "    meta <dir> [passes]\n"
+            "    write <file> <MiB> [write size]\n"
+            "    populate <dir> <files> <size>\n");
+    return 1;
+}
@@ -0,0 +1,184 @@
+/*
+ * BackFS cache I/O mode benchmark
+ * Copyright (c) 2026 William R. Fraser
+ *
+ * Fills a scratch cache through cache_add() and reads it back through
+ * cache_fetch() once for each I/O mode (buffered, fadvise, direct), and
+ * reports throughput and how much of the bucket data ended up resident in
+ * the host page cache. One JSON object per mode is printed on stdout.
+ *
+ * The scratch directory should be on the same kind of filesystem as the real
+ * cache; tmpfs doesn't support O_DIRECT.
+ *
+ * usage: cache_io_bench <scratch dir> [MiB] [block size] [read passes]
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "../fscache.h"
+
+int backfs_log_level = 0;
+bool backfs_log_stderr = true;
+
+static uint64_t resident_bytes;
+
+// the backing file never changes
+static const struct cache_validator validator = { .mtime = 1 };
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int count_resident(const char *path, const struct stat *sb, int type,
+        struct FTW *ftw)
+{
+    if (type != FTW_F || sb->st_size == 0 || strcmp(path + ftw->base, "data") != 0)
+        return 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return 0;
+
+    long page = sysconf(_SC_PAGESIZE);
+    size_t pages = (sb->st_size + page - 1) / page;
+    void *map = mmap(NULL, sb->st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED) {
+        unsigned char *vec = (unsigned char*)malloc(pages);
+        if (mincore(map, sb->st_size, vec) == 0) {
+            for (size_t i = 0; i < pages; i++) {
+                if (vec[i] & 1)
+                    resident_bytes += page;
+            }
+        }
+        free(vec);
+        munmap(map, sb->st_size);
+    }
+    close(fd);
+    return 0;
+}
+
+static double resident_mib(const char *dir)
+{
+    resident_bytes = 0;
+    nftw(dir, count_resident, 16, FTW_PHYS);
+    return resident_bytes / (1024.0 * 1024);
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int type,
+        struct FTW *ftw)
+{
+    (void)sb; (void)type; (void)ftw;
+    remove(path);
+    return 0;
+}
+
+static int run(const char *scratch, const char *name, enum cache_io_mode mode,
+        uint64_t mib, uint64_t block_size, int passes)
+{
+    char dir[4096];
+    char sub[4096];
+    snprintf(dir, sizeof(dir), "%s/%s", scratch, name);
+    mkdir(dir, 0700);
+    snprintf(sub, sizeof(sub), "%s/buckets", dir);
+    mkdir(sub, 0700);
+    snprintf(sub, sizeof(sub), "%s/map", dir);
+    mkdir(sub, 0700);
+
+    cache_set_io_mode(mode);
+    cache_init(dir, 0, block_size);
+
+    uint64_t blocks = mib * 1024 * 1024 / block_size;
+    char *buf = (char*)malloc(block_size);
+    for (uint64_t i = 0; i < block_size; i++) {
+        buf[i] = (char)(i * 2654435761u >> 24);
+    }
+
+    double start = now();
+    for (uint64_t i = 0; i < blocks; i++) {
+        if (cache_add("/bench", i, buf, block_size, &validator) != 0) {
+            fprintf(stderr, "%s: cache_add failed on block %llu: %s\n",
+                    name, (unsigned long long) i, strerror(errno));
+            return 1;
+        }
+    }
+    double fill_time = now() - start;
+    double after_fill = resident_mib(dir);
+
+    start = now();
+    for (int p = 0; p < passes; p++) {
+        for (uint64_t i = 0; i < blocks; i++) {
+            uint64_t bytes_read;
+            if (cache_fetch("/bench", i, 0, buf, block_size, &bytes_read, &validator) != 0) {
+                fprintf(stderr, "%s: cache_fetch failed on block %llu: %s\n",
+                        name, (unsigned long long) i, strerror(errno));
+                return 1;
+            }
+        }
+    }
+    double read_time = now() - start;
+    double after_read = resident_mib(dir);
+
+    printf("{\"mode\": \"%s\", \"mib\": %llu, \"block_size\": %llu, "
+            "\"fill_mib_per_sec\": %.1f, \"read_mib_per_sec\": %.1f, "
+            "\"resident_mib_after_fill\": %.1f, \"resident_mib_after_read\": %.1f}\n",
+            name, (unsigned long long) mib, (unsigned long long) block_size,
+            mib / fill_time, mib * passes / read_time, after_fill, after_read);
+
+    nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    free(buf);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <scratch dir> [MiB] [block size] [read passes]\n",
+                argv[0]);
+        return 1;
+    }
+
+    const char *scratch = argv[1];
+    uint64_t mib = (argc > 2) ? strtoull(argv[2], NULL, 0) : 256;
+    uint64_t block_size = (argc > 3) ? strtoull(argv[3], NULL, 0) : 0x20000;
+    int passes = (argc > 4) ? atoi(argv[4]) : 3;
+
+    const struct { const char *name; enum cache_io_mode mode; } modes[] = {
+        { "buffered",   CACHE_IO_BUFFERED },
+        { "fadvise",    CACHE_IO_FADVISE },
+        { "direct",     CACHE_IO_DIRECT },
+    };
+
+    int ret = 0;
+    for (size_t i = 0; i < sizeof(modes) / sizeof(*modes); i++) {
+        // the cache can only be initialized once per process
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            exit(run(scratch, modes[i].name, modes[i].mode, mib, block_size, passes));
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            ret = 1;
+        }
+    }
+
+    return ret;
+}
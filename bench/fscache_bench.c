@@ -0,0 +1,406 @@
+/*
+ * BackFS cache API benchmark
+ * Copyright (c) 2026 William R. Fraser
+ *
+ * Drives fscache directly through its C API (no FUSE) from many threads, the
+ * way backfs_read() does: fetch a block, and add it if it isn't cached;
+ * mixed with some invalidations. Every block fetched is checked against what
+ * was added, so this doubles as a test of the cache under concurrency.
+ *
+ * Runs every combination of cache size, working set and thread count given,
+ * each in a fresh scratch cache, and prints one JSON object per run on
+ * stdout with ops/sec, latency percentiles, hit ratio, and how many
+ * filesystem calls the cache code made per operation, its background threads
+ * (eviction, write-back) included.
+ *
+ * The working set is a percentage of the cache size: blocks are chosen
+ * uniformly from it, so over 100 the cache has to evict as it goes. It's
+ * filled before timing starts.
+ *
+ * usage: fscache_bench [-c cache sizes] [-w working sets] [-t threads]
+ *                      [-b block size] [-n ops per thread]
+ *                      [-i invalidate percent] <scratch dir>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "../fscache.h"
+
+int backfs_log_level = 0;
+bool backfs_log_stderr = true;
+
+#define MAX_LIST 16
+#define BLOCKS_PER_FILE 64
+
+// the backing files never change
+static const struct cache_validator validator = { .mtime = 1 };
+
+//
+// Counting filesystem calls: the Makefile links this with --wrap for each of
+// these, so calls from the cache code come through here first. The __real_
+// symbols are weak so a libc without one of them still links. The count is
+// for the whole process, so the cache's own threads' calls are in it too.
+//
+
+static _Atomic uint64_t fs_calls;
+
+#define COUNT(ret, name, params, args) \
+    extern ret __real_##name params __attribute__((weak)); \
+    ret __wrap_##name params; \
+    ret __wrap_##name params \
+    { \
+        atomic_fetch_add_explicit(&fs_calls, 1, memory_order_relaxed); \
+        return __real_##name args; \
+    }
+
+#define COUNT_OPEN(name, params, args) \
+    extern int __real_##name params __attribute__((weak)); \
+    int __wrap_##name params; \
+    int __wrap_##name params \
+    { \
+        mode_t mode = 0; \
+        if (flags & (O_CREAT | O_TMPFILE)) { \
+            va_list ap; \
+            va_start(ap, flags); \
+            mode = va_arg(ap, mode_t); \
+            va_end(ap); \
+        } \
+        atomic_fetch_add_explicit(&fs_calls, 1, memory_order_relaxed); \
+        return __real_##name args; \
+    }
+
+COUNT_OPEN(open64, (const char *path, int flags, ...), (path, flags, mode))
+COUNT_OPEN(openat64, (int dirfd, const char *path, int flags, ...), (dirfd, path, flags, mode))
+COUNT(int, close, (int fd), (fd))
+COUNT(ssize_t, read, (int fd, void *buf, size_t count), (fd, buf, count))
+COUNT(ssize_t, write, (int fd, const void *buf, size_t count), (fd, buf, count))
+COUNT(ssize_t, pread64, (int fd, void *buf, size_t count, off_t offset),
+        (fd, buf, count, offset))
+COUNT(ssize_t, pwrite64, (int fd, const void *buf, size_t count, off_t offset),
+        (fd, buf, count, offset))
+COUNT(int, lstat64, (const char *path, struct stat *buf), (path, buf))
+COUNT(int, stat64, (const char *path, struct stat *buf), (path, buf))
+COUNT(int, access, (const char *path, int mode), (path, mode))
+COUNT(ssize_t, readlink, (const char *path, char *buf, size_t size), (path, buf, size))
+COUNT(int, symlink, (const char *target, const char *path), (target, path))
+COUNT(int, mkdir, (const char *path, mode_t mode), (path, mode))
+COUNT(int, rmdir, (const char *path), (path))
+COUNT(int, unlink, (const char *path), (path))
+COUNT(int, unlinkat, (int dirfd, const char *path, int flags), (dirfd, path, flags))
+COUNT(int, rename, (const char *path, const char *new_path), (path, new_path))
+COUNT(DIR *, opendir, (const char *path), (path))
+COUNT(struct dirent *, readdir64, (DIR *dir), (dir))
+COUNT(int, closedir, (DIR *dir), (dir))
+COUNT(int, fsync, (int fd), (fd))
+COUNT(int, fdatasync, (int fd), (fd))
+COUNT(int, ftruncate64, (int fd, off_t length), (fd, length))
+COUNT(int, fallocate64, (int fd, int mode, off_t offset, off_t len), (fd, mode, offset, len))
+COUNT(int, posix_fadvise64, (int fd, off_t offset, off_t len, int advice),
+        (fd, offset, len, advice))
+// stdio: opening and closing are a system call each; reads and writes of
+// these small files are one each too
+COUNT(FILE *, fopen64, (const char *path, const char *mode), (path, mode))
+COUNT(int, fclose, (FILE *f), (f))
+
+//
+// The benchmark
+//
+
+struct config {
+    uint64_t cache_size;
+    unsigned int working_set;   // percent of cache size
+    unsigned int threads;
+    uint64_t block_size;
+    uint64_t ops;               // per thread
+    unsigned int invalidate;    // percent of ops
+};
+
+struct worker {
+    pthread_t thread;
+    const struct config *config;
+    uint64_t blocks;            // in the working set
+    uint64_t seed;
+    uint64_t *latencies;
+    uint64_t hits, misses, invalidations, errors;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t *x)
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+static void block_name(uint64_t n, char *filename, size_t size, uint32_t *block)
+{
+    snprintf(filename, size, "/bench/%llu", (unsigned long long)(n / BLOCKS_PER_FILE));
+    *block = n % BLOCKS_PER_FILE;
+}
+
+/*
+ * Block contents: which block it is, then filler.
+ */
+static void fill_block(char *buf, uint64_t size, uint64_t n)
+{
+    memset(buf, (int)(n & 0xff), size);
+    memcpy(buf, &n, sizeof(n));
+}
+
+static bool check_block(const char *buf, uint64_t size, uint64_t n)
+{
+    uint64_t stored;
+    memcpy(&stored, buf, sizeof(stored));
+    return stored == n && (unsigned char)buf[size - 1] == (n & 0xff);
+}
+
+static void * worker_main(void *arg)
+{
+    struct worker *w = (struct worker*)arg;
+    const struct config *c = w->config;
+    char *buf = (char*)malloc(c->block_size);
+    char filename[64];
+    uint32_t block;
+
+    for (uint64_t i = 0; i < c->ops; i++) {
+        uint64_t n = next_random(&w->seed) % w->blocks;
+        block_name(n, filename, sizeof(filename), &block);
+        bool invalidate = (next_random(&w->seed) % 100) < c->invalidate;
+
+        uint64_t begin = now_ns();
+        if (invalidate) {
+            // mostly single blocks; sometimes whole files
+            if (next_random(&w->seed) % 10 == 0)
+                cache_try_invalidate_file(filename);
+            else
+                cache_try_invalidate_block(filename, block);
+            w->invalidations++;
+        } else {
+            uint64_t bytes_read = 0;
+            if (cache_fetch(filename, block, 0, buf, c->block_size, &bytes_read, &validator) == 0) {
+                w->hits++;
+                if (bytes_read != c->block_size || !check_block(buf, c->block_size, n)) {
+                    fprintf(stderr, "wrong data in %s block %u\n", filename, block);
+                    w->errors++;
+                }
+            } else if (errno == ENOENT) {
+                w->misses++;
+                fill_block(buf, c->block_size, n);
+                if (cache_add(filename, block, buf, c->block_size, &validator) == -1
+                        && errno != ENOSPC) {
+                    w->errors++;
+                }
+            } else {
+                w->errors++;
+            }
+        }
+        w->latencies[i] = now_ns() - begin;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int type,
+        struct FTW *ftw)
+{
+    (void)sb; (void)type; (void)ftw;
+    remove(path);
+    return 0;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static int run(const char *scratch, const struct config *c)
+{
+    char dir[4096];
+    char sub[4096];
+    snprintf(dir, sizeof(dir), "%s/fscache_bench.%d", scratch, (int)getpid());
+    if (mkdir(dir, 0700) == -1) {
+        fprintf(stderr, "can't make %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    snprintf(sub, sizeof(sub), "%s/buckets", dir);
+    mkdir(sub, 0700);
+    snprintf(sub, sizeof(sub), "%s/map", dir);
+    mkdir(sub, 0700);
+
+    cache_init(dir, c->cache_size, c->block_size);
+
+    // fill the cache with the working set, in order
+    uint64_t blocks = c->cache_size / c->block_size * c->working_set / 100;
+    if (blocks == 0)
+        blocks = 1;
+    char *buf = (char*)malloc(c->block_size);
+    char filename[64];
+    uint32_t block;
+    for (uint64_t n = 0; n < blocks; n++) {
+        block_name(n, filename, sizeof(filename), &block);
+        fill_block(buf, c->block_size, n);
+        cache_add(filename, block, buf, c->block_size, &validator);
+    }
+    free(buf);
+    struct cache_usage usage;
+    cache_get_usage(&usage);
+
+    struct worker *workers = (struct worker*)calloc(c->threads, sizeof(*workers));
+    atomic_store(&fs_calls, 0);
+    uint64_t start = now_ns();
+    for (unsigned int i = 0; i < c->threads; i++) {
+        workers[i].config = c;
+        workers[i].blocks = blocks;
+        workers[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+        workers[i].latencies = (uint64_t*)malloc(c->ops * sizeof(uint64_t));
+        if (workers[i].latencies == NULL
+                || pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            fprintf(stderr, "can't start worker thread\n");
+            return 1;
+        }
+    }
+
+    uint64_t hits = 0, misses = 0, invalidations = 0, errors = 0;
+    uint64_t ops = c->ops * c->threads;
+    uint64_t *latencies = (uint64_t*)malloc(ops * sizeof(uint64_t));
+    for (unsigned int i = 0; i < c->threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        memcpy(latencies + i * c->ops, workers[i].latencies, c->ops * sizeof(uint64_t));
+        free(workers[i].latencies);
+        hits += workers[i].hits;
+        misses += workers[i].misses;
+        invalidations += workers[i].invalidations;
+        errors += workers[i].errors;
+    }
+    uint64_t calls = atomic_load(&fs_calls);
+    double seconds = (now_ns() - start) / 1e9;
+    free(workers);
+
+    qsort(latencies, ops, sizeof(uint64_t), compare_u64);
+    printf("{\"cache_size\": %llu, \"block_size\": %llu, \"working_set_percent\": %u, "
+            "\"fill_percent\": %.1f, \"threads\": %u, \"ops\": %llu, \"errors\": %llu, "
+            "\"ops_per_sec\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f, "
+            "\"hit_ratio\": %.4f, \"invalidations\": %llu, \"fs_calls_per_op\": %.2f}\n",
+            (unsigned long long) c->cache_size, (unsigned long long) c->block_size,
+            c->working_set, 100.0 * usage.used_bytes / c->cache_size, c->threads,
+            (unsigned long long) ops, (unsigned long long) errors,
+            ops / seconds,
+            latencies[(size_t)(0.50 * (ops - 1))] / 1000.0,
+            latencies[(size_t)(0.99 * (ops - 1))] / 1000.0,
+            latencies[ops - 1] / 1000.0,
+            (hits + misses) ? (double)hits / (hits + misses) : 0,
+            (unsigned long long) invalidations, (double)calls / ops);
+    free(latencies);
+
+    nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return (errors > 0) ? 1 : 0;
+}
+
+static int parse_list(const char *list, uint64_t *values)
+{
+    int n = 0;
+    const char *p = list;
+    while (*p != '\0' && n < MAX_LIST) {
+        char *end;
+        uint64_t value = strtoull(p, &end, 0);
+        switch (*end) {
+        case 'G': case 'g': value <<= 10; // fall through
+        case 'M': case 'm': value <<= 10; // fall through
+        case 'K': case 'k': value <<= 10; end++; break;
+        }
+        if (end == p || value == 0 || (*end != ',' && *end != '\0'))
+            return -1;
+        values[n++] = value;
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    const char *cache_list = "64M,256M";
+    const char *working_list = "50,90,150";
+    const char *thread_list = "1,8";
+    struct config config = {
+        .block_size = 0x20000,
+        .ops = 10000,
+        .invalidate = 5,
+    };
+    int opt;
+    while ((opt = getopt(argc, argv, "c:w:t:b:n:i:")) != -1) {
+        switch (opt) {
+        case 'c': cache_list = optarg; break;
+        case 'w': working_list = optarg; break;
+        case 't': thread_list = optarg; break;
+        case 'b': config.block_size = strtoull(optarg, NULL, 0); break;
+        case 'n': config.ops = strtoull(optarg, NULL, 0); break;
+        case 'i': config.invalidate = atoi(optarg); break;
+        default: goto usage;
+        }
+    }
+
+    uint64_t caches[MAX_LIST], workings[MAX_LIST], threads[MAX_LIST];
+    int ncache = parse_list(cache_list, caches);
+    int nworking = parse_list(working_list, workings);
+    int nthreads = parse_list(thread_list, threads);
+    if (argc - optind != 1 || ncache <= 0 || nworking <= 0 || nthreads <= 0
+            || config.block_size == 0 || config.ops == 0) {
+usage:
+        fprintf(stderr, "usage: %s [-c cache sizes] [-w working sets] [-t threads]\n"
+                "        [-b block size] [-n ops per thread] [-i invalidate percent]\n"
+                "        <scratch dir>\n"
+                "    lists are comma-separated; sizes can have a K, M or G suffix\n"
+                "    defaults: -c 64M,256M -w 50,90,150 -t 1,8 -b 131072 -n 10000 -i 5\n",
+                argv[0]);
+        return 1;
+    }
+
+    int ret = 0;
+    for (int c = 0; c < ncache; c++) {
+        for (int w = 0; w < nworking; w++) {
+            for (int t = 0; t < nthreads; t++) {
+                config.cache_size = caches[c];
+                config.working_set = workings[w];
+                config.threads = threads[t];
+
+                // the cache can only be initialized once per process
+                fflush(stdout);
+                pid_t pid = fork();
+                if (pid == 0) {
+                    exit(run(argv[optind], &config));
+                }
+                int status;
+                waitpid(pid, &status, 0);
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                    ret = 1;
+                }
+            }
+        }
+    }
+
+    return ret;
+}
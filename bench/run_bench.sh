@@ -0,0 +1,154 @@
+#!/bin/bash
+#
+# BackFS benchmark harness
+#
+# Mounts BackFS over a local directory made slow by bench/slowfs.so, runs the
+# workloads in bench/backfs_workload against it, and prints one JSON object
+# per workload on stdout (the first line describes the setup).
+#
+# Run it with `make bench`. Settings come from the environment:
+#   BENCH_DIR            scratch directory (default: a new one under /tmp,
+#                        removed afterwards)
+#   BENCH_LATENCY_US     backing store latency per read or write (2000)
+#   BENCH_META_US        backing store latency per metadata call (500)
+#   BENCH_MBPS           backing store bandwidth, MiB/s; 0 for unlimited (100)
+#   BENCH_FILE_MIB       size of the files for the sequential, random and
+#                        write workloads (128)
+#   BENCH_RANDOM_READS   reads in the random read workloads (2000)
+#   BENCH_TREE_FILES     files in the small-file tree (2000)
+#   BENCH_TREE_FILE_SIZE size of each of those (16384)
+#   BENCH_BACKFS_OPTS    extra -o options for BackFS, e.g. block_size=1048576
+#   BENCH_FUSE_OPTS      FUSE options; the default turns off the kernel's page
+#                        and attribute caches so every request reaches BackFS
+#   BENCH_EXIT_SECONDS   how long BackFS gets to exit after an unmount before
+#                        it's killed and the run fails (30)
+#
+
+set -e
+
+thisScript=$(readlink -f "$0")
+backfsDir=$(dirname "$(dirname "$thisScript")")
+backfs=$backfsDir/backfs
+workload=$backfsDir/bench/backfs_workload
+slowfs=$backfsDir/bench/slowfs.so
+
+: ${BENCH_LATENCY_US:=2000}
+: ${BENCH_META_US:=500}
+: ${BENCH_MBPS:=100}
+: ${BENCH_FILE_MIB:=128}
+: ${BENCH_RANDOM_READS:=2000}
+: ${BENCH_TREE_FILES:=2000}
+: ${BENCH_TREE_FILE_SIZE:=16384}
+: ${BENCH_BACKFS_OPTS:=}
+: ${BENCH_FUSE_OPTS:=direct_io,attr_timeout=0,entry_timeout=0,negative_timeout=0}
+: ${BENCH_EXIT_SECONDS:=30}
+
+if [ -z "$BENCH_DIR" ]; then
+    BENCH_DIR=$(mktemp -d /tmp/backfs-bench.XXXXXX)
+    removeDir=1
+fi
+backing=$BENCH_DIR/backing
+cache=$BENCH_DIR/cache
+mnt=$BENCH_DIR/mnt
+backfsPid=
+
+# BackFS exits by itself once it's unmounted; if it doesn't, that's a bug,
+# and it's killed rather than waited on forever. Returns 1 if it had to be.
+unmount() {
+    if [ -z "$backfsPid" ]; then
+        return 0
+    fi
+    fusermount -u "$mnt" 2>/dev/null || umount "$mnt" 2>/dev/null || true
+    local pid=$backfsPid
+    backfsPid=
+    for i in $(seq $((BENCH_EXIT_SECONDS * 10))); do
+        if ! kill -0 $pid 2>/dev/null; then
+            wait $pid 2>/dev/null || true
+            return 0
+        fi
+        sleep 0.1
+    done
+    echo "BackFS didn't exit ${BENCH_EXIT_SECONDS}s after unmounting; killing it" \
+        "(see $BENCH_DIR/backfs.log)" >&2
+    kill -9 $pid 2>/dev/null || true
+    wait $pid 2>/dev/null || true
+    fusermount -u -z "$mnt" 2>/dev/null || true
+    return 1
+}
+
+cleanup() {
+    unmount || true
+    if [ -n "$removeDir" ]; then
+        rm -rf "$BENCH_DIR"
+    fi
+}
+trap cleanup EXIT
+
+mount_backfs() {
+    opts=cache=$cache,rw
+    if [ -n "$BENCH_BACKFS_OPTS" ]; then
+        opts=$opts,$BENCH_BACKFS_OPTS
+    fi
+    if [ -n "$BENCH_FUSE_OPTS" ]; then
+        opts=$opts,$BENCH_FUSE_OPTS
+    fi
+
+    LD_PRELOAD=$slowfs \
+        SLOWFS_ROOT=$backing \
+        SLOWFS_LATENCY_US=$BENCH_LATENCY_US \
+        SLOWFS_META_US=$BENCH_META_US \
+        SLOWFS_MBPS=$BENCH_MBPS \
+        "$backfs" -f -o "$opts" "$backing" "$mnt" >"$BENCH_DIR/backfs.log" 2>&1 &
+    backfsPid=$!
+
+    for i in $(seq 100); do
+        if [ -e "$mnt/.backfs_control" ]; then
+            return 0
+        fi
+        if ! kill -0 $backfsPid 2>/dev/null; then
+            break
+        fi
+        sleep 0.1
+    done
+    echo "BackFS didn't mount; see $BENCH_DIR/backfs.log" >&2
+    cat "$BENCH_DIR/backfs.log" >&2
+    exit 1
+}
+
+run() {
+    "$workload" -n "$@"
+}
+
+mkdir -p "$backing" "$cache" "$mnt"
+
+# setup, straight to the backing store (not slowed down)
+head -c $((BENCH_FILE_MIB * 1024 * 1024)) /dev/urandom > "$backing/seq.dat"
+head -c $((BENCH_FILE_MIB * 1024 * 1024)) /dev/urandom > "$backing/rand.dat"
+mkdir "$backing/tree"
+"$workload" populate "$backing/tree" $BENCH_TREE_FILES $BENCH_TREE_FILE_SIZE
+
+echo "{\"latency_us\": $BENCH_LATENCY_US, \"meta_us\": $BENCH_META_US," \
+    "\"backing_mib_per_sec\": $BENCH_MBPS, \"file_mib\": $BENCH_FILE_MIB," \
+    "\"tree_files\": $BENCH_TREE_FILES, \"tree_file_size\": $BENCH_TREE_FILE_SIZE," \
+    "\"backfs_opts\": \"$BENCH_BACKFS_OPTS\", \"fuse_opts\": \"$BENCH_FUSE_OPTS\"}"
+
+mount_backfs
+
+# each cold run is the first to touch its data, so the cache starts out empty
+run seq_cold seq "$mnt/seq.dat"
+run seq_warm seq "$mnt/seq.dat"
+run rand_cold rand "$mnt/rand.dat" $BENCH_RANDOM_READS
+run rand_warm rand "$mnt/rand.dat" $BENCH_RANDOM_READS
+run tree_cold tree "$mnt/tree"
+run tree_warm tree "$mnt/tree"
+run meta meta "$mnt/tree" 5
+run rw_write write "$mnt/rw.dat" $BENCH_FILE_MIB
+run rw_read seq "$mnt/rw.dat"
+
+# and after a remount, everything should still be in the cache
+if ! unmount; then
+    exit 1
+fi
+mount_backfs
+run remount_seq seq "$mnt/seq.dat"
+run remount_tree tree "$mnt/tree"
@@ -0,0 +1,314 @@
+/*
+ * BackFS slow backing store shim
+ * Copyright (c) 2026 William R. Fraser
+ *
+ * An LD_PRELOAD library that makes one directory tree behave like a slow
+ * backing store: every call that touches a path under SLOWFS_ROOT, or a file
+ * descriptor opened from one, sleeps before doing the real thing.
+ *
+ * Configured from the environment:
+ *   SLOWFS_ROOT        absolute path of the tree to slow down (required;
+ *                      without it the shim does nothing)
+ *   SLOWFS_LATENCY_US  added to every read and write (default 0)
+ *   SLOWFS_META_US     added to every other call: open, stat, opendir,
+ *                      readlink, unlink, rename, ... (default 0)
+ *   SLOWFS_MBPS        bandwidth shared by all reads and writes, in MiB/s
+ *                      (default 0: unlimited)
+ *
+ * e.g.
+ *   LD_PRELOAD=bench/slowfs.so SLOWFS_ROOT=/srv/data SLOWFS_LATENCY_US=5000 \
+ *       ./backfs -o cache=/var/cache/backfs /srv/data /mnt/backfs
+ */
+
+// this defines both the plain and the 64-bit versions of each call itself
+#undef _FILE_OFFSET_BITS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define MAX_FDS 65536
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static const char *root = NULL;
+static size_t root_len = 0;
+static uint64_t latency_ns = 0;
+static uint64_t meta_ns = 0;
+static double ns_per_byte = 0;
+
+static _Atomic unsigned char slow_fds[MAX_FDS];
+
+// bandwidth: the time the (shared) link is busy until
+static pthread_mutex_t link_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t link_busy_until = 0;
+
+static uint64_t env_u64(const char *name)
+{
+    const char *value = getenv(name);
+    return (value == NULL) ? 0 : strtoull(value, NULL, 0);
+}
+
+static void init(void)
+{
+    root = getenv("SLOWFS_ROOT");
+    if (root != NULL) {
+        root_len = strlen(root);
+        while (root_len > 1 && root[root_len - 1] == '/')
+            root_len--;
+    }
+    latency_ns = env_u64("SLOWFS_LATENCY_US") * 1000;
+    meta_ns = env_u64("SLOWFS_META_US") * 1000;
+    uint64_t mbps = env_u64("SLOWFS_MBPS");
+    if (mbps != 0)
+        ns_per_byte = 1e9 / (mbps * 1024.0 * 1024.0);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline)
+{
+    struct timespec ts = {
+        .tv_sec = deadline / 1000000000,
+        .tv_nsec = deadline % 1000000000,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static bool slow_path(const char *path)
+{
+    pthread_once(&init_once, init);
+    return root != NULL && path != NULL
+        && strncmp(path, root, root_len) == 0
+        && (path[root_len] == '/' || path[root_len] == '\0');
+}
+
+static bool slow_fd(int fd)
+{
+    return fd >= 0 && fd < MAX_FDS && slow_fds[fd];
+}
+
+static void mark_fd(int fd, bool slow)
+{
+    if (fd >= 0 && fd < MAX_FDS)
+        slow_fds[fd] = slow;
+}
+
+static void delay_meta(void)
+{
+    if (meta_ns != 0)
+        sleep_until(now_ns() + meta_ns);
+}
+
+/*
+ * Latency, then the transfer: transfers queue up behind each other on the
+ * link when there's a bandwidth cap.
+ */
+static void delay_io(size_t bytes)
+{
+    uint64_t t = now_ns() + latency_ns;
+    if (ns_per_byte != 0) {
+        pthread_mutex_lock(&link_lock);
+        if (link_busy_until > t)
+            t = link_busy_until;
+        t += (uint64_t)(bytes * ns_per_byte);
+        link_busy_until = t;
+        pthread_mutex_unlock(&link_lock);
+    }
+    sleep_until(t);
+}
+
+#define REAL(ret, name, params) \
+    static ret (*real_##name) params = NULL; \
+    if (real_##name == NULL) \
+        *(void **)&real_##name = dlsym(RTLD_NEXT, #name)
+
+//
+// Opening and closing
+//
+
+#define OPEN_MODE(flags, mode) \
+    mode_t mode = 0; \
+    if ((flags) & (O_CREAT | O_TMPFILE)) { \
+        va_list ap; \
+        va_start(ap, flags); \
+        mode = va_arg(ap, mode_t); \
+        va_end(ap); \
+    }
+
+#define WRAP_OPEN(name) \
+    int name(const char *path, int flags, ...) \
+    { \
+        OPEN_MODE(flags, mode); \
+        REAL(int, name, (const char *, int, ...)); \
+        bool slow = slow_path(path); \
+        if (slow) \
+            delay_meta(); \
+        int fd = real_##name(path, flags, mode); \
+        mark_fd(fd, slow); \
+        return fd; \
+    }
+
+#define WRAP_OPENAT(name) \
+    int name(int dirfd, const char *path, int flags, ...) \
+    { \
+        OPEN_MODE(flags, mode); \
+        REAL(int, name, (int, const char *, int, ...)); \
+        bool slow = slow_path(path) || (path[0] != '/' && slow_fd(dirfd)); \
+        if (slow) \
+            delay_meta(); \
+        int fd = real_##name(dirfd, path, flags, mode); \
+        mark_fd(fd, slow); \
+        return fd; \
+    }
+
+WRAP_OPEN(open)
+WRAP_OPEN(open64)
+WRAP_OPENAT(openat)
+WRAP_OPENAT(openat64)
+
+int creat(const char *path, mode_t mode)
+{
+    return open(path, O_CREAT | O_WRONLY | O_TRUNC, mode);
+}
+
+int creat64(const char *path, mode_t mode)
+{
+    return open64(path, O_CREAT | O_WRONLY | O_TRUNC, mode);
+}
+
+int close(int fd)
+{
+    REAL(int, close, (int));
+    mark_fd(fd, false);
+    return real_close(fd);
+}
+
+DIR * opendir(const char *path)
+{
+    REAL(DIR *, opendir, (const char *));
+    if (slow_path(path))
+        delay_meta();
+    return real_opendir(path);
+}
+
+//
+// Data
+//
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+    REAL(ssize_t, read, (int, void *, size_t));
+    if (slow_fd(fd))
+        delay_io(count);
+    return real_read(fd, buf, count);
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+    REAL(ssize_t, write, (int, const void *, size_t));
+    if (slow_fd(fd))
+        delay_io(count);
+    return real_write(fd, buf, count);
+}
+
+#define WRAP_PREAD(name) \
+    ssize_t name(int fd, void *buf, size_t count, off_t offset) \
+    { \
+        REAL(ssize_t, name, (int, void *, size_t, off_t)); \
+        if (slow_fd(fd)) \
+            delay_io(count); \
+        return real_##name(fd, buf, count, offset); \
+    }
+
+#define WRAP_PWRITE(name) \
+    ssize_t name(int fd, const void *buf, size_t count, off_t offset) \
+    { \
+        REAL(ssize_t, name, (int, const void *, size_t, off_t)); \
+        if (slow_fd(fd)) \
+            delay_io(count); \
+        return real_##name(fd, buf, count, offset); \
+    }
+
+// off_t is 64 bits wide on the platforms this is meant for
+WRAP_PREAD(pread)
+WRAP_PREAD(pread64)
+WRAP_PWRITE(pwrite)
+WRAP_PWRITE(pwrite64)
+
+int fsync(int fd)
+{
+    REAL(int, fsync, (int));
+    if (slow_fd(fd))
+        delay_meta();
+    return real_fsync(fd);
+}
+
+int fdatasync(int fd)
+{
+    REAL(int, fdatasync, (int));
+    if (slow_fd(fd))
+        delay_meta();
+    return real_fdatasync(fd);
+}
+
+//
+// Metadata by path
+//
+
+#define WRAP_PATH(ret, name, params, args) \
+    ret name params \
+    { \
+        REAL(ret, name, params); \
+        if (slow_path(path)) \
+            delay_meta(); \
+        return real_##name args; \
+    }
+
+WRAP_PATH(int, stat, (const char *path, struct stat *buf), (path, buf))
+WRAP_PATH(int, lstat, (const char *path, struct stat *buf), (path, buf))
+WRAP_PATH(int, stat64, (const char *path, struct stat64 *buf), (path, buf))
+WRAP_PATH(int, lstat64, (const char *path, struct stat64 *buf), (path, buf))
+// glibc before 2.33 calls these from stat() and friends
+WRAP_PATH(int, __xstat, (int ver, const char *path, struct stat *buf), (ver, path, buf))
+WRAP_PATH(int, __lxstat, (int ver, const char *path, struct stat *buf), (ver, path, buf))
+WRAP_PATH(int, __xstat64, (int ver, const char *path, struct stat64 *buf), (ver, path, buf))
+WRAP_PATH(int, __lxstat64, (int ver, const char *path, struct stat64 *buf), (ver, path, buf))
+WRAP_PATH(int, fstatat, (int dirfd, const char *path, struct stat *buf, int flags),
+        (dirfd, path, buf, flags))
+WRAP_PATH(int, fstatat64, (int dirfd, const char *path, struct stat64 *buf, int flags),
+        (dirfd, path, buf, flags))
+WRAP_PATH(int, statx, (int dirfd, const char *path, int flags, unsigned int mask,
+            struct statx *buf), (dirfd, path, flags, mask, buf))
+WRAP_PATH(int, access, (const char *path, int mode), (path, mode))
+WRAP_PATH(ssize_t, readlink, (const char *path, char *buf, size_t size), (path, buf, size))
+WRAP_PATH(int, truncate, (const char *path, off_t length), (path, length))
+WRAP_PATH(int, truncate64, (const char *path, off64_t length), (path, length))
+WRAP_PATH(int, unlink, (const char *path), (path))
+WRAP_PATH(int, mkdir, (const char *path, mode_t mode), (path, mode))
+WRAP_PATH(int, rmdir, (const char *path), (path))
+WRAP_PATH(int, chmod, (const char *path, mode_t mode), (path, mode))
+WRAP_PATH(int, chown, (const char *path, uid_t uid, gid_t gid), (path, uid, gid))
+WRAP_PATH(int, lchown, (const char *path, uid_t uid, gid_t gid), (path, uid, gid))
+WRAP_PATH(int, symlink, (const char *target, const char *path), (target, path))
+WRAP_PATH(int, rename, (const char *path, const char *new_path), (path, new_path))
+WRAP_PATH(int, link, (const char *path, const char *new_path), (path, new_path))
+WRAP_PATH(int, utimensat, (int dirfd, const char *path, const struct timespec times[2],
+            int flags), (dirfd, path, times, flags))
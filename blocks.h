@@ -0,0 +1,46 @@
+#ifndef BACKFS_BLOCKS_H
+#define BACKFS_BLOCKS_H
+/*
+ * BackFS block mapping
+ * Copyright (c) 2026 William R. Fraser
+ *
+ * How a read is split into cache blocks. backfs_read() and the tools that
+ * simulate the cache both go by this, so they agree on what gets cached.
+ */
+
+#include <stdint.h>
+
+/*
+ * Blocks a read of size bytes at offset touches: first_block to last_block,
+ * inclusive. The part of the last block may be empty; see block_part().
+ */
+static inline uint32_t first_block(uint64_t offset, uint64_t block_size)
+{
+    return (uint32_t)(offset / block_size);
+}
+
+static inline uint32_t last_block(uint64_t offset, uint64_t size,
+        uint64_t block_size)
+{
+    return (uint32_t)((offset + size) / block_size);
+}
+
+/*
+ * The part of a block the read covers: where in the block it starts, and how
+ * many bytes. Returns the number of bytes, which is 0 for a read that ends
+ * exactly at the start of its last block.
+ */
+static inline uint64_t block_part(uint64_t offset, uint64_t size,
+        uint64_t block_size, uint32_t block, uint64_t *block_offset)
+{
+    uint64_t start = (uint64_t)block * block_size;
+    uint64_t end = start + block_size;
+
+    *block_offset = (offset > start) ? offset - start : 0;
+    if (offset + size < end) {
+        end = offset + size;
+    }
+    return end - start - *block_offset;
+}
+
+#endif //BACKFS_BLOCKS_H
@@ -0,0 +1,202 @@
+/*
+ * BackFS CRC32C (Castagnoli) checksums
+ * Copyright (c) 2026 William R. Fraser
+ */
+
+#include "crc32c.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CRC32C_HAVE_SSE42
+#include <nmmintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define CRC32C_HAVE_ARMV8
+#include <arm_acle.h>
+#endif
+
+// reversed Castagnoli polynomial
+#define CRC32C_POLY 0x82F63B78
+
+static uint32_t crc32c_table[8][256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+static pthread_once_t impl_once = PTHREAD_ONCE_INIT;
+
+static uint32_t (*crc32c_impl)(uint32_t, const void *, size_t) = NULL;
+static const char *crc32c_name = "software";
+
+static void make_tables(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : (c >> 1);
+        }
+        crc32c_table[0][i] = c;
+    }
+
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = crc32c_table[0][i];
+        for (int t = 1; t < 8; t++) {
+            c = crc32c_table[0][c & 0xff] ^ (c >> 8);
+            crc32c_table[t][i] = c;
+        }
+    }
+}
+
+/*
+ * Slicing-by-8: eight table lookups per 8 bytes of input.
+ */
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+    pthread_once(&table_once, make_tables);
+
+    const unsigned char *p = (const unsigned char*)buf;
+    uint32_t c = ~crc;
+
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        c = crc32c_table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+        len--;
+    }
+
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        lo = __builtin_bswap32(lo);
+        hi = __builtin_bswap32(hi);
+#endif
+        lo ^= c;
+        c = crc32c_table[7][lo & 0xff]
+          ^ crc32c_table[6][(lo >> 8) & 0xff]
+          ^ crc32c_table[5][(lo >> 16) & 0xff]
+          ^ crc32c_table[4][lo >> 24]
+          ^ crc32c_table[3][hi & 0xff]
+          ^ crc32c_table[2][(hi >> 8) & 0xff]
+          ^ crc32c_table[1][(hi >> 16) & 0xff]
+          ^ crc32c_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+
+    while (len > 0) {
+        c = crc32c_table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+        len--;
+    }
+
+    return ~c;
+}
+
+#ifdef CRC32C_HAVE_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char*)buf;
+    uint64_t c = ~crc;
+
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+        len--;
+    }
+
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+
+    while (len > 0) {
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+        len--;
+    }
+
+    return ~(uint32_t)c;
+}
+#endif //CRC32C_HAVE_SSE42
+
+#ifdef CRC32C_HAVE_ARMV8
+static uint32_t crc32c_armv8(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char*)buf;
+    uint32_t c = ~crc;
+
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = __crc32cd(c, v);
+        p += 8;
+        len -= 8;
+    }
+
+    while (len > 0) {
+        c = __crc32cb(c, *p++);
+        len--;
+    }
+
+    return ~c;
+}
+#endif //CRC32C_HAVE_ARMV8
+
+static void choose_impl(void)
+{
+    crc32c_impl = &crc32c_sw;
+    crc32c_name = "software";
+
+#ifdef CRC32C_HAVE_SSE42
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_impl = &crc32c_sse42;
+        crc32c_name = "sse4.2";
+    }
+#endif
+
+#ifdef CRC32C_HAVE_ARMV8
+    crc32c_impl = &crc32c_armv8;
+    crc32c_name = "armv8";
+#endif
+}
+
+void crc32c_init(void)
+{
+    pthread_once(&impl_once, choose_impl);
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    crc32c_init();
+    return crc32c_impl(crc, buf, len);
+}
+
+const char * crc32c_impl_name(void)
+{
+    crc32c_init();
+    return crc32c_name;
+}
+
+/*
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
@@ -0,0 +1,34 @@
+#ifndef BACKFS_CRC32C_H
+#define BACKFS_CRC32C_H
+/*
+ * BackFS CRC32C (Castagnoli) checksums
+ * Copyright (c) 2026 William R. Fraser
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Pick the fastest implementation for this CPU. Calling this is optional;
+ * crc32c() will do it on first use.
+ */
+void crc32c_init(void);
+
+/*
+ * Extend a running checksum with len bytes of buf.
+ * Start with crc = 0.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/*
+ * Portable table-driven implementation, regardless of CPU support.
+ */
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+
+/*
+ * Name of the implementation crc32c() uses ("sse4.2", "armv8" or "software").
+ */
+const char * crc32c_impl_name(void);
+
+#endif //BACKFS_CRC32C_H
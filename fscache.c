@@ -23,13 +23,16 @@
 #include <fcntl.h>
 #include <libgen.h>
 #include <limits.h>
+#include <time.h>
 
 #include <pthread.h>
 static pthread_mutex_t lock;
 
 #define BACKFS_LOG_SUBSYS "Cache"
 #include "global.h"
+#include "crc32c.h"
 #include "fsll.h"
+#include "stats.h"
 #include "util.h"
 
 extern int backfs_log_level;
@@ -38,10 +41,147 @@ extern bool backfs_log_stderr;
 static char *cache_dir;
 static uint64_t cache_size;
 static volatile uint64_t cache_used_size = 0;
+static uint64_t used_buckets = 0;
+static uint64_t free_buckets = 0;
 struct bucket_node { uint32_t number; struct bucket_node* next; };
 static struct bucket_node * volatile to_check;
 static bool use_whole_device;
 static uint64_t bucket_max_size;
+static unsigned int verify_percent = 1;
+static unsigned int verify_seed = 1;
+static bool *verified = NULL;       // by bucket number: checked since startup
+static uint32_t verified_size = 0;
+
+// bucket data I/O
+#define DIRECT_IO_ALIGN 4096
+#define ROUND_UP(n, align) (((n) + (align) - 1) / (align) * (align))
+static enum cache_io_mode io_mode = CACHE_IO_BUFFERED;
+static char *io_buf = NULL; // aligned bounce buffer; used with the lock held
+
+// background eviction
+#define EVICT_BATCH 32          // buckets freed per lock acquisition
+#define EVICT_INTERVAL 1        // seconds between free space checks
+#define EVICT_SECOND_CHANCES 8  // buckets the keep_fn can save per eviction
+static pthread_cond_t evict_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int evict_high_percent = 95;
+static unsigned int evict_low_percent = 90;
+static volatile uint64_t evict_high_bytes = UINT64_MAX;
+static volatile uint64_t dev_free_estimate = 0;
+static pthread_t evict_thread;
+
+// manifest export
+#define EXPORT_BATCH 256        // buckets listed per lock acquisition
+
+// allocation unit of the cache filesystem, for predicting space usage
+static uint64_t fs_block_size = 4096;
+// blocks of metadata per bucket: the crc32c file, plus a share of the map and
+// bucket directories
+#define BUCKET_METADATA_BLOCKS 2
+void* evictor(void* arg);
+
+// set by cache_shutdown(); the background threads check it, with the lock
+// held, whenever they wake up or finish a batch
+static bool stopping = false;
+static pthread_t size_check_thread;
+static bool size_check_started = false;
+
+// write-back
+#define WRITEBACK_COALESCE_MAX 16   // most consecutive blocks in one flush
+#define WRITEBACK_BACKOFF_MAX 300   // longest wait, in seconds, between retries
+struct dirty_bucket {
+    uint64_t generation;    // names the marker file in <cache_dir>/dirty
+    uint32_t number;        // bucket number
+    uint32_t block;
+    uint64_t file_id;       // of the file directory the bucket belongs to
+    uint64_t len;
+    char *path;
+    time_t since;           // when it was dirtied, or last failed to flush
+    bool flushing;          // a flusher is writing it back right now
+    bool syncing;           // a writer is making it durable, without the lock
+    bool superseded;        // freed while flushing or syncing; drop it after
+    struct dirty_bucket *next;
+};
+static struct dirty_bucket *dirty_list = NULL; // oldest first
+static uint64_t dirty_bytes = 0;
+static uint32_t dirty_count = 0;        // entries that aren't superseded
+static bool *dirty_numbers = NULL;      // by bucket number: has such an entry
+static uint32_t dirty_numbers_size = 0;
+static bool dirty_numbers_lost = false; // couldn't grow it; don't go by it
+static uint64_t dirty_generation = 1;
+static int dirty_dir_fd = -1;
+static pthread_cond_t dirty_cond = PTHREAD_COND_INITIALIZER; // something was flushed
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER; // something to flush
+static cache_flush_fn flush_fn = NULL;
+static unsigned int writeback_threads = 0;
+static uint64_t writeback_max_dirty = 64 * 1024 * 1024;
+static unsigned int writeback_delay = 5;
+static pthread_t *flush_threads = NULL;
+static unsigned int flush_thread_count = 0;
+// files whose last write-back failed; they aren't retried until retry_at,
+// and the wait doubles with each failure in a row
+struct flush_failure {
+    char *path;
+    unsigned int failures;
+    time_t retry_at;
+    struct flush_failure *next;
+};
+static struct flush_failure *flush_failures = NULL;
+void* flusher(void* arg);
+void free_flush_failures(void);
+int write_bucket_checksum(const char *bucketpath, uint32_t crc);
+void mark_verified(uint32_t number);
+
+// per-file directories
+#define CACHE_FORMAT 2  // 1: blocks in map/<path>/; 2: in files/<id>/
+static uint64_t next_file_id = 0;
+static cache_key_fn key_fn = NULL;     // set if files are keyed by inode
+static cache_keep_fn keep_fn = NULL;
+void trim_directory(const char *path);
+void free_file_dir(const char *filedir);
+uint64_t free_tail_bucket();
+bool file_is_dirty(const char *filename);
+
+// the validators of files checked lately, so a hit doesn't read the mtime file
+#define VALIDATOR_SLOTS 4096
+struct validator_slot {
+    char *filename;
+    uint64_t generation;    // map_generation when it was read or written
+    struct cache_validator v;
+};
+static struct validator_slot validators[VALIDATOR_SLOTS];
+static uint64_t map_generation = 1;     // bumped when a map directory moves
+static void forget_validator(const char *filename);
+
+// background orphan collection
+#define ORPHAN_BATCH 64         // buckets checked per lock acquisition
+#define ORPHAN_SCAN_FILE "orphan_scan"
+static bool orphan_scan_running = false;
+static pthread_t orphan_thread;
+static bool orphan_thread_started = false;  // and not joined yet
+static uint64_t orphan_next = 0;        // next bucket the scan checks
+static uint64_t orphan_end = 0;         // where it stops
+void resume_orphan_scan(void);
+
+// map subtrees detached by cache_invalidate_tree(), still being freed
+#define TRASH_DIR "trash"
+#define TRASH_BATCH 64          // blocks freed per lock acquisition
+struct trash_tree {
+    uint64_t number;        // names <cache_dir>/trash/<number>
+    char *name;             // the path it was at in the map
+    struct trash_tree *next;
+};
+static struct trash_tree *trash_list = NULL;
+static uint64_t next_trash_number = 0;
+static bool trash_collector_running = false;
+static pthread_t trash_thread;
+static bool trash_thread_started = false;   // and not joined yet
+bool file_dir_is_detached(const char *filedir);
+void resume_trash(void);
+
+// startup consistency check
+#define CLEAN_MARKER "clean_shutdown"
+static unsigned int check_threads = 1;
+static bool check_always = false;
 
 uint64_t prepare_buckets_size_check(const char *root)
 {
@@ -98,6 +238,20 @@ bool is_unchecked(const char* path)
     return false;
 }
 
+/*
+ * Predict how much of the cache filesystem a bucket holding data_size bytes
+ * uses: the data rounded up to whole filesystem blocks, plus metadata.
+ * Everything accounted in cache_used_size goes through this, so adding and
+ * freeing a bucket always balance.
+ */
+uint64_t bucket_footprint(uint64_t data_size)
+{
+    if (data_size == 0)
+        return 0;
+    uint64_t blocks = (data_size + fs_block_size - 1) / fs_block_size;
+    return (blocks + BUCKET_METADATA_BLOCKS) * fs_block_size;
+}
+
 void* check_buckets_size(void* arg)
 {
     INFO("starting cache size check\n");
@@ -111,18 +265,28 @@ void* check_buckets_size(void* arg)
 
     while (to_check) {
         pthread_mutex_lock(&lock);
+        if (stopping) {
+            pthread_mutex_unlock(&lock);
+            return NULL;
+        }
         bucket = to_check;
         if (bucket) {
             s.st_size = 0;
             snprintf(buf, PATH_MAX, "%s/buckets/%u/data", cache_dir, bucket->number);
-            if (stat(buf, &s) == -1 && errno != ENOENT) {
-                PERROR("stat in get_cache_used_size");
-                ERROR("\tcaused by stat(%s)\n", buf);
-                abort();
+            if (stat(buf, &s) == -1) {
+                if (errno != ENOENT) {
+                    PERROR("stat in get_cache_used_size");
+                    ERROR("\tcaused by stat(%s)\n", buf);
+                    abort();
+                }
+                // no data: it's on the free queue
+                used_buckets--;
+                free_buckets++;
             }
             DEBUG("bucket %u: %llu bytes\n",
                     bucket->number, (unsigned long long) s.st_size);
-            cache_used_size -= bucket_max_size - s.st_size;
+            cache_used_size -= bucket_footprint(bucket_max_size)
+                                - bucket_footprint(s.st_size);
             to_check = bucket->next;
         }
         pthread_mutex_unlock(&lock);
@@ -146,901 +310,4740 @@ uint64_t get_cache_fs_free_size(const char *root)
 }
 
 /*
- * Initialize the cache.
+ * Set the percentage (0-100) of cache reads whose block checksum gets
+ * verified, on top of the first read of each block after startup (unless
+ * it's 0). Call before cache_init().
  */
-void cache_init(const char *a_cache_dir, uint64_t a_cache_size, uint64_t a_bucket_max_size)
+void cache_set_verify_percent(unsigned int percent)
 {
-    cache_dir = (char*)malloc(strlen(a_cache_dir)+1);
-    strcpy(cache_dir, a_cache_dir);
-    cache_size = a_cache_size;
-    use_whole_device = (cache_size == 0);
-
-    char bucket_dir[PATH_MAX];
-    snprintf(bucket_dir, PATH_MAX, "%s/buckets", cache_dir);
-    uint64_t number_of_buckets = prepare_buckets_size_check(bucket_dir);
-    INFO("%llu buckets in cache dir\n",
-            (unsigned long long) number_of_buckets);
-    cache_used_size = number_of_buckets * a_bucket_max_size;
-    INFO("Estimated %llu bytes used in cache dir\n",
-            (unsigned long long) cache_used_size);
-    uint64_t cache_free_size = get_cache_fs_free_size(bucket_dir);
-    INFO("%llu bytes free in cache dir\n",
-            (unsigned long long) cache_free_size);
-
-    bucket_max_size = a_bucket_max_size;
+    verify_percent = (percent > 100) ? 100 : percent;
+}
 
-    if (number_of_buckets > 0) {
-        pthread_t thread;
-        if (pthread_create(&thread, NULL, &check_buckets_size, NULL) != 0) {
-            PERROR("cache_init: error creating checked thread");
-            abort();
-        }
-    }
+/*
+ * Set how bucket data is read and written. See enum cache_io_mode.
+ * Call before cache_init().
+ */
+void cache_set_io_mode(enum cache_io_mode mode)
+{
+    io_mode = mode;
+}
 
+/*
+ * Set when the background evictor starts freeing buckets (high, as a
+ * percentage of the space the cache may use) and when it stops (low).
+ * Call before cache_init().
+ */
+void cache_set_watermarks(unsigned int high_percent, unsigned int low_percent)
+{
+    evict_high_percent = (high_percent > 100) ? 100 : high_percent;
+    evict_low_percent = (low_percent > evict_high_percent) ? evict_high_percent : low_percent;
 }
 
-const char * bucketname(const char *path)
+/*
+ * Enable write-back: cache_add_dirty() data is written to the backing store
+ * later, by the given number of flusher threads, through fn. At most
+ * max_dirty_bytes of data may be waiting; blocks are left for delay_seconds
+ * (unless that's exceeded) to give later writes a chance to coalesce with
+ * them.
+ *
+ * With threads = 0, write-back is disabled, but fn is still used to flush
+ * any dirty data left over from before a crash.
+ * Call before cache_init().
+ */
+void cache_set_writeback(cache_flush_fn fn, unsigned int threads,
+        uint64_t max_dirty_bytes, unsigned int delay_seconds)
 {
-    return fsll_basename(path);
+    flush_fn = fn;
+    writeback_threads = threads;
+    writeback_max_dirty = max_dirty_bytes;
+    writeback_delay = delay_seconds;
 }
 
-void dump_queues()
+/*
+ * Key cached files by the backing file's identity (see struct cache_file_key)
+ * as well as by name, so data cached under one name is found under any other
+ * the file has or gets: hard links, and renames done on the backing store.
+ * fn is called when a name isn't in the map, or its mtime no longer matches.
+ * Call before cache_init().
+ */
+void cache_set_key_fn(cache_key_fn fn)
 {
-#ifdef FSLL_DUMP
-    fprintf(stderr, "BackFS Used Bucket Queue:\n");
-    fsll_dump(cache_dir, "buckets/head", "buckets/tail");
-    fprintf(stderr, "BackFS Free Bucket Queue:\n");
-    fsll_dump(cache_dir, "buckets/free_head", "buckets/free_tail");
-#endif //FSLL_DUMP
+    key_fn = fn;
 }
 
 /*
- * don't use this function directly.
+ * Ask fn about each block that reaches the tail of the queue, and move it back
+ * to the head instead of evicting it if fn says to keep it, up to
+ * EVICT_SECOND_CHANCES blocks per eviction.
+ * Call before cache_init().
  */
-char * makebucket(uint64_t number)
+void cache_set_keep_fn(cache_keep_fn fn)
 {
-    char *new_bucket = fsll_make_entry(cache_dir, "buckets", number);
-    fsll_insert_as_head(cache_dir, new_bucket,
-            "buckets/head", "buckets/tail");
-    return new_bucket;
+    keep_fn = fn;
 }
 
 /*
- * make a new bucket
- *
- * either re-use one from the free queue,
- *   or increment the next_bucket_number file and return that.
- *
- * If one from the free queue is returned, that bucket is made the head of the
- * used queue.
+ * Check the cache for damage from a crash when it's initialized, using this
+ * many threads, and even after a clean shutdown if always is set (see
+ * check_cache()). With threads 0, uses one per CPU.
+ * Call before cache_init().
  */
-char * next_bucket(void)
+void cache_set_check(unsigned int threads, bool always)
 {
-    char *bucket = fsll_getlink(cache_dir, "buckets/free_head");
-    if (bucket != NULL) {
-        DEBUG("re-using free bucket %s\n", bucketname(bucket));
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cpus > 0) ? (unsigned int) cpus : 1;
+    }
+    check_threads = threads;
+    check_always = always;
+}
 
-        // disconnect from free queue
-        fsll_disconnect(cache_dir, bucket,
-                "buckets/free_head", "buckets/free_tail");
+/*
+ * Each cached file has a directory, <cache_dir>/files/<id>, holding symlinks to
+ * the buckets of its blocks, its mtime, and its name (the path it's cached
+ * under). map/<path> is a symlink to that directory, with directories along
+ * the way mirroring the backing store's. The ID never changes, so neither do
+ * the buckets' parent links, and renaming a file is just a rename in map/.
+ *
+ * All of these are called with the lock held, or from cache_init().
+ */
 
-        // make head of the used queue
-        fsll_insert_as_head(cache_dir, bucket,
-                "buckets/head", "buckets/tail");
+/*
+ * The directory of a cached file, or NULL if nothing of it is cached.
+ * Free it when done.
+ */
+char * file_dir(const char *filename)
+{
+    char mappath[PATH_MAX];
+    snprintf(mappath, PATH_MAX, "%s/map%s", cache_dir, filename);
+    char *filedir = areadlink(mappath);
+    if (filedir != NULL && !fsll_file_exists(filedir, NULL)) {
+        FREE(filedir);
+    }
+    return filedir;
+}
 
-        return bucket;
+void write_file_name(const char *filedir, const char *filename)
+{
+    char namepath[PATH_MAX];
+    snprintf(namepath, PATH_MAX, "%s/name", filedir);
+    FILE *f = fopen(namepath, "w");
+    if (f == NULL) {
+        PERROR("opening name file failed");
     } else {
-        char nbnpath[PATH_MAX];
-        snprintf(nbnpath, PATH_MAX, "%s/buckets/next_bucket_number", cache_dir);
-        uint64_t next = 0;
-        
-        FILE *f = fopen(nbnpath, "r+");
-        if (f == NULL && errno != ENOENT) {
-            PERROR("open next_bucket");
-            return makebucket(0);
-        } else {
-            if (f != NULL) {
-                // we had a number already there; read it
-                if (fscanf(f, "%llu", (unsigned long long *)&next) != 1) {
-                    ERROR("unable to read next_bucket\n");
-                    fclose(f);
-                    return makebucket(0);
-                }
-                f = freopen(nbnpath, "w+", f);
-            } else {
-                // next_bucket_number doesn't exist; create it and write a 1.
-                f = fopen(nbnpath, "w+");
-                if (f == NULL) {
-                    PERROR("open next_bucket again");
-                    return makebucket(0);
-                }
-            }
-            // write the next number
-            if (f == NULL) {
-                PERROR("fdopen for writing in next_bucket");
-                return makebucket(0);
-            }
-            fprintf(f, "%llu\n", (unsigned long long) next+1);
-            fclose(f);
-        }
-
-        DEBUG("making new bucket %lu\n", (unsigned long) next);
-
-        char *new_bucket = makebucket(next);
-
-        return new_bucket;
+        fputs(filename, f);
+        fclose(f);
     }
 }
 
 /*
- * moves a bucket to the head of the used queue
+ * The path a file directory is cached under, or NULL if it has no name file.
+ * Free it when done.
  */
-void bucket_to_head(const char *bucketpath)
+char * read_file_name(const char *filedir)
 {
-    DEBUG("bucket_to_head(%s)\n", bucketpath);
-    fsll_to_head(cache_dir, bucketpath, "buckets/head", "buckets/tail");
+    char namepath[PATH_MAX];
+    snprintf(namepath, PATH_MAX, "%s/name", filedir);
+    int fd = open(namepath, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    char name[PATH_MAX];
+    ssize_t n = read(fd, name, sizeof(name) - 1);
+    close(fd);
+    if (n <= 0) {
+        return NULL;
+    }
+    name[n] = '\0';
+    return strdup(name);
 }
 
 /*
- * Starting at the dirname of path, remove empty directories upwards in the
- * path heirarchy.
- *
- * Stops when it gets to <cache_dir>/buckets or <cache_dir>/map
+ * With inode keys, each file directory also has a file "key", and
+ * <cache_dir>/inodes/<dev>.<ino>.<generation> is a symlink to the directory.
+ * The map then works as a cache of name to inode lookups: a name that isn't in
+ * it is looked up by key before concluding nothing is cached, and a name whose
+ * mtime stops matching is checked for pointing at a different file now.
  */
-void trim_directory(const char *path)
-{
-    size_t len = strlen(path);
-    char *copy = (char*)malloc(len+1);
-    strncpy(copy, path, len+1);
-
-    char map[PATH_MAX];
-    char buckets[PATH_MAX];
-    snprintf(map, PATH_MAX, "%s/map", cache_dir);
-    snprintf(buckets, PATH_MAX, "%s/buckets", cache_dir);
-
-    char *dir = dirname(copy);
-    while ((strcmp(dir, map) != 0) && (strcmp(dir, buckets) != 0)) {
-    
-        DIR *d = opendir(dir);
-        struct dirent *e = NULL;
-        bool found_mtime = false;
-        while ((e = readdir(d)) != NULL) {
-            if (e->d_name[0] == '.')
-                continue;
-            
-            // remove mtime files, if found
-            if (strcmp(e->d_name, "mtime") == 0) {
-                struct stat s;
-                char mtime[PATH_MAX];
-                snprintf(mtime, PATH_MAX, "%s/mtime", dir);
-                stat(mtime, &s);
-                if (S_IFREG & s.st_mode) {
-                    found_mtime = true;
-                    continue;
-                }
-            }
-            
-            // if we got here, the directory has entries
-            DEBUG("directory has entries -- in %s found '%s'\n", dir, e->d_name);
-            closedir(d);
-            FREE(copy);
-            return;
-        }
-        
-        if (found_mtime) {
-            char mtime[PATH_MAX];
-            snprintf(mtime, PATH_MAX, "%s/mtime", dir);
-            if (unlink(mtime) == -1) {
-                PERROR("in trim_directory, unable to unlink mtime file");
-                ERROR("\tpath was %s\n", mtime);
-            } else {
-                DEBUG("removed mtime file %s/mtime\n", dir);
-            }
-        }
-
-        closedir(d);
-        d = NULL;
 
-        int result = rmdir(dir);
-        if (result == -1) {
-            if (errno != EEXIST && errno != ENOTEMPTY) {
-                PERROR("in trim_directory, rmdir");
-            }
-            
-            WARN("in trim_directory, directory still not empty, but how? path was %s\n", dir);
-            FREE(copy);
-            return;
-        } else {
-            DEBUG("removed empty map directory %s\n", dir);
-        }
+void key_link_path(const struct cache_file_key *key, char *buf, size_t size)
+{
+    snprintf(buf, size, "%s/inodes/%llu.%llu.%llu", cache_dir,
+            (unsigned long long) key->dev, (unsigned long long) key->ino,
+            (unsigned long long) key->generation);
+}
 
-        dir = dirname(dir);
+bool read_file_key(const char *filedir, struct cache_file_key *key)
+{
+    char keypath[PATH_MAX];
+    snprintf(keypath, PATH_MAX, "%s/key", filedir);
+    FILE *f = fopen(keypath, "r");
+    if (f == NULL) {
+        return false;
     }
-
-    FREE(copy);
+    unsigned long long dev, ino, generation;
+    bool ok = (fscanf(f, "%llu %llu %llu", &dev, &ino, &generation) == 3);
+    fclose(f);
+    if (ok) {
+        key->dev = dev;
+        key->ino = ino;
+        key->generation = generation;
+    }
+    return ok;
 }
 
 /*
- * free a bucket
- *
- * moves bucket from the tail of the used queue to the tail of the free queue,
- * deletes the data in the bucket
- * returns the size of the data deleted
+ * Record which backing file a file directory's data is from, and index it.
  */
-uint64_t free_bucket_real(const char *bucketpath, bool free_in_the_middle_is_bad)
+void write_file_key(const char *filedir, const struct cache_file_key *key)
 {
-    char *parent = fsll_getlink(bucketpath, "parent");
-    if (parent && fsll_file_exists(parent, NULL)) {
-        DEBUG("bucket parent: %s\n", parent);
-        if (unlink(parent) == -1) {
-            PERROR("unlink parent in free_bucket");
-        }
-
-        // if this was the last block, remove the directory
-        trim_directory(parent);
+    char keypath[PATH_MAX];
+    snprintf(keypath, PATH_MAX, "%s/key", filedir);
+    FILE *f = fopen(keypath, "w");
+    if (f == NULL) {
+        PERROR("opening key file failed");
+        return;
     }
-    FREE(parent);
-    fsll_makelink(bucketpath, "parent", NULL);
-
-    if (free_in_the_middle_is_bad) {
-        char *n = fsll_getlink(bucketpath, "next");
-        if (n != NULL) {
-            ERROR("bucket freed (#%lu) was not the queue tail\n",
-                    (unsigned long) bucket_path_to_number(bucketpath));
-            FREE(n);
-            return 0;
-        }
+    fprintf(f, "%llu %llu %llu\n", (unsigned long long) key->dev,
+            (unsigned long long) key->ino,
+            (unsigned long long) key->generation);
+    fclose(f);
+
+    char link[PATH_MAX];
+    key_link_path(key, link, PATH_MAX);
+    if (unlink(link) == -1 && errno != ENOENT) {
+        PERROR("unlink in write_file_key");
     }
-
-    fsll_disconnect(cache_dir, bucketpath, 
-            "buckets/head", "buckets/tail");
-
-    fsll_insert_as_tail(cache_dir, bucketpath,
-            "buckets/free_head", "buckets/free_tail");
-
-    char data[PATH_MAX];
-    snprintf(data, PATH_MAX, "%s/data", bucketpath);
-    
-    struct stat s;
-    if (stat(data, &s) == -1) {
-        PERROR("stat data in free_bucket");
+    if (symlink(filedir, link) == -1) {
+        PERROR("symlink in write_file_key");
+        ERROR("\tcaused by symlink(%s, %s)\n", filedir, link);
     }
+}
 
-    pthread_mutex_lock(&lock);
-    uint64_t result = 0;
-    if (unlink(data) == -1) {
-        PERROR("unlink data in free_bucket");
-    } else {
-        result = (uint64_t) s.st_size;
-        if (!is_unchecked(bucketpath)) {
-            cache_used_size -= result;
-        }
+/*
+ * The directory of the file with the given key, or NULL if nothing of it is
+ * cached. Free it when done.
+ */
+char * key_file_dir(const struct cache_file_key *key)
+{
+    char link[PATH_MAX];
+    key_link_path(key, link, PATH_MAX);
+    char *filedir = areadlink(link);
+    if (filedir != NULL && !fsll_file_exists(filedir, NULL)) {
+        FREE(filedir);
     }
-    pthread_mutex_unlock(&lock);
-    return result;
+    return filedir;
 }
 
-uint64_t free_bucket_mid_queue(const char *bucketpath)
+bool same_key(const struct cache_file_key *a, const struct cache_file_key *b)
 {
-    return free_bucket_real(bucketpath, false);
+    return a->dev == b->dev && a->ino == b->ino
+        && a->generation == b->generation;
 }
 
-uint64_t free_bucket(const char *bucketpath)
+/*
+ * Whether the file directory can still be found: the map links its name to
+ * it, or it's indexed by its key. If not, its blocks are orphans.
+ */
+bool file_dir_is_mapped(const char *filedir)
 {
-    return free_bucket_real(bucketpath, true);
+    char *name = read_file_name(filedir);
+    if (name == NULL) {
+        return false;
+    }
+    char mappath[PATH_MAX];
+    snprintf(mappath, PATH_MAX, "%s/map%s", cache_dir, name);
+    char *target = areadlink(mappath);
+    bool mapped = (target != NULL && strcmp(target, filedir) == 0);
+    FREE(target);
+    FREE(name);
+
+    struct cache_file_key key;
+    if (!mapped && read_file_key(filedir, &key)) {
+        target = key_file_dir(&key);
+        mapped = (target != NULL && strcmp(target, filedir) == 0);
+        FREE(target);
+    }
+    return mapped;
 }
 
 /*
- * do not use this function directly
+ * Link filename in the map to a file directory, making the map directories
+ * along the way, and replacing whatever link was there.
+ * Returns 0, or -1 and sets errno (ENOSPC if there's no room left).
  */
-int cache_invalidate_bucket(const char *filename, uint32_t block, 
-                                const char *bucket)
+int map_link(const char *filename, const char *filedir)
 {
-    DEBUG("invalidating block %lu of file %s\n",
-            (unsigned long) block, filename);
+    char mappath[PATH_MAX];
+    snprintf(mappath, PATH_MAX, "%s/map%s", cache_dir, filename);
 
-    uint64_t freed_size = free_bucket_mid_queue(bucket);
+    // start from "$cache_dir/map/"
+    for (size_t i = strlen(cache_dir) + 5; mappath[i] != '\0'; i++) {
+        if (mappath[i] != '/')
+            continue;
 
-    DEBUG("freed %llu bytes in bucket %s\n",
-            (unsigned long long) freed_size,
-            bucketname(bucket));
+        mappath[i] = '\0';
+        DEBUG("making %s\n", mappath);
+        int result = mkdir(mappath, 0700);
+        if (result == -1 && errno == ENOSPC) {
+            // out of inodes or directory blocks; free one and retry
+            DEBUG("mkdir says ENOSPC, freeing and trying again\n");
+            stats_inc(STATS_SPACE_RETRIES);
+            free_tail_bucket();
+            result = mkdir(mappath, 0700);
+        }
+        if (result == -1 && errno != EEXIST) {
+            if (errno == ENOSPC) {
+                DEBUG("still no space for map directory; not caching\n");
+            }
+            else {
+                PERROR("mkdir in map_link");
+                ERROR("\tcaused by mkdir(%s)\n", mappath);
+                errno = EIO;
+            }
+            return -1;
+        }
+        mappath[i] = '/';
+    }
 
+    forget_validator(filename);
+    if (unlink(mappath) == -1 && errno != ENOENT) {
+        PERROR("unlink in map_link");
+    }
+    if (symlink(filedir, mappath) == -1) {
+        PERROR("symlink in map_link");
+        ERROR("\tcaused by symlink(%s, %s)\n", filedir, mappath);
+        errno = EIO;
+        return -1;
+    }
     return 0;
 }
 
-int cache_invalidate_file_real(const char *filename, bool error_if_not_exist)
+/*
+ * With inode keys: link a name that isn't in the map to the data cached for
+ * the file it refers to, if there is any. Returns true if it was linked.
+ */
+bool bind_file_key(const char *filename, const struct cache_file_key *key)
 {
-    char mappath[PATH_MAX];
-    snprintf(mappath, PATH_MAX, "%s/map%s", cache_dir, filename);
-    DIR *d = opendir(mappath);
-    if (d == NULL) {
-        if (errno != ENOENT || error_if_not_exist) {
-            PERROR("opendir in cache_invalidate");
-        }
-        return -errno;
+    char *filedir = key_file_dir(key);
+    if (filedir == NULL) {
+        return false;
+    }
+    if (file_dir_is_detached(filedir)) {
+        // invalidated, and waiting to be freed
+        FREE(filedir);
+        return false;
     }
 
-    struct dirent *e = NULL;
-    while ((e = readdir(d)) != NULL) {
-        // probably not needed, because trim_directory would take care of the
-        // mtime file, but might as well do it now to save time.
-        if (strcmp(e->d_name, "mtime") == 0) {
-            char mtime[PATH_MAX];
-            snprintf(mtime, PATH_MAX, "%s/mtime", mappath);
-            DEBUG("removed mtime file %s\n", mtime);
-            unlink(mtime);
-            continue;
-        }
-    
-        if (e->d_name[0] < '0' || e->d_name[0] > '9') continue;
+    DEBUG("%s is cached as %s\n", filename, fsll_basename(filedir));
+    bool linked = (map_link(filename, filedir) == 0);
+    if (linked) {
+        write_file_name(filedir, filename);
+    }
+    FREE(filedir);
+    return linked;
+}
 
-        char *bucket = fsll_getlink(mappath, e->d_name);
-        uint32_t block;
-        sscanf(e->d_name, "%lu", (unsigned long *)&block);
-    
-        cache_invalidate_bucket(filename, block, bucket);
+/*
+ * With inode keys: if the name now refers to a different file than the one
+ * its cached data is from, link it to what's cached for that file instead (if
+ * anything). The old data stays cached under its key.
+ * Returns true if the name's link changed.
+ */
+bool rebind_file(const char *filename)
+{
+    struct cache_file_key key;
+    struct cache_file_key cached;
+    bool changed = false;
+
+    char *filedir = file_dir(filename);
+    if (filedir == NULL || file_is_dirty(filename)
+            || key_fn(filename, &key) != 0) {
+        // blocks not written back yet stay with the name they were written to
+        goto exit;
+    }
 
-        FREE(bucket);
+    if (!read_file_key(filedir, &cached)) {
+        // cached before inode keys were used; assume it's the same file
+        write_file_key(filedir, &key);
+        goto exit;
+    }
+    if (same_key(&key, &cached)) {
+        goto exit;
     }
 
-    closedir(d);
+    DEBUG("%s refers to a different file now\n", filename);
+    changed = true;
+    if (!bind_file_key(filename, &key)) {
+        char mappath[PATH_MAX];
+        snprintf(mappath, PATH_MAX, "%s/map%s", cache_dir, filename);
+        forget_validator(filename);
+        if (unlink(mappath) == -1) {
+            PERROR("unlink in rebind_file");
+        } else {
+            trim_directory(mappath);
+        }
+    }
 
-    return 0;
+exit:
+    FREE(filedir);
+    return changed;
 }
 
-int cache_invalidate_file_(const char *filename, bool error_if_not_exist)
+/*
+ * With inode keys: whether a name still refers to the file its cached data is
+ * from.
+ */
+bool file_key_unchanged(const char *filename)
 {
-    pthread_mutex_lock(&lock);
-    int retval = cache_invalidate_file_real(filename, error_if_not_exist);
-    pthread_mutex_unlock(&lock);   
-    return retval;
+    struct cache_file_key key;
+    struct cache_file_key cached;
+    char *filedir = file_dir(filename);
+    bool same = (filedir != NULL && read_file_key(filedir, &cached)
+            && key_fn(filename, &key) == 0 && same_key(&key, &cached));
+    FREE(filedir);
+    return same;
 }
 
-int cache_invalidate_file(const char *filename)
+/*
+ * With inode keys: look up the key of a file that isn't in the map yet.
+ * Called without the lock, since it goes to the backing store; the map check
+ * is only a hint. Returns true if key was filled in.
+ */
+bool unmapped_file_key(const char *filename, struct cache_file_key *key)
 {
-    return cache_invalidate_file_(filename, true);
+    if (key_fn == NULL) {
+        return false;
+    }
+
+    char mappath[PATH_MAX];
+    snprintf(mappath, PATH_MAX, "%s/map%s", cache_dir, filename);
+    struct stat st;
+    if (lstat(mappath, &st) == 0) {
+        return false;
+    }
+
+    return (key_fn(filename, key) == 0);
 }
 
-int cache_try_invalidate_file(const char *filename)
+/*
+ * IDs are never re-used, so a stale map link can't point at some other file's
+ * data.
+ */
+uint64_t new_file_id(void)
 {
-    return cache_invalidate_file_(filename, false);
+    uint64_t id = next_file_id++;
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/files/next_file_id", cache_dir);
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        PERROR("open next_file_id");
+    } else {
+        fprintf(f, "%llu\n", (unsigned long long) next_file_id);
+        fclose(f);
+    }
+    return id;
 }
 
-int cache_invalidate_block_(const char *filename, uint32_t block,
-    bool warn_if_not_exist)
+/*
+ * Point every block's bucket at the block's link in its file directory.
+ */
+void fix_parent_links(const char *filedir)
 {
-    char mappath[PATH_MAX];
-    snprintf(mappath, PATH_MAX, "map%s/%lu",
-            filename, (unsigned long) block);
-
-    pthread_mutex_lock(&lock);
-    
-    char *bucket = fsll_getlink(cache_dir, mappath);
-    if (bucket == NULL) {
-        if (warn_if_not_exist) {
-            WARN("Cache invalidation: block %lu of file %s doesn't exist.\n",
-                    (unsigned long) block, filename);
-        }
-        pthread_mutex_unlock(&lock);
-        return -ENOENT;
+    DIR *d = opendir(filedir);
+    if (d == NULL) {
+        PERROR("opendir in fix_parent_links");
+        return;
     }
 
-    cache_invalidate_bucket(filename, block, bucket);
-
-    FREE(bucket);
+    struct dirent *e = NULL;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] < '0' || e->d_name[0] > '9') continue;
 
-    pthread_mutex_unlock(&lock);
+        char blocklink[PATH_MAX];
+        snprintf(blocklink, PATH_MAX, "%s/%s", filedir, e->d_name);
+        char *bucketpath = areadlink(blocklink);
+        if (bucketpath == NULL) continue;
 
-    return 0;
+        char *parent = fsll_getlink(bucketpath, "parent");
+        if (parent == NULL || strcmp(parent, blocklink) != 0) {
+            fsll_makelink(bucketpath, "parent", blocklink);
+        }
+        FREE(parent);
+        FREE(bucketpath);
+    }
+    closedir(d);
 }
 
-int cache_invalidate_block(const char *filename, uint32_t block)
+/*
+ * Whether a map directory from a format 1 cache is a file's (holds its mtime
+ * or its blocks), rather than one mirroring a directory.
+ */
+bool is_old_file_map(const char *mapdir)
 {
-    return cache_invalidate_block_(filename, block, true);
-}
+    DIR *d = opendir(mapdir);
+    if (d == NULL) {
+        return false;
+    }
 
-int cache_try_invalidate_block(const char *filename, uint32_t block)
-{
-    return cache_invalidate_block_(filename, block, false);
+    bool found = false;
+    struct dirent *e = NULL;
+    while (!found && (e = readdir(d)) != NULL) {
+        bool numeric = (e->d_name[0] >= '0' && e->d_name[0] <= '9');
+        if (!numeric && strcmp(e->d_name, "mtime") != 0) continue;
+
+        char path[PATH_MAX];
+        snprintf(path, PATH_MAX, "%s/%s", mapdir, e->d_name);
+        struct stat s;
+        if (lstat(path, &s) == 0) {
+            found = numeric ? S_ISLNK(s.st_mode) : S_ISREG(s.st_mode);
+        }
+    }
+    closedir(d);
+    return found;
 }
 
-int cache_try_invalidate_blocks_above(const char *filename, uint32_t block)
+/*
+ * Move each file's map directory under map/<relpath> to files/, leaving a
+ * link in its place.
+ */
+void migrate_map_dir(const char *relpath)
 {
-    DEBUG("trying to invalidate blocks >= %ld in %s\n", block, filename);
-    int ret = 0;
-    DIR *mapdir = NULL;
-    bool locked = false;
-
-    char mappath[PATH_MAX];
-    snprintf(mappath, PATH_MAX, "%s/map%s", cache_dir, filename);
-
-    pthread_mutex_lock(&lock);
-    locked = true;
-
-    mapdir = opendir(mappath);
-    if (mapdir == NULL) {
-        ret = -errno;
-        goto exit;
+    char mapdir[PATH_MAX];
+    snprintf(mapdir, PATH_MAX, "%s/map%s", cache_dir, relpath);
+    DIR *d = opendir(mapdir);
+    if (d == NULL) {
+        PERROR("opendir in migrate_map_dir");
+        return;
     }
 
     struct dirent *e = NULL;
-    while ((e = readdir(mapdir)) != NULL) {
-        if ((e->d_name[0] < '0') || (e->d_name[0] > '9')) continue;
+    while ((e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
 
-        uint32_t block_found;
-        sscanf(e->d_name, "%lu", &block_found);
+        char rel[PATH_MAX];
+        char path[PATH_MAX];
+        snprintf(rel, PATH_MAX, "%s/%s", relpath, e->d_name);
+        snprintf(path, PATH_MAX, "%s/%s", mapdir, e->d_name);
 
-        if (block_found >= block) {
-            char *bucket = fsll_getlink(mappath, e->d_name);
-            cache_invalidate_bucket(filename, block_found, bucket);
-            FREE(bucket);
+        struct stat s;
+        if (lstat(path, &s) == -1 || !S_ISDIR(s.st_mode)) continue;
+
+        if (!is_old_file_map(path)) {
+            migrate_map_dir(rel);
+            continue;
         }
-    }
 
-exit:
-    closedir(mapdir);
-    if (locked)
-        pthread_mutex_unlock(&lock);
-    return ret;
+        char filedir[PATH_MAX];
+        snprintf(filedir, PATH_MAX, "%s/files/%llu", cache_dir,
+                (unsigned long long) new_file_id());
+        if (rename(path, filedir) == -1) {
+            PERROR("rename in migrate_map_dir");
+            ERROR("\tcaused by rename(%s, %s)\n", path, filedir);
+            continue;
+        }
+        if (symlink(filedir, path) == -1) {
+            PERROR("symlink in migrate_map_dir");
+            ERROR("\tcaused by symlink(%s, %s)\n", filedir, path);
+            continue;
+        }
+        write_file_name(filedir, rel);
+    }
+    closedir(d);
 }
 
-int cache_free_orphan_buckets(void)
+/*
+ * Set up files/, converting a format 1 cache if need be. The conversion can be
+ * interrupted and started over; the format is only recorded once it's done.
+ */
+void init_files(void)
 {
-    char bucketdir[PATH_MAX];
-    snprintf(bucketdir, PATH_MAX, "%s/buckets", cache_dir);
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/inodes", cache_dir);
+    if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+        PERROR("unable to create inodes directory");
+        abort();
+    }
 
-    pthread_mutex_lock(&lock);
+    snprintf(path, PATH_MAX, "%s/files", cache_dir);
+    if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+        PERROR("unable to create files directory");
+        abort();
+    }
 
-    DIR *d = opendir(bucketdir);
+    // files/<id> might exist without next_file_id having been written
+    DIR *d = opendir(path);
     if (d == NULL) {
-        PERROR("opendir in cache_free_orphan_buckets");
-        pthread_mutex_unlock(&lock);
-        return -1*errno;
+        PERROR("opendir in init_files");
+        abort();
     }
-
     struct dirent *e = NULL;
     while ((e = readdir(d)) != NULL) {
         if (e->d_name[0] < '0' || e->d_name[0] > '9') continue;
+        uint64_t id = strtoull(e->d_name, NULL, 10);
+        if (id >= next_file_id) {
+            next_file_id = id + 1;
+        }
+    }
 
-        char bucketpath[PATH_MAX];
-        snprintf(bucketpath, PATH_MAX, "%s/buckets/%s", cache_dir, e->d_name);
+    snprintf(path, PATH_MAX, "%s/files/next_file_id", cache_dir);
+    FILE *f = fopen(path, "r");
+    if (f != NULL) {
+        unsigned long long id;
+        if (fscanf(f, "%llu", &id) == 1 && id > next_file_id) {
+            next_file_id = id;
+        }
+        fclose(f);
+    }
 
-        char *parent = fsll_getlink(bucketpath, "parent");
+    unsigned int format = 1;
+    snprintf(path, PATH_MAX, "%s/files/format", cache_dir);
+    f = fopen(path, "r");
+    if (f != NULL) {
+        if (fscanf(f, "%u", &format) != 1) {
+            format = 1;
+        }
+        fclose(f);
+    }
 
-        if (fsll_file_exists(bucketpath, "data") &&
-                (parent == NULL || !fsll_file_exists(parent, NULL))) {
-            DEBUG("bucket %s is an orphan\n", e->d_name);
-            if (parent) {
-                DEBUG("\tparent was %s\n", parent);
-            }
-            free_bucket_mid_queue(bucketpath);
+    if (format < CACHE_FORMAT) {
+        INFO("converting the cache map to per-file directories\n");
+        migrate_map_dir("");
+
+        // the buckets' parent links, including any left over from an
+        // interrupted conversion
+        rewinddir(d);
+        while ((e = readdir(d)) != NULL) {
+            if (e->d_name[0] < '0' || e->d_name[0] > '9') continue;
+            char filedir[PATH_MAX];
+            snprintf(filedir, PATH_MAX, "%s/files/%s", cache_dir, e->d_name);
+            fix_parent_links(filedir);
         }
 
-        FREE(parent);
+        f = fopen(path, "w");
+        if (f == NULL) {
+            PERROR("unable to write cache format marker");
+            abort();
+        }
+        fprintf(f, "%u\n", CACHE_FORMAT);
+        fclose(f);
+        INFO("done converting the cache map\n");
     }
-
     closedir(d);
-    pthread_mutex_unlock(&lock);
-
-    return 0;
 }
 
 /*
- * Read a block from the cache.
- * Important: you can specify less than one block, but not more.
- * Nor can a read be across block boundaries.
- *
- * mtime is the file modification time. If what's in the cache doesn't match
- * this, the cache data is invalidated and this function returns -1 and sets
- * ENOENT.
+ * Dirty buckets hold data written through the cache that hasn't reached the
+ * backing store yet. Each one has a marker file, <cache_dir>/dirty/<gen>,
+ * holding "<bucket> <block> <file id> <path>", so it survives a crash; the
+ * list above mirrors those. Before a write into a dirty bucket is
+ * acknowledged, its data, the bucket directory (the data file and the parent
+ * link saying which block of which file directory it is) and the marker are
+ * synced; the file directory and the map link can be lost, and
+ * recover_dirty() puts them back from the marker.
  *
- * Returns 0 on success.
- * On error returns -1 and sets errno.
- * In particular, if the block is not in the cache, sets ENOENT
+ * All of these are called with the lock held, except persist_dirty().
  */
-int cache_fetch(const char *filename, uint32_t block, uint64_t offset, 
-        char *buf, uint64_t len, uint64_t *bytes_read, time_t mtime)
+
+/*
+ * Grow an array of flags by bucket number to take number, with the new ones
+ * false. Returns false if there's no memory for it.
+ */
+bool grow_number_flags(bool **flags, uint32_t *size, uint32_t number)
 {
-    if (offset + len > bucket_max_size || filename == NULL) {
-        errno = EINVAL;
-        return -1;
+    if (number < *size)
+        return true;
+    uint32_t new_size = *size > 0 ? *size : 1024;
+    while (new_size <= number) {
+        new_size *= 2;
     }
-
-    if (len == 0) {
-        *bytes_read = 0;
-        return 0;
+    bool *grown = (bool*)realloc(*flags, new_size * sizeof(bool));
+    if (grown == NULL) {
+        PERROR("realloc bucket flags");
+        return false;
     }
+    memset(grown + *size, 0, (new_size - *size) * sizeof(bool));
+    *flags = grown;
+    *size = new_size;
+    return true;
+}
 
-    DEBUG("getting block %lu of file %s\n", (unsigned long) block, filename);
-
-    //###
-    pthread_mutex_lock(&lock);
-
-    char mapfile[PATH_MAX];
-    snprintf(mapfile, PATH_MAX, "%s/map%s/%lu",
-            cache_dir, filename, (unsigned long) block);
-    char bucketpath[PATH_MAX];
-    ssize_t bplen;
-    if ((bplen = readlink(mapfile, bucketpath, PATH_MAX-1)) == -1) {
-        if (errno == ENOENT || errno == ENOTDIR) {
-            DEBUG("block not in cache\n");
-            errno = ENOENT;
-            pthread_mutex_unlock(&lock);
-            return -1;
-        } else {
-            PERROR("readlink error");
-            errno = EIO;
-            pthread_mutex_unlock(&lock);
-            return -1;
+/*
+ * Keep track of which buckets have a dirty entry that isn't superseded, so
+ * finding out whether a bucket is dirty doesn't take a walk of the list.
+ */
+void set_dirty_number(uint32_t number, bool dirty)
+{
+    if (number >= dirty_numbers_size) {
+        if (!dirty || dirty_numbers_lost)
+            return;
+        if (!grow_number_flags(&dirty_numbers, &dirty_numbers_size, number)) {
+            // stop keeping track; find_dirty() goes by the list instead
+            FREE(dirty_numbers);
+            dirty_numbers_size = 0;
+            dirty_numbers_lost = true;
+            return;
         }
     }
-    bucketpath[bplen] = '\0';
-
-    bucket_to_head(bucketpath);
-    
-    uint64_t bucket_mtime;
-    char mtimepath[PATH_MAX];
-    snprintf(mtimepath, PATH_MAX, "%s/map%s/mtime", cache_dir, filename);
-    FILE *f = fopen(mtimepath, "r");
-    if (f == NULL) {
-        PERROR("open mtime file failed");
-        bucket_mtime = 0; // will cause invalidation
-    } else {
-        if (fscanf(f, "%llu", (unsigned long long *) &bucket_mtime) != 1) {
-            ERROR("error reading mtime file");
-
-            // debug
-            char buf[4096];
-            fseek(f, 0, SEEK_SET);
-            size_t b = fread(buf, 1, 4096, f);
-            buf[b] = '\0';
-            ERROR("mtime file contains: %u bytes: %s", (unsigned int) b, buf);
+    dirty_numbers[number] = dirty;
+}
 
-            fclose(f);
-            f = NULL;
-            unlink(mtimepath);
+/*
+ * Mark an entry as no longer the bucket's dirty data, leaving it for whoever
+ * is flushing or syncing it to drop.
+ */
+void supersede_dirty(struct dirty_bucket *dirty)
+{
+    if (!dirty->superseded) {
+        dirty->superseded = true;
+        set_dirty_number(dirty->number, false);
+        dirty_count--;
+    }
+}
 
-            bucket_mtime = 0; // will cause invalidation
+struct dirty_bucket * find_dirty(uint32_t number)
+{
+    if (!dirty_numbers_lost
+            && (number >= dirty_numbers_size || !dirty_numbers[number]))
+        return NULL;
+    for (struct dirty_bucket *d = dirty_list; d != NULL; d = d->next) {
+        if (d->number == number && !d->superseded) {
+            return d;
         }
     }
-    if (f) fclose(f);
-    
-    if (bucket_mtime != (uint64_t)mtime) {
-        // mtime mismatch; invalidate and return
-        if (bucket_mtime < (uint64_t)mtime) {
-            DEBUG("cache data is %llu seconds older than the backing data\n",
-                 (unsigned long long) mtime - bucket_mtime);
+    return NULL;
+}
+
+bool file_is_dirty(const char *filename)
+{
+    for (struct dirty_bucket *d = dirty_list; d != NULL; d = d->next) {
+        if (!d->superseded && strcmp(d->path, filename) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Drop a dirty entry and its marker: it's been written back, or its data is
+ * gone. If a flusher is in the middle of writing it, it's only marked, and the
+ * flusher drops it when done.
+ */
+void forget_dirty(struct dirty_bucket *dirty)
+{
+    if (dirty->flushing || dirty->syncing) {
+        supersede_dirty(dirty);
+        return;
+    }
+    if (!dirty->superseded) {
+        set_dirty_number(dirty->number, false);
+        dirty_count--;
+    }
+
+    char marker[32];
+    snprintf(marker, sizeof(marker), "%llu",
+            (unsigned long long) dirty->generation);
+    if (unlinkat(dirty_dir_fd, marker, 0) == -1 && errno != ENOENT) {
+        PERROR("unlink dirty marker");
+    }
+
+    struct dirty_bucket **pp = &dirty_list;
+    while (*pp != dirty) {
+        pp = &(*pp)->next;
+    }
+    *pp = dirty->next;
+
+    dirty_bytes -= dirty->len;
+    FREE(dirty->path);
+    FREE(dirty);
+
+    pthread_cond_broadcast(&dirty_cond);
+}
+
+void append_dirty(struct dirty_bucket *dirty)
+{
+    struct dirty_bucket **pp = &dirty_list;
+    while (*pp != NULL && (*pp)->generation < dirty->generation) {
+        pp = &(*pp)->next;
+    }
+    dirty->next = *pp;
+    *pp = dirty;
+    dirty_bytes += dirty->len;
+    if (!dirty->superseded) {
+        set_dirty_number(dirty->number, true);
+        dirty_count++;
+    }
+}
+
+/*
+ * The id of the file directory a bucket's parent link points into.
+ */
+bool bucket_file_id(const char *bucketpath, uint64_t *id)
+{
+    char *parent = fsll_getlink(bucketpath, "parent");
+    if (parent == NULL) {
+        return false;
+    }
+    size_t len = strlen(cache_dir);
+    unsigned long long value;
+    bool ok = (strncmp(parent, cache_dir, len) == 0
+            && sscanf(parent + len, "/files/%llu/", &value) == 1);
+    FREE(parent);
+    if (ok) {
+        *id = value;
+    }
+    return ok;
+}
+
+/*
+ * fsync() a directory, so the entries in it survive a crash.
+ */
+int sync_dir(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        return -1;
+    }
+    int result = fsync(fd);
+    int err = errno;
+    close(fd);
+    errno = err;
+    return result;
+}
+
+/*
+ * Record that a bucket's data needs to be written back. The entry starts out
+ * syncing, which keeps it from being written back or dropped; the caller
+ * makes it durable with sync_dirty() before acknowledging the write.
+ * Returns NULL and sets errno if the bucket isn't linked to a file directory.
+ */
+struct dirty_bucket * mark_dirty(uint32_t number, const char *filename,
+        uint32_t block, uint64_t len)
+{
+    char bucketpath[PATH_MAX];
+    snprintf(bucketpath, PATH_MAX, "%s/buckets/%lu",
+            cache_dir, (unsigned long) number);
+    uint64_t file_id;
+    if (!bucket_file_id(bucketpath, &file_id)) {
+        ERROR("bucket %lu has no file directory\n", (unsigned long) number);
+        errno = EIO;
+        return NULL;
+    }
+
+    struct dirty_bucket *dirty = (struct dirty_bucket*)calloc(1, sizeof(*dirty));
+    dirty->generation = dirty_generation++;
+    dirty->number = number;
+    dirty->block = block;
+    dirty->file_id = file_id;
+    dirty->len = len;
+    dirty->path = strdup(filename);
+    dirty->since = time(NULL);
+    dirty->syncing = true;
+    append_dirty(dirty);
+    return dirty;
+}
+
+/*
+ * What a dirty bucket's marker file holds. Free it when done.
+ */
+char * dirty_marker_contents(const struct dirty_bucket *dirty)
+{
+    char *contents = NULL;
+    asprintf(&contents, "%lu %lu %llu %s", (unsigned long) dirty->number,
+            (unsigned long) dirty->block,
+            (unsigned long long) dirty->file_id, dirty->path);
+    return contents;
+}
+
+/*
+ * Write a dirty bucket's marker file and sync it; with create, it's new, and
+ * the dirty directory is synced too.
+ * Returns 0, or -1 and sets errno.
+ */
+int write_dirty_marker(uint64_t generation, const char *contents, bool create)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%llu", (unsigned long long) generation);
+    int fd = openat(dirty_dir_fd, name,
+            O_WRONLY | O_TRUNC | (create ? O_CREAT : 0), 0600);
+    if (fd == -1) {
+        return -1;
+    }
+    if (dprintf(fd, "%s", contents) < 0 || fsync(fd) == -1
+            || (create && fsync(dirty_dir_fd) == -1)) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+ * Put a dirty bucket's data on disk, and with a marker to write, the bucket
+ * directory (and its entry in buckets/, since it may be new) and the marker
+ * too. Called without the lock.
+ * Returns 0, or -1 and sets errno.
+ */
+int persist_dirty(uint32_t number, uint64_t generation, const char *marker,
+        int fd)
+{
+    if (fdatasync(fd) == -1) {
+        return -1;
+    }
+    if (marker == NULL) {
+        return 0;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/buckets/%lu", cache_dir, (unsigned long) number);
+    if (sync_dir(path) == -1) {
+        return -1;
+    }
+    snprintf(path, PATH_MAX, "%s/buckets", cache_dir);
+    if (sync_dir(path) == -1) {
+        return -1;
+    }
+    return write_dirty_marker(generation, marker, true);
+}
+
+/*
+ * Make a dirty bucket durable before the write into it is acknowledged:
+ * its data, and if it was just marked, everything recover_dirty() needs to
+ * find it again (see persist_dirty()). The lock is dropped meanwhile, so
+ * readers don't wait on the disk; the entry stays put because it's syncing.
+ * Sets gone if the bucket was freed or written over in the meantime, in which
+ * case the caller mustn't touch it any more.
+ * Returns 0, or -1 and sets errno; a new mark is dropped if it failed.
+ */
+int sync_dirty(struct dirty_bucket *dirty, int fd, bool marker, bool *gone)
+{
+    char *contents = marker ? dirty_marker_contents(dirty) : NULL;
+    dirty->syncing = true;
+    pthread_mutex_unlock(&lock);
+    int result = persist_dirty(dirty->number, dirty->generation, contents, fd);
+    int err = errno;
+    pthread_mutex_lock(&lock);
+    dirty->syncing = false;
+
+    *gone = dirty->superseded;
+    if (result == 0 && !*gone && marker) {
+        // rename_dirty() leaves the marker of a syncing entry alone
+        char *now = dirty_marker_contents(dirty);
+        if (strcmp(now, contents) != 0) {
+            result = write_dirty_marker(dirty->generation, now, false);
+            err = errno;
+        }
+        FREE(now);
+    }
+    FREE(contents);
+
+    if (result == -1) {
+        errno = err;
+        PERROR("unable to persist dirty block");
+    }
+    if (*gone || (result == -1 && marker)) {
+        forget_dirty(dirty);
+    } else {
+        pthread_cond_signal(&flush_cond);
+    }
+    // cache_flush_dirty() waits for syncing entries too
+    pthread_cond_broadcast(&dirty_cond);
+
+    if (result == -1) {
+        errno = err;
+    }
+    return result;
+}
+
+/*
+ * Put back what a crash may have lost of a dirty bucket's place in the cache:
+ * its file directory and name, the block link to it, and the map link. If
+ * the block link pointed at an older dirty bucket, that one's superseded.
+ */
+void restore_dirty_links(const char *bucketpath, uint64_t file_id,
+        uint32_t block, const char *filename)
+{
+    char filedir[PATH_MAX];
+    snprintf(filedir, PATH_MAX, "%s/files/%llu", cache_dir,
+            (unsigned long long) file_id);
+    if (mkdir(filedir, 0700) == 0) {
+        WARN("recovering lost file directory %s\n", filedir);
+    } else if (errno != EEXIST) {
+        PERROR("mkdir in restore_dirty_links");
+    }
+    if (file_id >= next_file_id) {
+        next_file_id = file_id;
+        new_file_id();
+    }
+
+    // a rename the marker saw may not have reached the name file
+    char *name = read_file_name(filedir);
+    if (name == NULL || strcmp(name, filename) != 0) {
+        if (name != NULL) {
+            char *mapped = file_dir(name);
+            if (mapped != NULL && strcmp(mapped, filedir) == 0) {
+                char mappath[PATH_MAX];
+                snprintf(mappath, PATH_MAX, "%s/map%s", cache_dir, name);
+                unlink(mappath);
+            }
+            FREE(mapped);
+        }
+        write_file_name(filedir, filename);
+    }
+    FREE(name);
+
+    char blockname[32];
+    snprintf(blockname, sizeof(blockname), "%lu", (unsigned long) block);
+    char *linked = fsll_getlink(filedir, blockname);
+    if (linked == NULL || strcmp(linked, bucketpath) != 0) {
+        if (linked != NULL) {
+            struct dirty_bucket *older = find_dirty(bucket_path_to_number(linked));
+            if (older != NULL) {
+                forget_dirty(older);
+            }
+        }
+        DEBUG("recovering block link %s/%s\n", filedir, blockname);
+        fsll_makelink(filedir, blockname, bucketpath);
+    }
+    FREE(linked);
+
+    char *mapped = file_dir(filename);
+    if (mapped == NULL || strcmp(mapped, filedir) != 0) {
+        DEBUG("recovering map link for %s\n", filename);
+        if (map_link(filename, filedir) == -1) {
+            PERROR("map_link in restore_dirty_links");
+        }
+    }
+    FREE(mapped);
+}
+
+/*
+ * Rewrite the checksum of a recovered bucket: it's written before the data
+ * but never synced, so after a crash it may not match what was.
+ */
+void rewrite_dirty_checksum(const char *bucketpath, char *buf)
+{
+    char datapath[PATH_MAX];
+    snprintf(datapath, PATH_MAX, "%s/data", bucketpath);
+    int fd = open(datapath, O_RDONLY);
+    if (fd == -1) {
+        PERROR("open in rewrite_dirty_checksum");
+        return;
+    }
+    ssize_t n = pread(fd, buf, bucket_max_size, 0);
+    close(fd);
+    if (n < 0) {
+        PERROR("read in rewrite_dirty_checksum");
+        return;
+    }
+    write_bucket_checksum(bucketpath, crc32c(0, buf, n));
+}
+
+static int compare_generations(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Read the dirty markers left from the last run, oldest first, and put back
+ * the links a crash lost (see restore_dirty_links()). A marker whose bucket no
+ * longer belongs to the block it names is stale (the bucket was freed before
+ * the marker could be removed) and is deleted.
+ * Markers from before they held the file id are only kept if nothing was
+ * lost.
+ * Returns the number of dirty buckets found.
+ */
+unsigned int recover_dirty(void)
+{
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/dirty", cache_dir);
+    if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+        PERROR("unable to create dirty directory");
+        abort();
+    }
+    dirty_dir_fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (dirty_dir_fd == -1) {
+        PERROR("unable to open dirty directory");
+        abort();
+    }
+
+    DIR *d = opendir(path);
+    if (d == NULL) {
+        PERROR("opendir in recover_dirty");
+        abort();
+    }
+
+    uint64_t *generations = NULL;
+    size_t num_markers = 0, size = 0;
+    struct dirent *e = NULL;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] < '0' || e->d_name[0] > '9') continue;
+
+        if (num_markers == size) {
+            size = (size == 0) ? 64 : size * 2;
+            generations = (uint64_t*)realloc(generations,
+                    size * sizeof(*generations));
+            if (generations == NULL) {
+                ERROR("out of memory in recover_dirty\n");
+                abort();
+            }
+        }
+        uint64_t generation = strtoull(e->d_name, NULL, 10);
+        generations[num_markers++] = generation;
+        if (generation >= dirty_generation) {
+            dirty_generation = generation + 1;
+        }
+    }
+    closedir(d);
+    qsort(generations, num_markers, sizeof(*generations), &compare_generations);
+
+    char *buf = (num_markers > 0) ? (char*)malloc(bucket_max_size) : NULL;
+    unsigned int count = 0;
+    for (size_t i = 0; i < num_markers; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "%llu", (unsigned long long) generations[i]);
+
+        char contents[PATH_MAX + 64];
+        ssize_t n = -1;
+        int fd = openat(dirty_dir_fd, name, O_RDONLY);
+        if (fd != -1) {
+            n = read(fd, contents, sizeof(contents) - 1);
+            close(fd);
+        }
+
+        unsigned long number, block;
+        unsigned long long file_id = 0;
+        int pos = 0;
+        bool valid = false, relink = false;
+        char bucketpath[PATH_MAX];
+        char expected[PATH_MAX];
+        struct stat s;
+        if (n > 0) {
+            contents[n] = '\0';
+            if (sscanf(contents, "%lu %lu %llu %n", &number, &block, &file_id,
+                        &pos) == 3 && pos > 0 && contents[pos] == '/') {
+                relink = true;
+                snprintf(expected, PATH_MAX, "%s/files/%llu/%lu", cache_dir,
+                        file_id, block);
+            } else if (sscanf(contents, "%lu %lu %n", &number, &block, &pos) == 2
+                    && pos > 0 && contents[pos] == '/') {
+                char *filedir = file_dir(contents + pos);
+                snprintf(expected, PATH_MAX, "%s/%lu",
+                        filedir ? filedir : "", block);
+                FREE(filedir);
+            } else {
+                pos = 0;
+            }
+        }
+        if (pos > 0) {
+            snprintf(bucketpath, PATH_MAX, "%s/buckets/%lu", cache_dir, number);
+            char *parent = fsll_getlink(bucketpath, "parent");
+            char *mapped = relink ? NULL : areadlink(expected);
+            snprintf(path, PATH_MAX, "%s/data", bucketpath);
+            valid = (parent != NULL && strcmp(parent, expected) == 0
+                    && (relink
+                        || (mapped != NULL && strcmp(mapped, bucketpath) == 0))
+                    && stat(path, &s) == 0);
+            FREE(parent);
+            FREE(mapped);
+        }
+
+        if (valid && relink) {
+            restore_dirty_links(bucketpath, file_id, block, contents + pos);
+        } else if (valid) {
+            uint64_t id;
+            valid = bucket_file_id(bucketpath, &id);
+            file_id = id;
+        }
+
+        if (!valid) {
+            WARN("removing stale dirty marker %s\n", name);
+            unlinkat(dirty_dir_fd, name, 0);
+            continue;
+        }
+
+        // an older marker for the bucket whose removal didn't reach the disk
+        struct dirty_bucket *older = find_dirty(number);
+        if (older != NULL) {
+            forget_dirty(older);
+        }
+        rewrite_dirty_checksum(bucketpath, buf);
+
+        struct dirty_bucket *dirty = (struct dirty_bucket*)calloc(1, sizeof(*dirty));
+        dirty->generation = generations[i];
+        dirty->number = number;
+        dirty->block = block;
+        dirty->file_id = file_id;
+        dirty->len = s.st_size;
+        dirty->path = strdup(contents + pos);
+        dirty->since = 0;
+        append_dirty(dirty);
+        count++;
+    }
+    FREE(buf);
+    FREE(generations);
+
+    // restore_dirty_links() may have dropped some superseded ones
+    count = 0;
+    for (struct dirty_bucket *dirty = dirty_list; dirty != NULL;
+            dirty = dirty->next) {
+        count++;
+    }
+    if (count > 0) {
+        INFO("%u buckets (%llu bytes) still need to be written back\n",
+                count, (unsigned long long) dirty_bytes);
+    }
+    return count;
+}
+
+/*
+ * The startup consistency check.
+ *
+ * A crash can leave the cache half way through changing a bucket: a file
+ * directory's block link pointing at a bucket that's been given to another
+ * block, a bucket whose file directory is gone, or queue links that don't
+ * agree with each other. The check goes over every file directory and then
+ * every bucket with several threads, reading their links into memory, then
+ * works out which buckets belong on the used queue, walks both queues in
+ * memory, and rewrites whatever links are wrong, again with several threads.
+ * A clean shutdown leaves a marker that skips all of this.
+ *
+ * All of these run from cache_init(), before any other threads start.
+ */
+
+#define CHECK_NONE UINT32_MAX           // no link
+#define CHECK_BAD (UINT32_MAX - 1)      // a link to something that isn't a bucket
+
+struct check_bucket {
+    uint32_t next, prev;        // bucket numbers, or CHECK_NONE or CHECK_BAD
+    uint32_t new_next, new_prev;
+    time_t mtime;               // of its data
+    bool exists;
+    bool has_data;
+    bool linked;                // its parent link points back at it
+    bool keep;                  // belongs on the used queue
+    bool queued;                // reached walking the queues
+};
+
+static struct check_bucket *check_buckets = NULL;
+static uint32_t check_bucket_count = 0;     // size of check_buckets
+static uint32_t *check_numbers = NULL;      // of the buckets that exist
+static char **check_files = NULL;           // names of the file directories
+static _Atomic uint64_t check_links_removed = 0;
+static _Atomic uint64_t check_buckets_freed = 0;
+
+struct check_pass {
+    void (*fn)(uint32_t i);
+    uint32_t count;
+    _Atomic uint32_t next;
+};
+
+static void * check_worker(void *arg)
+{
+    struct check_pass *pass = (struct check_pass*)arg;
+    for (;;) {
+        uint32_t i = atomic_fetch_add_explicit(&pass->next, 1, memory_order_relaxed);
+        if (i >= pass->count) {
+            break;
+        }
+        pass->fn(i);
+    }
+    return NULL;
+}
+
+/*
+ * Call fn(0) to fn(count - 1), spread over check_threads threads.
+ */
+static void check_parallel(void (*fn)(uint32_t i), uint32_t count)
+{
+    struct check_pass pass = { .fn = fn, .count = count };
+    atomic_init(&pass.next, 0);
+
+    pthread_t *threads = (pthread_t*)calloc(check_threads, sizeof(*threads));
+    unsigned int started = 0;
+    for (unsigned int i = 1; threads != NULL && i < check_threads; i++) {
+        if (pthread_create(&threads[started], NULL, &check_worker, &pass) != 0) {
+            PERROR("check: error creating thread");
+            break;
+        }
+        started++;
+    }
+
+    check_worker(&pass);
+    for (unsigned int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    FREE(threads);
+}
+
+/*
+ * The number of the bucket a queue link points at.
+ */
+static uint32_t check_link_number(const char *bucketpath, const char *file)
+{
+    char *link = fsll_getlink(bucketpath, file);
+    if (link == NULL) {
+        return CHECK_NONE;
+    }
+
+    uint32_t number = CHECK_BAD;
+    char prefix[PATH_MAX];
+    int len = snprintf(prefix, PATH_MAX, "%s/buckets/", cache_dir);
+    if (strncmp(link, prefix, len) == 0 && link[len] >= '0' && link[len] <= '9') {
+        char *end;
+        unsigned long n = strtoul(link + len, &end, 10);
+        if (*end == '\0' && n < check_bucket_count && check_buckets[n].exists) {
+            number = (uint32_t) n;
+        }
+    }
+    FREE(link);
+    return number;
+}
+
+/*
+ * Remove a file directory's block links that don't point at a bucket with
+ * data that points back, or all of them if the directory isn't in the map;
+ * then the directory itself if that leaves it empty.
+ */
+static void check_file_dir(uint32_t i)
+{
+    char filedir[PATH_MAX];
+    snprintf(filedir, PATH_MAX, "%s/files/%s", cache_dir, check_files[i]);
+    bool mapped = file_dir_is_mapped(filedir);
+
+    DIR *d = opendir(filedir);
+    if (d == NULL) {
+        PERROR("check: opendir");
+        return;
+    }
+    struct dirent *e = NULL;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] < '0' || e->d_name[0] > '9') continue;
+
+        char link[PATH_MAX];
+        snprintf(link, PATH_MAX, "%s/%s", filedir, e->d_name);
+        char *bucketpath = areadlink(link);
+        char *parent = (bucketpath == NULL) ? NULL
+            : fsll_getlink(bucketpath, "parent");
+
+        // dirty buckets were checked by recover_dirty()
+        bool keep = (bucketpath != NULL
+                && find_dirty(bucket_path_to_number(bucketpath)) != NULL);
+        if (!keep && mapped && parent != NULL && strcmp(parent, link) == 0) {
+            keep = fsll_file_exists(bucketpath, "data");
+        }
+
+        if (!keep) {
+            DEBUG("check: removing block link %s\n", link);
+            if (unlink(link) == -1) {
+                PERROR("check: unlink block link");
+            } else {
+                atomic_fetch_add_explicit(&check_links_removed, 1,
+                        memory_order_relaxed);
+            }
+        }
+        FREE(parent);
+        FREE(bucketpath);
+    }
+    closedir(d);
+
+    if (!mapped) {
+        free_file_dir(filedir);
+    }
+}
+
+/*
+ * Read a bucket's links into check_buckets.
+ */
+static void check_read_bucket(uint32_t i)
+{
+    uint32_t number = check_numbers[i];
+    struct check_bucket *b = &check_buckets[number];
+
+    char bucketpath[PATH_MAX];
+    char path[PATH_MAX];
+    snprintf(bucketpath, PATH_MAX, "%s/buckets/%lu", cache_dir, (unsigned long) number);
+    snprintf(path, PATH_MAX, "%s/data", bucketpath);
+
+    struct stat st;
+    b->has_data = (stat(path, &st) == 0);
+    b->mtime = b->has_data ? st.st_mtime : 0;
+
+    char *parent = fsll_getlink(bucketpath, "parent");
+    char *back = (parent == NULL) ? NULL : areadlink(parent);
+    b->linked = (back != NULL && strcmp(back, bucketpath) == 0);
+    FREE(back);
+    FREE(parent);
+
+    b->keep = (b->has_data && b->linked) || find_dirty(number) != NULL;
+    b->next = check_link_number(bucketpath, "next");
+    b->prev = check_link_number(bucketpath, "prev");
+}
+
+/*
+ * Rewrite a bucket's queue links where they're wrong, and empty it if it's
+ * going on the free queue.
+ */
+static void check_fix_bucket(uint32_t i)
+{
+    uint32_t number = check_numbers[i];
+    struct check_bucket *b = &check_buckets[number];
+
+    char bucketpath[PATH_MAX];
+    char path[PATH_MAX];
+    snprintf(bucketpath, PATH_MAX, "%s/buckets/%lu", cache_dir, (unsigned long) number);
+
+    if (!b->keep) {
+        if (b->has_data) {
+            DEBUG("check: freeing bucket %lu\n", (unsigned long) number);
+            atomic_fetch_add_explicit(&check_buckets_freed, 1, memory_order_relaxed);
+        }
+        snprintf(path, PATH_MAX, "%s/data", bucketpath);
+        unlink(path);
+        snprintf(path, PATH_MAX, "%s/crc32c", bucketpath);
+        unlink(path);
+        fsll_makelink(bucketpath, "parent", NULL);
+    }
+
+    const char *files[] = { "next", "prev" };
+    uint32_t was[] = { b->next, b->prev };
+    uint32_t want[] = { b->new_next, b->new_prev };
+    for (int j = 0; j < 2; j++) {
+        if (was[j] == want[j]) {
+            continue;
+        }
+        if (want[j] == CHECK_NONE) {
+            fsll_makelink(bucketpath, files[j], NULL);
+        } else {
+            snprintf(path, PATH_MAX, "%s/buckets/%lu", cache_dir, (unsigned long) want[j]);
+            fsll_makelink(bucketpath, files[j], path);
+        }
+    }
+}
+
+/*
+ * Walk a queue in memory. Returns whether it's sound: every bucket on it
+ * belongs there (keep matches used), is on it once, and links back to the one
+ * before, and the tail link points at the last one. The buckets reached before
+ * anything wrong are added to order, if it's given.
+ */
+static bool check_walk(const char *head, const char *tail, bool used,
+        uint32_t *order, uint32_t *count)
+{
+    *count = 0;
+    uint32_t prev = CHECK_NONE;
+    uint32_t number = check_link_number(cache_dir, head);
+    while (number != CHECK_NONE) {
+        if (number == CHECK_BAD) {
+            return false;
+        }
+        struct check_bucket *b = &check_buckets[number];
+        if (b->queued || b->keep != used || b->prev != prev) {
+            return false;
+        }
+        b->queued = true;
+        if (order != NULL) {
+            order[*count] = number;
+        }
+        (*count)++;
+        prev = number;
+        number = b->next;
+    }
+    return check_link_number(cache_dir, tail) == prev;
+}
+
+static int check_newer(const void *a, const void *b)
+{
+    time_t x = check_buckets[*(const uint32_t*)a].mtime;
+    time_t y = check_buckets[*(const uint32_t*)b].mtime;
+    return (x < y) - (x > y);
+}
+
+/*
+ * Link the buckets in order into a queue, in check_buckets, and point the
+ * head and tail links at its ends.
+ */
+static void check_link_queue(const uint32_t *order, uint32_t count,
+        const char *head, const char *tail)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        struct check_bucket *b = &check_buckets[order[i]];
+        b->new_prev = (i == 0) ? CHECK_NONE : order[i - 1];
+        b->new_next = (i + 1 == count) ? CHECK_NONE : order[i + 1];
+    }
+
+    char path[PATH_MAX];
+    const char *ends[] = { head, tail };
+    uint32_t numbers[] = { (count > 0) ? order[0] : 0, (count > 0) ? order[count - 1] : 0 };
+    for (int j = 0; j < 2; j++) {
+        if (count == 0) {
+            fsll_makelink(cache_dir, ends[j], NULL);
+        } else {
+            snprintf(path, PATH_MAX, "%s/buckets/%lu", cache_dir,
+                    (unsigned long) numbers[j]);
+            fsll_makelink(cache_dir, ends[j], path);
+        }
+    }
+}
+
+/*
+ * Make sure the buckets, the file directories and the queues agree, fixing
+ * them if they don't.
+ */
+void check_cache(void)
+{
+    INFO("checking the cache with %u threads\n", check_threads);
+    uint64_t start = stats_now();
+    char path[PATH_MAX];
+
+    // the file directories
+    uint32_t file_count = 0;
+    uint32_t file_alloc = 0;
+    snprintf(path, PATH_MAX, "%s/files", cache_dir);
+    DIR *d = opendir(path);
+    if (d == NULL) {
+        PERROR("check: opendir files");
+        abort();
+    }
+    struct dirent *e = NULL;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] < '0' || e->d_name[0] > '9') continue;
+        if (file_count == file_alloc) {
+            file_alloc = (file_alloc == 0) ? 1024 : file_alloc * 2;
+            check_files = (char**)realloc(check_files, file_alloc * sizeof(char*));
+        }
+        check_files[file_count++] = strdup(e->d_name);
+    }
+    closedir(d);
+
+    check_parallel(&check_file_dir, file_count);
+
+    // the buckets
+    uint32_t bucket_count = 0;
+    uint32_t bucket_alloc = 0;
+    snprintf(path, PATH_MAX, "%s/buckets", cache_dir);
+    d = opendir(path);
+    if (d == NULL) {
+        PERROR("check: opendir buckets");
+        abort();
+    }
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] < '0' || e->d_name[0] > '9') continue;
+        if (bucket_count == bucket_alloc) {
+            bucket_alloc = (bucket_alloc == 0) ? 1024 : bucket_alloc * 2;
+            check_numbers = (uint32_t*)realloc(check_numbers,
+                    bucket_alloc * sizeof(uint32_t));
+        }
+        uint32_t number = (uint32_t) strtoul(e->d_name, NULL, 10);
+        check_numbers[bucket_count++] = number;
+        if (number >= check_bucket_count) {
+            check_bucket_count = number + 1;
+        }
+    }
+    closedir(d);
+
+    check_buckets = (struct check_bucket*)calloc(check_bucket_count + 1,
+            sizeof(*check_buckets));
+    for (uint32_t i = 0; i < bucket_count; i++) {
+        check_buckets[check_numbers[i]].exists = true;
+    }
+
+    check_parallel(&check_read_bucket, bucket_count);
+
+    // the queues
+    uint32_t used_count = 0;
+    for (uint32_t i = 0; i < bucket_count; i++) {
+        struct check_bucket *b = &check_buckets[check_numbers[i]];
+        if (b->keep) {
+            used_count++;
+        }
+        b->new_next = b->next;
+        b->new_prev = b->prev;
+    }
+
+    uint32_t *order = (uint32_t*)malloc((bucket_count + 1) * sizeof(uint32_t));
+    uint32_t walked_used, walked_free;
+    bool used_ok = check_walk("buckets/head", "buckets/tail", true, order, &walked_used);
+    bool free_ok = check_walk("buckets/free_head", "buckets/free_tail", false, NULL,
+            &walked_free);
+    bool sound = used_ok && free_ok && walked_used == used_count
+        && walked_free == bucket_count - used_count;
+
+    if (!sound) {
+        WARN("check: the bucket queues need fixing; rebuilding them\n");
+
+        // the used queue keeps the order of as much of it as could be
+        // walked; the rest goes after, most recently filled first
+        uint32_t count = walked_used;
+        for (uint32_t i = 0; i < bucket_count; i++) {
+            check_buckets[check_numbers[i]].queued = false;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            check_buckets[order[i]].queued = true;
+        }
+        uint32_t walked = count;
+        for (uint32_t i = 0; i < bucket_count; i++) {
+            struct check_bucket *b = &check_buckets[check_numbers[i]];
+            if (b->keep && !b->queued) {
+                order[count++] = check_numbers[i];
+            }
+        }
+        qsort(order + walked, count - walked, sizeof(uint32_t), &check_newer);
+        check_link_queue(order, count, "buckets/head", "buckets/tail");
+
+        count = 0;
+        for (uint32_t i = 0; i < bucket_count; i++) {
+            if (!check_buckets[check_numbers[i]].keep) {
+                order[count++] = check_numbers[i];
+            }
+        }
+        check_link_queue(order, count, "buckets/free_head", "buckets/free_tail");
+
+        check_parallel(&check_fix_bucket, bucket_count);
+    }
+
+    INFO("checked %lu files and %lu buckets in %.3f s: removed %llu block links, "
+            "freed %llu buckets%s\n",
+            (unsigned long) file_count, (unsigned long) bucket_count,
+            (stats_now() - start) / 1e9,
+            (unsigned long long) atomic_load(&check_links_removed),
+            (unsigned long long) atomic_load(&check_buckets_freed),
+            sound ? "" : ", rebuilt the queues");
+
+    FREE(order);
+    for (uint32_t i = 0; i < file_count; i++) {
+        FREE(check_files[i]);
+    }
+    FREE(check_files);
+    FREE(check_numbers);
+    FREE(check_buckets);
+    check_bucket_count = 0;
+}
+
+/*
+ * Whether the last run shut down cleanly. The marker is removed either way,
+ * so a crash from here on is checked for next time.
+ */
+bool take_clean_marker(void)
+{
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%s", cache_dir, CLEAN_MARKER);
+    if (unlink(path) == -1) {
+        return false;
+    }
+
+    int fd = open(cache_dir, O_RDONLY | O_DIRECTORY);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+    return true;
+}
+
+/*
+ * Stop the background threads, and leave the marker that lets the next
+ * cache_init() skip the check. Call this on the way out, once nothing else
+ * is using the cache. Dirty data not written back yet stays dirty, and an
+ * orphan scan or trash collection carries on at the next cache_init().
+ */
+void cache_shutdown(void)
+{
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&evict_cond);
+    pthread_cond_broadcast(&flush_cond);
+    bool orphan_started = orphan_thread_started;
+    bool trash_started = trash_thread_started;
+    orphan_thread_started = false;
+    trash_thread_started = false;
+    pthread_mutex_unlock(&lock);
+
+    // the ones in the middle of something finish that batch first
+    pthread_join(evict_thread, NULL);
+    for (unsigned int i = 0; i < flush_thread_count; i++) {
+        pthread_join(flush_threads[i], NULL);
+    }
+    FREE(flush_threads);
+    flush_thread_count = 0;
+    pthread_mutex_lock(&lock);
+    free_flush_failures();
+    pthread_mutex_unlock(&lock);
+    if (size_check_started) {
+        pthread_join(size_check_thread, NULL);
+        size_check_started = false;
+    }
+    if (orphan_started) {
+        pthread_join(orphan_thread, NULL);
+    }
+    if (trash_started) {
+        pthread_join(trash_thread, NULL);
+    }
+
+    pthread_mutex_lock(&lock);
+
+    // everything has to be on disk before the marker is
+    int fd = open(cache_dir, O_RDONLY | O_DIRECTORY);
+    if (fd == -1 || syncfs(fd) == -1) {
+        PERROR("cache_shutdown: syncfs");
+        if (fd != -1) {
+            close(fd);
+        }
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%s", cache_dir, CLEAN_MARKER);
+    int marker = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (marker == -1) {
+        PERROR("cache_shutdown: creating clean shutdown marker");
+    } else {
+        fsync(marker);
+        close(marker);
+        fsync(fd);
+        INFO("cache shut down cleanly\n");
+    }
+    close(fd);
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Initialize the cache.
+ */
+void cache_init(const char *a_cache_dir, uint64_t a_cache_size, uint64_t a_bucket_max_size)
+{
+    cache_dir = (char*)malloc(strlen(a_cache_dir)+1);
+    strcpy(cache_dir, a_cache_dir);
+    cache_size = a_cache_size;
+    use_whole_device = (cache_size == 0);
+    stopping = false;
+
+    char bucket_dir[PATH_MAX];
+    snprintf(bucket_dir, PATH_MAX, "%s/buckets", cache_dir);
+
+    struct statvfs fs;
+    if (statvfs(bucket_dir, &fs) == 0 && fs.f_bsize > 0) {
+        fs_block_size = fs.f_bsize;
+    }
+    bucket_max_size = a_bucket_max_size;
+
+    // before any threads start: these go through the map unlocked
+    init_files();
+    unsigned int recovered = recover_dirty();
+    if (!take_clean_marker() || check_always) {
+        check_cache();
+    } else {
+        INFO("the cache was shut down cleanly; not checking it\n");
+    }
+
+    uint64_t number_of_buckets = prepare_buckets_size_check(bucket_dir);
+    INFO("%llu buckets in cache dir\n",
+            (unsigned long long) number_of_buckets);
+    cache_used_size = number_of_buckets * bucket_footprint(bucket_max_size);
+    used_buckets = number_of_buckets;
+    INFO("Estimated %llu bytes used in cache dir\n",
+            (unsigned long long) cache_used_size);
+    uint64_t cache_free_size = get_cache_fs_free_size(bucket_dir);
+    INFO("%llu bytes free in cache dir\n",
+            (unsigned long long) cache_free_size);
+    dev_free_estimate = cache_free_size;
+
+    crc32c_init();
+    if (posix_memalign((void**)&io_buf, DIRECT_IO_ALIGN,
+                ROUND_UP(bucket_max_size, DIRECT_IO_ALIGN)) != 0) {
+        PERROR("cache_init: unable to allocate I/O buffer");
+        abort();
+    }
+    verify_seed = (unsigned int)time(NULL);
+    if (verify_percent == 0 || verify_percent >= 100) {
+        INFO("using %s crc32c, verifying %u%% of cache reads\n",
+                crc32c_impl_name(), verify_percent);
+    } else {
+        INFO("using %s crc32c, verifying the first read of each block, and"
+                " %u%% of the rest\n", crc32c_impl_name(), verify_percent);
+    }
+
+    if (number_of_buckets > 0) {
+        if (pthread_create(&size_check_thread, NULL, &check_buckets_size, NULL) != 0) {
+            PERROR("cache_init: error creating checked thread");
+            abort();
+        }
+        size_check_started = true;
+    }
+
+    if (pthread_create(&evict_thread, NULL, &evictor, NULL) != 0) {
+        PERROR("cache_init: error creating evictor thread");
+        abort();
+    }
+
+    unsigned int threads = writeback_threads;
+    if (recovered > 0 && threads == 0) {
+        threads = 1;
+    }
+    if (threads > 0 && flush_fn == NULL) {
+        WARN("no way to write back dirty data; leaving it in the cache\n");
+        threads = 0;
+    }
+    flush_threads = (pthread_t*)calloc(threads + 1, sizeof(*flush_threads));
+    for (unsigned int i = 0; i < threads; i++) {
+        if (pthread_create(&flush_threads[i], NULL, &flusher, NULL) != 0) {
+            PERROR("cache_init: error creating flusher thread");
+            abort();
+        }
+        flush_thread_count++;
+    }
+
+    resume_trash();
+    resume_orphan_scan();
+}
+
+const char * bucketname(const char *path)
+{
+    return fsll_basename(path);
+}
+
+void dump_queues()
+{
+#ifdef FSLL_DUMP
+    fprintf(stderr, "BackFS Used Bucket Queue:\n");
+    fsll_dump(cache_dir, "buckets/head", "buckets/tail");
+    fprintf(stderr, "BackFS Free Bucket Queue:\n");
+    fsll_dump(cache_dir, "buckets/free_head", "buckets/free_tail");
+#endif //FSLL_DUMP
+}
+
+/*
+ * don't use this function directly.
+ */
+char * makebucket(uint64_t number)
+{
+    char *new_bucket = fsll_make_entry(cache_dir, "buckets", number);
+    fsll_insert_as_head(cache_dir, new_bucket,
+            "buckets/head", "buckets/tail");
+    used_buckets++;
+    return new_bucket;
+}
+
+/*
+ * make a new bucket
+ *
+ * either re-use one from the free queue,
+ *   or increment the next_bucket_number file and return that.
+ *
+ * If one from the free queue is returned, that bucket is made the head of the
+ * used queue.
+ */
+char * next_bucket(void)
+{
+    char *bucket = fsll_getlink(cache_dir, "buckets/free_head");
+    if (bucket != NULL) {
+        DEBUG("re-using free bucket %s\n", bucketname(bucket));
+
+        // disconnect from free queue
+        fsll_disconnect(cache_dir, bucket,
+                "buckets/free_head", "buckets/free_tail");
+
+        // make head of the used queue
+        fsll_insert_as_head(cache_dir, bucket,
+                "buckets/head", "buckets/tail");
+        if (!is_unchecked(bucket)) {
+            // otherwise the size check counts it
+            free_buckets--;
+            used_buckets++;
+        }
+
+        return bucket;
+    } else {
+        char nbnpath[PATH_MAX];
+        snprintf(nbnpath, PATH_MAX, "%s/buckets/next_bucket_number", cache_dir);
+        uint64_t next = 0;
+        
+        FILE *f = fopen(nbnpath, "r+");
+        if (f == NULL && errno != ENOENT) {
+            PERROR("open next_bucket");
+            return makebucket(0);
+        } else {
+            if (f != NULL) {
+                // we had a number already there; read it
+                if (fscanf(f, "%llu", (unsigned long long *)&next) != 1) {
+                    ERROR("unable to read next_bucket\n");
+                    fclose(f);
+                    return makebucket(0);
+                }
+                f = freopen(nbnpath, "w+", f);
+            } else {
+                // next_bucket_number doesn't exist; create it and write a 1.
+                f = fopen(nbnpath, "w+");
+                if (f == NULL) {
+                    PERROR("open next_bucket again");
+                    return makebucket(0);
+                }
+            }
+            // write the next number
+            if (f == NULL) {
+                PERROR("fdopen for writing in next_bucket");
+                return makebucket(0);
+            }
+            fprintf(f, "%llu\n", (unsigned long long) next+1);
+            fclose(f);
+        }
+
+        DEBUG("making new bucket %lu\n", (unsigned long) next);
+
+        char *new_bucket = makebucket(next);
+
+        return new_bucket;
+    }
+}
+
+/*
+ * moves a bucket to the head of the used queue
+ */
+void bucket_to_head(const char *bucketpath)
+{
+    DEBUG("bucket_to_head(%s)\n", bucketpath);
+    fsll_to_head(cache_dir, bucketpath, "buckets/head", "buckets/tail");
+}
+
+/*
+ * Starting at the dirname of path, remove empty directories upwards in the
+ * path heirarchy.
+ *
+ * Stops when it gets to <cache_dir>/map
+ */
+void trim_directory(const char *path)
+{
+    char *copy = strdup(path);
+
+    char map[PATH_MAX];
+    snprintf(map, PATH_MAX, "%s/map", cache_dir);
+
+    char *dir = dirname(copy);
+    while (strncmp(dir, map, strlen(map)) == 0 && strcmp(dir, map) != 0) {
+        if (rmdir(dir) == -1) {
+            if (errno != EEXIST && errno != ENOTEMPTY) {
+                PERROR("in trim_directory, rmdir");
+            }
+            break;
+        }
+        DEBUG("removed empty map directory %s\n", dir);
+
+        dir = dirname(dir);
+    }
+
+    FREE(copy);
+}
+
+/*
+ * Once a file's last block is gone, remove its directory, and its map link if
+ * that still points to it, keeping the map tree minimal.
+ */
+void free_file_dir(const char *filedir)
+{
+    DIR *d = opendir(filedir);
+    if (d == NULL) {
+        return;
+    }
+    struct dirent *e = NULL;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] >= '0' && e->d_name[0] <= '9') {
+            // still has blocks
+            closedir(d);
+            return;
+        }
+    }
+    closedir(d);
+
+    char *name = read_file_name(filedir);
+    if (name != NULL) {
+        char mappath[PATH_MAX];
+        snprintf(mappath, PATH_MAX, "%s/map%s", cache_dir, name);
+        char *target = areadlink(mappath);
+        if (target != NULL && strcmp(target, filedir) == 0) {
+            forget_validator(name);
+            if (unlink(mappath) == -1) {
+                PERROR("unlink map link in free_file_dir");
+            } else {
+                trim_directory(mappath);
+            }
+        }
+        FREE(target);
+        FREE(name);
+    }
+
+    char path[PATH_MAX];
+    struct cache_file_key key;
+    if (read_file_key(filedir, &key)) {
+        char *target = key_file_dir(&key);
+        if (target != NULL && strcmp(target, filedir) == 0) {
+            key_link_path(&key, path, PATH_MAX);
+            unlink(path);
+        }
+        FREE(target);
+        snprintf(path, PATH_MAX, "%s/key", filedir);
+        unlink(path);
+    }
+
+    snprintf(path, PATH_MAX, "%s/mtime", filedir);
+    unlink(path);
+    snprintf(path, PATH_MAX, "%s/name", filedir);
+    unlink(path);
+    if (rmdir(filedir) == -1) {
+        PERROR("rmdir in free_file_dir");
+        ERROR("\tpath was %s\n", filedir);
+    } else {
+        DEBUG("removed file directory %s\n", filedir);
+    }
+}
+
+/*
+ * free a bucket
+ *
+ * moves bucket from the tail of the used queue to the tail of the free queue,
+ * deletes the data in the bucket
+ * returns the space freed (see bucket_footprint())
+ */
+uint64_t free_bucket_real(const char *bucketpath, bool free_in_the_middle_is_bad)
+{
+    struct dirty_bucket *dirty = find_dirty(bucket_path_to_number(bucketpath));
+    if (dirty != NULL) {
+        DEBUG("bucket %s had data not written back yet\n", bucketname(bucketpath));
+        forget_dirty(dirty);
+    }
+
+    char *parent = fsll_getlink(bucketpath, "parent");
+    if (parent && fsll_file_exists(parent, NULL)) {
+        DEBUG("bucket parent: %s\n", parent);
+        if (unlink(parent) == -1) {
+            PERROR("unlink parent in free_bucket");
+        }
+
+        // if this was the last block, remove the file's directory
+        char *filedir = strdup(parent);
+        free_file_dir(dirname(filedir));
+        FREE(filedir);
+    }
+    FREE(parent);
+    fsll_makelink(bucketpath, "parent", NULL);
+
+    if (free_in_the_middle_is_bad) {
+        char *n = fsll_getlink(bucketpath, "next");
+        if (n != NULL) {
+            ERROR("bucket freed (#%lu) was not the queue tail\n",
+                    (unsigned long) bucket_path_to_number(bucketpath));
+            FREE(n);
+            return 0;
+        }
+    }
+
+    fsll_disconnect(cache_dir, bucketpath, 
+            "buckets/head", "buckets/tail");
+
+    fsll_insert_as_tail(cache_dir, bucketpath,
+            "buckets/free_head", "buckets/free_tail");
+    if (!is_unchecked(bucketpath)) {
+        used_buckets--;
+        free_buckets++;
+    }
+
+    char data[PATH_MAX];
+    snprintf(data, PATH_MAX, "%s/data", bucketpath);
+    
+    struct stat s;
+    if (stat(data, &s) == -1) {
+        PERROR("stat data in free_bucket");
+    }
+
+    // caller holds the lock
+    uint64_t result = 0;
+    if (unlink(data) == -1) {
+        PERROR("unlink data in free_bucket");
+    } else {
+        result = bucket_footprint(s.st_size);
+        if (!is_unchecked(bucketpath)) {
+            cache_used_size -= result;
+        }
+        dev_free_estimate += result;
+    }
+
+    snprintf(data, PATH_MAX, "%s/crc32c", bucketpath);
+    if (unlink(data) == -1 && errno != ENOENT) {
+        PERROR("unlink crc32c in free_bucket");
+    }
+
+    return result;
+}
+
+uint64_t free_bucket_mid_queue(const char *bucketpath)
+{
+    return free_bucket_real(bucketpath, false);
+}
+
+uint64_t free_bucket(const char *bucketpath)
+{
+    return free_bucket_real(bucketpath, true);
+}
+
+/*
+ * do not use this function directly
+ */
+int cache_invalidate_bucket(const char *filename, uint32_t block, 
+                                const char *bucket, bool discard_dirty)
+{
+    if (!discard_dirty && find_dirty(bucket_path_to_number(bucket)) != NULL) {
+        DEBUG("block %lu of file %s isn't written back yet; keeping it\n",
+                (unsigned long) block, filename);
+        return 0;
+    }
+
+    DEBUG("invalidating block %lu of file %s\n",
+            (unsigned long) block, filename);
+
+    uint64_t freed_size = free_bucket_mid_queue(bucket);
+    stats_inc(STATS_INVALIDATIONS);
+
+    DEBUG("freed %llu bytes in bucket %s\n",
+            (unsigned long long) freed_size,
+            bucketname(bucket));
+
+    return 0;
+}
+
+int cache_invalidate_file_real(const char *filename, bool error_if_not_exist,
+        bool discard_dirty)
+{
+    char mappath[PATH_MAX];
+    snprintf(mappath, PATH_MAX, "%s/map%s", cache_dir, filename);
+    DIR *d = opendir(mappath);
+    if (d == NULL) {
+        if (errno != ENOENT || error_if_not_exist) {
+            PERROR("opendir in cache_invalidate");
+        }
+        return -errno;
+    }
+
+    struct dirent *e = NULL;
+    while ((e = readdir(d)) != NULL) {
+        // free_file_dir removes the mtime file along with the last block;
+        // dirty blocks may be kept, and they still need it.
+        if (e->d_name[0] < '0' || e->d_name[0] > '9') continue;
+
+        char *bucket = fsll_getlink(mappath, e->d_name);
+        uint32_t block = (uint32_t) strtoul(e->d_name, NULL, 10);
+    
+        cache_invalidate_bucket(filename, block, bucket, discard_dirty);
+
+        FREE(bucket);
+    }
+
+    closedir(d);
+
+    return 0;
+}
+
+int cache_invalidate_file_(const char *filename, bool error_if_not_exist)
+{
+    pthread_mutex_lock(&lock);
+    int retval = cache_invalidate_file_real(filename, error_if_not_exist, false);
+    pthread_mutex_unlock(&lock);   
+    return retval;
+}
+
+int cache_invalidate_file(const char *filename)
+{
+    return cache_invalidate_file_(filename, true);
+}
+
+int cache_try_invalidate_file(const char *filename)
+{
+    return cache_invalidate_file_(filename, false);
+}
+
+/*
+ * Like cache_try_invalidate_file(), but also throws away data that hasn't been
+ * written back. For when the backing file is deleted.
+ */
+int cache_discard_file(const char *filename)
+{
+    pthread_mutex_lock(&lock);
+    int retval = cache_invalidate_file_real(filename, false, true);
+    pthread_mutex_unlock(&lock);
+    return retval;
+}
+
+int cache_invalidate_block_(const char *filename, uint32_t block,
+    bool warn_if_not_exist)
+{
+    char mappath[PATH_MAX];
+    snprintf(mappath, PATH_MAX, "map%s/%lu",
+            filename, (unsigned long) block);
+
+    pthread_mutex_lock(&lock);
+    
+    char *bucket = fsll_getlink(cache_dir, mappath);
+    if (bucket == NULL) {
+        if (warn_if_not_exist) {
+            WARN("Cache invalidation: block %lu of file %s doesn't exist.\n",
+                    (unsigned long) block, filename);
+        }
+        pthread_mutex_unlock(&lock);
+        return -ENOENT;
+    }
+
+    cache_invalidate_bucket(filename, block, bucket, false);
+
+    FREE(bucket);
+
+    pthread_mutex_unlock(&lock);
+
+    return 0;
+}
+
+int cache_invalidate_block(const char *filename, uint32_t block)
+{
+    return cache_invalidate_block_(filename, block, true);
+}
+
+int cache_try_invalidate_block(const char *filename, uint32_t block)
+{
+    return cache_invalidate_block_(filename, block, false);
+}
+
+int cache_try_invalidate_blocks_above(const char *filename, uint32_t block)
+{
+    DEBUG("trying to invalidate blocks >= %ld in %s\n", block, filename);
+    int ret = 0;
+    DIR *mapdir = NULL;
+    bool locked = false;
+
+    char mappath[PATH_MAX];
+    snprintf(mappath, PATH_MAX, "%s/map%s", cache_dir, filename);
+
+    pthread_mutex_lock(&lock);
+    locked = true;
+
+    mapdir = opendir(mappath);
+    if (mapdir == NULL) {
+        ret = -errno;
+        goto exit;
+    }
+
+    struct dirent *e = NULL;
+    while ((e = readdir(mapdir)) != NULL) {
+        if ((e->d_name[0] < '0') || (e->d_name[0] > '9')) continue;
+
+        uint32_t block_found = (uint32_t) strtoul(e->d_name, NULL, 10);
+
+        if (block_found >= block) {
+            char *bucket = fsll_getlink(mappath, e->d_name);
+            cache_invalidate_bucket(filename, block_found, bucket, true);
+            FREE(bucket);
+        }
+    }
+
+exit:
+    closedir(mapdir);
+    if (locked)
+        pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+/*
+ * Free a bucket if it's an orphan: it has data, but isn't linked from a file
+ * directory that's still in the map, and isn't dirty.
+ * Caller holds the lock.
+ */
+bool free_if_orphan(const char *bucketpath)
+{
+    char *parent = fsll_getlink(bucketpath, "parent");
+
+    // linked from a file directory that's still in the map
+    bool linked = (parent != NULL && fsll_file_exists(parent, NULL));
+    if (linked) {
+        char *filedir = strdup(parent);
+        linked = file_dir_is_mapped(dirname(filedir));
+        FREE(filedir);
+    }
+
+    bool orphan = (fsll_file_exists(bucketpath, "data") && !linked &&
+            find_dirty(bucket_path_to_number(bucketpath)) == NULL);
+    if (orphan) {
+        DEBUG("bucket %s is an orphan\n", bucketname(bucketpath));
+        if (parent) {
+            DEBUG("\tparent was %s\n", parent);
+        }
+        free_bucket_mid_queue(bucketpath);
+        stats_inc(STATS_ORPHANS_FREED);
+    }
+
+    FREE(parent);
+    return orphan;
+}
+
+/*
+ * Record how far the orphan scan has got, so it carries on from there after
+ * a remount, or that there isn't one.
+ * Caller holds the lock.
+ */
+void save_orphan_scan(void)
+{
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%s", cache_dir, ORPHAN_SCAN_FILE);
+    if (!orphan_scan_running) {
+        if (unlink(path) == -1 && errno != ENOENT) {
+            PERROR("unlink orphan scan file");
+        }
+        return;
+    }
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        PERROR("opening orphan scan file failed");
+        return;
+    }
+    fprintf(f, "%llu %llu\n", (unsigned long long) orphan_next,
+            (unsigned long long) orphan_end);
+    fclose(f);
+}
+
+/*
+ * Go through the buckets from orphan_next to orphan_end, ORPHAN_BATCH at a
+ * time, letting go of the lock in between so reads and writes carry on.
+ */
+void* orphan_collector(void* arg)
+{
+    if (arg != NULL) {
+        abort();
+    }
+
+    uint64_t freed = 0;
+    pthread_mutex_lock(&lock);
+    while (orphan_next < orphan_end && !stopping) {
+        uint64_t stop = orphan_next + ORPHAN_BATCH;
+        if (stop > orphan_end) {
+            stop = orphan_end;
+        }
+        for (; orphan_next < stop; orphan_next++) {
+            char bucketpath[PATH_MAX];
+            snprintf(bucketpath, PATH_MAX, "%s/buckets/%llu", cache_dir,
+                    (unsigned long long) orphan_next);
+            if (fsll_file_exists(bucketpath, NULL) && free_if_orphan(bucketpath)) {
+                freed++;
+            }
+        }
+        save_orphan_scan();
+
+        // let foreground operations in between batches
+        pthread_mutex_unlock(&lock);
+        pthread_mutex_lock(&lock);
+    }
+    if (stopping) {
+        // save_orphan_scan() has kept where it got to, for the next mount
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+
+    INFO("orphan scan done: freed %llu buckets\n", (unsigned long long) freed);
+    orphan_scan_running = false;
+    orphan_next = 0;
+    orphan_end = 0;
+    save_orphan_scan();
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/*
+ * Start the orphan collector on buckets next to end, unless it's running.
+ * Returns 0 or -errno.
+ * Caller holds the lock.
+ */
+int start_orphan_scan(uint64_t next, uint64_t end)
+{
+    if (orphan_scan_running) {
+        return 0;
+    }
+
+    INFO("scanning buckets %llu to %llu for orphans\n",
+            (unsigned long long) next, (unsigned long long) end);
+    orphan_scan_running = true;
+    orphan_next = next;
+    orphan_end = end;
+
+    if (orphan_thread_started) {
+        // the last scan's thread is done, or about to be
+        pthread_join(orphan_thread, NULL);
+        orphan_thread_started = false;
+    }
+    int err = pthread_create(&orphan_thread, NULL, &orphan_collector, NULL);
+    if (err != 0) {
+        errno = err;
+        PERROR("error creating orphan collector thread");
+        orphan_scan_running = false;
+        orphan_next = 0;
+        orphan_end = 0;
+        return -1*err;
+    }
+    orphan_thread_started = true;
+    save_orphan_scan();
+    return 0;
+}
+
+/*
+ * Start freeing buckets not linked from any file directory in the map, in the
+ * background. Returns once it's started.
+ */
+int cache_free_orphan_buckets(void)
+{
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/buckets/next_bucket_number", cache_dir);
+
+    pthread_mutex_lock(&lock);
+
+    // buckets made after this aren't orphans
+    unsigned long long end = 0;
+    FILE *f = fopen(path, "r");
+    if (f != NULL) {
+        if (fscanf(f, "%llu", &end) != 1) {
+            end = 0;
+        }
+        fclose(f);
+    }
+
+    int ret = start_orphan_scan(0, end);
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+/*
+ * Carry on with an orphan scan that was going when the cache was last
+ * unmounted.
+ * Called from cache_init().
+ */
+void resume_orphan_scan(void)
+{
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%s", cache_dir, ORPHAN_SCAN_FILE);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return;
+    }
+    unsigned long long next, end;
+    bool ok = (fscanf(f, "%llu %llu", &next, &end) == 2);
+    fclose(f);
+
+    pthread_mutex_lock(&lock);
+    if (ok && next < end) {
+        start_orphan_scan(next, end);
+    } else {
+        save_orphan_scan();
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * cache_invalidate_tree() renames a directory in the map to
+ * <cache_dir>/trash/<n>/tree, with the path it was at in trash/<n>/name. That
+ * one rename takes everything under it out of the cache at once; a background
+ * thread then goes through the detached tree freeing the buckets, a few at a
+ * time, and removes it. Anything left over from an unmount is picked up by
+ * the next cache_init().
+ */
+
+/*
+ * Whether path is dir or something under it.
+ */
+bool path_is_under(const char *path, const char *dir)
+{
+    size_t len = strlen(dir);
+    return strncmp(path, dir, len) == 0
+        && (path[len] == '/' || path[len] == '\0');
+}
+
+/*
+ * Whether a file directory is in a tree that's been detached but not freed
+ * yet, so it shouldn't be found again by its key.
+ * Caller holds the lock.
+ */
+bool file_dir_is_detached(const char *filedir)
+{
+    if (trash_list == NULL) {
+        return false;
+    }
+
+    char *name = read_file_name(filedir);
+    if (name == NULL) {
+        return false;
+    }
+
+    bool detached = false;
+    for (struct trash_tree *t = trash_list; t != NULL && !detached; t = t->next) {
+        detached = path_is_under(name, t->name);
+    }
+    if (detached) {
+        // linked into the map again since, e.g. for data not written back
+        char *current = file_dir(name);
+        detached = (current == NULL || strcmp(current, filedir) != 0);
+        FREE(current);
+    }
+    FREE(name);
+    return detached;
+}
+
+/*
+ * Count one thing done by the trash collector, letting go of the lock every
+ * TRASH_BATCH of them so foreground operations carry on.
+ * Caller holds the lock.
+ */
+void trash_yield(void)
+{
+    static unsigned int batch = 0;
+    if (++batch == TRASH_BATCH) {
+        batch = 0;
+        pthread_mutex_unlock(&lock);
+        pthread_mutex_lock(&lock);
+    }
+}
+
+/*
+ * Free the blocks of a file directory linked from a detached tree. Blocks not written back yet are kept,
+ * as with cache_invalidate_file().
+ * Caller holds the lock.
+ */
+void free_trash_file(const char *link, const char *treename)
+{
+    char *filedir = areadlink(link);
+    if (filedir == NULL) {
+        return;
+    }
+
+    // if it's been linked to a name outside the tree since, leave it be
+    char *name = read_file_name(filedir);
+    if (name == NULL || !path_is_under(name, treename)) {
+        goto exit;
+    }
+
+    DIR *d = opendir(filedir);
+    if (d == NULL) {
+        goto exit;
+    }
+    struct dirent *e = NULL;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] < '0' || e->d_name[0] > '9') continue;
+
+        char *bucket = fsll_getlink(filedir, e->d_name);
+        if (bucket == NULL) continue;
+        uint32_t block = (uint32_t) strtoul(e->d_name, NULL, 10);
+        cache_invalidate_bucket(name, block, bucket, false);
+        FREE(bucket);
+        trash_yield();
+    }
+    closedir(d);
+
+    // in case it had no blocks to take it with them
+    free_file_dir(filedir);
+
+exit:
+    FREE(name);
+    FREE(filedir);
+}
+
+/*
+ * Free everything under path, a directory or file link in a detached tree,
+ * and remove it.
+ * Caller holds the lock.
+ */
+void free_trash_path(const char *path, const char *treename)
+{
+    struct stat s;
+    if (lstat(path, &s) == -1) {
+        return;
+    }
+
+    if (S_ISLNK(s.st_mode)) {
+        free_trash_file(path, treename);
+    } else if (S_ISDIR(s.st_mode)) {
+        DIR *d = opendir(path);
+        if (d == NULL) {
+            PERROR("opendir in free_trash_path");
+            return;
+        }
+        struct dirent *e = NULL;
+        while (!stopping && (e = readdir(d)) != NULL) {
+            if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+
+            char child[PATH_MAX];
+            snprintf(child, PATH_MAX, "%s/%s", path, e->d_name);
+            free_trash_path(child, treename);
+            trash_yield();
+        }
+        closedir(d);
+        if (stopping) {
+            return;
+        }
+        if (rmdir(path) == -1) {
+            PERROR("rmdir in free_trash_path");
+        }
+        return;
+    }
+
+    if (unlink(path) == -1) {
+        PERROR("unlink in free_trash_path");
+    }
+}
+
+/*
+ * Remove trash/<number>, once its tree is gone.
+ */
+void remove_trash_dir(uint64_t number)
+{
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%s/%llu/name", cache_dir, TRASH_DIR,
+            (unsigned long long) number);
+    if (unlink(path) == -1 && errno != ENOENT) {
+        PERROR("unlink in remove_trash_dir");
+    }
+    *strrchr(path, '/') = '\0';
+    if (rmdir(path) == -1 && errno != ENOENT) {
+        PERROR("rmdir in remove_trash_dir");
+    }
+}
+
+/*
+ * Free the detached trees on trash_list, oldest first, until there are none.
+ */
+void* trash_collector(void* arg)
+{
+    if (arg != NULL) {
+        abort();
+    }
+
+    pthread_mutex_lock(&lock);
+    while (trash_list != NULL) {
+        struct trash_tree *t = trash_list;
+        INFO("freeing invalidated tree %s\n", t->name[0] ? t->name : "/");
+
+        char tree[PATH_MAX];
+        snprintf(tree, PATH_MAX, "%s/%s/%llu/tree", cache_dir, TRASH_DIR,
+                (unsigned long long) t->number);
+        free_trash_path(tree, t->name);
+        if (stopping) {
+            // resume_trash() carries on from what's left on the next mount
+            break;
+        }
+        remove_trash_dir(t->number);
+
+        DEBUG("done freeing %s\n", t->name[0] ? t->name : "/");
+        trash_list = t->next;
+        FREE(t->name);
+        FREE(t);
+    }
+    trash_collector_running = false;
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/*
+ * Add a detached tree to the end of trash_list, and start the collector if
+ * it isn't running.
+ * Caller holds the lock.
+ */
+void add_trash(uint64_t number, const char *name)
+{
+    struct trash_tree *t = (struct trash_tree*)malloc(sizeof(*t));
+    t->number = number;
+    t->name = strdup(name);
+    t->next = NULL;
+
+    struct trash_tree **tail = &trash_list;
+    while (*tail != NULL) {
+        tail = &(*tail)->next;
+    }
+    *tail = t;
+
+    if (trash_collector_running) {
+        return;
+    }
+    if (trash_thread_started) {
+        // the last collector is done, or about to be
+        pthread_join(trash_thread, NULL);
+        trash_thread_started = false;
+    }
+    int err = pthread_create(&trash_thread, NULL, &trash_collector, NULL);
+    if (err != 0) {
+        errno = err;
+        PERROR("error creating trash collector thread");
+        return;
+    }
+    trash_thread_started = true;
+    trash_collector_running = true;
+}
+
+/*
+ * Blocks not written back yet have to stay readable, so link the files that
+ * have any in the detached tree back into the map, keeping only those blocks.
+ * Caller holds the lock.
+ */
+void relink_dirty(const char *treename)
+{
+    for (struct dirty_bucket *d = dirty_list; d != NULL; d = d->next) {
+        if (d->superseded || !path_is_under(d->path, treename)) continue;
+
+        char bucketpath[PATH_MAX];
+        snprintf(bucketpath, PATH_MAX, "%s/buckets/%lu", cache_dir,
+                (unsigned long) d->number);
+        char *parent = fsll_getlink(bucketpath, "parent");
+        if (parent == NULL) continue;
+
+        char *filedir = dirname(parent);
+        char *current = file_dir(d->path);
+        if (current == NULL || strcmp(current, filedir) != 0) {
+            DEBUG("keeping %s, which isn't written back yet\n", d->path);
+            if (map_link(d->path, filedir) == 0) {
+                // the rest of it goes now, as with cache_invalidate_file()
+                cache_invalidate_file_real(d->path, false, false);
+            }
+        }
+        FREE(current);
+        FREE(parent);
+    }
+}
+
+/*
+ * Take a directory (or file) and everything under it out of the cache. It's
+ * detached from the map right away, and its buckets are freed in the
+ * background. Returns 0 or -errno.
+ */
+int cache_invalidate_tree(const char *path)
+{
+    size_t len = strlen(path);
+    if (path[0] != '/' || strstr(path, "/../") != NULL
+            || (len >= 3 && strcmp(path + len - 3, "/..") == 0)) {
+        return -EINVAL;
+    }
+
+    // no trailing slashes; the root is ""
+    char name[PATH_MAX];
+    snprintf(name, PATH_MAX, "%s", path);
+    for (len = strlen(name); len > 0 && name[len - 1] == '/'; len--) {
+        name[len - 1] = '\0';
+    }
+
+    char mappath[PATH_MAX];
+    char trashdir[PATH_MAX];
+    char tree[PATH_MAX];
+    snprintf(mappath, PATH_MAX, "%s/map%s", cache_dir, name);
+    int ret = 0;
+
+    pthread_mutex_lock(&lock);
+
+    snprintf(trashdir, PATH_MAX, "%s/%s", cache_dir, TRASH_DIR);
+    if (mkdir(trashdir, 0700) == -1 && errno != EEXIST) {
+        PERROR("mkdir trash directory");
+        ret = -EIO;
+        goto exit;
+    }
+    uint64_t number = next_trash_number++;
+    snprintf(trashdir, PATH_MAX, "%s/%s/%llu", cache_dir, TRASH_DIR,
+            (unsigned long long) number);
+    if (mkdir(trashdir, 0700) == -1) {
+        PERROR("mkdir in cache_invalidate_tree");
+        ret = -EIO;
+        goto exit;
+    }
+    write_file_name(trashdir, name);
+
+    snprintf(tree, PATH_MAX, "%s/tree", trashdir);
+    map_generation++;
+    if (rename(mappath, tree) == -1) {
+        ret = -errno;
+        if (errno != ENOENT) {
+            PERROR("rename in cache_invalidate_tree");
+            ERROR("\tcaused by rename(%s, %s)\n", mappath, tree);
+            ret = -EIO;
+        }
+        remove_trash_dir(number);
+        goto exit;
+    }
+    INFO("invalidated tree %s\n", name[0] ? name : "/");
+
+    if (name[0] == '\0') {
+        if (mkdir(mappath, 0700) == -1) {
+            PERROR("mkdir map directory");
+        }
+    } else {
+        trim_directory(mappath);
+    }
+    relink_dirty(name);
+    add_trash(number, name);
+
+exit:
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+/*
+ * Carry on freeing trees detached before the cache was last unmounted.
+ * Called from cache_init().
+ */
+void resume_trash(void)
+{
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%s", cache_dir, TRASH_DIR);
+    DIR *d = opendir(path);
+    if (d == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    struct dirent *e = NULL;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] < '0' || e->d_name[0] > '9') continue;
+        uint64_t number = strtoull(e->d_name, NULL, 10);
+        if (number >= next_trash_number) {
+            next_trash_number = number + 1;
+        }
+
+        char trashdir[PATH_MAX];
+        snprintf(trashdir, PATH_MAX, "%s/%s", path, e->d_name);
+        char *name = read_file_name(trashdir);
+        if (name == NULL) {
+            // the root, whose name is empty
+            name = strdup("");
+        }
+        char tree[PATH_MAX];
+        snprintf(tree, PATH_MAX, "%s/tree", trashdir);
+        struct stat s;
+        if (lstat(tree, &s) == 0) {
+            add_trash(number, name);
+        } else {
+            // the rename never happened
+            remove_trash_dir(number);
+        }
+        FREE(name);
+    }
+    closedir(d);
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * The backing file mtime recorded in a file directory.
+ * Caller holds the lock.
+ */
+bool read_file_mtime(const char *filedir, uint64_t *mtime)
+{
+    char mtimepath[PATH_MAX];
+    snprintf(mtimepath, PATH_MAX, "%s/mtime", filedir);
+    FILE *f = fopen(mtimepath, "r");
+    if (f == NULL) {
+        return false;
+    }
+    unsigned long long value;
+    bool ok = (fscanf(f, "%llu", &value) == 1);
+    fclose(f);
+    *mtime = value;
+    return ok;
+}
+
+/*
+ * Write a manifest of the cache to manifest_path: a header line, then one
+ * "<block> <mtime> <path>" line per cached block, most recently used first.
+ * The used queue is walked EXPORT_BATCH buckets at a time, letting go of the
+ * lock in between, so this doesn't hold up reads for long on a big cache;
+ * blocks used in the meantime may be listed twice, or missed.
+ * Returns 0 or -errno.
+ */
+int cache_export_manifest(const char *manifest_path)
+{
+    FILE *f = fopen(manifest_path, "w");
+    if (f == NULL) {
+        return -1*errno;
+    }
+    fprintf(f, "# backfs manifest 1 block_size %llu\n",
+            (unsigned long long) bucket_max_size);
+
+    // the file directory of the last bucket listed, and what's in it
+    char *filedir = NULL;
+    char *name = NULL;
+    uint64_t mtime = 0;
+
+    uint64_t listed = 0;
+    uint64_t count = 0;
+
+    pthread_mutex_lock(&lock);
+
+    uint64_t limit = used_buckets;
+    char *bucket = fsll_getlink(cache_dir, "buckets/head");
+    while (bucket != NULL && count < limit) {
+        if (count > 0 && count % EXPORT_BATCH == 0) {
+            pthread_mutex_unlock(&lock);
+            pthread_mutex_lock(&lock);
+            if (!fsll_file_exists(bucket, "data")) {
+                // freed in the meantime; its place in the queue is lost
+                DEBUG("export_manifest: bucket %s was freed; stopping early\n",
+                        bucketname(bucket));
+                break;
+            }
+        }
+        count++;
+
+        char *parent = fsll_getlink(bucket, "parent");
+        char *slash = (parent == NULL) ? NULL : strrchr(parent, '/');
+        if (slash != NULL) {
+            *slash = '\0';
+            if (filedir == NULL || strcmp(filedir, parent) != 0) {
+                FREE(filedir);
+                FREE(name);
+                filedir = strdup(parent);
+                if (file_dir_is_mapped(filedir)
+                        && read_file_mtime(filedir, &mtime)) {
+                    name = read_file_name(filedir);
+                }
+            }
+
+            // a name with a newline in it can't go on a line
+            if (name != NULL && strchr(name, '\n') == NULL) {
+                fprintf(f, "%lu %llu %s\n", strtoul(slash + 1, NULL, 10),
+                        (unsigned long long) mtime, name);
+                listed++;
+            }
+        }
+        FREE(parent);
+
+        char *next = fsll_getlink(bucket, "next");
+        FREE(bucket);
+        bucket = next;
+    }
+    FREE(bucket);
+
+    pthread_mutex_unlock(&lock);
+
+    FREE(filedir);
+    FREE(name);
+
+    int ret = 0;
+    if (ferror(f)) {
+        ret = -1*EIO;
+    }
+    if (fclose(f) == EOF && ret == 0) {
+        ret = -1*errno;
+    }
+
+    INFO("exported %llu blocks to %s\n", (unsigned long long) listed,
+            manifest_path);
+    return ret;
+}
+
+/*
+ * Open a bucket's data file, with O_DIRECT if that's the I/O mode.
+ * If the cache filesystem doesn't support O_DIRECT, switches to the fadvise
+ * mode, which is the next best thing.
+ * Caller holds the lock.
+ */
+int open_bucket_data(const char *datapath, int flags, bool *direct)
+{
+    *direct = false;
+    if (io_mode == CACHE_IO_DIRECT) {
+        int fd = open(datapath, flags | O_DIRECT, S_IRUSR | S_IWUSR);
+        if (fd != -1 || errno != EINVAL) {
+            *direct = (fd != -1);
+            return fd;
+        }
+        WARN("cache filesystem doesn't support O_DIRECT; using fadvise mode instead\n");
+        io_mode = CACHE_IO_FADVISE;
+    }
+    return open(datapath, flags, S_IRUSR | S_IWUSR);
+}
+
+/*
+ * pread() from a bucket's data file.
+ * With O_DIRECT, reads the aligned span covering the range into io_buf and
+ * copies the requested part out; buf may itself be io_buf.
+ * Caller holds the lock.
+ */
+ssize_t bucket_pread(int fd, bool direct, char *buf, uint64_t len, uint64_t offset)
+{
+    if (!direct) {
+        return pread(fd, buf, len, offset);
+    }
+
+    uint64_t start = offset / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+    uint64_t end = ROUND_UP(offset + len, DIRECT_IO_ALIGN);
+    ssize_t nread = pread(fd, io_buf, end - start, start);
+    if (nread == -1) {
+        return -1;
+    }
+    if (nread <= offset - start) {
+        return 0;
+    }
+
+    uint64_t avail = nread - (offset - start);
+    if (avail > len) {
+        avail = len;
+    }
+    memmove(buf, io_buf + (offset - start), avail);
+    return avail;
+}
+
+/*
+ * write() a whole block to a bucket's (empty) data file.
+ * With O_DIRECT, goes through io_buf, padded out to the alignment, and the
+ * file is trimmed back to len afterwards.
+ * Caller holds the lock.
+ */
+ssize_t bucket_write(int fd, bool direct, const char *buf, uint64_t len)
+{
+    if (!direct) {
+        return write(fd, buf, len);
+    }
+
+    uint64_t padded = ROUND_UP(len, DIRECT_IO_ALIGN);
+    if (buf != io_buf) {
+        memcpy(io_buf, buf, len);
+    }
+    memset(io_buf + len, 0, padded - len);
+
+    ssize_t written = write(fd, io_buf, padded);
+    if (written == -1) {
+        return -1;
+    }
+    if (ftruncate(fd, len) == -1) {
+        PERROR("ftruncate in bucket_write");
+        return -1;
+    }
+    return (written > len) ? len : written;
+}
+
+/*
+ * In fadvise mode, tell the kernel not to keep a bucket's pages around:
+ * whoever reads through BackFS gets them from FUSE's page cache anyway.
+ * Dirty pages can't be dropped until they're written back, so after a fill
+ * this starts writeback and drops whatever is already clean.
+ */
+void bucket_drop_pages(int fd, uint64_t offset, uint64_t len, bool dirty)
+{
+    if (io_mode != CACHE_IO_FADVISE)
+        return;
+    if (dirty) {
+        sync_file_range(fd, offset, len, SYNC_FILE_RANGE_WRITE);
+    }
+    posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+}
+
+/*
+ * Record the checksum of a bucket's data.
+ * This gets written before the data, so a torn data write shows up as a
+ * mismatch instead of going unnoticed.
+ */
+int write_bucket_checksum(const char *bucketpath, uint32_t crc)
+{
+    // new data; nothing before startup could have torn it
+    mark_verified(bucket_path_to_number(bucketpath));
+
+    char crcpath[PATH_MAX];
+    snprintf(crcpath, PATH_MAX, "%s/crc32c", bucketpath);
+    FILE *f = fopen(crcpath, "w");
+    if (f == NULL) {
+        PERROR("opening crc32c file failed");
+        return -1;
+    }
+    fprintf(f, "%08x\n", crc);
+    fclose(f);
+    return 0;
+}
+
+/*
+ * Read the checksum of a bucket's data.
+ * Returns false if there isn't one (i.e. the bucket was filled by an older
+ * version of BackFS), in which case the data can't be verified.
+ */
+bool read_bucket_checksum(const char *bucketpath, uint32_t *crc)
+{
+    char crcpath[PATH_MAX];
+    snprintf(crcpath, PATH_MAX, "%s/crc32c", bucketpath);
+    FILE *f = fopen(crcpath, "r");
+    if (f == NULL) {
+        if (errno != ENOENT) {
+            PERROR("opening crc32c file failed");
+        }
+        return false;
+    }
+    unsigned int value;
+    bool ok = (fscanf(f, "%x", &value) == 1);
+    fclose(f);
+    if (!ok) {
+        ERROR("error reading crc32c file in %s\n", bucketpath);
+        return false;
+    }
+    *crc = (uint32_t) value;
+    return true;
+}
+
+/*
+ * Note that a bucket's data is known to match its checksum since startup.
+ * Caller holds the lock.
+ */
+void mark_verified(uint32_t number)
+{
+    if (grow_number_flags(&verified, &verified_size, number)) {
+        verified[number] = true;
+    }
+}
+
+/*
+ * Decide whether this read of a bucket gets its checksum verified: always
+ * the first since startup, as a crash can have torn what was being written
+ * then, and after that verify_percent of them.
+ * Caller holds the lock (for verify_seed).
+ */
+bool should_verify(uint32_t number)
+{
+    if (verify_percent == 0)
+        return false;
+    if (verify_percent >= 100)
+        return true;
+    if (number >= verified_size || !verified[number])
+        return true;
+    return (unsigned int)(rand_r(&verify_seed) % 100) < verify_percent;
+}
+
+/*
+ * What the backing file's stat says it is now.
+ */
+void cache_validator_from_stat(struct cache_validator *validator,
+        const struct stat *st)
+{
+    validator->mtime = st->st_mtim.tv_sec;
+    validator->mtime_nsec = st->st_mtim.tv_nsec;
+    validator->ctime = st->st_ctim.tv_sec;
+    validator->ctime_nsec = st->st_ctim.tv_nsec;
+    validator->size = st->st_size;
+}
+
+static bool same_validator(const struct cache_validator *a,
+        const struct cache_validator *b)
+{
+    return a->mtime == b->mtime && a->mtime_nsec == b->mtime_nsec
+        && a->ctime == b->ctime && a->ctime_nsec == b->ctime_nsec
+        && a->size == b->size;
+}
+
+/*
+ * The same validator but for the ctime, which renames, links and chmods move
+ * too.
+ */
+static bool same_data_validator(const struct cache_validator *a,
+        const struct cache_validator *b)
+{
+    return a->mtime == b->mtime && a->mtime_nsec == b->mtime_nsec
+        && a->size == b->size;
+}
+
+/*
+ * The slot in validators[] for a file name.
+ */
+static struct validator_slot * validator_slot(const char *filename)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const unsigned char *p = (const unsigned char*)filename; *p != '\0'; p++) {
+        hash ^= *p;
+        hash *= 0x100000001b3ULL;
+    }
+    return &validators[(hash ^ (hash >> 32)) % VALIDATOR_SLOTS];
+}
+
+static void remember_validator(const char *filename,
+        const struct cache_validator *validator)
+{
+    struct validator_slot *slot = validator_slot(filename);
+    if (slot->filename == NULL || strcmp(slot->filename, filename) != 0) {
+        FREE(slot->filename);
+        slot->filename = strdup(filename);
+    }
+    slot->generation = map_generation;
+    slot->v = *validator;
+}
+
+/*
+ * Drop what validators[] has for a file name, when the name is linked to
+ * other data or unlinked.
+ */
+static void forget_validator(const char *filename)
+{
+    struct validator_slot *slot = validator_slot(filename);
+    if (slot->filename != NULL && strcmp(slot->filename, filename) == 0) {
+        FREE(slot->filename);
+    }
+}
+
+/*
+ * Record the backing file's validator for a cached file.
+ * Caller holds the lock.
+ */
+void write_validator(const char *filename,
+        const struct cache_validator *validator)
+{
+    char mtimepath[PATH_MAX];
+    snprintf(mtimepath, PATH_MAX, "%s/map%s/mtime", cache_dir, filename);
+    FILE *f = fopen(mtimepath, "w");
+    if (f == NULL) {
+        PERROR("opening mtime file failed");
+        return;
+    }
+    fprintf(f, "%lld %lu %llu %lld %lu\n", (long long) validator->mtime,
+            (unsigned long) validator->mtime_nsec,
+            (unsigned long long) validator->size,
+            (long long) validator->ctime,
+            (unsigned long) validator->ctime_nsec);
+    fclose(f);
+    remember_validator(filename, validator);
+}
+
+/*
+ * The validator recorded for a cached file, from validators[] if it's there.
+ * An mtime file from before validators had more than the mtime's seconds in
+ * them sets only_mtime. Returns false if there isn't one that can be read.
+ * Caller holds the lock.
+ */
+bool read_validator(const char *filename, struct cache_validator *validator,
+        bool *only_mtime)
+{
+    *only_mtime = false;
+    struct validator_slot *slot = validator_slot(filename);
+    if (slot->filename != NULL && slot->generation == map_generation
+            && strcmp(slot->filename, filename) == 0) {
+        *validator = slot->v;
+        return true;
+    }
+
+    char mtimepath[PATH_MAX];
+    snprintf(mtimepath, PATH_MAX, "%s/map%s/mtime", cache_dir, filename);
+    FILE *f = fopen(mtimepath, "r");
+    if (f == NULL) {
+        PERROR("open mtime file failed");
+        return false;
+    }
+
+    long long mtime = 0, ctime = 0;
+    unsigned long mtime_nsec = 0, ctime_nsec = 0;
+    unsigned long long size = 0;
+    int n = fscanf(f, "%lld %lu %llu %lld %lu", &mtime, &mtime_nsec, &size,
+            &ctime, &ctime_nsec);
+    if (n != 1 && n != 5) {
+        ERROR("error reading mtime file %s\n", mtimepath);
+        fclose(f);
+        unlink(mtimepath);
+        return false;
+    }
+    fclose(f);
+
+    validator->mtime = mtime;
+    validator->mtime_nsec = mtime_nsec;
+    validator->size = size;
+    validator->ctime = ctime;
+    validator->ctime_nsec = ctime_nsec;
+    *only_mtime = (n == 1);
+    if (!*only_mtime) {
+        remember_validator(filename, validator);
+    }
+    return true;
+}
+
+/*
+ * Compare the validator recorded for a file in the cache against the backing
+ * file's. On a mismatch, the file's cached data is invalidated, except for
+ * dirty blocks. Returns true if they match.
+ * Caller holds the lock.
+ */
+bool check_validator(const char *filename,
+        const struct cache_validator *validator)
+{
+    struct cache_validator cached = {0};
+    bool only_mtime = false;
+    bool found = read_validator(filename, &cached, &only_mtime);
+    if (found && !only_mtime && !same_validator(&cached, validator)) {
+        // validators[] can be behind the mtime file, when it was written
+        // under another name of the same file; go by the file
+        forget_validator(filename);
+        found = read_validator(filename, &cached, &only_mtime);
+    }
+
+    if (found && only_mtime && cached.mtime == validator->mtime) {
+        // recorded by an older version; it's the same file as far as it can
+        // tell, so keep the data and go by the whole validator from now on
+        write_validator(filename, validator);
+        return true;
+    }
+
+    if (found && !only_mtime && key_fn != NULL
+            && !same_validator(&cached, validator)
+            && same_data_validator(&cached, validator)
+            && file_key_unchanged(filename)) {
+        // only the ctime moved, and the name still refers to the same file:
+        // it was renamed or linked behind BackFS's back, which leaves the data
+        // alone; keep it, as cache_refresh_validator() does for BackFS's own
+        DEBUG("metadata of %s changed outside BackFS; keeping its cached data\n",
+                filename);
+        write_validator(filename, validator);
+        return true;
+    }
+
+    if (!found || only_mtime || !same_validator(&cached, validator)) {
+        stats_inc(STATS_MTIME_MISMATCHES);
+        if (key_fn != NULL && rebind_file(filename)) {
+            // what's cached for the name now gets checked on the next access
+            return false;
+        }
+
+        // mismatch; invalidate and return
+        if (cached.mtime != validator->mtime) {
+            DEBUG("cache data is from mtime %lld, the backing file's is %lld\n",
+                    (long long) cached.mtime, (long long) validator->mtime);
+        } else {
+            DEBUG("backing file changed within the same second (mtime %lld.%09lu,"
+                    " was .%09lu; size %llu, was %llu)\n",
+                    (long long) validator->mtime,
+                    (unsigned long) validator->mtime_nsec,
+                    (unsigned long) cached.mtime_nsec,
+                    (unsigned long long) validator->size,
+                    (unsigned long long) cached.size);
+        }
+        cache_invalidate_file_real(filename, true, false);
+        if (file_is_dirty(filename)) {
+            // the blocks not written back yet were kept, and they're newer
+            // than whatever changed; go by the new validator from now on
+            write_validator(filename, validator);
+        }
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Check whether a file has data in the cache that is still current, going by
+ * the same validator check cache_fetch() does. If the file has changed, its cached
+ * data is invalidated.
+ *
+ * Returns 1 if the cached data is current, 0 if nothing is cached for the file
+ * (anymore). On error returns -1 and sets errno.
+ */
+int cache_file_is_current(const char *filename,
+        const struct cache_validator *validator)
+{
+    if (filename == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char mtimepath[PATH_MAX];
+    snprintf(mtimepath, PATH_MAX, "map%s/mtime", filename);
+
+    pthread_mutex_lock(&lock);
+
+    int ret = 0;
+    if (fsll_file_exists(cache_dir, mtimepath)) {
+        ret = check_validator(filename, validator) ? 1 : 0;
+    }
+
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+/*
+ * Record a new validator for a cached file after BackFS changed the backing
+ * file's metadata (renamed, linked, chmodded it...), which moves its ctime but
+ * not its data. Only done if the mtime and size still match what's cached;
+ * otherwise the next read finds the mismatch as usual.
+ */
+void cache_refresh_validator(const char *filename,
+        const struct cache_validator *validator)
+{
+    if (filename == NULL) {
+        return;
+    }
+
+    char mtimepath[PATH_MAX];
+    snprintf(mtimepath, PATH_MAX, "map%s/mtime", filename);
+
+    pthread_mutex_lock(&lock);
+
+    struct cache_validator cached;
+    bool only_mtime = false;
+    if (fsll_file_exists(cache_dir, mtimepath)
+            && read_validator(filename, &cached, &only_mtime)
+            && cached.mtime == validator->mtime
+            && (only_mtime || same_data_validator(&cached, validator))
+            && !same_validator(&cached, validator)) {
+        DEBUG("metadata of %s changed; keeping its cached data\n", filename);
+        write_validator(filename, validator);
+    }
+
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Check whether a block is in the cache and current, like cache_fetch() but
+ * without reading it. A cached block counts as just used, as it would if it
+ * were read.
+ *
+ * Returns 1 if it's cached, 0 if not. On error returns -1 and sets errno.
+ */
+int cache_touch_block(const char *filename, uint32_t block,
+        const struct cache_validator *validator)
+{
+    if (filename == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char mapfile[PATH_MAX];
+    snprintf(mapfile, PATH_MAX, "%s/map%s/%lu",
+            cache_dir, filename, (unsigned long) block);
+
+    pthread_mutex_lock(&lock);
+
+    int ret = 0;
+    char bucketpath[PATH_MAX];
+    ssize_t bplen = readlink(mapfile, bucketpath, PATH_MAX-1);
+    if (bplen == -1) {
+        if (errno != ENOENT && errno != ENOTDIR) {
+            PERROR("readlink error");
+            errno = EIO;
+            ret = -1;
+        }
+        goto exit;
+    }
+    bucketpath[bplen] = '\0';
+
+    // same as cache_fetch(): dirty blocks survive a change
+    if (!check_validator(filename, validator)) {
+        char kept[PATH_MAX];
+        ssize_t keptlen = readlink(mapfile, kept, PATH_MAX-1);
+        if (keptlen != bplen || memcmp(kept, bucketpath, bplen) != 0) {
+            goto exit;
+        }
+    }
+
+    bucket_to_head(bucketpath);
+    ret = 1;
+
+exit:
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+/*
+ * don't use this function directly.
+ */
+int cache_fetch_real(const char *filename, uint32_t block, uint64_t offset,
+        char *buf, uint64_t len, uint64_t *bytes_read,
+        const struct cache_validator *validator)
+{
+    if (offset + len > bucket_max_size || filename == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (len == 0) {
+        *bytes_read = 0;
+        return 0;
+    }
+
+    DEBUG("getting block %lu of file %s\n", (unsigned long) block, filename);
+
+    struct cache_file_key key;
+    bool have_key = unmapped_file_key(filename, &key);
+
+    //###
+    pthread_mutex_lock(&lock);
+
+    char mapfile[PATH_MAX];
+    snprintf(mapfile, PATH_MAX, "%s/map%s/%lu",
+            cache_dir, filename, (unsigned long) block);
+    char bucketpath[PATH_MAX];
+    ssize_t bplen = readlink(mapfile, bucketpath, PATH_MAX-1);
+    if (bplen == -1 && errno == ENOENT && have_key) {
+        // maybe it's cached under another name
+        char *filedir = file_dir(filename);
+        if (filedir == NULL && bind_file_key(filename, &key)) {
+            bplen = readlink(mapfile, bucketpath, PATH_MAX-1);
+        }
+        else {
+            errno = ENOENT;
+        }
+        FREE(filedir);
+    }
+    if (bplen == -1) {
+        if (errno == ENOENT || errno == ENOTDIR) {
+            DEBUG("block not in cache\n");
+            errno = ENOENT;
+            pthread_mutex_unlock(&lock);
+            return -1;
         } else {
-            DEBUG("cache data is %llu seconds newer than the backing data\n",
-                 (unsigned long long) bucket_mtime - mtime);
+            PERROR("readlink error");
+            errno = EIO;
+            pthread_mutex_unlock(&lock);
+            return -1;
+        }
+    }
+    bucketpath[bplen] = '\0';
+
+    bucket_to_head(bucketpath);
+    
+    // if the file changed, the block is still good if it was dirty (kept),
+    // unless the name was linked to another file's data
+    if (!check_validator(filename, validator)) {
+        char kept[PATH_MAX];
+        ssize_t keptlen = readlink(mapfile, kept, PATH_MAX-1);
+        if (keptlen != bplen || memcmp(kept, bucketpath, bplen) != 0) {
+            errno = ENOENT;
+            pthread_mutex_unlock(&lock);
+            return -1;
         }
-        cache_invalidate_file_real(filename, true);
-        errno = ENOENT;
-        pthread_mutex_unlock(&lock);
-        return -1;
     }
     
     // [cache_dir]/buckets/%lu/data
     char bucketdata[PATH_MAX];
     snprintf(bucketdata, PATH_MAX, "%s/data", bucketpath);
 
-    uint64_t size = 0;
-    struct stat stbuf;
-    if (stat(bucketdata, &stbuf) == -1) {
-        PERROR("stat on bucket error");
-        errno = EIO;
-        pthread_mutex_unlock(&lock);
+    uint64_t size = 0;
+    struct stat stbuf;
+    if (stat(bucketdata, &stbuf) == -1) {
+        PERROR("stat on bucket error");
+        errno = EIO;
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    size = (uint64_t) stbuf.st_size;
+
+    if (size < offset) {
+        WARN("offset for read is past the end: %llu vs %llu, bucket %s\n",
+                (unsigned long long) offset,
+                (unsigned long long) size,
+                bucketname(bucketpath));
+        pthread_mutex_unlock(&lock);
+        *bytes_read = 0;
+        return 0;
+    }
+
+    /*
+    if (e->bucket->size - offset < len) {
+        WARN("length + offset for read is past the end\n");
+        errno = ENXIO;
+        FREE(f);
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    */
+
+    bool direct;
+    int fd = open_bucket_data(bucketdata, O_RDONLY, &direct);
+    if (fd == -1) {
+        PERROR("error opening file from cache dir");
+        errno = EBADF;
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+
+    uint32_t expected_crc;
+    uint32_t number = bucket_path_to_number(bucketpath);
+    if (should_verify(number) && read_bucket_checksum(bucketpath, &expected_crc)) {
+        // need the whole block to check it; the read is served from the copy
+        ssize_t nread = bucket_pread(fd, direct, io_buf, size, 0);
+        uint32_t crc = 0;
+        if (nread != -1) {
+            crc = crc32c(0, io_buf, nread);
+        }
+        if (nread != size || crc != expected_crc) {
+            ERROR("checksum mismatch on block %lu of %s (bucket %s): "
+                    "expected %08x, got %08x over %lld of %llu bytes\n",
+                    (unsigned long) block, filename, bucketname(bucketpath),
+                    expected_crc, crc, (long long) nread,
+                    (unsigned long long) size);
+            close(fd);
+            free_bucket_mid_queue(bucketpath);
+            errno = ENOENT;
+            pthread_mutex_unlock(&lock);
+            return -1;
+        }
+
+        mark_verified(number);
+        *bytes_read = (size - offset < len) ? (size - offset) : len;
+        memcpy(buf, io_buf + offset, *bytes_read);
+        bucket_drop_pages(fd, 0, 0, false);
+    } else {
+        *bytes_read = bucket_pread(fd, direct, buf, len, offset);
+        if (*bytes_read == -1) {
+            PERROR("error reading file from cache dir");
+            errno = EIO;
+            close(fd);
+            pthread_mutex_unlock(&lock);
+            return -1;
+        }
+        bucket_drop_pages(fd, offset, len, false);
+    }
+
+    if (*bytes_read != len) {
+        DEBUG("read fewer than requested bytes from cache file: %llu instead of %llu\n", 
+                (unsigned long long) *bytes_read,
+                (unsigned long long) len
+        );
+        /*
+        errno = EIO;
+        FREE(f);
+        FREE(cachefile);
+        close(fd);
+        pthread_mutex_unlock(&lock);
+        return -1;
+        */
+    }
+
+    close(fd);
+
+    pthread_mutex_unlock(&lock);
+    //###
+
+    return 0;
+}
+
+/*
+ * Read a block from the cache.
+ * Important: you can specify less than one block, but not more.
+ * Nor can a read be across block boundaries.
+ *
+ * validator is what the backing file looks like now (see
+ * cache_validator_from_stat()). If what's in the cache doesn't match this,
+ * the cache data is invalidated and this function returns -1 and sets
+ * ENOENT.
+ *
+ * If the block's checksum is verified and doesn't match, the bucket is freed
+ * and this is also treated as a miss (-1 / ENOENT).
+ *
+ * Returns 0 on success.
+ * On error returns -1 and sets errno.
+ * In particular, if the block is not in the cache, sets ENOENT
+ */
+int cache_fetch(const char *filename, uint32_t block, uint64_t offset, 
+        char *buf, uint64_t len, uint64_t *bytes_read,
+        const struct cache_validator *validator)
+{
+    uint64_t start = stats_now();
+    int ret = cache_fetch_real(filename, block, offset, buf, len, bytes_read,
+            validator);
+    stats_record(STATS_CACHE_FETCH, start);
+    return ret;
+}
+
+/*
+ * Whether the keep_fn wants a bucket's block kept.
+ * Caller holds the lock.
+ */
+bool keep_bucket(const char *bucketpath)
+{
+    char *parent = fsll_getlink(bucketpath, "parent");
+    char *slash = (parent == NULL) ? NULL : strrchr(parent, '/');
+    if (slash == NULL) {
+        FREE(parent);
+        return false;
+    }
+
+    *slash = '\0';
+    char *filename = read_file_name(parent);
+    bool keep = (filename != NULL
+            && keep_fn(filename, (uint32_t) strtoul(slash + 1, NULL, 10)));
+    FREE(filename);
+    FREE(parent);
+    return keep;
+}
+
+/*
+ * Free the least recently used bucket that isn't dirty. Dirty buckets found at
+ * the tail on the way are moved to the head; they can go once written back.
+ * So are a few the keep_fn wants kept.
+ * Returns the space freed, which is 0 if there was nothing to free.
+ */
+uint64_t free_tail_bucket()
+{
+    uint64_t freed_bytes = 0;
+    char *tail = fsll_getlink(cache_dir, "buckets/tail");
+
+    if (tail == NULL) {
+        ERROR("can't free the tail bucket, no buckets in queue!\n");
+        goto exit;
+    }
+
+    uint32_t skip = dirty_count;
+    unsigned int kept = 0;
+    for (;;) {
+        if (find_dirty(bucket_path_to_number(tail)) != NULL) {
+            if (skip-- == 0) {
+                DEBUG("every bucket in the cache is dirty\n");
+                pthread_cond_broadcast(&flush_cond);
+                goto exit;
+            }
+        } else if (keep_fn != NULL && kept < EVICT_SECOND_CHANCES
+                && keep_bucket(tail)) {
+            kept++;
+            stats_inc(STATS_HEAT_KEPT);
+        } else {
+            break;
+        }
+        bucket_to_head(tail);
+        FREE(tail);
+        tail = fsll_getlink(cache_dir, "buckets/tail");
+    }
+
+    freed_bytes = free_bucket(tail);
+    stats_inc(STATS_EVICTIONS);
+    DEBUG("freed %llu bytes in bucket %lu\n",
+            (unsigned long long)freed_bytes,
+            (unsigned long)bucket_path_to_number(tail));
+
+exit:
+    FREE(tail);
+    return freed_bytes;
+}
+
+/*
+ * Space the cache may occupy: whatever it's using now plus what's free on the
+ * device, limited by the configured cache size.
+ * Caller holds the lock.
+ */
+uint64_t cache_capacity(uint64_t dev_free)
+{
+    uint64_t capacity = cache_used_size + dev_free;
+    if (!use_whole_device && cache_size < capacity) {
+        capacity = cache_size;
+    }
+    return capacity;
+}
+
+/*
+ * Background eviction thread.
+ *
+ * Once usage goes over the high watermark, frees buckets from the tail of the
+ * used queue, a batch at a time, until it is back under the low watermark.
+ * This keeps the statvfs() and the bucket freeing out of cache_add().
+ */
+void* evictor(void* arg)
+{
+    if (arg != NULL) {
+        abort();
+    }
+
+    for (;;) {
+        uint64_t dev_free = get_cache_fs_free_size(cache_dir);
+
+        pthread_mutex_lock(&lock);
+        if (stopping) {
+            pthread_mutex_unlock(&lock);
+            break;
+        }
+        dev_free_estimate = dev_free;
+
+        uint64_t capacity = cache_capacity(dev_free);
+        uint64_t high = capacity / 100 * evict_high_percent;
+        uint64_t low = capacity / 100 * evict_low_percent;
+        evict_high_bytes = high;
+
+        // Until the initial size check is done, cache_used_size is an
+        // overestimate; leave it to make_space_available() until then.
+        if (to_check == NULL && cache_used_size > high) {
+            DEBUG("evictor: %llu bytes used, high watermark %llu, low %llu\n",
+                    (unsigned long long) cache_used_size,
+                    (unsigned long long) high,
+                    (unsigned long long) low);
+
+            uint64_t freed = 0;
+            unsigned int buckets = 0;
+            bool empty = false;
+            while (!empty && cache_used_size > low && !stopping) {
+                for (int i = 0; i < EVICT_BATCH && cache_used_size > low; i++) {
+                    if (!fsll_file_exists(cache_dir, "buckets/tail")) {
+                        empty = true;
+                        break;
+                    }
+                    uint64_t bucket_freed = free_tail_bucket();
+                    if (bucket_freed == 0) {
+                        // nothing but dirty buckets left
+                        empty = true;
+                        break;
+                    }
+                    freed += bucket_freed;
+                    buckets++;
+                }
+
+                // let foreground operations in between batches
+                pthread_mutex_unlock(&lock);
+                pthread_mutex_lock(&lock);
+            }
+
+            INFO("evictor: freed %llu bytes in %u buckets\n",
+                    (unsigned long long) freed, buckets);
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += EVICT_INTERVAL;
+        pthread_cond_timedwait(&evict_cond, &lock, &deadline);
+
+        pthread_mutex_unlock(&lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * don't use this function directly.
+ */
+void make_space_available_real(uint64_t bytes_needed)
+{
+    uint64_t bytes_freed = 0;
+
+    if (bytes_needed == 0)
+        return;
+
+    if (dev_free_estimate >= bytes_needed
+            && (use_whole_device || cache_used_size + bytes_needed <= cache_size)) {
+        dev_free_estimate -= bytes_needed;
+        if (cache_used_size + bytes_needed > evict_high_bytes) {
+            pthread_cond_signal(&evict_cond);
+        }
+        return;
+    }
+
+    // evictor is behind; get it going, and make room ourselves meanwhile
+    pthread_cond_signal(&evict_cond);
+
+    uint64_t dev_free = get_cache_fs_free_size(cache_dir);
+    dev_free_estimate = dev_free;
+    if (dev_free >= bytes_needed) {
+        // device has plenty
+        if (use_whole_device) {
+            return;
+        } else {
+            // cache_size is limiting factor
+            if (cache_used_size + bytes_needed <= cache_size) {
+                return;
+            } else {
+                bytes_needed = (cache_used_size + bytes_needed) - cache_size;
+            }
+        }
+    } else {
+        // dev_free is limiting factor
+        bytes_needed = bytes_needed - dev_free;
+    }
+
+    DEBUG("need to free %llu bytes\n",
+            (unsigned long long) bytes_needed);
+
+    while (bytes_freed < bytes_needed) {
+        if (!fsll_file_exists(cache_dir, "buckets/tail")) {
+            WARN("cache is empty, but still need %llu bytes\n",
+                    (unsigned long long) (bytes_needed - bytes_freed));
+            break;
+        }
+        uint64_t freed = free_tail_bucket();
+        if (freed == 0) {
+            WARN("only dirty buckets left, but still need %llu bytes\n",
+                    (unsigned long long) (bytes_needed - bytes_freed));
+            break;
+        }
+        bytes_freed += freed;
+    }
+
+    DEBUG("freed %llu bytes total\n",
+            (unsigned long long) bytes_freed);
+}
+
+/*
+ * Make sure there's room for bytes_needed more bytes in the cache.
+ * Caller holds the lock.
+ *
+ * Normally the evictor has already made room, and this just checks the
+ * running estimates. Only if it has fallen behind do we statvfs and free
+ * buckets here.
+ */
+void make_space_available(uint64_t bytes_needed)
+{
+    uint64_t start = stats_now();
+    make_space_available_real(bytes_needed);
+    stats_record(STATS_MAKE_SPACE, start);
+}
+
+/*
+ * Wait until len more bytes of dirty data fit under the limit.
+ * Caller holds the lock.
+ */
+void wait_for_dirty_room(uint64_t len)
+{
+    while (dirty_bytes > 0 && dirty_bytes + len > writeback_max_dirty) {
+        DEBUG("too much dirty data; waiting for the flushers\n");
+        pthread_cond_broadcast(&flush_cond);
+        pthread_cond_wait(&dirty_cond, &lock);
+    }
+}
+
+/*
+ * Make a directory for a file that has nothing cached, and link it into the
+ * map. With inode keys (key isn't NULL), if the same file is cached under
+ * another name, link to that instead.
+ * Returns its path (free it when done), or NULL and sets errno.
+ * Caller holds the lock.
+ */
+char * make_file_dir(const char *filename, const struct cache_file_key *key)
+{
+    if (key != NULL && bind_file_key(filename, key)) {
+        return file_dir(filename);
+    }
+
+    char *filedir = NULL;
+    asprintf(&filedir, "%s/files/%llu", cache_dir,
+            (unsigned long long) new_file_id());
+
+    DEBUG("making %s\n", filedir);
+    int result = mkdir(filedir, 0700);
+    if (result == -1 && errno == ENOSPC) {
+        DEBUG("mkdir says ENOSPC, freeing and trying again\n");
+        stats_inc(STATS_SPACE_RETRIES);
+        free_tail_bucket();
+        result = mkdir(filedir, 0700);
+    }
+    if (result == -1) {
+        if (errno != ENOSPC) {
+            PERROR("mkdir in make_file_dir");
+            ERROR("\tcaused by mkdir(%s)\n", filedir);
+            errno = EIO;
+        }
+        FREE(filedir);
+        return NULL;
+    }
+
+    write_file_name(filedir, filename);
+    if (key != NULL) {
+        write_file_key(filedir, key);
+    }
+
+    if (map_link(filename, filedir) == -1) {
+        int err = errno;
+        free_file_dir(filedir);
+        FREE(filedir);
+        errno = err;
+        return NULL;
+    }
+
+    return filedir;
+}
+
+/*
+ * don't use this function directly.
+ */
+int cache_add_real(const char *filename, uint32_t block, const char *buf,
+              uint64_t len, const struct cache_validator *validator,
+              bool replace, bool dirty)
+{
+    if (len > bucket_max_size) {
+        errno = EOVERFLOW;
         return -1;
     }
-    size = (uint64_t) stbuf.st_size;
 
-    if (size < offset) {
-        WARN("offset for read is past the end: %llu vs %llu, bucket %s\n",
-                (unsigned long long) offset,
-                (unsigned long long) size,
-                bucketname(bucketpath));
-        pthread_mutex_unlock(&lock);
-        *bytes_read = 0;
+    if (len == 0) {
         return 0;
     }
 
-    /*
-    if (e->bucket->size - offset < len) {
-        WARN("length + offset for read is past the end\n");
-        errno = ENXIO;
-        FREE(f);
-        pthread_mutex_unlock(&lock);
-        return -1;
+    char fileandblock[PATH_MAX];
+    snprintf(fileandblock, PATH_MAX, "map%s/%lu", filename, (unsigned long) block);
+
+    DEBUG("writing %llu bytes to %s\n", (unsigned long long) len, fileandblock);
+
+    uint32_t crc = crc32c(0, buf, len);
+
+    struct cache_file_key key;
+    bool have_key = unmapped_file_key(filename, &key);
+
+    //###
+    pthread_mutex_lock(&lock);
+
+    if (dirty) {
+        wait_for_dirty_room(len);
     }
-    */
 
-    int fd = open(bucketdata, O_RDONLY);
+    bool flush_again = false;
+    char *bucketpath = fsll_getlink(cache_dir, fileandblock);
+
+    if (bucketpath != NULL) {
+        if (fsll_file_exists(bucketpath, "data")) {
+            if (!replace) {
+                WARN("data already exists in cache\n");
+                FREE(bucketpath);
+                pthread_mutex_unlock(&lock);
+                return 0;
+            }
+            // Newly written data replaces whatever was there. If that's being
+            // written back right now, the old data lands in the backing file
+            // after ours, so ours has to be written back again after it.
+            struct dirty_bucket *old = find_dirty(bucket_path_to_number(bucketpath));
+            if (old != NULL && old->flushing) {
+                flush_again = true;
+            }
+            free_bucket_mid_queue(bucketpath);
+        }
+    }
+
+    // reserve the space up front, so the writes below only fail if the
+    // prediction was off
+    uint64_t footprint = bucket_footprint(len);
+    make_space_available(footprint);
+
+    char *filedir = file_dir(filename);
+    if (filedir == NULL) {
+        filedir = make_file_dir(filename, have_key ? &key : NULL);
+        if (filedir == NULL) {
+            FREE(bucketpath);
+            pthread_mutex_unlock(&lock);
+            return -1;
+        }
+    }
+
+    FREE(bucketpath);
+    bucketpath = next_bucket();
+    DEBUG("bucket path = %s\n", bucketpath);
+
+    char blockname[32];
+    snprintf(blockname, sizeof(blockname), "%lu", (unsigned long) block);
+    fsll_makelink(filedir, blockname, bucketpath);
+
+    char blocklink[PATH_MAX];
+    snprintf(blocklink, PATH_MAX, "%s/%s", filedir, blockname);
+    fsll_makelink(bucketpath, "parent", blocklink);
+    FREE(filedir);
+    
+    // write the validator; a dirty block doesn't change the backing file, so
+    // the one already recorded for the file's other blocks stays right
+    
+    char mtimepath[PATH_MAX];
+    snprintf(mtimepath, PATH_MAX, "map%s/mtime", filename);
+    if (!dirty || !fsll_file_exists(cache_dir, mtimepath)) {
+        write_validator(filename, validator);
+    }
+
+    write_bucket_checksum(bucketpath, crc);
+
+    // finally, write data
+
+    char datapath[PATH_MAX];
+    snprintf(datapath, PATH_MAX, "%s/data", bucketpath);
+
+    bool direct;
+    int fd = open_bucket_data(datapath, O_WRONLY | O_CREAT | O_TRUNC, &direct);
     if (fd == -1) {
-        PERROR("error opening file from cache dir");
-        errno = EBADF;
+        int err = (errno == ENOSPC) ? ENOSPC : EIO;
+        if (err != ENOSPC) {
+            PERROR("open in cache_add");
+            ERROR("\tcaused by open(%s, O_WRONLY|O_CREAT)\n", datapath);
+        }
+        free_bucket_mid_queue(bucketpath);
+        FREE(bucketpath);
+        errno = err;
         pthread_mutex_unlock(&lock);
         return -1;
     }
 
-    *bytes_read = pread(fd, buf, len, offset);
-    if (*bytes_read == -1) {
-        PERROR("error reading file from cache dir");
-        errno = EIO;
-        close(fd);
-        pthread_mutex_unlock(&lock);
-        return -1;
+    bool unchecked = is_unchecked(bucketpath);
+
+    // Allocate all the blocks before writing anything. If the estimate of
+    // free space was off, this fails cleanly, and we can free exactly what's
+    // missing instead of writing partial data and retrying.
+    bool preallocated = true;
+    int result = fallocate(fd, 0, 0, len);
+    if (result == -1 && errno == ENOSPC) {
+        DEBUG("no space for %llu bytes, freeing and trying again\n",
+                (unsigned long long) len);
+        stats_inc(STATS_SPACE_RETRIES);
+        uint64_t freed = 0;
+        while (freed < footprint && fsll_file_exists(cache_dir, "buckets/tail")) {
+            uint64_t bucket_freed = free_tail_bucket();
+            if (bucket_freed == 0)
+                break;
+            freed += bucket_freed;
+        }
+        result = fallocate(fd, 0, 0, len);
+    }
+    if (result == -1) {
+        if (errno == EOPNOTSUPP || errno == ENOSYS) {
+            // the cache filesystem can't preallocate; just write
+            preallocated = false;
+        } else {
+            if (errno != ENOSPC) {
+                PERROR("fallocate in cache_add");
+            }
+            DEBUG("unable to reserve space; not caching\n");
+            close(fd);
+            free_bucket_mid_queue(bucketpath);
+            FREE(bucketpath);
+            errno = ENOSPC;
+            pthread_mutex_unlock(&lock);
+            return -1;
+        }
     }
 
-    if (*bytes_read != len) {
-        DEBUG("read fewer than requested bytes from cache file: %llu instead of %llu\n", 
-                (unsigned long long) *bytes_read,
-                (unsigned long long) len
-        );
-        /*
-        errno = EIO;
-        FREE(f);
-        FREE(cachefile);
+    // free_bucket accounts for whatever size the data file has, so account
+    // for the preallocated size now
+    if (preallocated && !unchecked) {
+        cache_used_size += footprint;
+    }
+
+    ssize_t bytes_written = bucket_write(fd, direct, buf, len);
+    if (bytes_written != len) {
+        // a short write means the cache filesystem filled up
+        int err = ENOSPC;
+        if (bytes_written == -1 && errno != ENOSPC) {
+            PERROR("write in cache_add");
+            err = EIO;
+        } else {
+            DEBUG("short write to cache (%lld of %llu bytes); not caching\n",
+                    (long long) bytes_written, (unsigned long long) len);
+        }
+        if (!preallocated) {
+            // so free_bucket doesn't take back space we never accounted
+            if (ftruncate(fd, 0) == -1) {
+                PERROR("ftruncate in cache_add");
+                // account for what's left, so it comes out even
+                struct stat st;
+                if (fstat(fd, &st) == 0 && !unchecked) {
+                    cache_used_size += bucket_footprint(st.st_size);
+                }
+            }
+        }
         close(fd);
+        free_bucket_mid_queue(bucketpath);
+        FREE(bucketpath);
+        errno = err;
         pthread_mutex_unlock(&lock);
         return -1;
-        */
     }
 
+    DEBUG("%llu bytes written to cache\n",
+            (unsigned long long) bytes_written);
+
+    if (!preallocated && !unchecked) {
+        cache_used_size += footprint;
+    }
+
+    if (dirty || flush_again) {
+        // the cache is the only copy now; it has to be on disk before the
+        // write is acknowledged
+        struct dirty_bucket *d = mark_dirty(bucket_path_to_number(bucketpath),
+                filename, block, len);
+        bool gone = false;
+        if (d == NULL || sync_dirty(d, fd, true, &gone) == -1) {
+            close(fd);
+            if (!gone) {
+                free_bucket_mid_queue(bucketpath);
+            }
+            FREE(bucketpath);
+            errno = EIO;
+            pthread_mutex_unlock(&lock);
+            return -1;
+        }
+        if (gone) {
+            // written over or dropped while syncing; nothing left to do
+            close(fd);
+            FREE(bucketpath);
+            pthread_mutex_unlock(&lock);
+            return 0;
+        }
+    }
+
+    bucket_drop_pages(fd, 0, 0, true);
+
+    DEBUG("size now %llu bytes of %llu bytes (%lf%%)\n",
+            (unsigned long long) cache_used_size,
+            (unsigned long long) cache_size,
+            (double)100 * cache_used_size / cache_size
+    );
+
+    dump_queues();
+
     close(fd);
+    stats_inc(STATS_FILLS);
 
     pthread_mutex_unlock(&lock);
     //###
 
+    FREE(bucketpath);
     return 0;
 }
 
-uint64_t free_tail_bucket()
+/*
+ * Adds a data block to the cache.
+ * Important: this must be the FULL block. All subsequent reads will
+ * assume that the full block is here.
+ *
+ * Space for the block is reserved before anything is written, so it either
+ * gets cached whole or not at all. Returns 0 on success; on failure returns
+ * -1 and sets errno (ENOSPC if there just wasn't room).
+ */
+int cache_add(const char *filename, uint32_t block, const char *buf,
+              uint64_t len, const struct cache_validator *validator)
 {
-    uint64_t freed_bytes = 0;
-    char *tail = fsll_getlink(cache_dir, "buckets/tail");
+    uint64_t start = stats_now();
+    int ret = cache_add_real(filename, block, buf, len, validator, false, false);
+    stats_record(STATS_CACHE_ADD, start);
+    return ret;
+}
 
-    if (tail == NULL) {
-        ERROR("can't free the tail bucket, no buckets in queue!\n");
+/*
+ * Like cache_add(), but for data just written to the backing file: replaces
+ * whatever is cached for the block, and records the validator regardless.
+ */
+int cache_replace(const char *filename, uint32_t block, const char *buf,
+        uint64_t len, const struct cache_validator *validator)
+{
+    return cache_add_real(filename, block, buf, len, validator, true, false);
+}
+
+/*
+ * Adds a block of newly written data to the cache, to be written to the
+ * backing file later by a flusher thread. Replaces anything already cached
+ * for the block. Like cache_add(), this must be the full block (or the whole
+ * tail of the file).
+ *
+ * validator is the backing file's; it's only recorded if nothing else of
+ * the file is cached.
+ *
+ * Blocks while there's too much dirty data already. Once this returns 0, the
+ * data is safely on disk in the cache. On failure (including write-back not
+ * being enabled) returns -1 and sets errno, and the caller should write the
+ * data to the backing file itself.
+ */
+int cache_add_dirty(const char *filename, uint32_t block, const char *buf,
+        uint64_t len, const struct cache_validator *validator)
+{
+    if (writeback_threads == 0 || flush_fn == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (len > writeback_max_dirty) {
+        errno = EFBIG;
+        return -1;
+    }
+    return cache_add_real(filename, block, buf, len, validator, true, true);
+}
+
+/*
+ * don't use this function directly.
+ */
+int cache_update_real(const char *filename, uint32_t block, uint64_t offset,
+        const char *buf, uint64_t len, const struct cache_validator *validator,
+        bool dirty)
+{
+    int ret = 0;
+    int fd = -1;
+    char *bucketpath = NULL;
+
+    if (offset + len > bucket_max_size || filename == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char mappath[PATH_MAX];
+    snprintf(mappath, PATH_MAX, "map%s/%lu", filename, (unsigned long) block);
+
+    pthread_mutex_lock(&lock);
+
+    if (dirty) {
+        wait_for_dirty_room(bucket_max_size);
+    }
+
+    bucketpath = fsll_getlink(cache_dir, mappath);
+    if (bucketpath == NULL) {
+        DEBUG("block not in cache\n");
+        ret = -ENOENT;
         goto exit;
     }
 
-    freed_bytes = free_bucket(tail);
-    DEBUG("freed %llu bytes in bucket %lu\n",
-            (unsigned long long)freed_bytes,
-            (unsigned long)bucket_path_to_number(tail));
+    char datapath[PATH_MAX];
+    snprintf(datapath, PATH_MAX, "%s/data", bucketpath);
+
+    struct stat stbuf;
+    if (stat(datapath, &stbuf) == -1) {
+        PERROR("stat on bucket error");
+        ret = -EIO;
+        goto exit;
+    }
+    uint64_t size = stbuf.st_size;
+
+    bool direct;
+    fd = open_bucket_data(datapath, O_RDWR, &direct);
+    if (fd == -1) {
+        PERROR("error opening file from cache dir");
+        ret = -EIO;
+        goto exit;
+    }
+
+    // The merged block gets a new checksum, so anything wrong with the old
+    // data would be made permanent; always check it.
+    ssize_t nread = bucket_pread(fd, direct, io_buf, size, 0);
+    uint32_t crc = 0;
+    uint32_t expected_crc;
+    if (nread != -1) {
+        crc = crc32c(0, io_buf, nread);
+    }
+    if (nread != size || (read_bucket_checksum(bucketpath, &expected_crc)
+                && crc != expected_crc)) {
+        ERROR("checksum mismatch on block %lu of %s (bucket %s) before "
+                "updating it; dropping it\n",
+                (unsigned long) block, filename, bucketname(bucketpath));
+        close(fd);
+        fd = -1;
+        free_bucket_mid_queue(bucketpath);
+        ret = -ENOENT;
+        goto exit;
+    }
+
+    // writing past the end of a short (last) block: the gap is a hole
+    if (offset > size) {
+        memset(io_buf + size, 0, offset - size);
+    }
+    memcpy(io_buf + offset, buf, len);
+    uint64_t new_size = (offset + len > size) ? offset + len : size;
+
+    uint64_t old_footprint = bucket_footprint(size);
+    uint64_t new_footprint = bucket_footprint(new_size);
+    if (new_footprint > old_footprint) {
+        make_space_available(new_footprint - old_footprint);
+    }
+
+    write_bucket_checksum(bucketpath, crc32c(0, io_buf, new_size));
+    ssize_t written = bucket_write(fd, direct, io_buf, new_size);
+    if (written != new_size) {
+        PERROR("write in cache_update");
+        close(fd);
+        fd = -1;
+        free_bucket_mid_queue(bucketpath);
+        ret = -EIO;
+        goto exit;
+    }
+
+    if (!is_unchecked(bucketpath)) {
+        cache_used_size += new_footprint - old_footprint;
+    }
+
+    uint32_t number = bucket_path_to_number(bucketpath);
+    struct dirty_bucket *d = find_dirty(number);
+    if (dirty || d != NULL) {
+        // the bucket is (still) the only up to date copy of the block
+        bool marker = false;
+        if (d != NULL && !d->flushing && !d->syncing) {
+            dirty_bytes += new_size - d->len;
+            d->len = new_size;
+            if (dirty) {
+                d->since = time(NULL);
+            }
+        } else {
+            // what's being written back (or marked) now is missing this
+            // update
+            if (d != NULL) {
+                supersede_dirty(d);
+            }
+            d = mark_dirty(number, filename, block, new_size);
+            if (d == NULL) {
+                ret = -EIO;
+                goto exit;
+            }
+            marker = true;
+        }
+        bool gone = false;
+        if (sync_dirty(d, fd, marker, &gone) == -1) {
+            ret = -EIO;
+            goto exit;
+        }
+        if (gone) {
+            // written over or dropped while syncing
+            goto exit;
+        }
+    }
+
+    bucket_drop_pages(fd, 0, 0, true);
+    bucket_to_head(bucketpath);
 
 exit:
-    FREE(tail);
-    return freed_bytes;
+    if (!dirty && (ret == 0 || ret == -ENOENT)) {
+        // the backing file changed because of this write, not because the
+        // rest of what's cached is stale
+        char mtimepath[PATH_MAX];
+        snprintf(mtimepath, PATH_MAX, "map%s/mtime", filename);
+        if (fsll_file_exists(cache_dir, mtimepath)) {
+            write_validator(filename, validator);
+        }
+    }
+    if (fd != -1)
+        close(fd);
+    FREE(bucketpath);
+    pthread_mutex_unlock(&lock);
+    if (ret != 0) {
+        errno = -ret;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Merge a write into a block that's in the cache: len bytes of buf at offset
+ * within the block. For data that was just written to the backing file;
+ * validator is the backing file's afterwards, and gets recorded even if the block isn't
+ * cached, so the file's other cached blocks stay valid.
+ *
+ * Returns 0 on success. On error returns -1 and sets errno; ENOENT means the
+ * block isn't cached (or was dropped).
+ */
+int cache_update(const char *filename, uint32_t block, uint64_t offset,
+        const char *buf, uint64_t len, const struct cache_validator *validator)
+{
+    return cache_update_real(filename, block, offset, buf, len, validator,
+            false);
 }
 
-void make_space_available(uint64_t bytes_needed)
+/*
+ * Like cache_update(), but in write-back mode: the merged block is marked
+ * dirty instead of the data being written to the backing file first.
+ * Fails with ENOENT if the block isn't cached, and the caller has to write
+ * through.
+ */
+int cache_update_dirty(const char *filename, uint32_t block, uint64_t offset,
+        const char *buf, uint64_t len)
 {
-    uint64_t bytes_freed = 0;
+    if (writeback_threads == 0 || flush_fn == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return cache_update_real(filename, block, offset, buf, len, NULL, true);
+}
 
-    if (bytes_needed == 0)
-        return;
+/*
+ * Whether path is filename, or is under it if filename is a directory.
+ * A NULL filename matches everything.
+ */
+bool path_matches(const char *path, const char *filename)
+{
+    if (filename == NULL)
+        return true;
+    size_t len = strlen(filename);
+    if (len > 0 && filename[len - 1] == '/')
+        len--;
+    return strncmp(path, filename, len) == 0
+        && (path[len] == '\0' || path[len] == '/');
+}
 
-    uint64_t dev_free = get_cache_fs_free_size(cache_dir);
-    if (dev_free >= bytes_needed) {
-        // device has plenty
-        if (use_whole_device) {
-            return;
-        } else {
-            // cache_size is limiting factor
-            if (cache_used_size + bytes_needed <= cache_size) {
-                return;
-            } else {
-                bytes_needed = (cache_used_size + bytes_needed) - cache_size;
-            }
+/*
+ * Whether another entry for the same block is being written back. Writes of
+ * the same block have to reach the backing file in order.
+ */
+bool flush_conflict(const struct dirty_bucket *dirty)
+{
+    for (struct dirty_bucket *d = dirty_list; d != NULL; d = d->next) {
+        if (d != dirty && d->flushing && d->block == dirty->block
+                && strcmp(d->path, dirty->path) == 0) {
+            return true;
         }
-    } else {
-        // dev_free is limiting factor
-        bytes_needed = bytes_needed - dev_free;
     }
+    return false;
+}
 
-    DEBUG("need to free %llu bytes\n",
-            (unsigned long long) bytes_needed);
-
-    while (bytes_freed < bytes_needed) {
-        bytes_freed += free_tail_bucket();
+struct flush_failure* find_flush_failure(const char *path)
+{
+    for (struct flush_failure *f = flush_failures; f != NULL; f = f->next) {
+        if (strcmp(f->path, path) == 0)
+            return f;
     }
-
-    DEBUG("freed %llu bytes total\n",
-            (unsigned long long) bytes_freed);
+    return NULL;
 }
 
 /*
- * Adds a data block to the cache.
- * Important: this must be the FULL block. All subsequent reads will
- * assume that the full block is here.
+ * Note how writing back path went. Returns whether the error is worth
+ * logging: only the first failure in a row, and each time the wait grows.
  */
-int cache_add(const char *filename, uint32_t block, const char *buf,
-              uint64_t len, time_t mtime)
+bool note_flush_result(const char *path, int result, time_t now)
 {
-    if (len > bucket_max_size) {
-        errno = EOVERFLOW;
-        return -1;
+    struct flush_failure **link = &flush_failures;
+    while (*link != NULL && strcmp((*link)->path, path) != 0) {
+        link = &(*link)->next;
+    }
+    struct flush_failure *f = *link;
+
+    if (result == 0 || result == -ENOENT) {
+        if (f != NULL) {
+            INFO("writing back %s works again\n", path);
+            *link = f->next;
+            FREE(f->path);
+            FREE(f);
+        }
+        return false;
     }
 
-    if (len == 0) {
-        return 0;
+    if (f == NULL) {
+        f = (struct flush_failure*)malloc(sizeof(struct flush_failure));
+        if (f == NULL) {
+            return true;
+        }
+        f->path = strdup(path);
+        f->failures = 0;
+        f->next = flush_failures;
+        flush_failures = f;
     }
 
-    char fileandblock[PATH_MAX];
-    snprintf(fileandblock, PATH_MAX, "map%s/%lu", filename, (unsigned long) block);
+    time_t wait = writeback_delay > 0 ? writeback_delay : 1;
+    for (unsigned int i = 0; i < f->failures && wait < WRITEBACK_BACKOFF_MAX;
+            i++) {
+        wait *= 2;
+    }
+    if (wait > WRITEBACK_BACKOFF_MAX)
+        wait = WRITEBACK_BACKOFF_MAX;
+    f->failures++;
+    f->retry_at = now + wait;
 
-    DEBUG("writing %llu bytes to %s\n", (unsigned long long) len, fileandblock);
+    return f->failures == 1 || wait < WRITEBACK_BACKOFF_MAX
+        || f->failures % 16 == 0;
+}
 
-    //###
-    pthread_mutex_lock(&lock);
+void free_flush_failures(void)
+{
+    while (flush_failures != NULL) {
+        struct flush_failure *next = flush_failures->next;
+        FREE(flush_failures->path);
+        FREE(flush_failures);
+        flush_failures = next;
+    }
+}
 
-    char *bucketpath = fsll_getlink(cache_dir, fileandblock);
+/*
+ * Whether the flusher should write the dirty bucket back now. A file whose write-back
+ * keeps failing waits out its backoff even when dirty data is over half its
+ * limit; otherwise the flushers would retry it as fast as they could.
+ */
+bool flush_eligible(const struct dirty_bucket *dirty, const char *filename,
+        bool force, time_t now)
+{
+    if (dirty->flushing || dirty->syncing || dirty->superseded)
+        return false;
+    if (!path_matches(dirty->path, filename))
+        return false;
+    if (!force && now - dirty->since < writeback_delay
+            && dirty_bytes <= writeback_max_dirty / 2)
+        return false;
+    if (!force && flush_failures != NULL) {
+        struct flush_failure *f = find_flush_failure(dirty->path);
+        if (f != NULL && now < f->retry_at)
+            return false;
+    }
+    return !flush_conflict(dirty);
+}
 
-    if (bucketpath != NULL) {
-        if (fsll_file_exists(bucketpath, "data")) {
-            WARN("data already exists in cache\n");
-            FREE(bucketpath);
-            pthread_mutex_unlock(&lock);
-            return 0;
+/*
+ * Write back the oldest eligible dirty bucket, along with any following
+ * blocks of the same file that are also dirty, as one write.
+ * Unless force is set, buckets younger than the write-back delay are left
+ * alone, unless dirty data is over half its limit.
+ *
+ * Caller holds the lock; it's released during the write to the backing file.
+ * Returns the number of buckets written back (0 if there was nothing to do),
+ * or -errno if writing failed.
+ */
+int flush_batch(const char *filename, bool force)
+{
+    struct dirty_bucket *run[WRITEBACK_COALESCE_MAX];
+    int count = 0;
+    time_t now = time(NULL);
+
+    for (struct dirty_bucket *d = dirty_list; d != NULL; d = d->next) {
+        if (flush_eligible(d, filename, force, now)) {
+            run[count++] = d;
+            break;
         }
     }
+    if (count == 0)
+        return 0;
 
-    char *filemap = (char*)malloc(strlen(filename) + 4);
-    snprintf(filemap, strlen(filename)+4, "map%s", filename);
-
-    char *full_filemap_dir = (char*)malloc(strlen(cache_dir) + 5 + strlen(filename) + 1);
-    snprintf(full_filemap_dir, strlen(cache_dir)+5+strlen(filename)+1, "%s/map%s/",
-            cache_dir, filename);
-
-    DEBUG("map file = %s\n", filemap);
-    DEBUG("full filemap dir = %s\n", full_filemap_dir);
-
-    if (!fsll_file_exists(cache_dir, filemap)) {
-        FREE(filemap);
-        size_t i;
-        // start from "$cache_dir/map/"
-        for (i = strlen(cache_dir) + 5; i < strlen(full_filemap_dir); i++) {
-            if (full_filemap_dir[i] == '/') {
-                char *component = (char*)malloc(i+1);
-                strncpy(component, full_filemap_dir, i+1);
-                component[i] = '\0';
-                DEBUG("making %s\n", component);
-                if(mkdir(component, 0700) == -1 && errno != EEXIST) {
-                    if (errno == ENOSPC) {
-                        // try to free some space
-                        DEBUG("mkdir says ENOSPC, freeing and trying again\n");
-                        free_tail_bucket();
-                        errno = EAGAIN;
-                    }
-                    else {
-                        PERROR("mkdir in cache_add");
-                        ERROR("\tcaused by mkdir(%s)\n", component);
-                        errno = EIO;
-                    }
-                    FREE(component);
-                    FREE(full_filemap_dir);
-                    pthread_mutex_unlock(&lock);
-                    return -1;
-                }
-                FREE(component);
+    // only full blocks can have another one right after them
+    while (count < WRITEBACK_COALESCE_MAX
+            && run[count - 1]->len == bucket_max_size) {
+        struct dirty_bucket *next = NULL;
+        for (struct dirty_bucket *d = dirty_list; d != NULL; d = d->next) {
+            if (d->block == run[count - 1]->block + 1
+                    && strcmp(d->path, run[0]->path) == 0
+                    && flush_eligible(d, NULL, true, now)) {
+                next = d;
+                break;
             }
         }
-    } else {
-        FREE(filemap);
+        if (next == NULL)
+            break;
+        run[count++] = next;
     }
-    FREE(full_filemap_dir);
-
-    make_space_available(len);
-
-    FREE(bucketpath);
-    bucketpath = next_bucket();
-    DEBUG("bucket path = %s\n", bucketpath);
 
-    fsll_makelink(cache_dir, fileandblock, bucketpath);
+    char *buf = (char*)malloc(count * bucket_max_size);
+    uint64_t len = 0;
+    for (int i = 0; i < count; i++) {
+        char datapath[PATH_MAX];
+        snprintf(datapath, PATH_MAX, "%s/buckets/%lu/data",
+                cache_dir, (unsigned long) run[i]->number);
+        ssize_t nread = -1;
+        int fd = open(datapath, O_RDONLY);
+        if (fd != -1) {
+            nread = pread(fd, buf + len, run[i]->len, 0);
+            close(fd);
+        }
+        if (nread != run[i]->len) {
+            PERROR("reading dirty bucket");
+            ERROR("\tblock %lu of %s is lost\n",
+                    (unsigned long) run[i]->block, run[i]->path);
+            if (i == 0) {
+                forget_dirty(run[0]);
+                FREE(buf);
+                return -EIO;
+            }
+            count = i;
+            break;
+        }
+        len += nread;
+    }
 
-    char *fullfilemap = (char*)malloc(PATH_MAX);
-    snprintf(fullfilemap, PATH_MAX, "%s/%s", cache_dir, fileandblock);
-    fsll_makelink(bucketpath, "parent", fullfilemap);
-    FREE(fullfilemap);
-    
-    // write mtime
-    
-    char mtimepath[PATH_MAX];
-    snprintf(mtimepath, PATH_MAX, "%s/map%s/mtime", cache_dir, filename);
-    FILE *f = fopen(mtimepath, "w");
-    if (f == NULL) {
-        PERROR("opening mtime file in cache_add failed");
-    } else {
-        fprintf(f, "%llu\n", (unsigned long long) mtime);
-        fclose(f);
+    for (int i = 0; i < count; i++) {
+        run[i]->flushing = true;
     }
 
-    // finally, write data
+    char *path = strdup(run[0]->path);
+    uint64_t offset = (uint64_t) run[0]->block * bucket_max_size;
 
-    char datapath[PATH_MAX];
-    snprintf(datapath, PATH_MAX, "%s/data", bucketpath);
+    DEBUG("writing back %llu bytes (%d blocks) of %s at %llu\n",
+            (unsigned long long) len, count, path,
+            (unsigned long long) offset);
 
-    int fd = open(datapath, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
-    if (fd == -1) {
-        PERROR("open in cache_add");
-        ERROR("\tcaused by open(%s, O_WRONLY|O_CREAT)\n", datapath);
-        errno = EIO;
-        pthread_mutex_unlock(&lock);
-        return -1;
+    pthread_mutex_unlock(&lock);
+    struct cache_validator validator = {0};
+    int result = flush_fn(path, offset, buf, len, &validator);
+    pthread_mutex_lock(&lock);
+
+    if (note_flush_result(path, result, time(NULL))) {
+        struct flush_failure *f = find_flush_failure(path);
+        ERROR("writing back %s failed: %s; retrying in %ld seconds\n",
+                path, strerror(-result),
+                f != NULL ? (long) (f->retry_at - time(NULL)) : 0L);
     }
 
-    ssize_t bytes_written = write(fd, buf, len);
-    if (bytes_written == -1) {
-        if (errno == ENOSPC) {
-            DEBUG("nothing written (no space on device)\n");
-            bytes_written = 0;
+    for (int i = 0; i < count; i++) {
+        run[i]->flushing = false;
+        if (result == 0 || result == -ENOENT || run[i]->superseded) {
+            // done, or the file is gone so there's nothing to do
+            forget_dirty(run[i]);
         } else {
-            PERROR("write in cache_add");
-            errno = EIO;
-            close(fd);
-            pthread_mutex_unlock(&lock);
-            return -1;
+            // try again later
+            run[i]->since = time(NULL);
         }
     }
 
-    DEBUG("%llu bytes written to cache\n",
-            (unsigned long long) bytes_written);
-
-    bool unchecked = is_unchecked(bucketpath);
-    if (!unchecked) {
-        cache_used_size += bytes_written;
+    if (result == 0) {
+        // this write is why the backing file changed; don't invalidate the
+        // rest of the cached file over it
+        char mtimepath[PATH_MAX];
+        snprintf(mtimepath, PATH_MAX, "map%s/mtime", path);
+        if (fsll_file_exists(cache_dir, mtimepath)) {
+            write_validator(path, &validator);
+        }
     }
 
-    // for some reason (filesystem metadata overhead?) this may need to loop a
-    // few times to write everything out.
-    while (bytes_written != len) {
-        DEBUG("not all bytes written to cache\n");
+    pthread_cond_broadcast(&dirty_cond);
+    FREE(path);
+    FREE(buf);
 
-        // Try again, more forcefully this time.
-        // Don't care if the FS says it has space, make some space anyway.
-        free_tail_bucket();
+    return (result == 0 || result == -ENOENT) ? count : result;
+}
 
-        ssize_t more_bytes_written = write(fd, buf + bytes_written, len - bytes_written);
+/*
+ * Write-back thread.
+ */
+void* flusher(void* arg)
+{
+    if (arg != NULL) {
+        abort();
+    }
 
-        if (more_bytes_written == -1) {
-            if (errno == ENOSPC) {
-                // this is normal
-                DEBUG("nothing written (no space on device)\n");
-                more_bytes_written = 0;
-            } else {
-                PERROR("write error");
-                close(fd);
-                pthread_mutex_unlock(&lock);
-                return -EIO;
-            }
+    pthread_mutex_lock(&lock);
+    while (!stopping) {
+        if (flush_batch(NULL, false) <= 0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&flush_cond, &lock, &deadline);
         }
+    }
+    pthread_mutex_unlock(&lock);
 
-        DEBUG("%llu more bytes written to cache (%llu total)\n",
-            (unsigned long long) more_bytes_written,
-            (unsigned long long) more_bytes_written + bytes_written);
+    return NULL;
+}
+
+/*
+ * Write back all dirty data for a file, or everything under it if it's a
+ * directory, or everything at all if filename is NULL. Waits for writes
+ * already in progress too.
+ * Returns 0, or -errno if writing failed.
+ */
+int cache_flush_dirty(const char *filename)
+{
+    int ret = 0;
 
-        if (!unchecked) {
-          cache_used_size += more_bytes_written;
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        int result = flush_batch(filename, true);
+        if (result < 0) {
+            ret = result;
+            break;
         }
-        bytes_written += more_bytes_written;
-    }
+        if (result > 0)
+            continue;
 
-    DEBUG("size now %llu bytes of %llu bytes (%lf%%)\n",
-            (unsigned long long) cache_used_size,
-            (unsigned long long) cache_size,
-            (double)100 * cache_used_size / cache_size
-    );
+        // nothing we can write ourselves; anything left is being written by
+        // someone else
+        bool pending = false;
+        for (struct dirty_bucket *d = dirty_list; d != NULL; d = d->next) {
+            if (!d->superseded && path_matches(d->path, filename)) {
+                pending = true;
+                break;
+            }
+        }
+        if (!pending)
+            break;
+        pthread_cond_wait(&dirty_cond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
 
-    dump_queues();
+    return ret;
+}
 
-    close(fd);
+/*
+ * Where the file's dirty data ends: the file size as far as the cache knows,
+ * which can be past the end of the backing file. 0 if nothing is dirty.
+ */
+uint64_t cache_dirty_extent(const char *filename)
+{
+    uint64_t extent = 0;
 
+    pthread_mutex_lock(&lock);
+    for (struct dirty_bucket *d = dirty_list; d != NULL; d = d->next) {
+        if (!d->superseded && strcmp(d->path, filename) == 0) {
+            uint64_t end = (uint64_t) d->block * bucket_max_size + d->len;
+            if (end > extent)
+                extent = end;
+        }
+    }
     pthread_mutex_unlock(&lock);
-    //###
 
-    FREE(bucketpath);
-    return 0;
+    return extent;
 }
 
 int cache_has_file_real(const char *filename, uint64_t *cached_byte_count, bool do_lock)
@@ -1081,16 +5084,15 @@ int cache_has_file_real(const char *filename, uint64_t *cached_byte_count, bool
         }
     }
 
-    // Check if it's a file or directory (see if it has an mtime file).
-    asprintf(&data, "%s/mtime", mapdir);
+    // Check if it's a file or directory (files are links to their directory).
     bool is_file = false;
-    struct stat mtime_stat = {0};
-    if (0 == stat(data, &mtime_stat)) {
-        is_file = (mtime_stat.st_mode & S_IFREG) != 0;
+    struct stat map_stat = {0};
+    if (0 == lstat(mapdir, &map_stat)) {
+        is_file = S_ISLNK(map_stat.st_mode);
     }
-    else if (errno != ENOENT) {
-        PERROR("stat");
-        ERROR("\tstat on %s\n", mapdir);
+    else {
+        PERROR("lstat");
+        ERROR("\tlstat on %s\n", mapdir);
         ret = -EIO;
         goto exit;
     }
@@ -1098,7 +5100,8 @@ int cache_has_file_real(const char *filename, uint64_t *cached_byte_count, bool
     // Loop over the sub-entries in the map.
     struct dirent *dirent = NULL;
     while ((dirent = readdir(dir)) != NULL) {
-        if (dirent->d_name[0] != '.' && strcmp(dirent->d_name, "mtime") != 0) {
+        if (is_file ? (dirent->d_name[0] >= '0' && dirent->d_name[0] <= '9')
+                    : (dirent->d_name[0] != '.')) {
             FREE(data);
 
             if (is_file) {
@@ -1140,82 +5143,180 @@ int cache_has_file(const char *filename, uint64_t *cached_bytes)
     return cache_has_file_real(filename, cached_bytes, true);
 }
 
+/*
+ * Point dirty entries for path (or under it) at path_new, markers included.
+ * Normally there aren't any: the caller writes them back before renaming.
+ * Caller holds the lock.
+ */
+void rename_dirty(const char *path, const char *path_new)
+{
+    size_t len = strlen(path);
+    for (struct dirty_bucket *d = dirty_list; d != NULL; d = d->next) {
+        if (d->superseded || !path_matches(d->path, path))
+            continue;
+
+        char *renamed = NULL;
+        asprintf(&renamed, "%s%s", path_new, d->path + len);
+        FREE(d->path);
+        d->path = renamed;
+
+        if (d->syncing) {
+            // its writer rewrites the marker when it's done
+            continue;
+        }
+        char *contents = dirty_marker_contents(d);
+        if (write_dirty_marker(d->generation, contents, false) == -1) {
+            PERROR("rewrite dirty marker");
+        }
+        FREE(contents);
+    }
+}
+
+/*
+ * Update the name files of the cached files in a renamed map directory.
+ * This is one small write per file, however many blocks each has cached.
+ * Caller holds the lock.
+ */
+void rename_file_names(const char *path_new)
+{
+    char mapdir[PATH_MAX];
+    snprintf(mapdir, PATH_MAX, "%s/map%s", cache_dir, path_new);
+    DIR *d = opendir(mapdir);
+    if (d == NULL) {
+        PERROR("opendir in rename_file_names");
+        return;
+    }
+
+    struct dirent *e = NULL;
+    while ((e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+
+        char child[PATH_MAX];
+        char childmap[PATH_MAX];
+        snprintf(child, PATH_MAX, "%s/%s", path_new, e->d_name);
+        snprintf(childmap, PATH_MAX, "%s/%s", mapdir, e->d_name);
+
+        struct stat s;
+        if (lstat(childmap, &s) == -1) continue;
+        if (S_ISLNK(s.st_mode)) {
+            char *filedir = file_dir(child);
+            if (filedir != NULL) {
+                write_file_name(filedir, child);
+                FREE(filedir);
+            }
+        } else if (S_ISDIR(s.st_mode)) {
+            rename_file_names(child);
+        }
+    }
+    closedir(d);
+}
+
+/*
+ * Move what's cached for a file or directory to its new name. The blocks stay
+ * where they are: only the link (or directory) in the map moves, and each
+ * file's name file is updated. Anything cached under path_new is dropped;
+ * the rename replaced it.
+ *
+ * Returns 0 on success, or -errno.
+ */
 int cache_rename(const char *path, const char *path_new)
 {
     DEBUG("cache_rename %s\n\t%s\n", path, path_new);
 
     int ret = 0;
-    char *mapdir = NULL;
-    char *mapdir_new = NULL;
-    DIR *dir = NULL;
-    char *parentlink = NULL;
+    char mapdir[PATH_MAX];
+    char mapdir_new[PATH_MAX];
 
     if (path == NULL || path_new == NULL) {
-        errno = EINVAL;
-        ret = -1;
-        goto exit;
+        return -EINVAL;
     }
 
-    // Look up and rename the cache map dir.
-    asprintf(&mapdir, "%s/map%s", cache_dir, path);
-    asprintf(&mapdir_new, "%s/map%s", cache_dir, path_new);
-    ret = rename(mapdir, mapdir_new);
-    if (0 != ret) {
-        if (ENOENT == errno) {
-            DEBUG("not in cache: %s\n", path);
-            ret = 0;
-        }
-        else {
-            PERROR("rename");
+    pthread_mutex_lock(&lock);
+
+    snprintf(mapdir, PATH_MAX, "%s/map%s", cache_dir, path);
+    snprintf(mapdir_new, PATH_MAX, "%s/map%s", cache_dir, path_new);
+
+    struct stat s;
+    if (lstat(mapdir, &s) == -1) {
+        if (errno != ENOENT && errno != ENOTDIR) {
+            PERROR("lstat in cache_rename");
             ret = -EIO;
+        } else {
+            DEBUG("not in cache: %s\n", path);
         }
         goto exit;
     }
 
-    // Next, need to fix all the buckets' parent links.
-    dir = opendir(mapdir_new);
-    if (dir == NULL) {
-        PERROR("opendir");
-        ERROR("\topendir on %s\n", mapdir_new);
-        ret = -EIO;
-        goto exit;
+    struct stat s_new;
+    if (lstat(mapdir_new, &s_new) == 0 && S_ISLNK(s_new.st_mode)) {
+        DEBUG("dropping what was cached for %s\n", path_new);
+        cache_invalidate_file_real(path_new, false, true);
+        // if it had no blocks, the link is still there
+        forget_validator(path_new);
+        unlink(mapdir_new);
     }
 
-    size_t cch_parentlink = strlen(mapdir_new) + 20;
-    parentlink = (char*)malloc(cch_parentlink);
-
-    struct dirent *dirent = NULL;
-    while ((dirent = readdir(dir)) != NULL) {
-        if (dirent->d_name[0] != '.' && strcmp(dirent->d_name, "mtime") != 0) {
-            snprintf(parentlink, cch_parentlink, "%s/%s/parent",
-                mapdir_new, dirent->d_name);
-
-            ret = unlink(parentlink);
-            if (0 != ret) {
-                PERROR("unlink");
-                ERROR("\tunlink on %s\n", parentlink);
+    // the map directories leading up to the new name
+    for (size_t i = strlen(cache_dir) + 5; mapdir_new[i] != '\0'; i++) {
+        if (mapdir_new[i] == '/') {
+            mapdir_new[i] = '\0';
+            int result = mkdir(mapdir_new, 0700);
+            mapdir_new[i] = '/';
+            if (result == -1 && errno != EEXIST) {
+                PERROR("mkdir in cache_rename");
                 ret = -EIO;
                 goto exit;
             }
+        }
+    }
 
-            ret = symlink(mapdir_new, parentlink);
-            if (0 != ret) {
-                PERROR("symlink");
-                ERROR("\tsymlink from %s\n\tto %s\n", parentlink, mapdir_new);
-                ret = -EIO;
-                goto exit;
-            }
+    if (S_ISLNK(s.st_mode)) {
+        forget_validator(path);
+        forget_validator(path_new);
+    } else {
+        // every file under it moves
+        map_generation++;
+    }
+    if (rename(mapdir, mapdir_new) == -1) {
+        PERROR("rename in cache_rename");
+        ERROR("\trename(%s, %s)\n", mapdir, mapdir_new);
+        ret = -EIO;
+        goto exit;
+    }
+
+    if (S_ISLNK(s.st_mode)) {
+        char *filedir = file_dir(path_new);
+        if (filedir != NULL) {
+            write_file_name(filedir, path_new);
+            FREE(filedir);
         }
+    } else {
+        rename_file_names(path_new);
     }
 
+    rename_dirty(path, path_new);
+    trim_directory(mapdir);
+
 exit:
-    FREE(mapdir);
-    FREE(mapdir_new);
-    FREE(parentlink);
-    closedir(dir);
+    pthread_mutex_unlock(&lock);
     return ret;
 }
 
+void cache_get_usage(struct cache_usage *usage)
+{
+    pthread_mutex_lock(&lock);
+    usage->used_bytes = cache_used_size;
+    usage->used_buckets = used_buckets;
+    usage->free_buckets = free_buckets;
+    usage->orphan_scan_next = orphan_next;
+    usage->orphan_scan_end = orphan_end;
+    usage->trash_trees = 0;
+    for (struct trash_tree *t = trash_list; t != NULL; t = t->next) {
+        usage->trash_trees++;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
 /*
 
 This program is free software; you can redistribute it and/or modify
@@ -9,19 +9,114 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
 
+enum cache_io_mode {
+    CACHE_IO_BUFFERED,  // plain reads and writes through the page cache
+    CACHE_IO_FADVISE,   // drop bucket pages from the page cache after use
+    CACHE_IO_DIRECT,    // O_DIRECT, bypassing the page cache entirely
+};
+
+/*
+ * What a backing file was like when its data was cached. If any of it is
+ * different now, the cached data is out of date: the mtime to the nanosecond
+ * catches writes within the same second, the size catches writes on
+ * filesystems with coarse timestamps, and the ctime catches an mtime being
+ * set back after a change.
+ */
+struct cache_validator {
+    int64_t mtime;
+    int64_t ctime;
+    uint64_t size;
+    uint32_t mtime_nsec;
+    uint32_t ctime_nsec;
+};
+
+/*
+ * Writes len bytes of buf to the backing file at offset, and fills in the
+ * backing file's new validator. Returns 0 or -errno.
+ */
+typedef int (*cache_flush_fn)(const char *filename, uint64_t offset,
+        const char *buf, uint64_t len, struct cache_validator *validator);
+
+/*
+ * Identity of a backing file: device, inode number, and generation if the
+ * filesystem has one (otherwise 0).
+ */
+struct cache_file_key {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t generation;
+};
+
+/*
+ * Looks up the identity of the backing file at filename. Returns 0 or -errno.
+ */
+typedef int (*cache_key_fn)(const char *filename, struct cache_file_key *key);
+
+/*
+ * Whether a block that's next to be evicted should be kept a while longer.
+ * Called with the cache lock held.
+ */
+typedef bool (*cache_keep_fn)(const char *filename, uint32_t block);
+
+/*
+ * Current size of the cache.
+ */
+struct cache_usage {
+    uint64_t used_bytes;
+    uint64_t used_buckets;      // buckets holding data
+    uint64_t free_buckets;      // empty buckets waiting to be re-used
+    uint64_t orphan_scan_next;  // bucket the orphan scan is up to, and where
+    uint64_t orphan_scan_end;   // it stops; both 0 when there's no scan
+    uint64_t trash_trees;       // invalidated trees still being freed
+};
+
+void cache_set_io_mode(enum cache_io_mode mode);
+void cache_set_verify_percent(unsigned int percent);
+void cache_set_watermarks(unsigned int high_percent, unsigned int low_percent);
+void cache_set_writeback(cache_flush_fn fn, unsigned int threads,
+        uint64_t max_dirty_bytes, unsigned int delay_seconds);
+void cache_set_key_fn(cache_key_fn fn);
+void cache_set_keep_fn(cache_keep_fn fn);
+void cache_set_check(unsigned int threads, bool always);
 void cache_init(const char *cache_dir, uint64_t cache_size, uint64_t bucket_max_size);
+void cache_shutdown(void);
+void cache_validator_from_stat(struct cache_validator *validator,
+        const struct stat *st);
 int cache_fetch(const char *filename, uint32_t block, uint64_t offset,
-        char *buf, uint64_t len, uint64_t *bytes_read, time_t mtime);
+        char *buf, uint64_t len, uint64_t *bytes_read,
+        const struct cache_validator *validator);
 int cache_add(const char *filename, uint32_t block, const char *buf, 
-        uint64_t len, time_t mtime);
+        uint64_t len, const struct cache_validator *validator);
+int cache_replace(const char *filename, uint32_t block, const char *buf,
+        uint64_t len, const struct cache_validator *validator);
+int cache_update(const char *filename, uint32_t block, uint64_t offset,
+        const char *buf, uint64_t len, const struct cache_validator *validator);
+int cache_update_dirty(const char *filename, uint32_t block, uint64_t offset,
+        const char *buf, uint64_t len);
+int cache_add_dirty(const char *filename, uint32_t block, const char *buf,
+        uint64_t len, const struct cache_validator *validator);
+int cache_flush_dirty(const char *filename);
+uint64_t cache_dirty_extent(const char *filename);
+int cache_discard_file(const char *filename);
 int cache_invalidate_block(const char *filename, uint32_t block);
 int cache_try_invalidate_block(const char *filename, uint32_t block);
 int cache_invalidate_file(const char *filename);
 int cache_try_invalidate_file(const char *filename);
+int cache_invalidate_tree(const char *path);
 int cache_free_orphan_buckets(void);
+int cache_export_manifest(const char *manifest_path);
+int cache_file_is_current(const char *filename,
+        const struct cache_validator *validator);
+void cache_refresh_validator(const char *filename,
+        const struct cache_validator *validator);
+int cache_touch_block(const char *filename, uint32_t block,
+        const struct cache_validator *validator);
 int cache_has_file(const char *filename, uint64_t *cached_byte_count);
 int cache_try_invalidate_blocks_above(const char *filename, uint32_t block);
 int cache_rename(const char *path, const char *path_new);
+void cache_get_usage(struct cache_usage *usage);
 
 #endif //BACKFS_CACHE_WRF_H
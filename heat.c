@@ -0,0 +1,672 @@
+/*
+ * BackFS block access heat
+ * Copyright (c) 2026 William R. Fraser
+ *
+ * Each block's heat is the number of times it's been read, decayed by half
+ * every half-life, so it says how often a block is read lately rather than
+ * ever. Unlike the order of the cache's queue, it outlives a block's eviction,
+ * and it's checkpointed to a file in the cache directory every few minutes,
+ * so it outlives a remount too.
+ *
+ * Blocks are kept in an open-addressed hash table keyed by file number and
+ * block, with the files' paths in a second one. At every checkpoint the heat
+ * is decayed, and both tables are rebuilt without the blocks that have cooled
+ * off. If the table fills up in between, it's decayed and rebuilt early, and
+ * the coolest quarter of the blocks goes too, to make room for new ones.
+ */
+
+#include "heat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <pthread.h>
+
+#define BACKFS_LOG_SUBSYS "Heat"
+#include "global.h"
+#include "util.h"
+
+extern int backfs_log_level;
+extern bool backfs_log_stderr;
+
+#define HEAT_MAGIC "BFSHEAT1"
+#define HEAT_CHECKPOINT_INTERVAL 300    // seconds
+#define HEAT_MIN 0.1f       // blocks cooler than this are forgotten
+#define HEAT_KEEP 2.0f      // blocks at least this hot are kept from eviction
+#define HEAT_PRUNE 4        // a full table drops 1/this of its blocks
+
+#define NO_FILE UINT32_MAX
+
+/*
+ * The checkpoint file is this header, then the files' paths, each a uint16_t
+ * length and that many bytes, then the blocks, all in host byte order.
+ */
+struct heat_header {
+    char magic[8];
+    uint64_t time;          // wall clock seconds when it was last decayed
+    uint32_t files;
+    uint32_t blocks;
+};
+
+struct heat_block {
+    uint32_t file;          // NO_FILE for an empty slot
+    uint32_t block;
+    float heat;
+};
+
+struct heat_table {
+    struct heat_block *blocks;
+    char **files;           // paths, by file number
+    uint32_t *file_slots;   // file number + 1, or 0 for an empty slot
+    uint32_t slots;         // size of both hash tables; a power of two
+    uint32_t block_count;
+    uint32_t file_count;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct heat_table table;
+static uint32_t max_blocks = 0;
+static float half_life = 0;
+static uint64_t block_size = 0;
+static time_t decayed_at = 0;
+static char *heat_path = NULL;
+static pthread_t checkpoint_thread;
+static bool checkpointing = false;  // the thread is running
+static bool stopping = false;       // set by heat_shutdown()
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;
+
+static bool table_alloc(struct heat_table *t)
+{
+    uint32_t slots = 16;
+    while (slots < (uint64_t)max_blocks * 2) {
+        slots <<= 1;
+    }
+
+    memset(t, 0, sizeof(*t));
+    t->blocks = (struct heat_block*)malloc(slots * sizeof(*t->blocks));
+    t->files = (char**)calloc(max_blocks, sizeof(*t->files));
+    t->file_slots = (uint32_t*)calloc(slots, sizeof(*t->file_slots));
+    if (t->blocks == NULL || t->files == NULL || t->file_slots == NULL) {
+        FREE(t->blocks);
+        FREE(t->files);
+        FREE(t->file_slots);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < slots; i++) {
+        t->blocks[i].file = NO_FILE;
+    }
+    t->slots = slots;
+    return true;
+}
+
+/*
+ * Empty a table, keeping its size.
+ */
+static void table_clear(struct heat_table *t)
+{
+    for (uint32_t i = 0; i < t->file_count; i++) {
+        FREE(t->files[i]);
+    }
+    for (uint32_t i = 0; i < t->slots; i++) {
+        t->blocks[i].file = NO_FILE;
+        t->file_slots[i] = 0;
+    }
+    t->block_count = 0;
+    t->file_count = 0;
+}
+
+static void table_free(struct heat_table *t)
+{
+    for (uint32_t i = 0; i < t->file_count; i++) {
+        FREE(t->files[i]);
+    }
+    FREE(t->blocks);
+    FREE(t->files);
+    FREE(t->file_slots);
+    memset(t, 0, sizeof(*t));
+}
+
+static uint32_t hash_path(const char *path)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const unsigned char *p = (const unsigned char*)path; *p != '\0'; p++) {
+        hash ^= *p;
+        hash *= 0x100000001b3ULL;
+    }
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+static uint32_t hash_block(uint32_t file, uint32_t block)
+{
+    uint64_t hash = (((uint64_t)file << 32) | block) * 0x9e3779b97f4a7c15ULL;
+    return (uint32_t)(hash >> 32);
+}
+
+/*
+ * The number of a file, adding it if add is set and there's room.
+ * Returns NO_FILE if it isn't there.
+ */
+static uint32_t file_number(struct heat_table *t, const char *path, bool add)
+{
+    uint32_t mask = t->slots - 1;
+    for (uint32_t i = hash_path(path) & mask; ; i = (i + 1) & mask) {
+        uint32_t n = t->file_slots[i];
+        if (n == 0) {
+            if (!add || t->file_count >= max_blocks) {
+                return NO_FILE;
+            }
+            char *copy = strdup(path);
+            if (copy == NULL) {
+                return NO_FILE;
+            }
+            t->files[t->file_count] = copy;
+            t->file_slots[i] = ++t->file_count;
+            return t->file_count - 1;
+        }
+        if (strcmp(t->files[n - 1], path) == 0) {
+            return n - 1;
+        }
+    }
+}
+
+/*
+ * A block's entry, adding it with no heat if add is set and there's room.
+ * Returns NULL if it isn't there.
+ */
+static struct heat_block * block_entry(struct heat_table *t, uint32_t file,
+        uint32_t block, bool add)
+{
+    uint32_t mask = t->slots - 1;
+    for (uint32_t i = hash_block(file, block) & mask; ; i = (i + 1) & mask) {
+        struct heat_block *b = &t->blocks[i];
+        if (b->file == NO_FILE) {
+            if (!add || t->block_count >= max_blocks) {
+                return NULL;
+            }
+            b->file = file;
+            b->block = block;
+            b->heat = 0;
+            t->block_count++;
+            return b;
+        }
+        if (b->file == file && b->block == block) {
+            return b;
+        }
+    }
+}
+
+static float decay_factor(time_t elapsed)
+{
+    if (elapsed <= 0) {
+        return 1;
+    }
+    return exp2f(-(float)elapsed / half_life);
+}
+
+static int cooler(const void *a, const void *b)
+{
+    float x = *(const float*)a;
+    float y = *(const float*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * The heat at or below which the coolest 1/HEAT_PRUNE of the blocks are, and
+ * how many of those at exactly that heat to drop, to drop no more than that.
+ * Returns false if there's no memory to work it out.
+ */
+static bool prune_threshold(float *threshold, uint32_t *ties)
+{
+    float *heats = (float*)malloc(((size_t)table.block_count + 1) * sizeof(float));
+    if (heats == NULL) {
+        return false;
+    }
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < table.slots; i++) {
+        if (table.blocks[i].file != NO_FILE) {
+            heats[count++] = table.blocks[i].heat;
+        }
+    }
+    qsort(heats, count, sizeof(float), &cooler);
+
+    uint32_t drop = count / HEAT_PRUNE;
+    if (drop == 0) {
+        drop = 1;
+    }
+    *threshold = heats[drop - 1];
+    *ties = drop;
+    for (uint32_t i = 0; i < drop && heats[i] < *threshold; i++) {
+        (*ties)--;
+    }
+    FREE(heats);
+    return true;
+}
+
+/*
+ * Decay every block's heat to now, and rebuild the tables without the blocks
+ * that have cooled off, or the files left with no blocks. With prune set, the
+ * coolest 1/HEAT_PRUNE of the blocks are dropped too, however hot they are.
+ * Caller holds the lock.
+ */
+static void decay(time_t now, bool prune)
+{
+    float factor = decay_factor(now - decayed_at);
+    decayed_at = now;
+
+    // heat from before the decay, so it compares exactly
+    float threshold = -1;
+    uint32_t ties = 0;
+    if (prune && table.block_count > 0
+            && !prune_threshold(&threshold, &ties)) {
+        threshold = -1;
+    }
+
+    struct heat_table fresh;
+    if (!table_alloc(&fresh)) {
+        // nothing can be dropped this time
+        for (uint32_t i = 0; i < table.slots; i++) {
+            table.blocks[i].heat *= factor;
+        }
+        return;
+    }
+
+    for (uint32_t i = 0; i < table.slots; i++) {
+        struct heat_block *b = &table.blocks[i];
+        float heat = b->heat * factor;
+        if (b->file == NO_FILE || heat < HEAT_MIN || b->heat < threshold) {
+            continue;
+        }
+        if (b->heat == threshold && ties > 0) {
+            ties--;
+            continue;
+        }
+        uint32_t file = file_number(&fresh, table.files[b->file], true);
+        struct heat_block *entry = (file == NO_FILE) ? NULL
+            : block_entry(&fresh, file, b->block, true);
+        if (entry != NULL) {
+            entry->heat = heat;
+        }
+    }
+
+    table_free(&table);
+    table = fresh;
+}
+
+/*
+ * Pick up the heat from the last checkpoint, decayed for the time since.
+ */
+static void load(void)
+{
+    char *buf = NULL;
+    uint32_t *numbers = NULL;
+    int fd = open(heat_path, O_RDONLY);
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            PERROR("opening heat checkpoint failed");
+        }
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct heat_header)) {
+        goto bad;
+    }
+    buf = (char*)malloc(st.st_size);
+    if (buf == NULL || read(fd, buf, st.st_size) != st.st_size) {
+        goto bad;
+    }
+
+    struct heat_header header;
+    memcpy(&header, buf, sizeof(header));
+    if (memcmp(header.magic, HEAT_MAGIC, sizeof(header.magic)) != 0
+            || header.files > st.st_size / sizeof(uint16_t)) {
+        goto bad;
+    }
+
+    numbers = (uint32_t*)calloc(header.files, sizeof(*numbers));
+    if (header.files > 0 && numbers == NULL) {
+        goto bad;
+    }
+
+    char *p = buf + sizeof(header);
+    char *end = buf + st.st_size;
+    char path[PATH_MAX];
+    for (uint32_t i = 0; i < header.files; i++) {
+        uint16_t len;
+        if (end - p < (ptrdiff_t)sizeof(len)) {
+            goto bad;
+        }
+        memcpy(&len, p, sizeof(len));
+        p += sizeof(len);
+        if (end - p < len || len >= PATH_MAX) {
+            goto bad;
+        }
+        memcpy(path, p, len);
+        path[len] = '\0';
+        p += len;
+        numbers[i] = file_number(&table, path, true);
+    }
+
+    float factor = decay_factor(time(NULL) - (time_t)header.time);
+    for (uint32_t i = 0; i < header.blocks
+            && end - p >= (ptrdiff_t)sizeof(struct heat_block); i++) {
+        struct heat_block b;
+        memcpy(&b, p, sizeof(b));
+        p += sizeof(b);
+        if (b.file >= header.files || numbers[b.file] == NO_FILE
+                || b.heat * factor < HEAT_MIN) {
+            continue;
+        }
+        struct heat_block *entry = block_entry(&table, numbers[b.file], b.block, true);
+        if (entry != NULL) {
+            entry->heat = b.heat * factor;
+        }
+    }
+    FREE(numbers);
+
+    INFO("picked up the heat of %lu blocks\n", (unsigned long) table.block_count);
+    close(fd);
+    FREE(buf);
+    return;
+
+bad:
+    ERROR("%s isn't a heat checkpoint; starting over\n", heat_path);
+    // it's no use knowing the files without their blocks
+    table_clear(&table);
+    close(fd);
+    FREE(numbers);
+    FREE(buf);
+}
+
+/*
+ * Decay the heat, and write it to the checkpoint file. The checkpoint is put
+ * together in memory with the lock held, and written without it.
+ */
+static void checkpoint(void)
+{
+    pthread_mutex_lock(&lock);
+    decay(time(NULL), false);
+
+    size_t len = sizeof(struct heat_header)
+        + (size_t)table.block_count * sizeof(struct heat_block);
+    for (uint32_t i = 0; i < table.file_count; i++) {
+        len += sizeof(uint16_t) + strlen(table.files[i]);
+    }
+
+    char *buf = (char*)malloc(len);
+    if (buf == NULL) {
+        pthread_mutex_unlock(&lock);
+        ERROR("out of memory for the heat checkpoint\n");
+        return;
+    }
+
+    struct heat_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HEAT_MAGIC, sizeof(header.magic));
+    header.time = (uint64_t)decayed_at;
+    header.files = table.file_count;
+    header.blocks = table.block_count;
+
+    char *p = buf;
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    for (uint32_t i = 0; i < table.file_count; i++) {
+        uint16_t n = (uint16_t)strlen(table.files[i]);
+        memcpy(p, &n, sizeof(n));
+        p += sizeof(n);
+        memcpy(p, table.files[i], n);
+        p += n;
+    }
+    for (uint32_t i = 0; i < table.slots; i++) {
+        if (table.blocks[i].file != NO_FILE) {
+            memcpy(p, &table.blocks[i], sizeof(struct heat_block));
+            p += sizeof(struct heat_block);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    // write a new file and rename it over the old one, so a crash part way
+    // through leaves the last checkpoint
+    char tmppath[PATH_MAX];
+    snprintf(tmppath, PATH_MAX, "%s.tmp", heat_path);
+    int fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        PERROR("opening heat checkpoint failed");
+        FREE(buf);
+        return;
+    }
+
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(fd, buf + written, len - written);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            PERROR("writing heat checkpoint failed");
+            break;
+        }
+        written += n;
+    }
+    close(fd);
+    FREE(buf);
+
+    if (written < len) {
+        unlink(tmppath);
+    } else if (rename(tmppath, heat_path) == -1) {
+        PERROR("renaming heat checkpoint failed");
+        unlink(tmppath);
+    }
+}
+
+static void * checkpointer(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    while (!stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += HEAT_CHECKPOINT_INTERVAL;
+        while (!stopping && pthread_cond_timedwait(&stop_cond, &lock,
+                    &deadline) != ETIMEDOUT)
+            ;
+        if (!stopping) {
+            pthread_mutex_unlock(&lock);
+            checkpoint();
+            pthread_mutex_lock(&lock);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+void heat_init(const char *cache_dir, uint32_t a_max_blocks,
+        unsigned int a_half_life, uint64_t a_block_size)
+{
+    if (a_max_blocks == 0) {
+        return;
+    }
+
+    max_blocks = a_max_blocks;
+    half_life = (a_half_life == 0) ? 1 : a_half_life;
+    block_size = a_block_size;
+    decayed_at = time(NULL);
+    if (asprintf(&heat_path, "%s/heat", cache_dir) == -1 || !table_alloc(&table)) {
+        ERROR("out of memory; not keeping block heat\n");
+        max_blocks = 0;
+        return;
+    }
+
+    load();
+
+    if (pthread_create(&checkpoint_thread, NULL, &checkpointer, NULL) != 0) {
+        PERROR("error creating heat checkpoint thread");
+    } else {
+        checkpointing = true;
+    }
+}
+
+void heat_shutdown(void)
+{
+    if (max_blocks == 0) {
+        return;
+    }
+    if (checkpointing) {
+        pthread_mutex_lock(&lock);
+        stopping = true;
+        pthread_cond_signal(&stop_cond);
+        pthread_mutex_unlock(&lock);
+        pthread_join(checkpoint_thread, NULL);
+        checkpointing = false;
+    }
+
+    // otherwise the heat since the last checkpoint is lost
+    checkpoint();
+}
+
+/*
+ * A block's entry, adding it (and its file) if there's room.
+ * Caller holds the lock.
+ */
+static struct heat_block * record_entry(const char *path, uint32_t block)
+{
+    uint32_t file = file_number(&table, path, false);
+    if (file == NO_FILE && table.block_count < max_blocks) {
+        file = file_number(&table, path, true);
+    }
+    return (file == NO_FILE) ? NULL : block_entry(&table, file, block, true);
+}
+
+void heat_record(const char *path, uint32_t block)
+{
+    if (max_blocks == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    struct heat_block *b = record_entry(path, block);
+    if (b == NULL && table.block_count >= max_blocks) {
+        // make room by forgetting the coolest blocks; a new block can't be
+        // told apart from a cool one otherwise, so it would never get in
+        DEBUG("heat table is full; dropping the coolest blocks\n");
+        decay(time(NULL), true);
+        b = record_entry(path, block);
+    }
+    if (b != NULL) {
+        b->heat += 1;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+bool heat_keep(const char *path, uint32_t block)
+{
+    if (max_blocks == 0) {
+        return false;
+    }
+
+    bool keep = false;
+    pthread_mutex_lock(&lock);
+    uint32_t file = file_number(&table, path, false);
+    struct heat_block *b = (file == NO_FILE) ? NULL
+        : block_entry(&table, file, block, false);
+    if (b != NULL && b->heat >= HEAT_KEEP) {
+        b->heat /= 2;
+        keep = true;
+    }
+    pthread_mutex_unlock(&lock);
+    return keep;
+}
+
+static int hotter(const void *a, const void *b)
+{
+    float x = ((const struct heat_block*)a)->heat;
+    float y = ((const struct heat_block*)b)->heat;
+    return (x < y) - (x > y);
+}
+
+int heat_write_manifest(const char *filename)
+{
+    if (max_blocks == 0) {
+        return -ENODATA;
+    }
+
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        return -errno;
+    }
+    fprintf(f, "# backfs manifest 1 block_size %llu\n",
+            (unsigned long long) block_size);
+
+    pthread_mutex_lock(&lock);
+    struct heat_block *sorted = (struct heat_block*)malloc(
+            ((size_t)table.block_count + 1) * sizeof(*sorted));
+    if (sorted == NULL) {
+        pthread_mutex_unlock(&lock);
+        fclose(f);
+        return -ENOMEM;
+    }
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < table.slots; i++) {
+        if (table.blocks[i].file != NO_FILE) {
+            sorted[count++] = table.blocks[i];
+        }
+    }
+    qsort(sorted, count, sizeof(*sorted), &hotter);
+
+    // the mtime isn't known, so it's 0 and doesn't get checked
+    for (uint32_t i = 0; i < count; i++) {
+        const char *path = table.files[sorted[i].file];
+        if (strchr(path, '\n') == NULL) {
+            fprintf(f, "%lu 0 %s\n", (unsigned long) sorted[i].block, path);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    FREE(sorted);
+
+    int ret = 0;
+    if (ferror(f)) {
+        ret = -EIO;
+    }
+    if (fclose(f) == EOF && ret == 0) {
+        ret = -errno;
+    }
+    return ret;
+}
+
+size_t heat_format(char *buf, size_t size)
+{
+    pthread_mutex_lock(&lock);
+    int n = snprintf(buf, size, "heat_blocks %lu\n",
+            (unsigned long) table.block_count);
+    pthread_mutex_unlock(&lock);
+    return (n > 0) ? n : 0;
+}
+
+/*
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
@@ -0,0 +1,50 @@
+#ifndef BACKFS_HEAT_H
+#define BACKFS_HEAT_H
+/*
+ * BackFS block access heat
+ * Copyright (c) 2026 William R. Fraser
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Keep the heat of up to max_blocks blocks, halving every half_life seconds,
+ * and checkpoint it to <cache_dir>/heat, picking up where the last checkpoint
+ * there left off. With max_blocks 0, or if this isn't called, the other
+ * functions do nothing.
+ */
+void heat_init(const char *cache_dir, uint32_t max_blocks,
+        unsigned int half_life, uint64_t block_size);
+
+/*
+ * Stop the checkpoint thread, and write a last checkpoint.
+ */
+void heat_shutdown(void);
+
+/*
+ * Count a read of a block.
+ */
+void heat_record(const char *path, uint32_t block);
+
+/*
+ * Whether a block about to be evicted has been read often enough lately to
+ * deserve another trip round the cache. Each time it says so, the block's
+ * heat is halved, so a block that stops being read isn't kept forever.
+ */
+bool heat_keep(const char *path, uint32_t block);
+
+/*
+ * Write the blocks with any heat to filename, hottest first, as a manifest
+ * for prefetch_import(). Returns 0 or -errno.
+ */
+int heat_write_manifest(const char *filename);
+
+/*
+ * Write how many blocks have heat to buf as "name value" lines.
+ * Returns the length it needed, like snprintf.
+ */
+size_t heat_format(char *buf, size_t size);
+
+#endif //BACKFS_HEAT_H
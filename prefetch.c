@@ -0,0 +1,641 @@
+/*
+ * BackFS cache prefetching
+ * Copyright (c) 2026 William R. Fraser
+ */
+
+#include "prefetch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <pthread.h>
+
+#define BACKFS_LOG_SUBSYS "Prefetch"
+#include "global.h"
+#include "stats.h"
+#include "util.h"
+
+extern int backfs_log_level;
+extern bool backfs_log_stderr;
+
+// files are split into pieces of this many blocks, so threads can share them
+#define PREFETCH_CHUNK_BLOCKS 16
+
+// manifest lines queued per turn, so the queue stays short and in order
+#define MANIFEST_LINES 256
+
+struct prefetch_job {
+    bool recursive;
+    uint64_t max_bytes;
+    uint64_t bytes;         // read into the cache so far
+    unsigned int items;     // queued or being worked on
+    FILE *manifest;         // being imported, if any
+    uint64_t manifest_block_size;
+};
+
+enum item_type {
+    ITEM_DIR,
+    ITEM_FILE,
+    ITEM_BLOCKS,
+    ITEM_MANIFEST,
+};
+
+struct prefetch_item {
+    struct prefetch_item *next;
+    struct prefetch_job *job;
+    enum item_type type;
+    uint32_t block;         // ITEM_BLOCKS: first block, and how many
+    uint32_t count;
+    uint64_t mtime;         // ITEM_BLOCKS: the file's mtime in the manifest, or 0
+    char path[];
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct prefetch_item *queue_head = NULL;
+static struct prefetch_item *queue_tail = NULL;
+static uint64_t queued = 0;
+static unsigned int jobs = 0;
+static bool started = false;
+static bool stopping = false;       // set by prefetch_shutdown()
+static pthread_t *threads = NULL;
+static unsigned int threads_started = 0;
+
+static const char *root = NULL;
+static uint64_t block_size = 0;
+static unsigned int thread_count = 0;
+static prefetch_block_fn block_fn = NULL;
+
+// rate limit: when the bytes read so far are allowed to have been read by
+static double ns_per_byte = 0;
+static uint64_t rate_next = 0;
+
+void prefetch_init(const char *real_root, uint64_t a_block_size,
+        unsigned int threads, uint64_t bytes_per_sec, prefetch_block_fn fn)
+{
+    root = real_root;
+    block_size = a_block_size;
+    thread_count = threads;
+    ns_per_byte = (bytes_per_sec == 0) ? 0 : 1e9 / bytes_per_sec;
+    block_fn = fn;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Account for bytes read, and wait for however long that takes at the rate
+ * limit.
+ */
+static void rate_wait(uint64_t bytes)
+{
+    if (ns_per_byte == 0) {
+        return;
+    }
+
+    uint64_t now = now_ns();
+    pthread_mutex_lock(&lock);
+    if (rate_next < now) {
+        rate_next = now;
+    }
+    rate_next += (uint64_t)(bytes * ns_per_byte);
+    uint64_t until = rate_next;
+    pthread_mutex_unlock(&lock);
+
+    struct timespec ts = {
+        .tv_sec = until / 1000000000,
+        .tv_nsec = until % 1000000000,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/*
+ * Returns the item, or NULL if there's no memory for it.
+ * Caller holds the lock.
+ */
+static struct prefetch_item * enqueue(struct prefetch_job *job, enum item_type type,
+        const char *dir, const char *name, uint32_t block, uint32_t count)
+{
+    size_t dirlen = strlen(dir);
+    size_t namelen = (name == NULL) ? 0 : strlen(name);
+    struct prefetch_item *item = (struct prefetch_item*)malloc(
+            sizeof(*item) + dirlen + namelen + 2);
+    if (item == NULL) {
+        ERROR("out of memory; not prefetching %s\n", dir);
+        return NULL;
+    }
+
+    item->next = NULL;
+    item->job = job;
+    item->type = type;
+    item->block = block;
+    item->count = count;
+    item->mtime = 0;
+    memcpy(item->path, dir, dirlen + 1);
+    if (name != NULL) {
+        if (dirlen > 0 && dir[dirlen - 1] != '/') {
+            item->path[dirlen++] = '/';
+        }
+        memcpy(item->path + dirlen, name, namelen + 1);
+    }
+
+    if (queue_tail == NULL) {
+        queue_head = item;
+    } else {
+        queue_tail->next = item;
+    }
+    queue_tail = item;
+    queued++;
+    job->items++;
+    pthread_cond_signal(&queue_cond);
+    return item;
+}
+
+/*
+ * Whether a job should stop: it's read as much as it may, or prefetching is
+ * shutting down.
+ */
+static bool over_budget(struct prefetch_job *job)
+{
+    pthread_mutex_lock(&lock);
+    bool over = stopping
+        || (job->max_bytes != 0 && job->bytes >= job->max_bytes);
+    pthread_mutex_unlock(&lock);
+    return over;
+}
+
+static char * real_path(const char *path)
+{
+    char *real = NULL;
+    if (asprintf(&real, "%s%s", root, path) == -1) {
+        return NULL;
+    }
+    return real;
+}
+
+static void prefetch_dir(struct prefetch_item *item)
+{
+    char *real = real_path(item->path);
+    DIR *dir = (real == NULL) ? NULL : opendir(real);
+    if (dir == NULL) {
+        PERROR("prefetch: opendir");
+        ERROR("\topendir on %s\n", item->path);
+        stats_inc(STATS_PREFETCH_ERRORS);
+        FREE(real);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                continue;
+            }
+            type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR : DT_UNKNOWN;
+        }
+
+        pthread_mutex_lock(&lock);
+        if (type == DT_REG) {
+            enqueue(item->job, ITEM_FILE, item->path, entry->d_name, 0, 0);
+        } else if (type == DT_DIR && item->job->recursive) {
+            enqueue(item->job, ITEM_DIR, item->path, entry->d_name, 0, 0);
+        }
+        pthread_mutex_unlock(&lock);
+    }
+
+    closedir(dir);
+    FREE(real);
+}
+
+static void prefetch_file(struct prefetch_item *item)
+{
+    char *real = real_path(item->path);
+    struct stat st;
+    if (real == NULL || stat(real, &st) == -1) {
+        DEBUG("prefetch: %s is gone\n", item->path);
+        FREE(real);
+        return;
+    }
+    FREE(real);
+
+    uint64_t blocks = (st.st_size + block_size - 1) / block_size;
+    pthread_mutex_lock(&lock);
+    for (uint64_t block = 0; block < blocks; block += PREFETCH_CHUNK_BLOCKS) {
+        uint64_t count = blocks - block;
+        if (count > PREFETCH_CHUNK_BLOCKS) {
+            count = PREFETCH_CHUNK_BLOCKS;
+        }
+        enqueue(item->job, ITEM_BLOCKS, item->path, NULL, block, count);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static void prefetch_blocks(struct prefetch_item *item)
+{
+    char *real = real_path(item->path);
+    int fd = (real == NULL) ? -1 : open(real, O_RDONLY | O_NOFOLLOW);
+    FREE(real);
+    if (fd == -1) {
+        DEBUG("prefetch: can't open %s: %m\n", item->path);
+        return;
+    }
+
+    struct stat st;
+    if (item->mtime != 0
+            && (fstat(fd, &st) == -1 || (uint64_t)st.st_mtime != item->mtime)) {
+        DEBUG("prefetch: %s changed since the manifest was written\n",
+                item->path);
+        close(fd);
+        return;
+    }
+
+    for (uint32_t block = item->block; block < item->block + item->count; block++) {
+        if (over_budget(item->job)) {
+            break;
+        }
+
+        ssize_t n = block_fn(item->path, fd, block);
+        if (n < 0) {
+            ERROR("prefetch: reading block %lu of %s: %s\n",
+                    (unsigned long) block, item->path, strerror(-n));
+            stats_inc(STATS_PREFETCH_ERRORS);
+            break;
+        } else if (n == 0) {
+            stats_inc(STATS_PREFETCH_CACHED);
+            continue;
+        }
+
+        stats_inc(STATS_PREFETCH_BLOCKS);
+        stats_add(STATS_PREFETCH_BYTES, n);
+        pthread_mutex_lock(&lock);
+        item->job->bytes += n;
+        pthread_mutex_unlock(&lock);
+
+        // it's in the cache now; don't keep it in the page cache as well
+        posix_fadvise(fd, (off_t)block * block_size, n, POSIX_FADV_DONTNEED);
+        rate_wait(n);
+    }
+
+    close(fd);
+}
+
+/*
+ * A manifest path is one in the backing filesystem, not outside it.
+ */
+static bool manifest_path_ok(const char *path)
+{
+    size_t len = strlen(path);
+    return path[0] == '/' && strstr(path, "/../") == NULL
+        && !(len >= 3 && strcmp(path + len - 3, "/..") == 0);
+}
+
+/*
+ * Queue the blocks on the next MANIFEST_LINES lines of a manifest, joining
+ * runs of a file's blocks into pieces, and then the manifest again to carry on
+ * from there. The blocks get queued in the order the manifest lists them,
+ * hottest first, without the whole manifest having to fit in the queue.
+ * Only one item of a job reads its manifest at a time.
+ */
+static void prefetch_manifest(struct prefetch_item *item)
+{
+    FILE *f = item->job->manifest;
+    uint64_t manifest_block_size = item->job->manifest_block_size;
+
+    // the run of blocks being put together
+    char *run_path = NULL;
+    uint32_t run_block = 0;
+    uint32_t run_count = 0;
+    uint64_t run_mtime = 0;
+
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    unsigned int lines = 0;
+    bool done = true;
+
+    pthread_mutex_lock(&lock);
+    while ((len = getline(&line, &line_size, f)) != -1) {
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+
+        unsigned long manifest_block;
+        unsigned long long mtime;
+        int path_start = 0;
+        if (line[0] == '#'
+                || sscanf(line, "%lu %llu %n", &manifest_block, &mtime, &path_start) != 2
+                || path_start == 0 || !manifest_path_ok(line + path_start)) {
+            if (line[0] != '#' && line[0] != '\0') {
+                DEBUG("prefetch: skipping manifest line: %s\n", line);
+            }
+            continue;
+        }
+        const char *path = line + path_start;
+
+        // the manifest's block, in this cache's blocks
+        uint64_t start = (uint64_t)manifest_block * manifest_block_size;
+        uint32_t block = (uint32_t)(start / block_size);
+        uint32_t count = (uint32_t)((start + manifest_block_size - 1) / block_size)
+            - block + 1;
+
+        if (run_path != NULL && strcmp(run_path, path) == 0
+                && run_mtime == mtime && block == run_block + run_count
+                && run_count + count <= PREFETCH_CHUNK_BLOCKS) {
+            run_count += count;
+        } else {
+            if (run_path != NULL) {
+                struct prefetch_item *blocks = enqueue(item->job, ITEM_BLOCKS,
+                        run_path, NULL, run_block, run_count);
+                if (blocks != NULL) {
+                    blocks->mtime = run_mtime;
+                }
+                FREE(run_path);
+            }
+            run_path = strdup(path);
+            run_block = block;
+            run_count = count;
+            run_mtime = mtime;
+        }
+
+        if (++lines == MANIFEST_LINES) {
+            done = false;
+            break;
+        }
+    }
+
+    if (run_path != NULL) {
+        struct prefetch_item *blocks = enqueue(item->job, ITEM_BLOCKS,
+                run_path, NULL, run_block, run_count);
+        if (blocks != NULL) {
+            blocks->mtime = run_mtime;
+        }
+        FREE(run_path);
+    }
+
+    if (!done) {
+        enqueue(item->job, ITEM_MANIFEST, item->path, NULL, 0, 0);
+    }
+    pthread_mutex_unlock(&lock);
+
+    FREE(line);
+}
+
+/*
+ * Done with an item; the job's done too if it was its last.
+ * Caller holds the lock.
+ */
+static void finish_item(struct prefetch_item *item)
+{
+    struct prefetch_job *job = item->job;
+    if (--job->items == 0) {
+        INFO("prefetch: done, %llu bytes read\n",
+                (unsigned long long) job->bytes);
+        if (job->manifest != NULL) {
+            fclose(job->manifest);
+        }
+        FREE(job);
+        jobs--;
+    }
+    FREE(item);
+}
+
+static void * prefetch_worker(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (queue_head == NULL && !stopping) {
+            pthread_cond_wait(&queue_cond, &lock);
+        }
+        if (stopping) {
+            break;
+        }
+
+        struct prefetch_item *item = queue_head;
+        queue_head = item->next;
+        if (queue_head == NULL) {
+            queue_tail = NULL;
+        }
+        queued--;
+        pthread_mutex_unlock(&lock);
+
+        if (!over_budget(item->job)) {
+            switch (item->type) {
+            case ITEM_DIR:
+                prefetch_dir(item);
+                break;
+            case ITEM_FILE:
+                prefetch_file(item);
+                break;
+            case ITEM_BLOCKS:
+                prefetch_blocks(item);
+                break;
+            case ITEM_MANIFEST:
+                prefetch_manifest(item);
+                break;
+            }
+        }
+
+        pthread_mutex_lock(&lock);
+        finish_item(item);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return NULL;
+}
+
+/*
+ * Start the worker threads, unless they're running already. Returns whether
+ * any are.
+ * Caller holds the lock.
+ */
+static bool start_workers(void)
+{
+    if (!started && !stopping) {
+        threads = (pthread_t*)calloc(thread_count, sizeof(*threads));
+        for (unsigned int i = 0; threads != NULL && i < thread_count; i++) {
+            if (pthread_create(&threads[i], NULL, &prefetch_worker, NULL) != 0) {
+                PERROR("prefetch: error creating worker thread");
+                break;
+            }
+            threads_started++;
+            started = true;
+        }
+    }
+    return started;
+}
+
+int prefetch_start(const char *path, bool recursive, uint64_t max_bytes)
+{
+    if (block_fn == NULL || thread_count == 0) {
+        return -ENOSYS;
+    }
+
+    char *real = real_path(path);
+    if (real == NULL) {
+        return -ENOMEM;
+    }
+    struct stat st;
+    int ret = (lstat(real, &st) == -1) ? -errno : 0;
+    FREE(real);
+    if (ret != 0) {
+        return ret;
+    }
+    if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+        return -EINVAL;
+    }
+
+    struct prefetch_job *job = (struct prefetch_job*)calloc(1, sizeof(*job));
+    if (job == NULL) {
+        return -ENOMEM;
+    }
+    job->recursive = recursive;
+    job->max_bytes = max_bytes;
+
+    pthread_mutex_lock(&lock);
+    if (!start_workers()) {
+        pthread_mutex_unlock(&lock);
+        FREE(job);
+        return -EAGAIN;
+    }
+
+    INFO("prefetch: %s%s, up to %llu bytes\n", path,
+            recursive ? " (recursive)" : "", (unsigned long long) max_bytes);
+    jobs++;
+    enqueue(job, S_ISDIR(st.st_mode) ? ITEM_DIR : ITEM_FILE, path, NULL, 0, 0);
+    pthread_mutex_unlock(&lock);
+
+    return 0;
+}
+
+int prefetch_import(const char *manifest, uint64_t max_bytes)
+{
+    if (block_fn == NULL || thread_count == 0) {
+        return -ENOSYS;
+    }
+    if (manifest[0] != '/') {
+        return -EINVAL;
+    }
+
+    FILE *f = fopen(manifest, "r");
+    if (f == NULL) {
+        return -errno;
+    }
+    unsigned long long manifest_block_size = 0;
+    if (fscanf(f, "# backfs manifest 1 block_size %llu\n", &manifest_block_size) != 1
+            || manifest_block_size == 0) {
+        ERROR("prefetch: %s isn't a BackFS manifest\n", manifest);
+        fclose(f);
+        return -EINVAL;
+    }
+
+    struct prefetch_job *job = (struct prefetch_job*)calloc(1, sizeof(*job));
+    if (job == NULL) {
+        fclose(f);
+        return -ENOMEM;
+    }
+    job->max_bytes = max_bytes;
+    job->manifest = f;
+    job->manifest_block_size = manifest_block_size;
+
+    pthread_mutex_lock(&lock);
+    if (!start_workers()) {
+        pthread_mutex_unlock(&lock);
+        fclose(f);
+        FREE(job);
+        return -EAGAIN;
+    }
+
+    INFO("prefetch: importing %s, up to %llu bytes\n", manifest,
+            (unsigned long long) max_bytes);
+    jobs++;
+    if (enqueue(job, ITEM_MANIFEST, manifest, NULL, 0, 0) == NULL) {
+        jobs--;
+        pthread_mutex_unlock(&lock);
+        fclose(f);
+        FREE(job);
+        return -ENOMEM;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return 0;
+}
+
+void prefetch_shutdown(void)
+{
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&lock);
+
+    // each finishes the block it's reading first
+    for (unsigned int i = 0; i < threads_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    FREE(threads);
+    threads_started = 0;
+
+    pthread_mutex_lock(&lock);
+    if (queue_head != NULL) {
+        INFO("prefetch: stopping with %llu items queued\n",
+                (unsigned long long) queued);
+    }
+    while (queue_head != NULL) {
+        struct prefetch_item *item = queue_head;
+        queue_head = item->next;
+        queued--;
+        finish_item(item);
+    }
+    queue_tail = NULL;
+    pthread_mutex_unlock(&lock);
+}
+
+size_t prefetch_format(char *buf, size_t size)
+{
+    pthread_mutex_lock(&lock);
+    int n = snprintf(buf, size,
+            "prefetch_jobs %u\n"
+            "prefetch_queued %llu\n",
+            jobs, (unsigned long long) queued);
+    pthread_mutex_unlock(&lock);
+    return (n > 0) ? n : 0;
+}
+
+/*
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
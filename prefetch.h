@@ -0,0 +1,57 @@
+#ifndef BACKFS_PREFETCH_H
+#define BACKFS_PREFETCH_H
+/*
+ * BackFS cache prefetching
+ * Copyright (c) 2026 William R. Fraser
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * Read one block of path (open as fd, on the backing store) into the cache,
+ * unless it's cached already. Returns the number of bytes read into the
+ * cache, 0 if there was nothing to do, or -errno.
+ */
+typedef ssize_t (*prefetch_block_fn)(const char *path, int fd, uint32_t block);
+
+/*
+ * Set up prefetching of files under real_root, with up to threads threads
+ * reading at most bytes_per_sec (0 for no limit) between them. The threads
+ * start with the first prefetch_start().
+ */
+void prefetch_init(const char *real_root, uint64_t block_size,
+        unsigned int threads, uint64_t bytes_per_sec, prefetch_block_fn fn);
+
+/*
+ * Queue every block of path (a file, or the files in a directory, and in its
+ * subdirectories too if recursive) to be read into the cache, stopping after
+ * max_bytes (0 for no limit) have been read. Returns 0 once it's queued, or
+ * -errno.
+ */
+int prefetch_start(const char *path, bool recursive, uint64_t max_bytes);
+
+/*
+ * Queue the blocks listed in a manifest written by cache_export_manifest() (at
+ * manifest, outside the backing filesystem) to be read into the cache, in the
+ * order listed, stopping after max_bytes (0 for no limit) have been read.
+ * Blocks of files whose mtime has changed since are skipped. The manifest is
+ * kept open until the import is done, so it can be removed once this returns.
+ * Returns 0 once it's started, or -errno.
+ */
+int prefetch_import(const char *manifest, uint64_t max_bytes);
+
+/*
+ * Stop the worker threads, dropping whatever is still queued. Call this
+ * before shutting down the cache.
+ */
+void prefetch_shutdown(void);
+
+/*
+ * Write how much prefetching is in progress to buf as "name value" lines.
+ * Returns the length it needed, like snprintf.
+ */
+size_t prefetch_format(char *buf, size_t size);
+
+#endif //BACKFS_PREFETCH_H
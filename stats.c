@@ -0,0 +1,253 @@
+/*
+ * BackFS statistics counters
+ * Copyright (c) 2026 William R. Fraser
+ */
+
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+
+struct stats_slot stats_slots[STATS_COUNT];
+
+static const char *stats_names[STATS_COUNT] = {
+    [STATS_HITS]                = "hits",
+    [STATS_MISSES]              = "misses",
+    [STATS_BYTES_FROM_CACHE]    = "bytes_from_cache",
+    [STATS_BYTES_FROM_BACKING]  = "bytes_from_backing",
+    [STATS_FILLS]               = "fills",
+    [STATS_EVICTIONS]           = "evictions",
+    [STATS_INVALIDATIONS]       = "invalidations",
+    [STATS_MTIME_MISMATCHES]    = "mtime_mismatches",
+    [STATS_SPACE_RETRIES]       = "space_retries",
+    [STATS_HEAT_KEPT]           = "heat_kept",
+    [STATS_ORPHANS_FREED]       = "orphans_freed",
+    [STATS_PREFETCH_BLOCKS]     = "prefetch_blocks",
+    [STATS_PREFETCH_BYTES]      = "prefetch_bytes",
+    [STATS_PREFETCH_CACHED]     = "prefetch_cached",
+    [STATS_PREFETCH_ERRORS]     = "prefetch_errors",
+};
+
+uint64_t stats_get(enum stats_counter counter)
+{
+    return atomic_load_explicit(&stats_slots[counter].value,
+            memory_order_relaxed);
+}
+
+size_t stats_format(char *buf, size_t size)
+{
+    size_t len = 0;
+    for (int i = 0; i < STATS_COUNT; i++) {
+        bool room = (len < size);
+        int n = snprintf(room ? buf + len : NULL, room ? size - len : 0,
+                "%s %llu\n", stats_names[i],
+                (unsigned long long) stats_get(i));
+        if (n > 0) {
+            len += n;
+        }
+    }
+    return len;
+}
+
+/*
+ * Histograms are log-linear, like HdrHistogram: each power of two is split
+ * into HIST_SUB_COUNT equal buckets, so a value is known to within about 6%
+ * whatever its size. Values are nanoseconds; anything from 2^HIST_MAX_BITS
+ * (about 18 minutes) up goes in the last bucket.
+ */
+#define HIST_SUB_BITS   4
+#define HIST_SUB_COUNT  (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS   40
+#define HIST_BUCKETS    ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct stats_histogram {
+    _Atomic uint64_t counts[HIST_BUCKETS];
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+};
+
+static struct stats_histogram histograms[STATS_TIMER_COUNT];
+
+static const char *timer_names[STATS_TIMER_COUNT] = {
+    [STATS_OP_GETATTR]      = "getattr",
+    [STATS_OP_READLINK]     = "readlink",
+    [STATS_OP_MKDIR]        = "mkdir",
+    [STATS_OP_UNLINK]       = "unlink",
+    [STATS_OP_RMDIR]        = "rmdir",
+    [STATS_OP_SYMLINK]      = "symlink",
+    [STATS_OP_RENAME]       = "rename",
+    [STATS_OP_LINK]         = "link",
+    [STATS_OP_CHMOD]        = "chmod",
+    [STATS_OP_CHOWN]        = "chown",
+    [STATS_OP_TRUNCATE]     = "truncate",
+    [STATS_OP_OPEN]         = "open",
+    [STATS_OP_READ]         = "read",
+    [STATS_OP_WRITE]        = "write",
+    [STATS_OP_FLUSH]        = "flush",
+    [STATS_OP_RELEASE]      = "release",
+    [STATS_OP_FSYNC]        = "fsync",
+    [STATS_OP_SETXATTR]     = "setxattr",
+    [STATS_OP_GETXATTR]     = "getxattr",
+    [STATS_OP_LISTXATTR]    = "listxattr",
+    [STATS_OP_REMOVEXATTR]  = "removexattr",
+    [STATS_OP_OPENDIR]      = "opendir",
+    [STATS_OP_READDIR]      = "readdir",
+    [STATS_OP_RELEASEDIR]   = "releasedir",
+    [STATS_OP_ACCESS]       = "access",
+    [STATS_OP_CREATE]       = "create",
+    [STATS_OP_UTIMENS]      = "utimens",
+    [STATS_CACHE_FETCH]     = "cache_fetch",
+    [STATS_CACHE_ADD]       = "cache_add",
+    [STATS_MAKE_SPACE]      = "make_space_available",
+    [STATS_BACKING_PREAD]   = "backing_pread",
+    [STATS_READ_LOCK_WAIT]  = "read_lock_wait",
+};
+
+static unsigned int hist_index(uint64_t value)
+{
+    if (value < HIST_SUB_COUNT) {
+        return (unsigned int) value;
+    }
+    if (value >> HIST_MAX_BITS) {
+        return HIST_BUCKETS - 1;
+    }
+
+    unsigned int msb = 63 - __builtin_clzll(value);
+    unsigned int shift = msb - HIST_SUB_BITS;
+    unsigned int sub = (unsigned int)(value >> shift) - HIST_SUB_COUNT;
+    return (shift + 1) * HIST_SUB_COUNT + sub;
+}
+
+/*
+ * Largest value that lands in a bucket.
+ */
+static uint64_t hist_value(unsigned int index)
+{
+    if (index < HIST_SUB_COUNT) {
+        return index;
+    }
+
+    unsigned int shift = index / HIST_SUB_COUNT - 1;
+    uint64_t top = HIST_SUB_COUNT + index % HIST_SUB_COUNT;
+    return ((top + 1) << shift) - 1;
+}
+
+uint64_t stats_record(enum stats_timer timer, uint64_t start)
+{
+    uint64_t elapsed = stats_now() - start;
+    struct stats_histogram *h = &histograms[timer];
+
+    atomic_fetch_add_explicit(&h->counts[hist_index(elapsed)], 1,
+            memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, elapsed, memory_order_relaxed);
+
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (elapsed > max
+            && !atomic_compare_exchange_weak_explicit(&h->max, &max, elapsed,
+                memory_order_relaxed, memory_order_relaxed)) {
+        // max was reloaded; try again if we're still bigger
+    }
+
+    return elapsed;
+}
+
+const char * stats_timer_name(enum stats_timer timer)
+{
+    if (timer >= STATS_TIMER_COUNT) {
+        return "unknown";
+    }
+    return timer_names[timer];
+}
+
+size_t stats_format_latency(char *buf, size_t size)
+{
+    static const double percentiles[] = { 50, 90, 99, 99.9 };
+    uint64_t counts[HIST_BUCKETS];
+    size_t len = 0;
+    int n;
+
+#define APPEND(...) \
+    do { \
+        bool room = (len < size); \
+        n = snprintf(room ? buf + len : NULL, room ? size - len : 0, \
+                __VA_ARGS__); \
+        if (n > 0) \
+            len += n; \
+    } while (0)
+
+    APPEND("# name count mean p50 p90 p99 p99.9 max (microseconds)\n");
+
+    for (int t = 0; t < STATS_TIMER_COUNT; t++) {
+        struct stats_histogram *h = &histograms[t];
+
+        uint64_t total = 0;
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            counts[i] = atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+            total += counts[i];
+        }
+        if (total == 0) {
+            continue;
+        }
+        uint64_t sum = atomic_load_explicit(&h->sum, memory_order_relaxed);
+        uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+
+        APPEND("%s %llu %.1f", timer_names[t], (unsigned long long) total,
+                (double) sum / total / 1000);
+
+        int i = 0;
+        uint64_t seen = 0;
+        for (size_t p = 0; p < sizeof(percentiles) / sizeof(*percentiles); p++) {
+            // the smallest value at least this fraction of the samples are under
+            uint64_t want = (uint64_t)(percentiles[p] / 100 * total + 0.999999);
+            if (want == 0) {
+                want = 1;
+            }
+            while (i < HIST_BUCKETS - 1 && seen + counts[i] < want) {
+                seen += counts[i];
+                i++;
+            }
+            uint64_t value = hist_value(i);
+            if (value > max) {
+                value = max;
+            }
+            APPEND(" %.1f", (double) value / 1000);
+        }
+
+        APPEND(" %.1f\n", (double) max / 1000);
+    }
+
+#undef APPEND
+
+    return len;
+}
+
+void stats_reset_latency(void)
+{
+    for (int t = 0; t < STATS_TIMER_COUNT; t++) {
+        struct stats_histogram *h = &histograms[t];
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            atomic_store_explicit(&h->counts[i], 0, memory_order_relaxed);
+        }
+        atomic_store_explicit(&h->sum, 0, memory_order_relaxed);
+        atomic_store_explicit(&h->max, 0, memory_order_relaxed);
+    }
+}
+
+/*
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
@@ -0,0 +1,131 @@
+#ifndef BACKFS_STATS_H
+#define BACKFS_STATS_H
+/*
+ * BackFS statistics counters
+ * Copyright (c) 2026 William R. Fraser
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+enum stats_counter {
+    STATS_HITS,             // blocks read from the cache
+    STATS_MISSES,           // blocks read from the backing store
+    STATS_BYTES_FROM_CACHE,
+    STATS_BYTES_FROM_BACKING,
+    STATS_FILLS,            // blocks added to the cache
+    STATS_EVICTIONS,        // buckets freed to make room
+    STATS_INVALIDATIONS,    // buckets freed because their data was stale
+    STATS_MTIME_MISMATCHES,
+    STATS_SPACE_RETRIES,    // cache writes retried after freeing space
+    STATS_HEAT_KEPT,        // buckets kept from eviction for being hot
+    STATS_ORPHANS_FREED,    // buckets freed by the orphan scan
+    STATS_PREFETCH_BLOCKS,  // blocks read into the cache by prefetch
+    STATS_PREFETCH_BYTES,
+    STATS_PREFETCH_CACHED,  // blocks prefetch found cached already
+    STATS_PREFETCH_ERRORS,
+    STATS_COUNT
+};
+
+/*
+ * Each counter gets its own cache line, so threads bumping different counters
+ * don't slow each other down.
+ */
+struct stats_slot {
+    _Atomic uint64_t value;
+    char pad[64 - sizeof(uint64_t)];
+};
+
+extern struct stats_slot stats_slots[STATS_COUNT];
+
+static inline void stats_add(enum stats_counter counter, uint64_t n)
+{
+    atomic_fetch_add_explicit(&stats_slots[counter].value, n,
+            memory_order_relaxed);
+}
+
+static inline void stats_inc(enum stats_counter counter)
+{
+    stats_add(counter, 1);
+}
+
+uint64_t stats_get(enum stats_counter counter);
+
+/*
+ * Write every counter to buf as "name value" lines. Returns the length it
+ * needed, like snprintf.
+ */
+size_t stats_format(char *buf, size_t size);
+
+/*
+ * Latency histograms, for each FUSE operation and for some steps inside them.
+ */
+enum stats_timer {
+    STATS_OP_GETATTR,
+    STATS_OP_READLINK,
+    STATS_OP_MKDIR,
+    STATS_OP_UNLINK,
+    STATS_OP_RMDIR,
+    STATS_OP_SYMLINK,
+    STATS_OP_RENAME,
+    STATS_OP_LINK,
+    STATS_OP_CHMOD,
+    STATS_OP_CHOWN,
+    STATS_OP_TRUNCATE,
+    STATS_OP_OPEN,
+    STATS_OP_READ,
+    STATS_OP_WRITE,
+    STATS_OP_FLUSH,
+    STATS_OP_RELEASE,
+    STATS_OP_FSYNC,
+    STATS_OP_SETXATTR,
+    STATS_OP_GETXATTR,
+    STATS_OP_LISTXATTR,
+    STATS_OP_REMOVEXATTR,
+    STATS_OP_OPENDIR,
+    STATS_OP_READDIR,
+    STATS_OP_RELEASEDIR,
+    STATS_OP_ACCESS,
+    STATS_OP_CREATE,
+    STATS_OP_UTIMENS,
+    STATS_CACHE_FETCH,
+    STATS_CACHE_ADD,
+    STATS_MAKE_SPACE,
+    STATS_BACKING_PREAD,
+    STATS_READ_LOCK_WAIT,   // waiting for backfs.lock in read
+    STATS_TIMER_COUNT
+};
+
+/*
+ * Monotonic clock in nanoseconds, for timing with stats_record().
+ */
+static inline uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Record the time since start (from stats_now()), and return it. Lock-free;
+ * safe to call from any thread.
+ */
+uint64_t stats_record(enum stats_timer timer, uint64_t start);
+
+const char * stats_timer_name(enum stats_timer timer);
+
+/*
+ * Write a line for each timer that has recorded anything: count, mean,
+ * percentiles and max, in microseconds. Returns the length it needed, like
+ * snprintf.
+ */
+size_t stats_format_latency(char *buf, size_t size);
+
+/*
+ * Clear all the histograms. Times recorded while this runs may be lost.
+ */
+void stats_reset_latency(void);
+
+#endif //BACKFS_STATS_H
@@ -0,0 +1,115 @@
+#!/bin/bash
+#
+# BackFS partial block write test
+#
+# Mounts BackFS read-write over a scratch directory and writes files through
+# it in pieces much smaller than a block: one new, and one overwriting a file
+# that isn't cached. Checks that the backing store gets the data, and that the
+# pieces were put together into whole cached blocks, so reading the files
+# back doesn't miss the cache. Then does the same with write-back.
+#
+# Run it with `make check`. Needs FUSE (fusermount) but not root.
+#
+
+set -e
+
+thisScript=$(readlink -f "$0")
+backfsDir=$(dirname "$thisScript")
+backfs=$backfsDir/backfs
+
+dir=$(mktemp -d /tmp/backfs-test.XXXXXX)
+backing=$dir/backing
+cache=$dir/cache
+mnt=$dir/mnt
+backfsPid=
+
+# BackFS exits by itself once it's unmounted; it's killed if it doesn't
+unmount() {
+    if [ -z "$backfsPid" ]; then
+        return 0
+    fi
+    fusermount -u "$mnt" 2>/dev/null || umount "$mnt" 2>/dev/null || true
+    local pid=$backfsPid
+    backfsPid=
+    for i in $(seq 300); do
+        if ! kill -0 $pid 2>/dev/null; then
+            wait $pid 2>/dev/null || true
+            return 0
+        fi
+        sleep 0.1
+    done
+    echo "FAIL: BackFS didn't exit after unmounting" >&2
+    kill -9 $pid 2>/dev/null || true
+    wait $pid 2>/dev/null || true
+    fusermount -u -z "$mnt" 2>/dev/null || true
+    return 1
+}
+
+cleanup() {
+    unmount || true
+    rm -rf "$dir"
+}
+trap cleanup EXIT
+
+stat_value() {
+    awk -v name="$1" '$1 == name { print $2 }' "$mnt/.backfs_stats"
+}
+
+# no kernel caching, so every read and write reaches BackFS as it was made
+mount_backfs() {
+    "$backfs" -f -o cache=$cache,rw,direct_io,attr_timeout=0,entry_timeout=0$1 \
+        "$backing" "$mnt" >>"$dir/backfs.log" 2>&1 &
+    backfsPid=$!
+    for i in $(seq 100); do
+        if [ -e "$mnt/.backfs_control" ]; then
+            break
+        fi
+        sleep 0.1
+    done
+    if [ ! -e "$mnt/.backfs_control" ]; then
+        echo "BackFS didn't mount:" >&2
+        cat "$dir/backfs.log" >&2
+        exit 1
+    fi
+}
+
+# write $1 from the expected data 1000 bytes at a time, then check it
+check_pieces() {
+    dd if="$dir/expected.dat" of="$mnt/$1" bs=1000 conv=notrunc status=none
+    # with write-back, the blocks can take a moment to get there
+    for i in $(seq 100); do
+        if cmp -s "$backing/$1" "$dir/expected.dat"; then
+            break
+        fi
+        sleep 0.1
+    done
+    if ! cmp "$backing/$1" "$dir/expected.dat"; then
+        echo "FAIL: $1 $2 didn't reach the backing store" >&2
+        exit 1
+    fi
+    local misses=$(stat_value misses)
+    cmp "$mnt/$1" "$dir/expected.dat"
+    if [ "$(stat_value misses)" != "$misses" ]; then
+        echo "FAIL: reading $1 $2 missed the cache" \
+            "($misses misses before, $(stat_value misses) after)" >&2
+        exit 1
+    fi
+}
+
+mkdir -p "$backing" "$cache" "$mnt"
+head -c $((1024 * 1024)) /dev/urandom > "$dir/expected.dat"
+
+head -c $((1024 * 1024)) /dev/zero > "$backing/old.dat"
+mount_backfs
+check_pieces new.dat "written in pieces"
+check_pieces old.dat "overwritten in pieces"
+unmount
+
+rm -rf "$cache"/* "$backing"/*
+head -c $((1024 * 1024)) /dev/zero > "$backing/old.dat"
+mount_backfs ,writeback,writeback_delay=0
+check_pieces new.dat "written in pieces with write-back"
+check_pieces old.dat "overwritten in pieces with write-back"
+unmount
+
+echo "PASS"
@@ -0,0 +1,109 @@
+#!/bin/bash
+#
+# BackFS rename test
+#
+# Mounts BackFS read-write over a scratch directory, reads a file into the
+# cache, renames it through BackFS, and checks that reading it under its new
+# name comes from the cache rather than the backing store. Then remounts it
+# with cache_key=inode, and checks the same for a file renamed and hard linked
+# on the backing store, behind BackFS's back.
+#
+# Run it with `make check`. Needs FUSE (fusermount) but not root.
+#
+
+set -e
+
+thisScript=$(readlink -f "$0")
+backfsDir=$(dirname "$thisScript")
+backfs=$backfsDir/backfs
+
+dir=$(mktemp -d /tmp/backfs-test.XXXXXX)
+backing=$dir/backing
+cache=$dir/cache
+mnt=$dir/mnt
+backfsPid=
+
+# BackFS exits by itself once it's unmounted; it's killed if it doesn't
+unmount() {
+    if [ -z "$backfsPid" ]; then
+        return 0
+    fi
+    fusermount -u "$mnt" 2>/dev/null || umount "$mnt" 2>/dev/null || true
+    local pid=$backfsPid
+    backfsPid=
+    for i in $(seq 300); do
+        if ! kill -0 $pid 2>/dev/null; then
+            wait $pid 2>/dev/null || true
+            return 0
+        fi
+        sleep 0.1
+    done
+    echo "FAIL: BackFS didn't exit after unmounting" >&2
+    kill -9 $pid 2>/dev/null || true
+    wait $pid 2>/dev/null || true
+    fusermount -u -z "$mnt" 2>/dev/null || true
+    return 1
+}
+
+cleanup() {
+    unmount || true
+    rm -rf "$dir"
+}
+trap cleanup EXIT
+
+stat_value() {
+    awk -v name="$1" '$1 == name { print $2 }' "$mnt/.backfs_stats"
+}
+
+# no kernel caching, so every read reaches BackFS
+mount_backfs() {
+    "$backfs" -f -o cache=$cache,rw,direct_io,attr_timeout=0,entry_timeout=0$1 \
+        "$backing" "$mnt" >"$dir/backfs.log" 2>&1 &
+    backfsPid=$!
+    for i in $(seq 100); do
+        if [ -e "$mnt/.backfs_control" ]; then
+            break
+        fi
+        sleep 0.1
+    done
+    if [ ! -e "$mnt/.backfs_control" ]; then
+        echo "BackFS didn't mount:" >&2
+        cat "$dir/backfs.log" >&2
+        exit 1
+    fi
+}
+
+# reading $1 from BackFS matches $2 on the backing store, and hits the cache
+check_cached() {
+    local misses=$(stat_value misses)
+    cmp "$mnt/$1" "$backing/$2"
+    if [ "$(stat_value misses)" != "$misses" ]; then
+        echo "FAIL: reading $1 $3 missed the cache" \
+            "($misses misses before, $(stat_value misses) after)" >&2
+        exit 1
+    fi
+}
+
+mkdir -p "$backing" "$cache" "$mnt"
+head -c $((4 * 1024 * 1024)) /dev/urandom > "$backing/before.dat"
+
+mount_backfs
+cat "$mnt/before.dat" > /dev/null
+mv "$mnt/before.dat" "$mnt/after.dat"
+check_cached after.dat after.dat "renamed through BackFS"
+unmount
+
+# renames and links change the file's ctime, but not its data
+head -c $((4 * 1024 * 1024)) /dev/urandom > "$backing/outside.dat"
+mount_backfs ,cache_key=inode
+cat "$mnt/outside.dat" > /dev/null
+sleep 0.1
+mv "$backing/outside.dat" "$backing/moved.dat"
+check_cached moved.dat moved.dat "renamed on the backing store"
+sleep 0.1
+ln "$backing/moved.dat" "$backing/linked.dat"
+check_cached moved.dat moved.dat "after it was linked on the backing store"
+check_cached linked.dat moved.dat "(a link made on the backing store)"
+unmount
+
+echo "PASS"
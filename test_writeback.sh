@@ -0,0 +1,114 @@
+#!/bin/bash
+#
+# BackFS write-back crash test
+#
+# Mounts BackFS with write-back over a scratch directory, writes a file
+# through it, and kills BackFS before it has written anything back. Then
+# remounts it, and checks that the file reads back as written, and that the
+# dirty blocks recovered from the cache reach the backing store.
+#
+# Run it with `make check`. Needs FUSE (fusermount) but not root.
+#
+
+set -e
+
+thisScript=$(readlink -f "$0")
+backfsDir=$(dirname "$thisScript")
+backfs=$backfsDir/backfs
+
+dir=$(mktemp -d /tmp/backfs-test.XXXXXX)
+backing=$dir/backing
+cache=$dir/cache
+mnt=$dir/mnt
+backfsPid=
+
+# BackFS exits by itself once it's unmounted; it's killed if it doesn't
+unmount() {
+    if [ -z "$backfsPid" ]; then
+        return 0
+    fi
+    fusermount -u "$mnt" 2>/dev/null || umount "$mnt" 2>/dev/null || true
+    local pid=$backfsPid
+    backfsPid=
+    for i in $(seq 300); do
+        if ! kill -0 $pid 2>/dev/null; then
+            wait $pid 2>/dev/null || true
+            return 0
+        fi
+        sleep 0.1
+    done
+    echo "FAIL: BackFS didn't exit after unmounting" >&2
+    kill -9 $pid 2>/dev/null || true
+    wait $pid 2>/dev/null || true
+    fusermount -u -z "$mnt" 2>/dev/null || true
+    return 1
+}
+
+# what a crash looks like to the cache: no chance to shut down
+crash() {
+    kill -9 $backfsPid
+    wait $backfsPid 2>/dev/null || true
+    backfsPid=
+    fusermount -u -z "$mnt" 2>/dev/null || umount -l "$mnt" 2>/dev/null || true
+}
+
+cleanup() {
+    unmount || true
+    rm -rf "$dir"
+}
+trap cleanup EXIT
+
+# whole-block writes, so they're acknowledged once they're in the cache, and
+# too long a delay for any of them to be written back before the crash
+mount_backfs() {
+    "$backfs" -f -o cache=$cache,rw,direct_io,block_size=4096 \
+        -o writeback,writeback_delay=600 \
+        "$backing" "$mnt" >>"$dir/backfs.log" 2>&1 &
+    backfsPid=$!
+    for i in $(seq 100); do
+        if [ -e "$mnt/.backfs_control" ]; then
+            break
+        fi
+        sleep 0.1
+    done
+    if [ ! -e "$mnt/.backfs_control" ]; then
+        echo "BackFS didn't mount:" >&2
+        cat "$dir/backfs.log" >&2
+        exit 1
+    fi
+}
+
+mkdir -p "$backing" "$cache" "$mnt"
+head -c $((1024 * 1024)) /dev/zero > "$backing/data.dat"
+head -c $((1024 * 1024)) /dev/urandom > "$dir/expected.dat"
+
+mount_backfs
+dd if="$dir/expected.dat" of="$mnt/data.dat" bs=4096 conv=notrunc \
+    status=none
+if cmp -s "$backing/data.dat" "$dir/expected.dat"; then
+    echo "FAIL: the data was written back before the crash;" \
+        "the test didn't test anything" >&2
+    exit 1
+fi
+crash
+
+mount_backfs
+if ! cmp "$mnt/data.dat" "$dir/expected.dat"; then
+    echo "FAIL: acknowledged writes were lost in the crash" >&2
+    exit 1
+fi
+
+# recovered blocks are old enough to be written back right away
+for i in $(seq 300); do
+    if cmp -s "$backing/data.dat" "$dir/expected.dat"; then
+        break
+    fi
+    sleep 0.1
+done
+if ! cmp "$backing/data.dat" "$dir/expected.dat"; then
+    echo "FAIL: recovered dirty blocks weren't written back" >&2
+    exit 1
+fi
+unmount
+
+echo "PASS"
@@ -0,0 +1,167 @@
+/*
+ * BackFS in-memory request trace
+ * Copyright (c) 2026 William R. Fraser
+ *
+ * Records go in a fixed-size ring. Writers claim a slot with one atomic add,
+ * and each slot has a sequence number that's cleared while it's being written
+ * and set to its position in the trace (plus one) after, so a dump can tell
+ * which slots hold a complete record, and skip the rest.
+ */
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+struct trace_record {
+    uint64_t time;          // stats_now() when the operation started
+    uint64_t latency;       // nanoseconds
+    uint64_t path_hash;
+    uint64_t bytes;
+    uint32_t block;
+    uint32_t thread;
+    uint16_t op;
+    uint16_t flags;
+};
+
+struct trace_slot {
+    _Atomic uint64_t seq;
+    struct trace_record record;
+};
+
+static struct trace_slot *ring = NULL;
+static uint64_t ring_mask = 0;
+static _Atomic uint64_t ring_next = 0;
+
+static _Thread_local uint32_t thread_id = 0;
+
+void trace_init(unsigned int records)
+{
+    if (records == 0) {
+        return;
+    }
+
+    uint64_t size = 1;
+    while (size < records) {
+        size <<= 1;
+    }
+
+    ring = (struct trace_slot*)calloc(size, sizeof(struct trace_slot));
+    if (ring != NULL) {
+        ring_mask = size - 1;
+    }
+}
+
+/*
+ * FNV-1a; just enough to tell paths apart.
+ */
+static uint64_t hash_path(const char *path)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const unsigned char *p = (const unsigned char*)path; *p != '\0'; p++) {
+        hash ^= *p;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+void trace_add(enum stats_timer op, const char *path, uint32_t block,
+        unsigned int flags, uint64_t bytes, uint64_t start, uint64_t latency)
+{
+    if (ring == NULL) {
+        return;
+    }
+
+    if (thread_id == 0) {
+        thread_id = (uint32_t) syscall(SYS_gettid);
+    }
+
+    uint64_t n = atomic_fetch_add_explicit(&ring_next, 1, memory_order_relaxed);
+    struct trace_slot *slot = &ring[n & ring_mask];
+
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    slot->record.time = start;
+    slot->record.latency = latency;
+    slot->record.path_hash = (path == NULL) ? 0 : hash_path(path);
+    slot->record.bytes = bytes;
+    slot->record.block = block;
+    slot->record.thread = thread_id;
+    slot->record.op = (uint16_t) op;
+    slot->record.flags = (uint16_t) flags;
+
+    atomic_store_explicit(&slot->seq, n + 1, memory_order_release);
+}
+
+int trace_dump(const char *filename)
+{
+    if (ring == NULL) {
+        return -ENODATA;
+    }
+
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        return -errno;
+    }
+
+    fprintf(f, "# time_ns thread op path_hash block result bytes latency_ns\n");
+
+    uint64_t next = atomic_load_explicit(&ring_next, memory_order_relaxed);
+    uint64_t first = (next > ring_mask + 1) ? next - (ring_mask + 1) : 0;
+    for (uint64_t n = first; n < next; n++) {
+        struct trace_slot *slot = &ring[n & ring_mask];
+
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        struct trace_record r = slot->record;
+        atomic_thread_fence(memory_order_acquire);
+        if (seq != n + 1
+                || atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) {
+            // being written, or already overwritten by a newer one
+            continue;
+        }
+
+        char block[16] = "-";
+        if (r.block != TRACE_NO_BLOCK) {
+            snprintf(block, sizeof(block), "%u", r.block);
+        }
+        const char *result = (r.flags & TRACE_HIT) ? "hit"
+                           : (r.flags & TRACE_MISS) ? "miss"
+                           : "-";
+
+        fprintf(f, "%llu %u %s %016llx %s %s %llu %llu\n",
+                (unsigned long long) r.time, r.thread,
+                stats_timer_name(r.op), (unsigned long long) r.path_hash,
+                block, result, (unsigned long long) r.bytes,
+                (unsigned long long) r.latency);
+    }
+
+    if (fclose(f) != 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+/*
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
+
@@ -0,0 +1,40 @@
+#ifndef BACKFS_TRACE_H
+#define BACKFS_TRACE_H
+/*
+ * BackFS in-memory request trace
+ * Copyright (c) 2026 William R. Fraser
+ */
+
+#include <stdint.h>
+
+#include "stats.h"
+
+// block field of records that aren't about one block
+#define TRACE_NO_BLOCK UINT32_MAX
+
+enum trace_flags {
+    TRACE_HIT   = 1,    // block was read from the cache
+    TRACE_MISS  = 2,    // block was read from the backing store
+};
+
+/*
+ * Keep the last (at least) records operations in memory. With 0, or if this
+ * isn't called, trace_add() does nothing.
+ */
+void trace_init(unsigned int records);
+
+/*
+ * Add a record of an operation (one of the stats timers) on path, which
+ * started at start (from stats_now()) and took latency nanoseconds.
+ * Lock-free; safe to call from any thread.
+ */
+void trace_add(enum stats_timer op, const char *path, uint32_t block,
+        unsigned int flags, uint64_t bytes, uint64_t start, uint64_t latency);
+
+/*
+ * Write the records in memory to filename as text, oldest first.
+ * Returns 0 or -errno.
+ */
+int trace_dump(const char *filename);
+
+#endif //BACKFS_TRACE_H
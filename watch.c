@@ -0,0 +1,742 @@
+/*
+ * BackFS backing store change notification
+ * Copyright (c) 2026 William R. Fraser
+ *
+ * Every directory of the backing store gets an inotify watch, and a thread
+ * reads the events. In between, the stat() of a backing file that a read
+ * needs to check the cache against can be kept, since any change to the file
+ * would have dropped it; a read then costs no round trip to the backing store
+ * at all. An event only drops the kept stat, so the next read checks the file
+ * against the cache as usual: BackFS's own writes and renames show up as
+ * events too, and mustn't cost it what's cached. Only a directory removed or
+ * moved away behind BackFS's back has its cached tree invalidated.
+ *
+ * inotify only hears about changes made through the local kernel, so on a
+ * network or FUSE filesystem, changes made by other machines (or behind the
+ * FUSE server) aren't seen; there, stat results are always only kept for the
+ * TTL. The same goes where there's no watch (a directory that couldn't get
+ * one, or one that's new and hasn't got one yet) or events were lost: the TTL
+ * is what keeps those cases from serving stale data for long.
+ */
+
+#include "watch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+#include <pthread.h>
+
+#define BACKFS_LOG_SUBSYS "Watch"
+#include "global.h"
+#include "util.h"
+
+extern int backfs_log_level;
+extern bool backfs_log_stderr;
+
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE \
+        | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+#define WATCH_SLOTS 16384           // hash chains, for files and directories
+#define WATCH_MAX_FILES 65536       // stat results kept; all dropped when full
+#define WATCH_BUF_SIZE (64 * 1024)  // events read at once
+#define WATCH_OWN_MOVE_SECONDS 60   // how long to wait for a move's event
+
+// filesystems that can change without the local kernel knowing (statfs types)
+static const uint32_t remote_fs_types[] = {
+    0x6969,         // NFS
+    0x517b,         // SMB
+    0xff534d42,     // CIFS
+    0xfe534d42,     // SMB2
+    0x65735546,     // FUSE
+    0x00c36400,     // Ceph
+    0x01021997,     // 9P
+    0x5346414f,     // AFS
+    0x6b414653,     // kAFS
+    0x73757245,     // Coda
+    0x01161970,     // GFS2
+    0x7461636f,     // OCFS2
+    0x0bd00bd0,     // Lustre
+};
+
+struct watch_file {
+    struct watch_file *next;
+    struct stat st;
+    time_t expires;         // 0: until a change is seen
+    char path[];
+};
+
+struct watch_dir {
+    struct watch_dir *next;
+    int wd;
+    char path[];            // relative to the root; "" for the root itself
+};
+
+// a directory gone, waiting for the callback
+struct watch_change {
+    struct watch_change *next;
+    char path[];
+};
+
+// a rename by BackFS whose event hasn't been seen yet
+struct watch_move {
+    struct watch_move *next;
+    time_t expires;
+    char path[];
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static bool enabled = false;
+static char *root = NULL;
+static unsigned int ttl = 0;
+static watch_gone_fn gone_fn = NULL;
+static int inotify_fd = -1;
+static int stop_fd = -1;            // written to by watch_shutdown()
+static bool stopping = false;
+static pthread_t watch_thread;
+static bool out_of_watches = false;
+static bool remote = false;         // events don't cover every change
+static uint64_t generation = 0;     // bumped by every change seen
+
+static struct watch_file *files[WATCH_SLOTS];
+static uint32_t file_count = 0;
+static struct watch_dir *dirs[WATCH_SLOTS];
+static struct watch_dir **dirs_by_wd = NULL;
+static int dirs_by_wd_size = 0;
+static uint32_t dir_count = 0;
+static struct watch_move *own_moves = NULL;
+
+static uint64_t events = 0;
+static uint64_t overflows = 0;
+
+static uint32_t hash_path(const char *path, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)path[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return (uint32_t)(hash ^ (hash >> 32)) % WATCH_SLOTS;
+}
+
+/*
+ * Whether path is dir or something under it.
+ */
+static bool path_is_under(const char *path, const char *dir)
+{
+    size_t len = strlen(dir);
+    return strncmp(path, dir, len) == 0
+        && (path[len] == '/' || path[len] == '\0');
+}
+
+/*
+ * The files table. Caller holds the lock.
+ */
+
+static struct watch_file ** find_file(const char *path)
+{
+    struct watch_file **f = &files[hash_path(path, strlen(path))];
+    while (*f != NULL && strcmp((*f)->path, path) != 0) {
+        f = &(*f)->next;
+    }
+    return f;
+}
+
+static void drop_files(bool (*match)(const struct watch_file *f, const void *arg),
+        const void *arg)
+{
+    for (uint32_t i = 0; i < WATCH_SLOTS; i++) {
+        struct watch_file **f = &files[i];
+        while (*f != NULL) {
+            if (match == NULL || match(*f, arg)) {
+                struct watch_file *gone = *f;
+                *f = gone->next;
+                FREE(gone);
+                file_count--;
+            } else {
+                f = &(*f)->next;
+            }
+        }
+    }
+}
+
+static bool file_is_under(const struct watch_file *f, const void *dir)
+{
+    return path_is_under(f->path, (const char*)dir);
+}
+
+static void forget(const char *path, bool tree)
+{
+    if (tree) {
+        drop_files(&file_is_under, path);
+        return;
+    }
+    struct watch_file **f = find_file(path);
+    if (*f != NULL) {
+        struct watch_file *gone = *f;
+        *f = gone->next;
+        FREE(gone);
+        file_count--;
+    }
+}
+
+/*
+ * The directories table. Caller holds the lock.
+ */
+
+static struct watch_dir * find_dir(const char *path, size_t len)
+{
+    struct watch_dir *d = dirs[hash_path(path, len)];
+    while (d != NULL && !(strncmp(d->path, path, len) == 0 && d->path[len] == '\0')) {
+        d = d->next;
+    }
+    return d;
+}
+
+static void remove_dir(struct watch_dir *dir)
+{
+    struct watch_dir **d = &dirs[hash_path(dir->path, strlen(dir->path))];
+    while (*d != dir) {
+        d = &(*d)->next;
+    }
+    *d = dir->next;
+    dirs_by_wd[dir->wd] = NULL;
+    dir_count--;
+    FREE(dir);
+}
+
+static void add_dir(int wd, const char *path)
+{
+    if (wd >= dirs_by_wd_size) {
+        int size = (dirs_by_wd_size == 0) ? 1024 : dirs_by_wd_size;
+        while (size <= wd) {
+            size *= 2;
+        }
+        struct watch_dir **bigger = (struct watch_dir**)realloc(dirs_by_wd,
+                size * sizeof(*bigger));
+        if (bigger == NULL) {
+            ERROR("out of memory for directory watches\n");
+            inotify_rm_watch(inotify_fd, wd);
+            return;
+        }
+        memset(bigger + dirs_by_wd_size, 0,
+                (size - dirs_by_wd_size) * sizeof(*bigger));
+        dirs_by_wd = bigger;
+        dirs_by_wd_size = size;
+    }
+
+    // the same directory again (moved, and found under its new name)
+    if (dirs_by_wd[wd] != NULL) {
+        remove_dir(dirs_by_wd[wd]);
+    }
+
+    size_t len = strlen(path);
+    struct watch_dir *d = (struct watch_dir*)malloc(sizeof(*d) + len + 1);
+    if (d == NULL) {
+        ERROR("out of memory for directory watches\n");
+        inotify_rm_watch(inotify_fd, wd);
+        return;
+    }
+    d->wd = wd;
+    memcpy(d->path, path, len + 1);
+    uint32_t slot = hash_path(path, len);
+    d->next = dirs[slot];
+    dirs[slot] = d;
+    dirs_by_wd[wd] = d;
+    dir_count++;
+}
+
+/*
+ * Watch the backing directory at path and everything under it.
+ */
+static void watch_tree(const char *path)
+{
+    char real[PATH_MAX];
+    snprintf(real, PATH_MAX, "%s%s", root, path);
+
+    pthread_mutex_lock(&lock);
+    if (stopping) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    int wd = inotify_add_watch(inotify_fd, real,
+            WATCH_MASK | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK);
+    if (wd == -1) {
+        if (errno == ENOSPC && !out_of_watches) {
+            WARN("out of inotify watches (see /proc/sys/fs/inotify/max_user_watches);"
+                    " directories without one are checked every %u seconds\n", ttl);
+            out_of_watches = true;
+        } else if (errno != ENOSPC && errno != ENOENT && errno != ENOTDIR) {
+            PERROR("inotify_add_watch");
+            ERROR("\tcaused by inotify_add_watch(%s)\n", real);
+        }
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    add_dir(wd, path);
+
+    // Anything changed under it before the watch was there went unseen; a
+    // stat taken meanwhile mustn't be kept on the strength of the watch.
+    generation++;
+    pthread_mutex_unlock(&lock);
+
+    DIR *d = opendir(real);
+    if (d == NULL) {
+        return;
+    }
+    struct dirent *e = NULL;
+    while ((e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+
+        char child[PATH_MAX];
+        snprintf(child, PATH_MAX, "%s/%s", path, e->d_name);
+        bool is_dir = (e->d_type == DT_DIR);
+        if (e->d_type == DT_UNKNOWN) {
+            char real_child[PATH_MAX];
+            struct stat st;
+            snprintf(real_child, PATH_MAX, "%s%s", root, child);
+            is_dir = (lstat(real_child, &st) == 0 && S_ISDIR(st.st_mode));
+        }
+        if (is_dir) {
+            watch_tree(child);
+        }
+    }
+    closedir(d);
+}
+
+/*
+ * Stop watching a directory that's gone, and everything under it.
+ */
+static void unwatch_tree(const char *path)
+{
+    pthread_mutex_lock(&lock);
+    for (uint32_t i = 0; i < WATCH_SLOTS; i++) {
+        struct watch_dir *d = dirs[i];
+        while (d != NULL) {
+            struct watch_dir *next = d->next;
+            if (path_is_under(d->path, path)) {
+                inotify_rm_watch(inotify_fd, d->wd);
+                remove_dir(d);
+            }
+            d = next;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Keep nothing for longer than the TTL from now.
+ * Caller holds the lock.
+ */
+static void expire_files(void)
+{
+    generation++;
+    time_t expires = time(NULL) + ttl;
+    for (uint32_t i = 0; i < WATCH_SLOTS; i++) {
+        for (struct watch_file *f = files[i]; f != NULL; f = f->next) {
+            if (f->expires == 0 || f->expires > expires) {
+                f->expires = expires;
+            }
+        }
+    }
+}
+
+/*
+ * Events might have been lost: nothing kept can be relied on for longer than
+ * the TTL now.
+ */
+static void overflowed(void)
+{
+    pthread_mutex_lock(&lock);
+    WARN("change notifications overflowed; checking files every %u seconds"
+            " until they're seen to change\n", ttl);
+    overflows++;
+    expire_files();
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * The watcher thread is exiting. Unless that's watch_shutdown() stopping it,
+ * no more changes will be seen, so from now on, as on a network filesystem,
+ * stat results are only kept for the TTL.
+ */
+static void watcher_exiting(void)
+{
+    pthread_mutex_lock(&lock);
+    if (!stopping) {
+        WARN("no longer watching for changes; checking files every %u"
+                " seconds\n", ttl);
+        remote = true;
+        expire_files();
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Whether path going away is BackFS renaming it; if so, it's taken off the
+ * list. Moves whose event never came (their directory wasn't watched, or
+ * events were lost) are dropped after a while.
+ * Caller holds the lock.
+ */
+static bool take_own_move(const char *path)
+{
+    time_t now = time(NULL);
+    bool found = false;
+    struct watch_move **m = &own_moves;
+    while (*m != NULL) {
+        bool match = !found && strcmp((*m)->path, path) == 0;
+        if (match || (*m)->expires < now) {
+            found = found || match;
+            struct watch_move *gone = *m;
+            *m = gone->next;
+            FREE(gone);
+        } else {
+            m = &(*m)->next;
+        }
+    }
+    return found;
+}
+
+/*
+ * Add a directory to the list for the callback.
+ */
+static void add_change(struct watch_change **list, struct watch_change **last,
+        const char *path)
+{
+    size_t len = strlen(path);
+    struct watch_change *c = (struct watch_change*)malloc(sizeof(*c) + len + 1);
+    if (c == NULL) {
+        ERROR("out of memory for changes\n");
+        return;
+    }
+    c->next = NULL;
+    memcpy(c->path, path, len + 1);
+    if (*last == NULL) {
+        *list = c;
+    } else {
+        (*last)->next = c;
+    }
+    *last = c;
+}
+
+static void* watcher(void* arg)
+{
+    if (arg != NULL) {
+        abort();
+    }
+
+    watch_tree("");
+    INFO("watching %u directories for changes\n", dir_count);
+
+    char *buf = (char*)malloc(WATCH_BUF_SIZE);
+    if (buf == NULL) {
+        ERROR("out of memory for the watcher\n");
+        watcher_exiting();
+        return NULL;
+    }
+
+    struct pollfd fds[2] = {
+        { .fd = inotify_fd, .events = POLLIN },
+        { .fd = stop_fd, .events = POLLIN },
+    };
+    while (true) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            PERROR("waiting for inotify events");
+            break;
+        }
+        if (fds[1].revents != 0) {
+            break;
+        }
+
+        ssize_t len = read(inotify_fd, buf, WATCH_BUF_SIZE);
+        if (len == -1) {
+            if (errno == EINTR) continue;
+            PERROR("reading inotify events");
+            break;
+        }
+
+        struct watch_change *changes = NULL;
+        struct watch_change *last = NULL;
+        for (char *p = buf; p < buf + len; ) {
+            struct inotify_event *e = (struct inotify_event*)p;
+            p += sizeof(*e) + e->len;
+
+            if (e->mask & IN_Q_OVERFLOW) {
+                overflowed();
+                continue;
+            }
+
+            pthread_mutex_lock(&lock);
+            if (e->mask & IN_IGNORED) {
+                if (e->wd < dirs_by_wd_size && dirs_by_wd[e->wd] != NULL) {
+                    remove_dir(dirs_by_wd[e->wd]);
+                }
+                pthread_mutex_unlock(&lock);
+                continue;
+            }
+            if (e->len == 0 || e->wd >= dirs_by_wd_size || dirs_by_wd[e->wd] == NULL) {
+                // about the directory itself, or one that's gone
+                pthread_mutex_unlock(&lock);
+                continue;
+            }
+
+            char path[PATH_MAX];
+            snprintf(path, PATH_MAX, "%s/%s", dirs_by_wd[e->wd]->path, e->name);
+            bool is_dir = (e->mask & IN_ISDIR);
+            bool own = (e->mask & IN_MOVED_FROM) && take_own_move(path);
+            events++;
+            generation++;
+            forget(path, is_dir);
+            pthread_mutex_unlock(&lock);
+
+            DEBUG("change to %s (0x%x)\n", path, e->mask);
+            if (is_dir) {
+                if (e->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    unwatch_tree(path);
+                    if (!own) {
+                        add_change(&changes, &last, path);
+                    }
+                }
+                if (e->mask & (IN_CREATE | IN_MOVED_TO)) {
+                    watch_tree(path);
+                }
+            }
+        }
+
+        while (changes != NULL) {
+            struct watch_change *c = changes;
+            changes = c->next;
+            gone_fn(c->path);
+            FREE(c);
+        }
+    }
+
+    watcher_exiting();
+    FREE(buf);
+    return NULL;
+}
+
+int watch_init(const char *a_root, unsigned int a_ttl, watch_gone_fn fn)
+{
+    struct statfs fs;
+    if (statfs(a_root, &fs) == -1) {
+        int err = errno;
+        PERROR("statfs on backing store");
+        return -err;
+    }
+    for (size_t i = 0; i < sizeof(remote_fs_types) / sizeof(remote_fs_types[0]); i++) {
+        if ((uint32_t) fs.f_type == remote_fs_types[i]) {
+            WARN("%s is a network or FUSE filesystem (type 0x%x), where not"
+                    " every change is seen; checking files every %u seconds\n",
+                    a_root, (unsigned int) fs.f_type, a_ttl);
+            remote = true;
+        }
+    }
+
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd == -1) {
+        int err = errno;
+        PERROR("inotify_init1");
+        return -err;
+    }
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (stop_fd == -1) {
+        int err = errno;
+        PERROR("eventfd");
+        close(inotify_fd);
+        inotify_fd = -1;
+        return -err;
+    }
+
+    root = strdup(a_root);
+    ttl = a_ttl;
+    gone_fn = fn;
+
+    int err = pthread_create(&watch_thread, NULL, &watcher, NULL);
+    if (err != 0) {
+        errno = err;
+        PERROR("error creating watcher thread");
+        close(inotify_fd);
+        inotify_fd = -1;
+        close(stop_fd);
+        stop_fd = -1;
+        return -err;
+    }
+
+    pthread_mutex_lock(&lock);
+    enabled = true;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+void watch_shutdown(void)
+{
+    if (stop_fd == -1) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    enabled = false;
+    stopping = true;
+    pthread_mutex_unlock(&lock);
+
+    uint64_t one = 1;
+    if (write(stop_fd, &one, sizeof(one)) != sizeof(one)) {
+        PERROR("waking the watcher");
+    }
+    pthread_join(watch_thread, NULL);
+
+    close(inotify_fd);
+    inotify_fd = -1;
+    close(stop_fd);
+    stop_fd = -1;
+}
+
+bool watch_lookup(const char *path, struct stat *st, uint64_t *a_generation)
+{
+    pthread_mutex_lock(&lock);
+    bool found = false;
+    if (enabled) {
+        struct watch_file *f = *find_file(path);
+        if (f != NULL && (f->expires == 0 || time(NULL) < f->expires)) {
+            *st = f->st;
+            found = true;
+        }
+    }
+    *a_generation = generation;
+    pthread_mutex_unlock(&lock);
+    return found;
+}
+
+void watch_remember(const char *path, const struct stat *st,
+        uint64_t a_generation)
+{
+    pthread_mutex_lock(&lock);
+    if (!enabled || a_generation != generation) {
+        goto exit;
+    }
+
+    // kept until it changes if its directory is watched, else for the TTL
+    const char *slash = strrchr(path, '/');
+    time_t expires = 0;
+    if (remote || slash == NULL || find_dir(path, slash - path) == NULL) {
+        if (ttl == 0) {
+            goto exit;
+        }
+        expires = time(NULL) + ttl;
+    }
+
+    struct watch_file **slot = find_file(path);
+    struct watch_file *f = *slot;
+    if (f == NULL) {
+        if (file_count >= WATCH_MAX_FILES) {
+            DEBUG("stat table full; starting over\n");
+            drop_files(NULL, NULL);
+            slot = find_file(path);
+        }
+        size_t len = strlen(path);
+        f = (struct watch_file*)malloc(sizeof(*f) + len + 1);
+        if (f == NULL) {
+            goto exit;
+        }
+        memcpy(f->path, path, len + 1);
+        f->next = NULL;
+        *slot = f;
+        file_count++;
+    }
+    f->st = *st;
+    f->expires = expires;
+
+exit:
+    pthread_mutex_unlock(&lock);
+}
+
+void watch_forget(const char *path)
+{
+    pthread_mutex_lock(&lock);
+    if (enabled) {
+        generation++;
+        forget(path, false);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void watch_forget_tree(const char *path)
+{
+    pthread_mutex_lock(&lock);
+    if (enabled) {
+        generation++;
+        forget(path, true);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void watch_own_move(const char *path)
+{
+    pthread_mutex_lock(&lock);
+    if (enabled) {
+        size_t len = strlen(path);
+        struct watch_move *m = (struct watch_move*)malloc(sizeof(*m) + len + 1);
+        if (m != NULL) {
+            m->expires = time(NULL) + WATCH_OWN_MOVE_SECONDS;
+            memcpy(m->path, path, len + 1);
+            m->next = own_moves;
+            own_moves = m;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void watch_own_move_failed(const char *path)
+{
+    pthread_mutex_lock(&lock);
+    take_own_move(path);
+    pthread_mutex_unlock(&lock);
+}
+
+size_t watch_format(char *buf, size_t size)
+{
+    pthread_mutex_lock(&lock);
+    int n = 0;
+    if (enabled) {
+        n = snprintf(buf, size,
+                "watch_dirs %u\n"
+                "watch_files %u\n"
+                "watch_events %llu\n"
+                "watch_overflows %llu\n",
+                dir_count, file_count, (unsigned long long) events,
+                (unsigned long long) overflows);
+    }
+    pthread_mutex_unlock(&lock);
+    return (n > 0) ? n : 0;
+}
+
+/*
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+*/
@@ -0,0 +1,74 @@
+#ifndef BACKFS_WATCH_H
+#define BACKFS_WATCH_H
+/*
+ * BackFS backing store change notification
+ * Copyright (c) 2026 William R. Fraser
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+/*
+ * Called from the watcher thread when a directory of the backing store was
+ * removed or moved away, other than by BackFS (see watch_own_move()).
+ * Changes to files only make their stat results be taken again.
+ * Called without any locks held.
+ */
+typedef void (*watch_gone_fn)(const char *path);
+
+/*
+ * Watch the backing store at root for changes, passing removed directories to
+ * fn, and keep the backing files' stat results until a change says they're
+ * out of date.
+ * Where changes can't be watched (no more inotify watches, the notifications
+ * overflowed or couldn't be read, or root is on a network or FUSE filesystem
+ * that other machines can change), a stat result is only kept for ttl
+ * seconds.
+ * Returns 0 or -errno; until this is called, the other functions do nothing.
+ */
+int watch_init(const char *root, unsigned int ttl, watch_gone_fn fn);
+
+/*
+ * Stop watching, and stop the watcher thread. Kept stat results aren't used
+ * any more.
+ */
+void watch_shutdown(void);
+
+/*
+ * What the backing file at path was last seen to be, if nothing has changed
+ * it since. If not, returns false and sets generation, to pass to
+ * watch_remember() after stat()ing the file.
+ */
+bool watch_lookup(const char *path, struct stat *st, uint64_t *generation);
+
+/*
+ * Keep the stat result of a backing file, unless a change was seen since
+ * watch_lookup() gave out generation.
+ */
+void watch_remember(const char *path, const struct stat *st,
+        uint64_t generation);
+
+/*
+ * Drop what's kept of a backing file, or of everything under a directory,
+ * when BackFS changes it itself.
+ */
+void watch_forget(const char *path);
+void watch_forget_tree(const char *path);
+
+/*
+ * BackFS is about to rename path itself; when the watcher sees it go, it
+ * isn't a change behind BackFS's back. If the rename fails, call
+ * watch_own_move_failed().
+ */
+void watch_own_move(const char *path);
+void watch_own_move_failed(const char *path);
+
+/*
+ * Write the watcher's counters to buf as "name value" lines.
+ * Returns the length it needed, like snprintf.
+ */
+size_t watch_format(char *buf, size_t size);
+
+#endif //BACKFS_WATCH_H